@@ -1,17 +1,57 @@
-// maintenance of list of known deros addresses - their fast lookup using binary search
+// maintenance of list of known deros addresses - their fast lookup using a hash table (open addressing, linear probing),
+// each address keeps the lists of its local subscribers and publishers so that matching does not scan all of them,
+// patterns are matched in a trie of address segments, a new address or pattern only walks the branches it can match
 
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdatomic.h>
 
 #include "deros_addrs.h"
 #include "deros_dbglog.h"
 
-char *addresses[MAX_NUM_ADDRESSES];
-int addr[MAX_NUM_ADDRESSES];
+char **addresses;
 int num_addresses;
-int *addr_subscribers[MAX_NUM_ADDRESSES];
-int addr_num_sub[MAX_NUM_ADDRESSES];
+int **addr_subscribers;
+int *addr_num_sub;
+int **addr_publishers;
+int *addr_num_pub;
+uint8_t *addr_is_pattern;
+int **addr_matches;
+int *addr_num_matches;
+
+static int address_capacity = 0;
+
+// the lists are changed by one thread at a time (subscribers may be registered while a receiving thread adds
+// the address of a new publisher), they are read without locking: a list that grows is copied into a new one
+// that replaces it, the old one is never freed (see grow_table()), its capacity is kept in front of its first id
+static pthread_mutex_t addr_change_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/** one segment of known addresses, the wildcard segments of patterns have their own children */
+typedef struct address_trie_node {
+    char *segment;
+    int segment_length;
+    int adr_id;                               // address that ends with this segment, -1 if none
+    struct address_trie_node **children;      // plain segments, sorted
+    int num_children;
+    int children_capacity;
+    struct address_trie_node *any_segment;    // "*"
+    struct address_trie_node *any_segments;   // "**"
+} address_trie_node;
+
+static address_trie_node *address_trie = 0;
+static int *trie_matches;    // collected by a walk of the trie
+static int num_trie_matches;
+
+/** the size and the slots are replaced together when the table grows, a lookup loads the table once */
+typedef struct {
+    int size;                   // power of 2, kept at least twice the number of addresses
+    _Atomic int *slots;         // address id + 1 in each used slot, 0 in empty slot
+} address_hash_table;
+
+static _Atomic(address_hash_table *) addr_hash = 0;
 
 
 void addr_mem_failure(char *msg)
@@ -20,62 +60,429 @@ void addr_mem_failure(char *msg)
     exit(1);
 }
 
-// returns position in the index array, not the addr id itself
-int find_address(char *adr, int *found)
+static uint32_t address_hash(char *adr)
+{
+    uint32_t h = 2166136261u;  // FNV-1a
+    while (*adr)
+    {
+        h ^= (uint8_t) *(adr++);
+        h *= 16777619u;
+    }
+    return h;
+}
+
+void address_multicast_group(char *adr, struct in_addr *group)
+{
+    uint32_t h = address_hash(adr);
+    h = (h >> 16) ^ (h & 0xffff);
+    group->s_addr = htonl((239u << 24) | (255u << 16) | h);
+}
+
+/** copy a table into a larger one, the old one is not freed: the receiving thread of a node
+ *  may be still reading it while a new subscriber is being registered (it wastes less than the final size) */
+static void *grow_table(void *old_table, int old_size, int new_size, int item_size)
+{
+    void *table = calloc(new_size, item_size);
+    if (!table) addr_mem_failure("grow table");
+    if (old_size) memcpy(table, old_table, old_size * item_size);
+    return table;
+}
+
+static void ensure_address_capacity()
+{
+    if (num_addresses < address_capacity) return;
+    int new_capacity = address_capacity ? 2 * address_capacity : INITIAL_ADDRESS_CAPACITY;
+    addresses = (char **) grow_table(addresses, address_capacity, new_capacity, sizeof(char *));
+    addr_subscribers = (int **) grow_table(addr_subscribers, address_capacity, new_capacity, sizeof(int *));
+    addr_num_sub = (int *) grow_table(addr_num_sub, address_capacity, new_capacity, sizeof(int));
+    addr_publishers = (int **) grow_table(addr_publishers, address_capacity, new_capacity, sizeof(int *));
+    addr_num_pub = (int *) grow_table(addr_num_pub, address_capacity, new_capacity, sizeof(int));
+    addr_is_pattern = (uint8_t *) grow_table(addr_is_pattern, address_capacity, new_capacity, sizeof(uint8_t));
+    addr_matches = (int **) grow_table(addr_matches, address_capacity, new_capacity, sizeof(int *));
+    addr_num_matches = (int *) grow_table(addr_num_matches, address_capacity, new_capacity, sizeof(int));
+    address_capacity = new_capacity;
+}
+
+/** the address is published to the lookups once its tables are filled in */
+static void insert_into_hash(address_hash_table *table, int adr_id)
+{
+    uint32_t slot = address_hash(addresses[adr_id]) & (table->size - 1);
+    while (atomic_load_explicit(&table->slots[slot], memory_order_relaxed)) slot = (slot + 1) & (table->size - 1);
+    atomic_store_explicit(&table->slots[slot], adr_id + 1, memory_order_release);
+}
+
+static void ensure_hash_size()
+{
+    address_hash_table *old_table = atomic_load_explicit(&addr_hash, memory_order_relaxed);
+    int old_size = old_table ? old_table->size : 0;
+    if (2 * (num_addresses + 1) <= old_size) return;
+    address_hash_table *table = (address_hash_table *) malloc(sizeof(address_hash_table));
+    if (!table) addr_mem_failure("grow hash");
+    table->size = old_size ? 2 * old_size : 2 * INITIAL_ADDRESS_CAPACITY;
+    table->slots = (_Atomic int *) calloc(table->size, sizeof(int));
+    if (!table->slots) addr_mem_failure("grow hash");
+    for (int i = 0; i < num_addresses; i++)
+        insert_into_hash(table, i);
+    atomic_store_explicit(&addr_hash, table, memory_order_release);   // old table is not freed, see grow_table()
+}
+
+int find_address(char *adr)
+{
+    address_hash_table *table = atomic_load_explicit(&addr_hash, memory_order_acquire);
+    if (!table) return -1;
+    uint32_t slot = address_hash(adr) & (table->size - 1);
+    int entry;
+    while ((entry = atomic_load_explicit(&table->slots[slot], memory_order_acquire)))
+    {
+        int adr_id = entry - 1;
+        if (strcmp(adr, addresses[adr_id]) == 0)
+        {
+            deros_dbglog_msg_str_int(D_DEBG, "addr", "common", "find addr (1) => id (2)", adr, adr_id);
+            return adr_id;
+        }
+        slot = (slot + 1) & (table->size - 1);
+    }
+    deros_dbglog_msg_str(D_DEBG, "addr", "common", "find addr => not found", adr);
+    return -1;
+}
+
+static int list_capacity(int *list)
+{
+    return list ? list[-1] : 0;
+}
+
+/** the id is stored before the list and its new length are published to the threads that read without the lock */
+static void add_to_list(int **list, int *num, int id)
+{
+    int *ids = *list;
+    if (*num == list_capacity(ids))
+    {
+        int capacity = *num ? 2 * *num : 4;
+        int *block = (int *) malloc(sizeof(int) * (capacity + 1));
+        if (!block) addr_mem_failure("add addr");
+        block[0] = capacity;
+        ids = block + 1;
+        if (*num) memcpy(ids, *list, sizeof(int) * *num);
+    }
+    ids[*num] = id;
+    __atomic_store_n(list, ids, __ATOMIC_RELEASE);
+    __atomic_store_n(num, *num + 1, __ATOMIC_RELEASE);
+}
+
+int *address_subscribers(int adr_id, int *num)
+{
+    int n = __atomic_load_n(&addr_num_sub[adr_id], __ATOMIC_ACQUIRE);
+    int *list = __atomic_load_n(&addr_subscribers[adr_id], __ATOMIC_ACQUIRE);
+    // the tables may have been read before and after they grew, a list never holds more than its capacity
+    *num = (n < list_capacity(list)) ? n : list_capacity(list);
+    return list;
+}
+
+static int is_wildcard(char *segment, int length, int num_stars)
+{
+    return (length == num_stars) && (strncmp(segment, "**", num_stars) == 0);
+}
+
+/** @return  the rest of the address after its first segment, 0 if it was the last one */
+static char *next_segment(char *adr, int *length)
+{
+    char *slash = strchr(adr, '/');
+    *length = slash ? slash - adr : strlen(adr);
+    return slash ? slash + 1 : 0;
+}
+
+int address_is_pattern(char *adr)
+{
+    while (adr)
+    {
+        int length;
+        char *rest = next_segment(adr, &length);
+        if (is_wildcard(adr, length, 1) || is_wildcard(adr, length, 2)) return 1;
+        adr = rest;
+    }
+    return 0;
+}
+
+static address_trie_node *new_trie_node(char *segment, int length)
+{
+    address_trie_node *node = (address_trie_node *) calloc(1, sizeof(address_trie_node));
+    if (!node) addr_mem_failure("trie node");
+    node->segment = segment;
+    node->segment_length = length;
+    node->adr_id = -1;
+    return node;
+}
+
+static int compare_segment(address_trie_node *node, char *segment, int length)
+{
+    int n = (node->segment_length < length) ? node->segment_length : length;
+    int c = memcmp(node->segment, segment, n);
+    return c ? c : node->segment_length - length;
+}
+
+/** @return  the child of the node for the plain segment, or 0 if there is none
+ *  @param where  set to the position where the child belongs among the children (unless it is 0) */
+static address_trie_node *find_trie_child(address_trie_node *node, char *segment, int length, int *where)
+{
+    int low = 0;
+    int high = node->num_children;
+    while (low < high)
+    {
+        int mid = (low + high) / 2;
+        int c = compare_segment(node->children[mid], segment, length);
+        if (c == 0) return node->children[mid];
+        if (c < 0) low = mid + 1;
+        else high = mid;
+    }
+    if (where) *where = low;
+    return 0;
+}
+
+/** add the segments of the address to the trie, they point into the stored address */
+static void insert_into_trie(int adr_id)
 {
-    int l = 0, h = num_addresses;
-    while (l != h) 
+    if (!address_trie) address_trie = new_trie_node("", 0);
+    address_trie_node *node = address_trie;
+    char *adr = addresses[adr_id];
+    while (adr)
     {
-        int mid = (l + h) / 2;
-        int cmpmid = strcmp(adr, addresses[addr[mid]]);
-        if (cmpmid > 0) l = mid + 1;
-        else if (cmpmid < 0) h = mid;
-        else 
+        int length;
+        char *rest = next_segment(adr, &length);
+        address_trie_node **wildcard = is_wildcard(adr, length, 1) ? &node->any_segment : 
+                                       is_wildcard(adr, length, 2) ? &node->any_segments : 0;
+        if (wildcard)
         {
-            if (found) *found = 1;
-            deros_dbglog_msg_str_2int(D_DEBG, "addr", "common", "find addr (1) => found (2) index (3)", adr, *found, mid);
-            return mid;
+            if (!*wildcard) *wildcard = new_trie_node(adr, length);
+            node = *wildcard;
         }
-    }  
-    if (found) *found = 0;
-    deros_dbglog_msg_str_2int(D_DEBG, "addr", "common", "find addr (1) => found (2) index (3)", adr, *found, l);
-    return l;
+        else
+        {
+            int where;
+            address_trie_node *child = find_trie_child(node, adr, length, &where);
+            if (!child)
+            {
+                child = new_trie_node(adr, length);
+                if (node->num_children == node->children_capacity)
+                {
+                    node->children_capacity = node->children_capacity ? 2 * node->children_capacity : 4;
+                    node->children = (address_trie_node **) realloc(node->children, sizeof(address_trie_node *) * node->children_capacity);
+                    if (!node->children) addr_mem_failure("trie children");
+                }
+                memmove(node->children + where + 1, node->children + where, sizeof(address_trie_node *) * (node->num_children - where));
+                node->children[where] = child;
+                node->num_children++;
+            }
+            node = child;
+        }
+        adr = rest;
+    }
+    node->adr_id = adr_id;
+}
+
+static void collect_trie_match(int adr_id)
+{
+    for (int i = 0; i < num_trie_matches; i++)
+        if (trie_matches[i] == adr_id) return;   // "**" can reach the same address in more ways
+    add_to_list(&trie_matches, &num_trie_matches, adr_id);
+}
+
+/** collect the patterns below the node that match the rest of the address
+ *  @param adr  the rest of the address, 0 if all its segments have been matched */
+static void match_patterns_of_address(address_trie_node *node, char *adr)
+{
+    if (node->any_segments)   // "**" takes none, one, or more of the remaining segments
+    {
+        char *rest = adr;
+        while (1)
+        {
+            match_patterns_of_address(node->any_segments, rest);
+            if (!rest) break;
+            int length;
+            rest = next_segment(rest, &length);
+        }
+    }
+    if (!adr)
+    {
+        if ((node->adr_id >= 0) && addr_is_pattern[node->adr_id]) collect_trie_match(node->adr_id);
+        return;
+    }
+
+    int length;
+    char *rest = next_segment(adr, &length);
+    address_trie_node *child = find_trie_child(node, adr, length, 0);
+    if (child) match_patterns_of_address(child, rest);
+    if (node->any_segment) match_patterns_of_address(node->any_segment, rest);
 }
 
-void insert_address_at_index(char *address, int at_index)
+/** collect the addresses below the node that match the rest of the pattern, patterns do not match patterns
+ *  @param pattern  the rest of the pattern, 0 if all its segments have been matched */
+static void match_addresses_of_pattern(address_trie_node *node, char *pattern)
+{
+    if (!pattern)
+    {
+        if ((node->adr_id >= 0) && !addr_is_pattern[node->adr_id]) collect_trie_match(node->adr_id);
+        return;
+    }
+
+    int length;
+    char *rest = next_segment(pattern, &length);
+    if (is_wildcard(pattern, length, 2))
+    {
+        match_addresses_of_pattern(node, rest);
+        for (int i = 0; i < node->num_children; i++)
+            match_addresses_of_pattern(node->children[i], pattern);
+    }
+    else if (is_wildcard(pattern, length, 1))
+    {
+        for (int i = 0; i < node->num_children; i++)
+            match_addresses_of_pattern(node->children[i], rest);
+    }
+    else
+    {
+        address_trie_node *child = find_trie_child(node, pattern, length, 0);
+        if (child) match_addresses_of_pattern(child, rest);
+    }
+}
+
+/** the address gets the subscribers of the pattern that matches it */
+static void link_pattern_to_address(int pattern_id, int adr_id)
+{
+    add_to_list(&addr_matches[pattern_id], &addr_num_matches[pattern_id], adr_id);
+    add_to_list(&addr_matches[adr_id], &addr_num_matches[adr_id], pattern_id);
+    for (int i = 0; i < addr_num_sub[pattern_id]; i++)
+        add_to_list(&addr_subscribers[adr_id], &addr_num_sub[adr_id], addr_subscribers[pattern_id][i]);
+}
+
+/** address change lock must be held */
+static int insert_address(char *address)
 {
     char *adr = (char *) malloc(strlen(address) + 1);
     if (!adr) addr_mem_failure("insert addr");
     strcpy(adr, address);
-    addresses[num_addresses] = adr;
-    for (int i = num_addresses; i > at_index; i--)
-       addr[i] = addr[i - 1];
-    addr[at_index] = num_addresses;
+
+    ensure_address_capacity();
+    ensure_hash_size();
+    int adr_id = num_addresses;
+    addresses[adr_id] = adr;
+    addr_subscribers[adr_id] = 0;
+    addr_num_sub[adr_id] = 0;
+    addr_publishers[adr_id] = 0;
+    addr_num_pub[adr_id] = 0;
+    addr_is_pattern[adr_id] = address_is_pattern(adr);
+    addr_matches[adr_id] = 0;
+    addr_num_matches[adr_id] = 0;
     num_addresses++;
+    insert_into_hash(atomic_load_explicit(&addr_hash, memory_order_relaxed), adr_id);
+    insert_into_trie(adr_id);
+
+    num_trie_matches = 0;
+    if (addr_is_pattern[adr_id]) match_addresses_of_pattern(address_trie, adr);
+    else match_patterns_of_address(address_trie, adr);
+    for (int i = 0; i < num_trie_matches; i++)
+    {
+        if (addr_is_pattern[adr_id]) link_pattern_to_address(adr_id, trie_matches[i]);
+        else link_pattern_to_address(trie_matches[i], adr_id);
+    }
+    return adr_id;
 }
 
-void init_address_of_subscriber(int adr_id, int sub_id)
+int find_or_insert_address(char *address)
 {
-    addr_subscribers[sub_id] = (int *) malloc(sizeof(int) * 1);
-    if (!addr_subscribers[sub_id]) addr_mem_failure("init addr");
-    addr_subscribers[sub_id][0] = sub_id;
-    addr_num_sub[adr_id] = 1;
+    int adr_id = find_address(address);
+    if (adr_id >= 0) return adr_id;
+
+    pthread_mutex_lock(&addr_change_lock);
+    adr_id = find_address(address);
+    if (adr_id < 0) adr_id = insert_address(address);
+    pthread_mutex_unlock(&addr_change_lock);
+    return adr_id;
 }
 
-void add_subscriber_to_address(int adr_id, int sub_id)
+int find_or_insert_matched_address(char *address)
 {
-    int ind = addr_num_sub[adr_id]++;
-    addr_subscribers[adr_id] = (int *) realloc(addr_subscribers[adr_id], sizeof(int) * addr_num_sub[adr_id]);
-    if (!addr_subscribers[adr_id]) addr_mem_failure("add addr");
-    addr_subscribers[adr_id][ind] = sub_id;
+    int adr_id = find_address(address);
+    if (adr_id >= 0) return adr_id;
+
+    pthread_mutex_lock(&addr_change_lock);
+    adr_id = find_address(address);
+    if ((adr_id < 0) && address_trie && !address_is_pattern(address))
+    {
+        num_trie_matches = 0;
+        match_patterns_of_address(address_trie, address);
+        if (num_trie_matches) adr_id = insert_address(address);
+    }
+    pthread_mutex_unlock(&addr_change_lock);
+    return adr_id;
 }
 
-void remove_subscriber_from_address(int adr_id, int sub_id)
+static void remove_from_list(int *list, int *num, int id)
+{
+    for (int i = 0; i < *num; i++)
+        if (list[i] == id)
+        {
+            list[i] = list[*num - 1];
+            __atomic_store_n(num, *num - 1, __ATOMIC_RELEASE);
+            break;
+        }
+}
+
+static void renumber_in_list(int *list, int num, int old_id, int new_id)
 {
-    for (int i = 0; i < addr_num_sub[adr_id]; i++)
-        if (addr_subscribers[adr_id][i] == sub_id)
+    for (int i = 0; i < num; i++)
+        if (list[i] == old_id)
         {
-            addr_subscribers[adr_id][i] = addr_subscribers[adr_id][--addr_num_sub[adr_id]];
+            list[i] = new_id;
             break;
         }
 }
+
+void add_subscriber_to_address(int adr_id, int sub_id)
+{
+    pthread_mutex_lock(&addr_change_lock);
+    add_to_list(&addr_subscribers[adr_id], &addr_num_sub[adr_id], sub_id);
+    for (int i = 0; addr_is_pattern[adr_id] && (i < addr_num_matches[adr_id]); i++)
+    {
+        int matched = addr_matches[adr_id][i];
+        add_to_list(&addr_subscribers[matched], &addr_num_sub[matched], sub_id);
+    }
+    pthread_mutex_unlock(&addr_change_lock);
+}
+
+void remove_subscriber_from_address(int adr_id, int sub_id)
+{
+    pthread_mutex_lock(&addr_change_lock);
+    remove_from_list(addr_subscribers[adr_id], &addr_num_sub[adr_id], sub_id);
+    for (int i = 0; addr_is_pattern[adr_id] && (i < addr_num_matches[adr_id]); i++)
+    {
+        int matched = addr_matches[adr_id][i];
+        remove_from_list(addr_subscribers[matched], &addr_num_sub[matched], sub_id);
+    }
+    pthread_mutex_unlock(&addr_change_lock);
+}
+
+void renumber_subscriber_of_address(int adr_id, int old_sub_id, int new_sub_id)
+{
+    pthread_mutex_lock(&addr_change_lock);
+    renumber_in_list(addr_subscribers[adr_id], addr_num_sub[adr_id], old_sub_id, new_sub_id);
+    for (int i = 0; addr_is_pattern[adr_id] && (i < addr_num_matches[adr_id]); i++)
+    {
+        int matched = addr_matches[adr_id][i];
+        renumber_in_list(addr_subscribers[matched], addr_num_sub[matched], old_sub_id, new_sub_id);
+    }
+    pthread_mutex_unlock(&addr_change_lock);
+}
+
+void add_publisher_to_address(int adr_id, int pub_id)
+{
+    add_to_list(&addr_publishers[adr_id], &addr_num_pub[adr_id], pub_id);
+}
+
+void remove_publisher_from_address(int adr_id, int pub_id)
+{
+    remove_from_list(addr_publishers[adr_id], &addr_num_pub[adr_id], pub_id);
+}
+
+void renumber_publisher_of_address(int adr_id, int old_pub_id, int new_pub_id)
+{
+    renumber_in_list(addr_publishers[adr_id], addr_num_pub[adr_id], old_pub_id, new_pub_id);
+}
@@ -3,23 +3,52 @@
 
 // structures and methods used to maintain list of used deros addresses
 
-#define MAX_NUM_ADDRESSES 1000
+#include <netinet/in.h>
+#include <inttypes.h>
 
-extern char *addresses[MAX_NUM_ADDRESSES];
-extern int addr[MAX_NUM_ADDRESSES];
+#define INITIAL_ADDRESS_CAPACITY 64
+
+// addresses are made of segments separated by '/', a pattern is an address with wildcard segments: "*" stands for
+// any one segment, "**" for any number of segments (also none), e.g. "sensors/*" or "diag/**"
+
+// all tables are indexed by address id, they grow as new addresses are added (addresses are never removed)
+extern char **addresses;
 extern int num_addresses;
-extern int *addr_subscribers[MAX_NUM_ADDRESSES];
-extern int addr_num_sub[MAX_NUM_ADDRESSES];
+extern int **addr_subscribers;      // the subscribers of an address include those of the patterns that match it
+extern int *addr_num_sub;
+extern int **addr_publishers;
+extern int *addr_num_pub;
+extern uint8_t *addr_is_pattern;
+extern int **addr_matches;          // addresses that a pattern matches, or patterns that match an address
+extern int *addr_num_matches;
+
+// returns 1 if the address has wildcard segments
+int address_is_pattern(char *adr);
 
-// returns position in the index array, not the addr id itself
-int find_address(char *adr, int *found);
+// returns address id, or -1 if the address is not known
+int find_address(char *adr);
 
-void insert_address_at_index(char *address, int at_index);
+// returns address id of a known address, or adds a new address with empty lists of subscribers and publishers,
+// (the lists of a new address get the subscribers of the patterns that match it)
+int find_or_insert_address(char *adr);
 
-void init_address_of_subscriber(int adr_id, int sub_id);
+// returns address id of a known address, or adds the address if some known pattern matches it, -1 otherwise
+int find_or_insert_matched_address(char *adr);
+
+// a subscriber of a pattern is added to (removed from, renumbered in) the lists of all addresses that the pattern matches too
 void add_subscriber_to_address(int adr_id, int sub_id);
 void remove_subscriber_from_address(int adr_id, int sub_id);
+void renumber_subscriber_of_address(int adr_id, int old_sub_id, int new_sub_id);
+
+// returns the list of subscribers of the address for a thread that walks it without the lock (a list that grows
+// is replaced, the old one stays valid), num is set to the number of subscribers in it
+int *address_subscribers(int adr_id, int *num);
 
+// multicast group 239.255.x.y of the address (x.y is derived from its hash, different addresses may share a group)
+void address_multicast_group(char *adr, struct in_addr *group);
 
+void add_publisher_to_address(int adr_id, int pub_id);
+void remove_publisher_from_address(int adr_id, int pub_id);
+void renumber_publisher_of_address(int adr_id, int old_pub_id, int new_pub_id);
 
 #endif
@@ -6,6 +6,7 @@
 #define MAX_NODES 100
 
 #define MAX_PACKET_LENGTH       (10*1024*1024)
+#define LISTEN_BACKLOG 128
 #define PACKET_INIT              1
 #define PACKET_RESPONSE_INIT     2
 #define PACKET_DONE              3
@@ -16,6 +17,20 @@
 #define PACKET_ADD_SUBSCRIBER    8
 #define PACKET_REMOVE_SUBSCRIBER 9
 #define PACKET_NEW_MESSAGE       10
+#define PACKET_SHM_ATTACH        11
+#define PACKET_SHM_ATTACHED      12
+#define PACKET_SHM_DOORBELL      13
+#define PACKET_SHM_VIA_SOCKET    14
+#define PACKET_TOPIC_BIND        15
+#define PACKET_MEMFD_MESSAGE     16
+#define PACKET_MESSAGE_CHUNK     17
+#define PACKET_TOPIC_ID          18
+#define PACKET_BATCH             19
+#define PACKET_BATCH_DONE        20
+#define PACKET_RESYNC            21
+#define PACKET_HEARTBEAT         22
+#define PACKET_QUERY             23
+#define PACKET_QUERY_RESPONSE    24
 
 
 #define INIT_MSG_HEADER     "deros?"
@@ -24,5 +39,61 @@
 #define MAX_NUM_PUBLISHERS         1000
 #define MAX_NUM_SUBSCRIBERS        1000
 #define MAX_NUM_REMOTE_SUBSCRIBERS  200
+#define SUBSCRIBER_MAX_EPOLL_EVENTS  64
+#define PUBLISHER_MAX_EPOLL_EVENTS   64
+#define DEFAULT_CALLBACK_THREADS      2
+
+// pool of packet buffers of publishers, classes have capacities from 4 KB up to 16 MB
+#define PACKET_POOL_MIN_CAPACITY  4096
+#define PACKET_POOL_CLASSES       13
+#define PACKET_POOL_MAX_BYTES     (64*1024*1024L)
+
+// messages waiting for slow subscriber nodes
+#define DEFAULT_QUEUE_BLOCK_TIMEOUT_MS  1000
+#define REMOTE_NODE_CLOSE_TIMEOUT_MS    1000   // how long the queue can be still flushed when the last publisher leaves
+
+// connections to subscriber nodes are made in the background, a failed one is tried again after a delay that doubles each time
+#define REMOTE_NODE_CONNECT_TIMEOUT_MS  3000
+#define RECONNECT_MIN_BACKOFF_MS         100
+#define RECONNECT_MAX_BACKOFF_MS        5000
+#define SERVER_RECONNECT_MIN_MS           20   // pauses between attempts to connect to the deros server again
+#define SERVER_RECONNECT_MAX_MS          500
+
+// idle connections carry heartbeats, a peer that stays silent for the timeout is considered dead,
+// the server announces both values to its nodes, and they use them on their data connections too
+#define DEFAULT_HEARTBEAT_INTERVAL_MS   1000
+#define DEFAULT_HEARTBEAT_TIMEOUT_MS    5000
+
+// packets waiting for the socket of a subscriber node leave together in one sendmsg()
+#define PUBLISHER_MAX_IOV           64
+#define PUBLISHER_TX_BATCH_BYTES    (256*1024)   // more packets are not taken from the queue while this much waits for the socket
+
+// size of the shared memory ring used for each publisher->subscriber node pair on the same host
+#define SHM_RING_CAPACITY   (8*1024*1024)
+#define SHM_ATTACH_TIMEOUT_MS  1000
+#define SHM_RING_FULL_WAIT_US  50
+
+// subscriber nodes on the same host are connected through Unix domain sockets, messages from this size on are written 
+// to a sealed memory file and only its descriptor is passed through the socket, the subscriber maps it
+#define MEMFD_MESSAGE_THRESHOLD  (1024*1024)
+
+// longer messages are streamed in chunks of this size (packet contents), the chunks of messages of different publishers
+// take turns, and a chunk is sent only when nothing else waits for the socket, so that small messages do not wait for large ones
+#define MESSAGE_CHUNK_SIZE      (256*1024)
+#define PUBLISHER_UNSENT_LIMIT  (512*1024)   // TCP_NOTSENT_LOWAT: the rest waits in the queue, where small messages can overtake
+
+// publishers of each priority class have their own connections to subscriber nodes, their packets are marked for the network
+#define HIGH_PRIORITY_SOCKET_PRIORITY   6   // SO_PRIORITY: TC_PRIO_INTERACTIVE, the first band of the default queueing discipline
+#define HIGH_PRIORITY_DSCP             46   // expedited forwarding
+#define LOW_PRIORITY_SOCKET_PRIORITY    2   // TC_PRIO_BULK, the last band
+#define LOW_PRIORITY_DSCP               8   // class selector 1, lower effort
+
+// UDP and multicast transport: messages are split to datagrams that fit the usual MTU of ethernet, 
+// all nodes join multicast groups 239.255.x.y on the same port
+#define UDP_DATAGRAM_SIZE        1472
+#define UDP_SEND_BATCH             64   // datagrams sent with one sendmmsg()
+#define UDP_RECEIVE_BATCH          32   // datagrams received with one recvmmsg()
+#define UDP_SOCKET_BUFFER   (4*1024*1024)   // send and receive buffers of datagram sockets, bursts of fragments need it
+#define DEROS_MULTICAST_PORT     9343
 
 #endif
@@ -53,7 +53,7 @@ int deros_dbglog_init(char *path, char *prefix, int num_levels, char **level_nam
     if (path)
     {
         int path_len = strlen(path);
-        deros_dbglog_filename = (char *)malloc(path_len + 30);
+        deros_dbglog_filename = (char *)malloc(path_len + strlen(prefix) + 30);
         if (!deros_dbglog_filename) deros_dbglog_mem_fail();
         if ((path_len > 0) && ((path[path_len - 1] == '/') ||
             (path[path_len - 1] == '\\')))
@@ -62,7 +62,7 @@ int deros_dbglog_init(char *path, char *prefix, int num_levels, char **level_nam
     }
     else
     {
-        deros_dbglog_filename = (char *)malloc(30);
+        deros_dbglog_filename = (char *)malloc(strlen(prefix) + 30);
         if (!deros_dbglog_filename) deros_dbglog_mem_fail();
         sprintf(deros_dbglog_filename, "%s_deroslog_%ld.txt", prefix, t);
     }
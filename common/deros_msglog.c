@@ -66,7 +66,7 @@ int deros_msglog_init(char *path, char *prefix)
 void deros_msglog_published_msg(int handle, struct timeval *tm, char *pub_node_name, char *address, 
                                 char *msg, int msglen, int isAlreadyFormatted)
 {
-    static char msgcopy[DEROS_MSGLOG_MAX_MESSAGE_LEN + 1];
+    char msgcopy[DEROS_MSGLOG_MAX_MESSAGE_LEN + 1];   // logs of different publishers are written concurrently
 
     pthread_mutex_lock(&deros_lock_log[handle]);
     
@@ -74,6 +74,7 @@ void deros_msglog_published_msg(int handle, struct timeval *tm, char *pub_node_n
     if (!f)
     {
        deros_dbglog_msg_str(D_ERRR, "msglog", "common", "cannot open msglogfilename", deros_msglog_filename[handle]);
+       pthread_mutex_unlock(&deros_lock_log[handle]);
        return;
     }
     fprintf(f, "%ld.%ld\t%s\t%s\t", tm->tv_sec, tm->tv_usec / 10, pub_node_name, address);
@@ -4,11 +4,19 @@
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <poll.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <stddef.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
 #include <errno.h>
+#include <fcntl.h>
 
+#include "deros_common.h"
+#include "deros_net.h"
 #include "deros_dbglog.h"
 
 /** try to connect to a socket server at specified IP:port
@@ -46,6 +54,7 @@ int deros_connect_to_server(char *server, int port)
     if (connect(sock, (struct sockaddr *)&serv_addr, sizeof(serv_addr)) < 0) 
     { 
         deros_dbglog_msg(D_ERRR, "net", "common", "connect failed"); 
+        close(sock);
         return 0; 
     } 
     deros_dbglog_msg_str_int(D_INFO, "net", "common", "server connected", server, port);
@@ -53,6 +62,56 @@ int deros_connect_to_server(char *server, int port)
     return sock;
 }
 
+/** start connecting to the node at IP:port without waiting for the connection
+ *  @param in_progress  set to 1 if the connection is not established yet, the socket becomes writable when it is
+ *  @return  the non-blocking socket, or 0 on error */
+int deros_start_connect(char *ip, int port, int *in_progress)
+{
+    struct sockaddr_in address;
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_port = htons(port);
+    if (inet_pton(AF_INET, ip, &address.sin_addr) != 1)
+    {
+        deros_dbglog_msg_str(D_ERRR, "net", "common", "address not recognized", ip);
+        return 0;
+    }
+
+    int sock = socket(AF_INET, SOCK_STREAM, 0);
+    if (sock < 0)
+    { 
+        deros_dbglog_msg_int(D_ERRR, "net", "common", "socket error", errno); 
+        return 0; 
+    } 
+    if (!deros_set_nonblocking(sock))
+    {
+        close(sock);
+        return 0;
+    }
+    *in_progress = 0;
+    if (connect(sock, (struct sockaddr *)&address, sizeof(address)) < 0)
+    {
+        if (errno != EINPROGRESS)
+        {
+            deros_dbglog_msg_str_int(D_DEBG, "net", "common", "connect failed (ip, errno)", ip, errno);
+            close(sock);
+            return 0;
+        }
+        *in_progress = 1;
+    }
+    return sock;
+}
+
+/** @return  1 if the connection started by deros_start_connect() has been established, 0 if it failed (errno is set) */
+int deros_connect_result(int socket)
+{
+    int error = 0;
+    socklen_t len = sizeof(error);
+    if (getsockopt(socket, SOL_SOCKET, SO_ERROR, &error, &len) < 0) return 0;
+    errno = error;
+    return (error == 0);
+}
+
 /** convert unsigned int to C string */
 void deros_store_uint(uint8_t *buffer, unsigned int x)
 {
@@ -75,6 +134,53 @@ void deros_retrieve_uint(uint8_t *buffer, unsigned int *x)
     }
 }
 
+/** convert message header to its binary wire form of MSG_HEADER_LENGTH bytes */
+void deros_store_msg_header(uint8_t *buffer, deros_msg_header *header)
+{
+    deros_store_uint(buffer, header->topic_id);
+    deros_store_uint(buffer + 4, header->length);
+    deros_store_uint(buffer + 8, header->seq);
+    deros_store_uint(buffer + 12, header->sec);
+    deros_store_uint(buffer + 16, header->usec);
+}
+
+/** convert binary wire form of message header to the structure */
+void deros_retrieve_msg_header(uint8_t *buffer, deros_msg_header *header)
+{
+    unsigned int x;
+    deros_retrieve_uint(buffer, &x);       header->topic_id = x;
+    deros_retrieve_uint(buffer + 4, &x);   header->length = x;
+    deros_retrieve_uint(buffer + 8, &x);   header->seq = x;
+    deros_retrieve_uint(buffer + 12, &x);  header->sec = x;
+    deros_retrieve_uint(buffer + 16, &x);  header->usec = x;
+}
+
+/** convert datagram header to its binary wire form of DATAGRAM_HEADER_LENGTH bytes */
+void deros_store_datagram_header(uint8_t *buffer, deros_datagram_header *header)
+{
+    deros_store_msg_header(buffer, &header->msg);
+    buffer[MSG_HEADER_LENGTH] = header->fragment & 255;
+    buffer[MSG_HEADER_LENGTH + 1] = header->fragment >> 8;
+    buffer[MSG_HEADER_LENGTH + 2] = header->num_fragments & 255;
+    buffer[MSG_HEADER_LENGTH + 3] = header->num_fragments >> 8;
+    buffer[MSG_HEADER_LENGTH + 4] = header->address_length;
+}
+
+/** convert binary wire form of datagram header to the structure */
+void deros_retrieve_datagram_header(uint8_t *buffer, deros_datagram_header *header)
+{
+    deros_retrieve_msg_header(buffer, &header->msg);
+    header->fragment = buffer[MSG_HEADER_LENGTH] | (buffer[MSG_HEADER_LENGTH + 1] << 8);
+    header->num_fragments = buffer[MSG_HEADER_LENGTH + 2] | (buffer[MSG_HEADER_LENGTH + 3] << 8);
+    header->address_length = buffer[MSG_HEADER_LENGTH + 4];
+}
+
+/** @return  how many bytes of a message fit into one datagram together with the header and the address */
+int deros_fragment_payload(int address_length)
+{
+    return UDP_DATAGRAM_SIZE - DATAGRAM_HEADER_LENGTH - address_length;
+}
+
 /** send a packet to a connected TCP/IP peer over the specified socket 
  *  @param socket  an open socket to send it to
  *  @param packet_type  one-byte number manifesting the type of the packet
@@ -83,20 +189,97 @@ void deros_retrieve_uint(uint8_t *buffer, unsigned int *x)
  *  @return  if sending was successful, returns 1, otherwise 0 */
 int deros_send_packet(int socket, uint8_t packet_type, uint8_t *buffer, unsigned int size)
 {
-    unsigned int count = size;
+    return deros_send_packet_parts(socket, packet_type, 0, 0, buffer, size);
+}
+
+/** send a packet whose contents consist of a prefix and a body without joining them first, the framing, prefix and body
+ *  are written with a single system call (more only if the socket does not accept it all at once)
+ *  @param prefix  first part of the packet contents (can be 0 if prefix_size is 0)
+ *  @param buffer  the rest of the packet contents
+ *  @return  if sending was successful, returns 1, otherwise 0 */
+int deros_send_packet_parts(int socket, uint8_t packet_type, uint8_t *prefix, unsigned int prefix_size, uint8_t *buffer, unsigned int size)
+{
     uint8_t len[sizeof(unsigned int) + 1];
+    deros_store_uint(len, prefix_size + size);
+    len[sizeof(unsigned int)] = packet_type;
 
-    deros_store_uint(len, count);
+    struct iovec iov[3] = { { len, sizeof(len) }, { prefix, prefix_size }, { buffer, size } };
+    struct iovec *next = iov;
+    int num_iov = 3;
 
-    len[sizeof(unsigned int)] = packet_type;
+    while (num_iov)
+    {
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = next;
+        msg.msg_iovlen = num_iov;
+        ssize_t sent = sendmsg(socket, &msg, MSG_NOSIGNAL);
+        if (sent < 0)
+        {
+            if (errno == EINTR) continue;
+            if ((errno == EAGAIN) || (errno == EWOULDBLOCK))
+            {
+                // non-blocking socket: the packet must not be left half-sent, wait until the rest fits
+                struct pollfd pfd = { socket, POLLOUT, 0 };
+                if ((poll(&pfd, 1, -1) < 0) && (errno != EINTR)) return 0;
+                continue;
+            }
+            return 0;
+        }
+        while (num_iov && ((size_t)sent >= next->iov_len))
+        {
+            sent -= next->iov_len;
+            next++;
+            num_iov--;
+        }
+        if (num_iov)
+        {
+            next->iov_base = (uint8_t *)next->iov_base + sent;
+            next->iov_len -= sent;
+        }
+    }
+    return 1;
+}
 
-    if (send(socket, len, sizeof(unsigned int) + 1, 0) < 0)
-        return 0;
+/** fill in the options used for connections unless they are configured otherwise: small packets are not delayed */
+void deros_default_socket_options(deros_socket_options *options)
+{
+    options->nodelay = 1;
+    options->send_buffer = -1;
+    options->receive_buffer = -1;
+    options->priority = -1;
+}
 
-    if (send(socket, buffer, size, 0) < 0)
-        return 0;
+/** set the options of a TCP connection, options with value -1 are left at the system default
+ *  @return  1 on success, 0 if some option could not be set (the others are set anyway) */
+int deros_apply_socket_options(int socket, deros_socket_options *options)
+{
+    int ok = 1;
+    int domain = AF_INET;
+    socklen_t domain_len = sizeof(domain);
+    getsockopt(socket, SOL_SOCKET, SO_DOMAIN, &domain, &domain_len);
+    if ((options->nodelay >= 0) && (domain != AF_UNIX) && setsockopt(socket, IPPROTO_TCP, TCP_NODELAY, &options->nodelay, sizeof(int)))
+        ok = 0;
+    if ((options->send_buffer >= 0) && setsockopt(socket, SOL_SOCKET, SO_SNDBUF, &options->send_buffer, sizeof(int)))
+        ok = 0;
+    if ((options->receive_buffer >= 0) && setsockopt(socket, SOL_SOCKET, SO_RCVBUF, &options->receive_buffer, sizeof(int)))
+        ok = 0;
+    if ((options->priority >= 0) && setsockopt(socket, SOL_SOCKET, SO_PRIORITY, &options->priority, sizeof(int)))
+        ok = 0;
+    if (!ok) deros_dbglog_msg_int(D_WARN, "net", "common", "could not set some socket option, errno=", errno);
+    return ok;
+}
 
-    return 1;
+/** mark the packets of a TCP connection for the network: SO_PRIORITY chooses the band of the queueing discipline
+ *  of the interface, DSCP (in the TOS byte) is seen by the routers and switches
+ *  @return  1 on success, 0 if some option could not be set */
+int deros_set_traffic_class(int socket, int priority, int dscp)
+{
+    int tos = dscp << 2;
+    int ok = (setsockopt(socket, SOL_SOCKET, SO_PRIORITY, &priority, sizeof(int)) == 0) &&
+             (setsockopt(socket, IPPROTO_IP, IP_TOS, &tos, sizeof(int)) == 0);
+    if (!ok) deros_dbglog_msg_int(D_WARN, "net", "common", "could not set traffic class of socket, errno=", errno);
+    return ok;
 }
 
 /** wait for a packet arriving from the spcified socket, and store it to a buffer up to the maximum size specified in bytes
@@ -166,7 +349,7 @@ int deros_create_server(int port)
     deros_dbglog_msg(D_INFO, "net", "common", "socket bound to address");
 
     deros_dbglog_msg(D_DEBG, "net", "common", "listening...");
-    if (listen(server_fd, 3) < 0) 
+    if (listen(server_fd, LISTEN_BACKLOG) < 0) 
     { 
         deros_dbglog_msg_int(D_ERRR, "net", "common", "listen", errno);
         return 0;
@@ -174,6 +357,90 @@ int deros_create_server(int port)
     return server_fd;
 }
 
+/** create a non-blocking UDP socket bound to the specified port, with a large receive buffer for bursts of datagrams
+ * @param shared  other sockets can be bound to the same port too (the sockets of multicast groups)
+ * @return  if setup is successful, returns the socket descriptor, otherwise returns 0 */
+int deros_create_datagram_socket(int port, int shared)
+{
+    int sock = socket(AF_INET, SOCK_DGRAM, 0);
+    if (sock < 0)
+    {
+        deros_dbglog_msg_int(D_ERRR, "net", "common", "datagram socket failed", errno);
+        return 0;
+    }
+    int opt = 1;
+    if (shared && setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)))
+    {
+        deros_dbglog_msg_int(D_ERRR, "net", "common", "setsockopt", errno);
+        close(sock);
+        return 0;
+    }
+    int rcvbuf = UDP_SOCKET_BUFFER;   // the system limits it to net.core.rmem_max
+    setsockopt(sock, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+
+    struct sockaddr_in address;
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = INADDR_ANY;
+    address.sin_port = htons(port);
+    if ((bind(sock, (struct sockaddr *)&address, sizeof(address)) < 0) || !deros_set_nonblocking(sock))
+    { 
+        deros_dbglog_msg_int(D_ERRR, "net", "common", "datagram socket bind failed", errno);
+        close(sock);
+        return 0;
+    } 
+    return sock;
+}
+
+/** the Unix domain socket of a node has an abstract name (no file) derived from its listen port, which is unique on the host */
+static socklen_t local_node_address(int port, struct sockaddr_un *address)
+{
+    memset(address, 0, sizeof(struct sockaddr_un));
+    address->sun_family = AF_UNIX;
+    int len = snprintf(address->sun_path + 1, sizeof(address->sun_path) - 1, "deros-node-%d", port);
+    return offsetof(struct sockaddr_un, sun_path) + 1 + len;
+}
+
+/** will create a Unix domain server socket for the nodes on the same host, and prepare it for listening for connections 
+ * @param port  the TCP listen port of the node
+ * @return  if setup is successful, returns the server socket descriptor, otherwise returns 0 */
+int deros_create_local_server(int port)
+{
+    int server_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (server_fd < 0) 
+    {
+        deros_dbglog_msg_int(D_ERRR, "net", "common", "local socket failed", errno);
+        return 0;
+    }
+    struct sockaddr_un address;
+    socklen_t addrlen = local_node_address(port, &address);
+    if ((bind(server_fd, (struct sockaddr *)&address, addrlen) < 0) || (listen(server_fd, LISTEN_BACKLOG) < 0))
+    { 
+        deros_dbglog_msg_int(D_ERRR, "net", "common", "local socket bind/listen failed", errno);
+        close(server_fd);
+        return 0;
+    } 
+    return server_fd;
+}
+
+/** try to connect to the Unix domain socket of a node on the same host
+ * @param port  the TCP listen port of the node
+ * @return  socket descriptor, or 0 if the node cannot be reached this way (e.g. it runs in another network namespace) */
+int deros_connect_to_local_node(int port)
+{
+    int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (sock < 0) return 0;
+    struct sockaddr_un address;
+    socklen_t addrlen = local_node_address(port, &address);
+    if (connect(sock, (struct sockaddr *)&address, addrlen) < 0)
+    {
+        deros_dbglog_msg_int(D_DEBG, "net", "common", "local connect failed", errno);
+        close(sock);
+        return 0;
+    }
+    return sock;
+}
+
 /** after the server socket was created, we can start accepting connections
  * @param server_fd  server socket descriptor created by the previous function
  * @return  after a connection to a newly accepted node is established, the new TCP socket for communication with the new peer is returned, 0 is returned on error */
@@ -189,3 +456,212 @@ int deros_wait_for_client_connection(int server_fd)
     return new_socket;
 }
 
+/** switch the socket to non-blocking mode 
+ *  @return  1 on success, 0 on error */
+int deros_set_nonblocking(int socket)
+{
+    int flags = fcntl(socket, F_GETFL, 0);
+    if ((flags < 0) || (fcntl(socket, F_SETFL, flags | O_NONBLOCK) < 0))
+    {
+        deros_dbglog_msg_int(D_ERRR, "net", "common", "could not set non-blocking socket", errno);
+        return 0;
+    }
+    return 1;
+}
+
+void deros_net_mem_failure(char *msg)
+{
+    deros_dbglog_msg_str(D_GRRR, "net", "common", "not enough memory", msg);
+    exit(1);
+}
+
+/** add a packet to the batch, the batch grows as needed (it starts empty, zeroed)
+ *  @param prefix  first part of the packet contents (can be 0 if prefix_size is 0) */
+void deros_batch_append(deros_packet_batch *batch, uint8_t packet_type, uint8_t *prefix, unsigned int prefix_size, uint8_t *buffer, unsigned int size)
+{
+    unsigned int needed = batch->len + sizeof(unsigned int) + 1 + prefix_size + size;
+    if (needed > batch->capacity)
+    {
+        unsigned int new_capacity = batch->capacity ? batch->capacity : 1024;
+        while (new_capacity < needed) new_capacity *= 2;
+        batch->data = (uint8_t *) realloc(batch->data, new_capacity);
+        if (!batch->data) deros_net_mem_failure("batch grow");
+        batch->capacity = new_capacity;
+    }
+    uint8_t *pos = batch->data + batch->len;
+    deros_store_uint(pos, prefix_size + size);
+    pos[sizeof(unsigned int)] = packet_type;
+    if (prefix_size) memcpy(pos + sizeof(unsigned int) + 1, prefix, prefix_size);
+    if (size) memcpy(pos + sizeof(unsigned int) + 1 + prefix_size, buffer, size);
+    batch->len = needed;
+}
+
+void deros_batch_free(deros_packet_batch *batch)
+{
+    free(batch->data);
+    batch->data = 0;
+    batch->len = batch->capacity = 0;
+}
+
+/** iterate over the packets in the contents of a PACKET_BATCH
+ *  @param offset  position of the next packet, start with 0
+ *  @param packet  will point to the contents of the packet inside of the batch
+ *  @return  type of the packet, 0 after the last packet, 255 if the batch is malformed */
+uint8_t deros_batch_next_packet(uint8_t *batch, unsigned int batch_size, unsigned int *offset, uint8_t **packet, unsigned int *size)
+{
+    if (*offset == batch_size) return 0;
+    if (batch_size - *offset < sizeof(unsigned int) + 1) return 255;
+    unsigned int len;
+    deros_retrieve_uint(batch + *offset, &len);
+    if (len > batch_size - *offset - sizeof(unsigned int) - 1) return 255;
+    uint8_t packet_type = batch[*offset + sizeof(unsigned int)];
+    *packet = batch + *offset + sizeof(unsigned int) + 1;
+    *size = len;
+    *offset += sizeof(unsigned int) + 1 + len;
+    return packet_type ? packet_type : 255;
+}
+
+/** prepare an empty receive buffer of the initial capacity */
+void deros_rxbuf_init(deros_rxbuf *rx)
+{
+    rx->data = (uint8_t *) malloc(RXBUF_INITIAL_CAPACITY + 1);   // one spare byte for terminating the last packet
+    if (!rx->data) deros_net_mem_failure("rxbuf init");
+    rx->capacity = RXBUF_INITIAL_CAPACITY;
+    rx->start = rx->end = rx->needed = 0;
+    rx->terminated = 0;
+    rx->num_passed_fds = 0;
+}
+
+void deros_rxbuf_free(deros_rxbuf *rx)
+{
+    while (rx->num_passed_fds) close(rx->passed_fds[--rx->num_passed_fds]);
+    free(rx->data);
+    rx->data = 0;
+    rx->capacity = 0;
+}
+
+/** move the unparsed data to the beginning of the buffer, and resize the buffer so that the next packet fits,
+ *  a buffer that grew for a very long packet returns to the initial capacity when it is no longer needed */
+static void rxbuf_make_space(deros_rxbuf *rx)
+{
+    unsigned int pending = rx->end - rx->start;
+    if (rx->start)
+    {
+        memmove(rx->data, rx->data + rx->start, pending);
+        rx->start = 0;
+        rx->end = pending;
+    }
+
+    unsigned int wanted = RXBUF_INITIAL_CAPACITY;
+    if (rx->needed > wanted) wanted = rx->needed;
+    if (pending + RXBUF_MIN_READ > wanted) wanted = pending + RXBUF_MIN_READ;
+    if ((wanted > rx->capacity) || ((rx->capacity > RXBUF_MAX_IDLE_CAPACITY) && (wanted < rx->capacity)))
+    {
+        uint8_t *data = (uint8_t *) realloc(rx->data, wanted + 1);
+        if (!data) deros_net_mem_failure("rxbuf grow");
+        rx->data = data;
+        rx->capacity = wanted;
+    }
+}
+
+/** read whatever has arrived on a non-blocking socket into the buffer 
+ *  @return  1 if the connection is still open, 0 if it was closed or failed */
+int deros_rxbuf_fill(deros_rxbuf *rx, int socket)
+{
+    if ((rx->capacity - rx->end < RXBUF_MIN_READ) || (rx->start + rx->needed > rx->capacity) || 
+        ((rx->start == rx->end) && (rx->capacity > RXBUF_MAX_IDLE_CAPACITY)))
+        rxbuf_make_space(rx);
+
+    // descriptors passed through a Unix domain socket arrive together with the first bytes of their packets
+    struct iovec iov = { rx->data + rx->end, rx->capacity - rx->end };
+    char control[CMSG_SPACE(sizeof(int) * RXBUF_MAX_PASSED_FDS)];
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    int nread = recvmsg(socket, &msg, MSG_CMSG_CLOEXEC);
+    if (nread > 0) 
+    {
+        rx->end += nread;
+        for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg))
+        {
+            if ((cmsg->cmsg_level != SOL_SOCKET) || (cmsg->cmsg_type != SCM_RIGHTS)) continue;
+            int num_fds = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+            for (int i = 0; i < num_fds; i++)
+            {
+                int fd;
+                memcpy(&fd, CMSG_DATA(cmsg) + i * sizeof(int), sizeof(int));
+                if (rx->num_passed_fds < RXBUF_MAX_PASSED_FDS) rx->passed_fds[rx->num_passed_fds++] = fd;
+                else
+                {
+                    deros_dbglog_msg(D_ERRR, "net", "common", "too many descriptors passed, closing");
+                    close(fd);
+                }
+            }
+        }
+        return 1;
+    }
+    if ((nread < 0) && ((errno == EAGAIN) || (errno == EWOULDBLOCK) || (errno == EINTR))) return 1;
+    return 0;
+}
+
+/** @return  the oldest descriptor passed with the received data, or -1 if there is none, the caller owns it */
+int deros_rxbuf_take_fd(deros_rxbuf *rx)
+{
+    if (rx->num_passed_fds == 0) return -1;
+    int fd = rx->passed_fds[0];
+    rx->num_passed_fds--;
+    memmove(rx->passed_fds, rx->passed_fds + 1, sizeof(int) * rx->num_passed_fds);
+    return fd;
+}
+
+/** look at the next complete packet in the buffer without consuming it
+ *  @param packet  will point to the packet contents inside of the buffer
+ *  @param size  will contain the length of the packet contents
+ *  @return  type of the packet, 0 if there is no complete packet yet, 255 if the packet is too long */
+uint8_t deros_rxbuf_peek_packet(deros_rxbuf *rx, uint8_t **packet, int *size)
+{
+    unsigned int available = rx->end - rx->start;
+    if (available < sizeof(unsigned int) + 1) return 0;
+
+    unsigned int len;
+    deros_retrieve_uint(rx->data + rx->start, &len);
+    if (len > MAX_PACKET_LENGTH) return 255;
+    rx->needed = len + sizeof(unsigned int) + 1;
+    if (available < rx->needed) return 0;
+
+    *packet = rx->data + rx->start + sizeof(unsigned int) + 1;
+    *size = len;
+    return rx->data[rx->start + sizeof(unsigned int)];
+}
+
+/** terminate the contents of the packet returned by the last deros_rxbuf_peek_packet() with zero, so that it can be
+ *  parsed as a string in place, the overwritten byte (start of the next packet) is restored when the packet is consumed
+ *  @return  the contents of the packet */
+char *deros_rxbuf_packet_string(deros_rxbuf *rx)
+{
+    uint8_t *after = rx->data + rx->start + rx->needed;
+    if (!rx->terminated)
+    {
+        rx->saved_byte = *after;
+        *after = 0;
+        rx->terminated = 1;
+    }
+    return (char *)(rx->data + rx->start + sizeof(unsigned int) + 1);
+}
+
+/** drop the packet returned by the last deros_rxbuf_peek_packet() */
+void deros_rxbuf_consume_packet(deros_rxbuf *rx)
+{
+    if (rx->terminated)
+    {
+        rx->data[rx->start + rx->needed] = rx->saved_byte;
+        rx->terminated = 0;
+    }
+    rx->start += rx->needed;
+    rx->needed = 0;
+    if (rx->start == rx->end) rx->start = rx->end = 0;
+}
@@ -6,14 +6,105 @@
 #include <inttypes.h>
 
 int deros_connect_to_server(char *server, int port);
+int deros_connect_to_local_node(int port);
+int deros_start_connect(char *ip, int port, int *in_progress);
+int deros_connect_result(int socket);
 int deros_send_packet(int socket, uint8_t packet_type, uint8_t *buffer, unsigned int size);
+int deros_send_packet_parts(int socket, uint8_t packet_type, uint8_t *prefix, unsigned int prefix_size, uint8_t *buffer, unsigned int size);
 uint8_t deros_receive_packet(int socket, uint8_t *buffer, int *size, unsigned int maxsize);
+
+// packets collected in a growable buffer with the same framing as on the socket, to be sent together
+// as the contents of one PACKET_BATCH
+typedef struct {
+    uint8_t *data;
+    unsigned int len;
+    unsigned int capacity;
+} deros_packet_batch;
+
+void deros_batch_append(deros_packet_batch *batch, uint8_t packet_type, uint8_t *prefix, unsigned int prefix_size, uint8_t *buffer, unsigned int size);
+void deros_batch_free(deros_packet_batch *batch);
+uint8_t deros_batch_next_packet(uint8_t *batch, unsigned int batch_size, unsigned int *offset, uint8_t **packet, unsigned int *size);
 int deros_create_server(int port);
+int deros_create_local_server(int port);
+int deros_create_datagram_socket(int port, int shared);
 int deros_wait_for_client_connection(int server_fd);
+int deros_set_nonblocking(int socket);
+
+// options of TCP connections, -1 leaves the system default
+typedef struct {
+    int nodelay;          // 1 = small packets are sent immediately (Nagle's algorithm off)
+    int send_buffer;      // SO_SNDBUF in bytes
+    int receive_buffer;   // SO_RCVBUF in bytes
+    int priority;         // SO_PRIORITY, 0-6 without special privileges
+} deros_socket_options;
+
+void deros_default_socket_options(deros_socket_options *options);
+int deros_apply_socket_options(int socket, deros_socket_options *options);
+int deros_set_traffic_class(int socket, int priority, int dscp);
 
 void deros_store_uint(uint8_t *buffer, unsigned int x);
 void deros_retrieve_uint(uint8_t *buffer, unsigned int *x);
 
+// fixed binary header in front of each PACKET_NEW_MESSAGE
+#define MSG_HEADER_LENGTH 20
+
+typedef struct {
+    uint32_t topic_id;      // publisher's id of the address, announced once with PACKET_TOPIC_BIND
+    uint32_t length;        // length of the message that follows the header
+    uint32_t seq;           // sequence number of the message from this publisher
+    uint32_t sec;           // timestamp when the message was published
+    uint32_t usec;
+} deros_msg_header;
+
+void deros_store_msg_header(uint8_t *buffer, deros_msg_header *header);
+void deros_retrieve_msg_header(uint8_t *buffer, deros_msg_header *header);
+
+// each PACKET_MESSAGE_CHUNK carries the message header (length of the whole message), offset of the chunk, then the chunk
+#define CHUNK_HEADER_LENGTH (MSG_HEADER_LENGTH + 4)
+
+// each UDP datagram carries a fragment of a message: the message header (length of the whole message), fragment number,
+// number of fragments and the address (a datagram can be lost, so it has to be understood on its own), then the fragment
+#define DATAGRAM_HEADER_LENGTH (MSG_HEADER_LENGTH + 5)
+
+typedef struct {
+    deros_msg_header msg;
+    uint16_t fragment;
+    uint16_t num_fragments;
+    uint8_t address_length;  // the address follows the header
+} deros_datagram_header;
+
+void deros_store_datagram_header(uint8_t *buffer, deros_datagram_header *header);
+void deros_retrieve_datagram_header(uint8_t *buffer, deros_datagram_header *header);
+int deros_fragment_payload(int address_length);
+
+// growable receive buffer for non-blocking sockets - packets are parsed incrementally as the data arrive,
+// and returned in place (valid until the next fill)
+
+#define RXBUF_INITIAL_CAPACITY  (64*1024)
+#define RXBUF_MAX_IDLE_CAPACITY (1024*1024)
+#define RXBUF_MIN_READ          4096
+#define RXBUF_MAX_PASSED_FDS      16
+
+typedef struct {
+    uint8_t *data;
+    unsigned int capacity;
+    unsigned int start;       // first byte not yet parsed
+    unsigned int end;         // end of the received data
+    unsigned int needed;      // size of the incomplete packet at start, if known
+    int terminated;           // the packet at start is followed by zero instead of saved_byte
+    uint8_t saved_byte;
+    int passed_fds[RXBUF_MAX_PASSED_FDS];   // descriptors received through a Unix domain socket, oldest first
+    int num_passed_fds;
+} deros_rxbuf;
+
+void deros_rxbuf_init(deros_rxbuf *rx);
+void deros_rxbuf_free(deros_rxbuf *rx);
+int deros_rxbuf_fill(deros_rxbuf *rx, int socket);
+uint8_t deros_rxbuf_peek_packet(deros_rxbuf *rx, uint8_t **packet, int *size);
+char *deros_rxbuf_packet_string(deros_rxbuf *rx);
+void deros_rxbuf_consume_packet(deros_rxbuf *rx);
+int deros_rxbuf_take_fd(deros_rxbuf *rx);
+
 
 #endif
 
@@ -0,0 +1,234 @@
+
+// shared memory ring buffer for same-host message delivery - records are always stored contiguously
+// (a padding record fills the space at the end of the ring before wrapping), so that the reader can
+// process them in place without copying, the reader is woken up by the caller (via a doorbell packet
+// on the regular connection) only when it announced it is going to sleep
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <stdatomic.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "deros_shm.h"
+#include "deros_dbglog.h"
+
+#define DEROS_SHM_MAGIC 0x5244534d
+#define RECORD_HEADER_SIZE 8
+#define RECORD_PADDING 0
+
+struct deros_shm_ring_header {
+    uint32_t magic;
+    uint32_t capacity;
+    _Atomic uint64_t tail;              // written by producer only
+    uint8_t cacheline1[48];
+    _Atomic uint64_t head;              // written by consumer only
+    uint8_t cacheline2[56];
+    _Atomic uint32_t reader_waiting;
+    uint8_t cacheline3[60];
+    uint8_t data[];
+};
+
+static _Atomic int next_ring_number = 0;
+
+static unsigned int align8(unsigned int x)
+{
+    return (x + 7) & ~7u;
+}
+
+/** common part of create and attach - maps the whole ring into memory */
+static deros_shm_ring *map_ring(int fd, char *name, unsigned int capacity)
+{
+    size_t total = sizeof(deros_shm_ring_header) + capacity;
+    void *mem = mmap(0, total, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (mem == MAP_FAILED)
+    {
+        deros_dbglog_msg_str_int(D_ERRR, "shm", "common", "mmap failed (name, errno)", name, errno);
+        return 0;
+    }
+    deros_shm_ring *ring = (deros_shm_ring *) malloc(sizeof(deros_shm_ring));
+    if (!ring)
+    {
+        munmap(mem, total);
+        return 0;
+    }
+    ring->hdr = (deros_shm_ring_header *) mem;
+    ring->capacity = capacity;
+    ring->read_size = 0;
+    strncpy(ring->name, name, DEROS_SHM_NAME_LENGTH - 1);
+    ring->name[DEROS_SHM_NAME_LENGTH - 1] = 0;
+    pthread_mutex_init(&ring->producer_lock, 0);
+    return ring;
+}
+
+deros_shm_ring *deros_shm_ring_create(unsigned int capacity)
+{
+    char name[DEROS_SHM_NAME_LENGTH];
+    capacity = align8(capacity);
+    sprintf(name, "/deros_%d_%d", getpid(), atomic_fetch_add(&next_ring_number, 1));
+
+    int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+    if (fd < 0)
+    {
+        deros_dbglog_msg_str_int(D_ERRR, "shm", "common", "shm_open failed (name, errno)", name, errno);
+        return 0;
+    }
+    if (ftruncate(fd, sizeof(deros_shm_ring_header) + capacity) < 0)
+    {
+        deros_dbglog_msg_str_int(D_ERRR, "shm", "common", "ftruncate failed (name, errno)", name, errno);
+        close(fd);
+        shm_unlink(name);
+        return 0;
+    }
+    deros_shm_ring *ring = map_ring(fd, name, capacity);
+    close(fd);
+    if (!ring)
+    {
+        shm_unlink(name);
+        return 0;
+    }
+
+    ring->hdr->capacity = capacity;
+    atomic_store(&ring->hdr->tail, 0);
+    atomic_store(&ring->hdr->head, 0);
+    atomic_store(&ring->hdr->reader_waiting, 0);
+    ring->hdr->magic = DEROS_SHM_MAGIC;
+    deros_dbglog_msg_str_int(D_DEBG, "shm", "common", "created ring (name, capacity)", name, capacity);
+    return ring;
+}
+
+deros_shm_ring *deros_shm_ring_attach(char *name)
+{
+    int fd = shm_open(name, O_RDWR, 0600);
+    if (fd < 0)
+    {
+        deros_dbglog_msg_str_int(D_ERRR, "shm", "common", "shm_open for attach failed (name, errno)", name, errno);
+        return 0;
+    }
+    struct stat st;
+    if ((fstat(fd, &st) < 0) || (st.st_size <= sizeof(deros_shm_ring_header)))
+    {
+        deros_dbglog_msg_str(D_ERRR, "shm", "common", "shared memory object has wrong size", name);
+        close(fd);
+        return 0;
+    }
+    deros_shm_ring *ring = map_ring(fd, name, st.st_size - sizeof(deros_shm_ring_header));
+    close(fd);
+    if (!ring) return 0;
+
+    if ((ring->hdr->magic != DEROS_SHM_MAGIC) || (ring->hdr->capacity != ring->capacity))
+    {
+        deros_dbglog_msg_str(D_ERRR, "shm", "common", "shared memory object is not a deros ring", name);
+        deros_shm_ring_close(ring);
+        return 0;
+    }
+    deros_dbglog_msg_str(D_DEBG, "shm", "common", "attached ring", name);
+    return ring;
+}
+
+void deros_shm_ring_unlink(deros_shm_ring *ring)
+{
+    shm_unlink(ring->name);
+}
+
+void deros_shm_ring_close(deros_shm_ring *ring)
+{
+    munmap(ring->hdr, sizeof(deros_shm_ring_header) + ring->capacity);
+    pthread_mutex_destroy(&ring->producer_lock);
+    free(ring);
+}
+
+unsigned int deros_shm_ring_max_record(deros_shm_ring *ring)
+{
+    return ring->capacity / 2 - RECORD_HEADER_SIZE - 8;
+}
+
+int deros_shm_ring_write(deros_shm_ring *ring, uint8_t type, uint8_t *part1, unsigned int len1, uint8_t *part2, unsigned int len2)
+{
+    deros_shm_ring_header *hdr = ring->hdr;
+    unsigned int len = len1 + len2;
+    unsigned int needed = align8(RECORD_HEADER_SIZE + len + 1);   // + spare byte for the reader
+    if (len > deros_shm_ring_max_record(ring)) return -1;
+
+    pthread_mutex_lock(&ring->producer_lock);
+
+    uint64_t tail = atomic_load_explicit(&hdr->tail, memory_order_relaxed);
+    uint64_t head = atomic_load_explicit(&hdr->head, memory_order_acquire);
+    unsigned int offset = tail % ring->capacity;
+    unsigned int contiguous = ring->capacity - offset;
+    unsigned int total = (needed > contiguous) ? contiguous + needed : needed;
+
+    if (total > ring->capacity - (tail - head))
+    {
+        pthread_mutex_unlock(&ring->producer_lock);
+        return -1;
+    }
+
+    if (needed > contiguous)
+    {
+        uint8_t *pad = hdr->data + offset;
+        *((uint32_t *)pad) = contiguous - RECORD_HEADER_SIZE;
+        pad[4] = RECORD_PADDING;
+        tail += contiguous;
+        offset = 0;
+    }
+
+    uint8_t *rec = hdr->data + offset;
+    *((uint32_t *)rec) = len;
+    rec[4] = type;
+    memcpy(rec + RECORD_HEADER_SIZE, part1, len1);
+    if (len2) memcpy(rec + RECORD_HEADER_SIZE + len1, part2, len2);
+
+    atomic_store_explicit(&hdr->tail, tail + needed, memory_order_release);
+    atomic_thread_fence(memory_order_seq_cst);
+    int wake = atomic_exchange(&hdr->reader_waiting, 0);
+
+    pthread_mutex_unlock(&ring->producer_lock);
+    return wake ? 1 : 0;
+}
+
+uint8_t *deros_shm_ring_peek(deros_shm_ring *ring, uint8_t *type, int *len)
+{
+    deros_shm_ring_header *hdr = ring->hdr;
+    uint64_t head = atomic_load_explicit(&hdr->head, memory_order_relaxed);
+    uint64_t tail = atomic_load_explicit(&hdr->tail, memory_order_acquire);
+
+    while (head != tail)
+    {
+        uint8_t *rec = hdr->data + (head % ring->capacity);
+        unsigned int rec_len = *((uint32_t *)rec);
+        if (rec[4] == RECORD_PADDING)
+        {
+            head += RECORD_HEADER_SIZE + rec_len;
+            atomic_store_explicit(&hdr->head, head, memory_order_release);
+            continue;
+        }
+        *type = rec[4];
+        *len = rec_len;
+        ring->read_size = align8(RECORD_HEADER_SIZE + rec_len + 1);
+        return rec + RECORD_HEADER_SIZE;
+    }
+    return 0;
+}
+
+void deros_shm_ring_release(deros_shm_ring *ring)
+{
+    deros_shm_ring_header *hdr = ring->hdr;
+    uint64_t head = atomic_load_explicit(&hdr->head, memory_order_relaxed);
+    atomic_store_explicit(&hdr->head, head + ring->read_size, memory_order_release);
+    ring->read_size = 0;
+}
+
+int deros_shm_ring_prepare_wait(deros_shm_ring *ring)
+{
+    deros_shm_ring_header *hdr = ring->hdr;
+    atomic_store(&hdr->reader_waiting, 1);
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load(&hdr->tail) == atomic_load_explicit(&hdr->head, memory_order_relaxed)) return 1;
+    atomic_store(&hdr->reader_waiting, 0);
+    return 0;
+}
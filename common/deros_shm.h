@@ -0,0 +1,58 @@
+#ifndef __DEROS_SHM_H__
+#define __DEROS_SHM_H__
+
+// single-producer single-consumer ring buffer in POSIX shared memory, used for pushing messages
+// between a publisher and a subscriber that run on the same host
+
+#include <inttypes.h>
+#include <pthread.h>
+
+#define DEROS_SHM_NAME_LENGTH 64
+
+typedef struct deros_shm_ring_header deros_shm_ring_header;
+
+typedef struct {
+    deros_shm_ring_header *hdr;
+    unsigned int capacity;
+    unsigned int read_size;
+    char name[DEROS_SHM_NAME_LENGTH];
+    pthread_mutex_t producer_lock;
+} deros_shm_ring;
+
+/** create a new ring in /dev/shm (publisher side), its name is generated and can be sent to the peer
+ *  @param capacity  size of the data area in bytes
+ *  @return  the ring handle, or 0 on error */
+deros_shm_ring *deros_shm_ring_create(unsigned int capacity);
+
+/** map a ring created by the peer (subscriber side)
+ *  @return  the ring handle, or 0 on error */
+deros_shm_ring *deros_shm_ring_attach(char *name);
+
+/** remove the name of the ring from /dev/shm, existing mappings stay valid */
+void deros_shm_ring_unlink(deros_shm_ring *ring);
+
+/** unmap the ring and release the handle */
+void deros_shm_ring_close(deros_shm_ring *ring);
+
+/** @return  the longest record that can ever be written into this ring */
+unsigned int deros_shm_ring_max_record(deros_shm_ring *ring);
+
+/** append a record composed of a header part and a body part
+ *  @return  -1 if there is currently no space for the record,
+ *           1 if the record was written and the reader is asleep and has to be woken up,
+ *           0 if the record was written and no wake up is needed */
+int deros_shm_ring_write(deros_shm_ring *ring, uint8_t type, uint8_t *part1, unsigned int len1, uint8_t *part2, unsigned int len2);
+
+/** get the oldest unread record without copying it, the record stays valid until deros_shm_ring_release()
+ *  is called, one spare byte after the record may be overwritten (e.g. by a zero terminator)
+ *  @return  pointer to the record contents or 0 if the ring is empty */
+uint8_t *deros_shm_ring_peek(deros_shm_ring *ring, uint8_t *type, int *len);
+
+/** free the record returned by the last deros_shm_ring_peek() */
+void deros_shm_ring_release(deros_shm_ring *ring);
+
+/** announce that the reader is going to sleep until a doorbell arrives
+ *  @return  1 if the ring is empty and it is safe to sleep, 0 if more records must be read first */
+int deros_shm_ring_prepare_wait(deros_shm_ring *ring);
+
+#endif
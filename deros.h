@@ -5,16 +5,42 @@
 
 #define DEFAULT_DEROS_SERVER_PORT  9342
 #define MAX_ADDRESS_LENGTH 100
+#define MAX_MESSAGE_LENGTH (1024*1024*1024)
 
 
 #define VARIABLE_SIZE_MESSAGE -1
 
+// what publish() does when the queue of messages waiting for some subscriber node is full
+#define DEROS_QUEUE_DROP_OLDEST  0   // the oldest waiting message of the publisher is discarded
+#define DEROS_QUEUE_DROP_NEWEST  1   // the new message is not delivered to that subscriber node
+#define DEROS_QUEUE_BLOCK        2   // publish() waits for space, at most the specified timeout, then drops the new message
+
+// priority classes of subscribers - callbacks of higher classes are called first, and one callback thread serves only the high class
+#define DEROS_PRIORITY_HIGH    0
+#define DEROS_PRIORITY_NORMAL  1
+#define DEROS_PRIORITY_LOW     2
+#define DEROS_NUM_PRIORITIES   3
+
+// how messages of a publisher get to subscriber nodes in other processes
+#define DEROS_TRANSPORT_TCP        0   // reliable: TCP connection, or shared memory ring on the same host (the default)
+#define DEROS_TRANSPORT_UDP        1   // loss-tolerant: a UDP datagram to each subscriber node
+#define DEROS_TRANSPORT_MULTICAST  2   // loss-tolerant: one UDP datagram to the multicast group of the address for all subscriber nodes
+
+// which of the messages kept by publishers with history (see publisher_set_history_depth()) a new subscriber node gets
+#define DEROS_HISTORY_ALL     0   // all of them, the oldest first (the default)
+#define DEROS_HISTORY_LATEST  1   // only the last one
+
 /** defines callback function type for pretty printing message bodies into message log */
 typedef char *(*pretty_print_function)(uint8_t *message, int length);
 
 /** defines callback function type for receiving message from subscribed addresses */
 typedef void (*subscriber_callback_function)(uint8_t *message, int length);
 
+/** defines callback function type for receiving messages in chunks, as they arrive
+ *  @param chunk  part of the message that starts at the specified offset
+ *  @param total_length  length of the whole message */
+typedef void (*subscriber_chunk_callback_function)(uint8_t *chunk, int length, int offset, int total_length);
+
 // API for client nodes
 
 /** each program that wants to use the framework should initialize it first, specify the server IP and port,
@@ -24,25 +50,104 @@ typedef void (*subscriber_callback_function)(uint8_t *message, int length);
 int deros_init(char *server_address, int server_port, char *node_name, int listen_port, char *log_path);
 
 /** when Deros communication is not needed anymore, program can call deros_done(), it can later
- * initialize it over agin with deros_init() */
+ * initialize it over agin with deros_init(), until then, the node connects to the server again whenever
+ * the connection is lost (or the server misses its heartbeats), and sends it all its registrations */
 void deros_done(int node_id);
 
+/** configure the TCP connections of the node: the connection to the server (immediately), and the connections opened
+ *  later to subscriber nodes and accepted from publishers, -1 leaves the system default of any option
+ *  @param nodelay  1 (the default) sends small messages immediately, 0 lets the system wait to join them (Nagle's algorithm)
+ *  @param send_buffer  size of the socket send buffer in bytes (SO_SNDBUF)
+ *  @param receive_buffer  size of the socket receive buffer in bytes (SO_RCVBUF)
+ *  @param priority  priority of the packets of the connections (SO_PRIORITY, 0-6)
+ *  @return  1 on success, 0 if node is not known or some option could not be set */
+int deros_set_socket_options(int node_id, int nodelay, int send_buffer, int receive_buffer, int priority);
+
+/** collect the registrations of the node (publisher_register(), subscriber_register() and the like, and unregistering)
+ *  until deros_end_registrations(), they are sent to the server together, useful for nodes with many topics at startup,
+ *  the registering functions return as usual, but the server learns about the registrations only at the end */
+void deros_begin_registrations(int node_id);
+
+/** send the registrations collected since deros_begin_registrations() in one packet, the server answers with one packet
+ *  for the node, and returns after the answer has been processed: the publishers of the node know all their subscribers 
+ *  (their connections are opened in the background)
+ *  @return  1 on success, 0 if node is not known or the connection to the server was lost (the registrations
+ *           are sent when the node connects again) */
+int deros_end_registrations(int node_id);
+
 // API for the publishers:
 
 /** register a new publisher on the server, if subscribers to the same address are already registered, this publisher will be immediatelly notified to open 
  *  connections for pushing messages to those subscribers, later arriving subscribers will also be automatically connected.
  *  @param node_id  id returned by deros_init()
- *  @param address  string containing the address where messages will be published (such as "lidar")
+ *  @param address  string containing the address where messages will be published (such as "lidar"), not a pattern
  *  @param message_size  Deros messages are typically of a fixed size (when the size do not match, error is reporter), but -1 allows for variable-length messages
- *  @param message_queue_size  currently, there are no message queues and messages are delivered instantly, reserved for future versions 
+ *  @param message_queue_size  how many messages of this publisher can wait for each subscriber node that does not keep up (at least 1),
+ *                            when the queue is full, the queue policy applies (DEROS_QUEUE_DROP_OLDEST by default)
  *  @return  ID of publisher or -1 on error 
  */
 int publisher_register(int node_id, char *address, int message_size, int message_queue_size);
 
-/** send message to a specified address, i.e. to all nodes that subscribed to this address - their callbacks will be called with the message delivered
- *  @return  if successful returns 1, otherwise 0 */
+/** same as publisher_register(), but the publisher allows its messages to be sent in UDP datagrams - to the subscribers
+ *  that registered with DEROS_TRANSPORT_UDP or DEROS_TRANSPORT_MULTICAST too (the others still get them through TCP),
+ *  datagrams are never queued nor repeated, messages that do not fit one datagram are split to fragments,
+ *  and a message is lost if any of its fragments is lost
+ *  @param transport  DEROS_TRANSPORT_TCP, or DEROS_TRANSPORT_UDP (or DEROS_TRANSPORT_MULTICAST, it means the same here) */
+int publisher_register_with_transport(int node_id, char *address, int message_size, int message_queue_size, int transport);
+
+/** send message to a specified address, i.e. to all nodes that subscribed to this address - their callbacks will be called with the message delivered,
+ *  the message is queued for subscriber nodes that cannot accept it immediately and it is sent in the background,
+ *  a message can be up to MAX_MESSAGE_LENGTH long, long messages are streamed in chunks that give way to small messages
+ *  @return  if successful returns 1, 0 if the message was dropped for some subscriber node, or some subscriber node is not reachable */
 int publish(int publisher_id, uint8_t *message, int msg_len);
 
+/** borrow a buffer for a message of at most the specified size, the message can be written to it directly and sent with
+ *  publish_loaned() without copying it, one buffer is shared by all subscriber nodes, buffers are reused from a pool
+ *  @return  the buffer, or 0 on error */
+uint8_t *publisher_loan(int publisher_id, int size);
+
+/** publish a message written to a buffer from publisher_loan(), the buffer belongs to Deros again after the call (even on error)
+ *  @param msg_len  length of the message, at most the size of the loan
+ *  @return  same as publish() */
+int publish_loaned(int publisher_id, uint8_t *message, int msg_len);
+
+/** give back a loaned buffer without publishing it */
+void publisher_return_loan(uint8_t *message);
+
+/** choose what happens when the queue of messages for some subscriber node is full (see message_queue_size of publisher_register())
+ *  @param policy  one of DEROS_QUEUE_DROP_OLDEST, DEROS_QUEUE_DROP_NEWEST, DEROS_QUEUE_BLOCK
+ *  @param block_timeout_ms  longest time publish() waits with DEROS_QUEUE_BLOCK policy (0 or more)
+ *  @return  1 on success, 0 if publisher is not known, the policy is not valid or the timeout is negative */
+int publisher_set_queue_policy(int publisher_id, int policy, int block_timeout_ms);
+
+/** set the priority class of the publisher (DEROS_PRIORITY_NORMAL by default), each class has its own connection
+ *  to each subscriber node, so that small urgent messages (commands) are never stuck behind bulk data (point clouds),
+ *  high and low priority connections mark their packets for the network (SO_PRIORITY and DSCP), best called right after 
+ *  the publisher is registered: messages published before the change may arrive after the first ones published after it
+ *  @return  1 on success, 0 if publisher is not known, the priority is not valid, or some subscriber node could not be connected */
+int publisher_set_priority(int publisher_id, int priority);
+
+/** keep the last messages of the publisher and send them to each subscriber node that subscribes later, before any new message,
+ *  useful for messages that are published only once or rarely (a map, calibration, description of the robot),
+ *  subscriber nodes connected through TCP, shared memory or in the same process get them, datagram subscribers do not
+ *  @param depth  how many messages are kept, 0 (the default) keeps none
+ *  @return  1 on success, 0 if publisher is not known */
+int publisher_set_history_depth(int publisher_id, int depth);
+
+/** cork the node: messages of its publishers are only collected for each subscriber node until deros_flush() is called,
+ *  then all messages for the same subscriber node leave together (with one system call), useful for nodes that publish many
+ *  small messages at once, e.g. in each step of a control loop */
+void deros_cork(int node_id);
+
+/** send all messages collected since deros_cork() and stop collecting them
+ *  @return  1 on success, 0 if node is not known or some subscriber node is not reachable */
+int deros_flush(int node_id);
+
+/** let a corked node send the collected messages by itself when they are too old or too many, the node stays corked
+ *  @param max_delay_ms  the oldest collected message waits at most this long (roughly), 0 = no limit
+ *  @param max_bytes  messages are sent when their total size reaches this limit, 0 = no limit */
+void deros_set_autoflush(int node_id, int max_delay_ms, long max_bytes);
+
 /** remove this publisher from the server - if any subscribers are found on the same address, connection for pushing messages to them is closed */
 void publisher_unregister(int publisher_id);
 
@@ -65,11 +170,47 @@ char *int_pretty_printer(uint8_t *message, int length);
 /** register a new subscriber on the server - all publishers on the same address are automatically notified to make connections for pushing messages,
  *  publishers arriving later will also automatically connect 
  *  @param node_id  id returned by deros_init() 
- *  @param address  string containing the address from which messages are automatically deilivered
+ *  @param address  string containing the address from which messages are automatically deilivered, or a pattern of addresses
+ *                  made of segments separated by '/': "*" matches any one segment, "**" any number of segments (also none),
+ *                  e.g. "sensors" followed by segment "*" matches "sensors/imu", "diag" followed by "**" matches also "diag" itself, the subscriber gets the messages of all current and future publishers that match,
+ *                  unless their message_size differs from its (fixed) message_size
  *  @param message_size  should match the message size of the publisher, or -1 for variable-length messages
- *  @param msg_queue_size  currently messages are never queued, they are delivered immediately (queue size 1), reserved for future use */
+ *  @param msg_queue_size  how many received messages can wait for the callback, when the queue is full, the oldest message is dropped */
 int subscriber_register(int node_id, char *address, int message_size, subscriber_callback_function callback, int msg_queue_size);
 
+/** same as subscriber_register(), but the subscriber prefers high rate over reliability: publishers that allow it send
+ *  the messages to its node in UDP datagrams, lost messages are not repeated (they are only counted in the debug log)
+ *  @param transport  DEROS_TRANSPORT_UDP - datagrams are sent to the listen port of the node,
+ *                    DEROS_TRANSPORT_MULTICAST - the node joins the multicast group of the address, a publisher sends
+ *                    each message only once for all such subscriber nodes (not for patterns), 
+ *                    or DEROS_TRANSPORT_TCP - same as subscriber_register() */
+int subscriber_register_with_transport(int node_id, char *address, int message_size, subscriber_callback_function callback, int msg_queue_size, int transport);
+
+/** same as subscriber_register_with_transport(), and chooses what the subscriber gets from publishers that keep history
+ *  @param history  DEROS_HISTORY_ALL, or DEROS_HISTORY_LATEST - only the last kept message of each publisher,
+ *                  the choice of the first subscriber of the node to the address applies to the whole node */
+int subscriber_register_with_history(int node_id, char *address, int message_size, subscriber_callback_function callback, int msg_queue_size, int transport, int history);
+
+/** let the subscriber process large messages while they arrive: the chunk callback is called for each chunk of a message 
+ *  (in order) instead of the callback with the whole message, that is never assembled for it, messages that arrive whole 
+ *  come as a single chunk, set it right after the subscriber is registered, 0 goes back to whole messages,
+ *  a chunk is dropped like a message when the queue of the subscriber is full, the offsets tell that some is missing
+ *  @return  1 on success, 0 if subscriber is not known */
+int subscriber_set_chunk_callback(int subscriber_id, subscriber_chunk_callback_function callback);
+
+/** choose the network interface for multicast by its IP address (the system chooses by default), 
+ *  call it before the publishers and subscribers that use datagrams are registered
+ *  @return  1 on success, 0 if the address is not valid */
+int deros_set_multicast_interface(char *interface_ip);
+
+/** set the priority class of the subscriber (DEROS_PRIORITY_NORMAL by default)
+ *  @return  1 on success, 0 if subscriber is not known or the priority is not valid */
+int subscriber_set_priority(int subscriber_id, int priority);
+
+/** set the number of threads that call the subscriber callbacks (2 by default), the number can only grow,
+ *  callbacks of one subscriber are never called concurrently and get the messages in the order they arrived */
+void deros_set_callback_threads(int num_threads);
+
 /** remove this subscriber from the server - if any publishers are found on the same address, they will automatically close their connections to this subscriber */
 void subscriber_unregister(int subscriber_id);
 
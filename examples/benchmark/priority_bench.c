@@ -0,0 +1,186 @@
+// measures the latency of small high priority messages while a bulk publisher of the same node saturates the link
+//
+// run the server, then on one host:      bin/deros_priority_bench sub
+//                 and on another host:   bin/deros_priority_bench pub [--no-priority] [--server IP]
+// (the clocks of the two hosts need to be synchronized, the latency is measured with the send timestamps)
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/time.h>
+
+#include "../../deros.h"
+
+#define PORT_BENCH_SUB 9340
+#define PORT_BENCH_PUB 9341
+#define ADDR_BULK "bench_bulk"
+#define ADDR_CONTROL "bench_control"
+
+#define BULK_MESSAGE_SIZE (5 * 1024 * 1024)
+#define CONTROL_PERIOD_US 1000
+#define BENCH_SECONDS 10
+#define MAX_SAMPLES (BENCH_SECONDS * 1000000 / CONTROL_PERIOD_US + 1000)
+
+#define LOG_PATH "/tmp"
+
+typedef struct {
+  int seq;          // -1 ends the benchmark
+  int unused;
+  double sent_at;
+} control_message;
+
+static volatile int running = 1;
+static int publisher_bulk, publisher_control;
+
+static double latency[MAX_SAMPLES];
+static volatile int num_samples = 0;
+static volatile int finished = 0;
+static volatile long bulk_bytes = 0;
+
+static double now()
+{
+  struct timeval tv;
+  gettimeofday(&tv, 0);
+  return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+void control_callback(uint8_t *message, int length)
+{
+  control_message msg;
+  memcpy(&msg, message, sizeof(msg));
+  if (msg.seq < 0) finished = 1;
+  else if (num_samples < MAX_SAMPLES) latency[num_samples++] = (now() - msg.sent_at) * 1000.0;
+}
+
+void bulk_callback(uint8_t *message, int length)
+{
+  bulk_bytes += length;
+}
+
+static int compare_doubles(const void *a, const void *b)
+{
+  double x = *(const double *)a, y = *(const double *)b;
+  return (x > y) - (x < y);
+}
+
+void *bulk_thread(void *arg)
+{
+  uint8_t *bulk = (uint8_t *) malloc(BULK_MESSAGE_SIZE);
+  memset(bulk, 0x55, BULK_MESSAGE_SIZE);
+  while (running) publish(publisher_bulk, bulk, BULK_MESSAGE_SIZE);
+  free(bulk);
+  return 0;
+}
+
+int run_publisher(char *server, int use_priority, char *log_path)
+{
+  int node = deros_init(server, DEFAULT_DEROS_SERVER_PORT, "bench_pub", PORT_BENCH_PUB, log_path);
+  if (node < 0)
+  {
+    printf("could not init deros\n");
+    return 1;
+  }
+  publisher_bulk = publisher_register(node, ADDR_BULK, -1, 2);
+  publisher_control = publisher_register(node, ADDR_CONTROL, sizeof(control_message), 1000);
+  if ((publisher_bulk < 0) || (publisher_control < 0))
+  {
+    printf("could not register publishers\n");
+    deros_done(node);
+    return 1;
+  }
+  if (use_priority)
+  {
+    publisher_set_priority(publisher_control, DEROS_PRIORITY_HIGH);
+    publisher_set_priority(publisher_bulk, DEROS_PRIORITY_LOW);
+  }
+  sleep(1);
+
+  pthread_t t;
+  pthread_create(&t, 0, bulk_thread, 0);
+
+  control_message msg;
+  memset(&msg, 0, sizeof(msg));
+  for (msg.seq = 0; msg.seq < BENCH_SECONDS * 1000000 / CONTROL_PERIOD_US; msg.seq++)
+  {
+    msg.sent_at = now();
+    publish(publisher_control, (uint8_t *) &msg, sizeof(msg));
+    usleep(CONTROL_PERIOD_US);
+  }
+  running = 0;
+  pthread_join(t, 0);
+
+  msg.seq = -1;
+  publish(publisher_control, (uint8_t *) &msg, sizeof(msg));
+  sleep(1);
+  printf("publisher done (%s)\n", use_priority ? "control high, bulk low priority" : "no priorities");
+
+  publisher_unregister(publisher_bulk);
+  publisher_unregister(publisher_control);
+  deros_done(node);
+  return 0;
+}
+
+int run_subscriber(char *server, char *log_path)
+{
+  int node = deros_init(server, DEFAULT_DEROS_SERVER_PORT, "bench_sub", PORT_BENCH_SUB, log_path);
+  if (node < 0)
+  {
+    printf("could not init deros\n");
+    return 1;
+  }
+  int subscriber_bulk = subscriber_register(node, ADDR_BULK, -1, bulk_callback, 2);
+  int subscriber_control = subscriber_register(node, ADDR_CONTROL, sizeof(control_message), control_callback, 1000);
+  if ((subscriber_bulk < 0) || (subscriber_control < 0))
+  {
+    printf("could not register subscribers\n");
+    deros_done(node);
+    return 1;
+  }
+  subscriber_set_priority(subscriber_control, DEROS_PRIORITY_HIGH);
+
+  printf("waiting for the publisher...\n");
+  double started = now();
+  while (!finished) usleep(100000);
+  double elapsed = now() - started;
+
+  int n = num_samples;
+  if (n > 0)
+  {
+    qsort(latency, n, sizeof(double), compare_doubles);
+    double sum = 0;
+    for (int i = 0; i < n; i++) sum += latency[i];
+    printf("control messages: %d, latency avg %.3f ms, median %.3f ms, 99%% %.3f ms, max %.3f ms\n",
+           n, sum / n, latency[n / 2], latency[n * 99 / 100], latency[n - 1]);
+  }
+  printf("bulk data received: %.1f MB (%.1f MB/s)\n", bulk_bytes / 1048576.0, bulk_bytes / 1048576.0 / elapsed);
+
+  subscriber_unregister(subscriber_bulk);
+  subscriber_unregister(subscriber_control);
+  deros_done(node);
+  return 0;
+}
+
+int main(int argc, char **argv)
+{
+  char *server = "127.0.0.1";
+  char *log_path = LOG_PATH;
+  int use_priority = 1;
+  int publisher_role = -1;
+
+  for (int i = 1; i < argc; i++)
+    if (strcmp(argv[i], "pub") == 0) publisher_role = 1;
+    else if (strcmp(argv[i], "sub") == 0) publisher_role = 0;
+    else if (strcmp(argv[i], "--no-priority") == 0) use_priority = 0;
+    else if ((strcmp(argv[i], "--server") == 0) && (i + 1 < argc)) server = argv[++i];
+    else if ((strcmp(argv[i], "--logpath") == 0) && (i + 1 < argc)) log_path = argv[++i];
+
+  if (publisher_role < 0)
+  {
+    printf("usage: deros_priority_bench pub|sub [--no-priority] [--server IP] [--logpath PATH]\n");
+    return 1;
+  }
+  if (publisher_role) return run_publisher(server, use_priority, log_path);
+  return run_subscriber(server, log_path);
+}
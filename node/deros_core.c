@@ -5,11 +5,17 @@
 #include <unistd.h>
 #include <stdio.h>
 #include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
 
 #include "../deros.h"
 #include "../common/deros_common.h"
 #include "../common/deros_net.h"
 #include "../common/deros_dbglog.h"
+#include "../common/deros_addrs.h"
 #include "deros_core_internal.h"
 
 
@@ -24,13 +30,67 @@ char *node_log_path[MAX_NODES];
 
 pthread_mutex_t node_mutexes[MAX_NODES];
 int node_server_sockets[MAX_NODES];
-static volatile int node_thread_started;
-static uint8_t *node_recv_packet[MAX_NODES];
+volatile int node_active[MAX_NODES];
 int node_listen_ports[MAX_NODES];
+deros_socket_options node_socket_options[MAX_NODES];
+volatile int node_heartbeat_interval_ms[MAX_NODES];
+volatile int node_heartbeat_timeout_ms[MAX_NODES];
+struct in_addr multicast_interface = { INADDR_ANY };
+
+// topic ids assigned by the server of the node, and the ids of their addresses in this process,
+// only the thread reading from the server uses them
+static int *node_topic_addr[MAX_NODES];
+static int node_num_topics[MAX_NODES];
+
+// registrations collected between deros_begin_registrations() and deros_end_registrations(), with node mutex held
+static int node_collecting_registrations[MAX_NODES];
+static deros_packet_batch node_registrations[MAX_NODES];
+static int node_batches_sent[MAX_NODES];
+
+// batches of registrations that the server has answered, counted by the thread reading from the server,
+// when the connection is lost, the batches sent so far are not answered anymore
+static pthread_mutex_t node_batch_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t node_batch_answered = PTHREAD_COND_INITIALIZER;
+static int node_batches_done[MAX_NODES];
+static int node_batches_lost[MAX_NODES];
+
+/** remember the topic id that the server has assigned to the address */
+void set_node_topic(int node_id, int topic_id, int adr_id)
+{
+    if (topic_id >= node_num_topics[node_id])
+    {
+        int new_num = (topic_id < 2 * node_num_topics[node_id]) ? 2 * node_num_topics[node_id] : topic_id + 16;
+        node_topic_addr[node_id] = (int *) realloc(node_topic_addr[node_id], sizeof(int) * new_num);
+        if (!node_topic_addr[node_id]) deros_node_mem_failure("node topics");
+        for (int i = node_num_topics[node_id]; i < new_num; i++) node_topic_addr[node_id][i] = -1;
+        node_num_topics[node_id] = new_num;
+    }
+    node_topic_addr[node_id][topic_id] = adr_id;
+}
+
+/** @return  id of the address of the topic in this process, -1 if the server has not assigned the topic id */
+int node_topic_address(int node_id, int topic_id)
+{
+    if ((topic_id < 0) || (topic_id >= node_num_topics[node_id])) return -1;
+    return node_topic_addr[node_id][topic_id];
+}
+
+/** the server has assigned the topic id to an address that the node publishes or subscribes to (topic_id!address) */
+void process_topic_id_packet(int node_id, char *pack)
+{
+    int topic_id;
+    char *exclpos = strchr(pack, '!');
+    if ((exclpos == 0) || (sscanf(pack, "%d", &topic_id) != 1) || (topic_id < 0))
+    {
+        deros_dbglog_msg(D_ERRR, node_names[node_id], "process_packet", "malformed topic id packet");
+        return;
+    }
+    set_node_topic(node_id, topic_id, find_or_insert_address(exclpos + 1));
+}
 
-void deros_node_process_packet(int node_id, uint8_t packet_type, int packet_size)
+/** handle a packet from the server, its contents are terminated with zero and they are parsed in place */
+void deros_node_process_packet(int node_id, uint8_t packet_type, char *pack, int packet_size)
 {
-    char *pack = (char *)node_recv_packet[node_id];
     switch (packet_type)
     {
         case PACKET_ADD_SUBSCRIBER:
@@ -63,51 +123,278 @@ void deros_node_process_packet(int node_id, uint8_t packet_type, int packet_size
                 deros_dbglog_msg_str(D_DEBG, node_names[node_id], "process_packet", "subscriber_ip", subscriber_ip);
 
                 restpack = exclpos + 1;
-                char *adres = (char *)malloc(strlen(restpack) + 1);
-                if (!adres) deros_node_mem_failure("node add/remove sub");
-                strcpy(adres, restpack);
+                exclpos = strchr(restpack, '!');
+                if (exclpos == 0)
+                {
+                    deros_dbglog_msg(D_ERRR, node_names[node_id], "process_packet", "malformed ADD subscriber packet");
+                    free(subscriber_ip);
+                    return;
+                }
+                int colocated = (*restpack == '1');
 
-                if (packet_type == PACKET_ADD_SUBSCRIBER) 
+                restpack = exclpos + 1;
+                exclpos = strchr(restpack, '!');
+                if (exclpos == 0)
                 {
-                    if (!publisher_add_new_subscriber(subscriber_port, subscriber_ip, adres))
-                    {
-                        free(adres);
-                        free(subscriber_ip);
-                    }
+                    deros_dbglog_msg(D_ERRR, node_names[node_id], "process_packet", "malformed ADD subscriber packet");
+                    free(subscriber_ip);
+                    return;
                 }
-                else
+                int transport = *restpack - '0';
+
+                restpack = exclpos + 1;
+                exclpos = strchr(restpack, '!');
+                if (exclpos == 0)
+                {
+                    deros_dbglog_msg(D_ERRR, node_names[node_id], "process_packet", "malformed ADD subscriber packet");
+                    free(subscriber_ip);
+                    return;
+                }
+                int history = *restpack - '0';
+
+                int topic_id = -1;
+                sscanf(exclpos + 1, "%d", &topic_id);
+                int adr_id = node_topic_address(node_id, topic_id);
+                if (adr_id < 0)
                 {
-                    publisher_remove_subscriber(subscriber_port, subscriber_ip, adres);
-                    free(adres);
+                    deros_dbglog_msg_int(D_ERRR, node_names[node_id], "process_packet", "add/remove subscriber to unknown topic", topic_id);
                     free(subscriber_ip);
+                    return;
                 }
+
+                if (packet_type == PACKET_ADD_SUBSCRIBER) 
+                    publisher_add_new_subscriber(node_id, subscriber_port, subscriber_ip, colocated, transport, history, adr_id);
+                else
+                    publisher_remove_subscriber(subscriber_port, subscriber_ip, colocated, transport, adr_id);
+                free(subscriber_ip);
                 break;
 
+        case PACKET_TOPIC_ID:
+
+                deros_dbglog_msg_str(D_DEBG, node_names[node_id], "process_packet", "topic id packet", pack);
+                process_topic_id_packet(node_id, pack);
+                break;
     }
 
 }
 
+/** handle the packets that the server has sent together in one PACKET_BATCH */
+void deros_node_process_batch(int node_id, uint8_t *batch, int batch_size)
+{
+    uint8_t packet_type, *packet;
+    unsigned int offset = 0, packet_size;
+    while ((packet_type = deros_batch_next_packet(batch, batch_size, &offset, &packet, &packet_size)))
+    {
+        if ((packet_type == 255) || (packet_type == PACKET_BATCH))
+        {
+            deros_dbglog_msg(D_ERRR, node_names[node_id], "process_packet", "malformed batch packet");
+            return;
+        }
+        uint8_t saved_byte = packet[packet_size];   // start of the next packet
+        packet[packet_size] = 0;
+        deros_node_process_packet(node_id, packet_type, (char *)packet, packet_size);
+        packet[packet_size] = saved_byte;
+    }
+}
+
+/** the server has answered all packets of a batch of registrations, or the node will not get the answers anymore */
+void batch_of_registrations_answered(int node_id, int server_lost)
+{
+    pthread_mutex_lock(&node_batch_lock);
+    if (server_lost) node_batches_lost[node_id] = node_batches_done[node_id] = node_batches_sent[node_id];
+    else node_batches_done[node_id]++;
+    pthread_cond_broadcast(&node_batch_answered);
+    pthread_mutex_unlock(&node_batch_lock);
+}
 
-void *node_read_from_server_thread(void *arg)
+/** connect to the server of the node and log in
+ *  @return  the socket, 0 if the server cannot be reached or it has not accepted the node */
+int login_to_server(int node_id)
 {
     uint8_t packet_type;
-    int my_node_id = next_free_node_id - 1;
-    node_recv_packet[my_node_id] = (uint8_t *)malloc(MAX_PACKET_LENGTH + 1);
-    if (!node_recv_packet[my_node_id]) deros_node_mem_failure("read from server thread");
+    char *node_name = node_names[node_id];
 
-    node_thread_started = 1;
-    deros_dbglog_msg_int(D_DEBG, node_names[my_node_id], "process_packet", "read thread for node started", my_node_id);
+    int sock_conn = deros_connect_to_server(node_server_addresses[node_id], node_server_ports[node_id]);
+    if (!sock_conn) return 0;
+
+    deros_apply_socket_options(sock_conn, &node_socket_options[node_id]);
+    char *init_msg = (char *)malloc(strlen(node_name) + strlen(INIT_MSG_HEADER) + 1 + 11);
+    if (!init_msg) deros_node_mem_failure("init msg");
 
+    sprintf(init_msg, "%s%s!%d", INIT_MSG_HEADER, node_name, node_listen_ports[node_id]);
+    int initmsg_len = strlen(init_msg);
     int packet_size = 0;
+    int responsemsg_len = strlen(INIT_MSG_RESPONSE) + strlen(node_name);
+    if (!deros_send_packet(sock_conn, PACKET_INIT, (uint8_t *)init_msg, initmsg_len) ||
+        !(packet_type = deros_receive_packet(sock_conn, (uint8_t *)init_msg, &packet_size, responsemsg_len)))
+    {
+        close(sock_conn);
+        free(init_msg);
+        return 0;
+    }
+    if ((packet_type == PACKET_RESPONSE_INIT) &&
+        (packet_size == responsemsg_len) &&
+        (strncmp(init_msg, INIT_MSG_RESPONSE, strlen(INIT_MSG_RESPONSE)) == 0) &&
+        (strncmp(init_msg + strlen(INIT_MSG_RESPONSE), node_name, strlen(node_name)) == 0))
+    {
+        deros_dbglog_msg(D_INFO, node_name, "process_packet", "connection to deros server established");
+        node_heartbeat_interval_ms[node_id] = 0;   // until the server announces them, it may have been restarted without heartbeats
+        free(init_msg);
+        return sock_conn;
+    }
+    deros_dbglog_msg_str_2int(D_ERRR, node_name, "process_packet", "unexpected response from deros server, (msg, response, size)", init_msg, packet_type, packet_size);
+    close(sock_conn);
+    free(init_msg);
+    return 0;
+}
 
-    while ((packet_type = deros_receive_packet(node_server_sockets[my_node_id], node_recv_packet[my_node_id], &packet_size, MAX_PACKET_LENGTH)))
+/** the connection to the server was lost, connect again with growing pauses until it succeeds or the node is done, 
+ *  then send all registrations of the node in PACKET_RESYNC, the server brings its registry to the same state
+ *  @return  1 if the node is connected again, 0 if it is done */
+int reconnect_to_server(int node_id)
+{
+    pthread_mutex_lock(&node_mutexes[node_id]);
+    close(node_server_sockets[node_id]);
+    node_server_sockets[node_id] = 0;   // registrations only change the tables of the node in the meantime
+    batch_of_registrations_answered(node_id, 1);
+    pthread_mutex_unlock(&node_mutexes[node_id]);
+    if (!node_active[node_id]) return 0;
+    deros_dbglog_msg(D_WARN, node_names[node_id], "process_packet", "connection to deros server lost, connecting again");
+
+    // the server may assign other topic ids
+    for (int i = 0; i < node_num_topics[node_id]; i++) node_topic_addr[node_id][i] = -1;
+
+    int pause_ms = SERVER_RECONNECT_MIN_MS;
+    int sock_conn;
+    while (!(sock_conn = login_to_server(node_id)))
     {
-        deros_dbglog_msg_int(D_DEBG, node_names[my_node_id], "process_packet", "arrived packet", packet_type);
-        node_recv_packet[my_node_id][packet_size] = 0;
-        deros_node_process_packet(my_node_id, packet_type, packet_size);  
+        if (!node_active[node_id]) return 0;
+        usleep(pause_ms * 1000);
+        pause_ms = (2 * pause_ms < SERVER_RECONNECT_MAX_MS) ? 2 * pause_ms : SERVER_RECONNECT_MAX_MS;
     }
 
-    free(node_recv_packet[my_node_id]);
+    pthread_mutex_lock(&node_mutexes[node_id]);
+    if (!node_active[node_id])
+    {
+        pthread_mutex_unlock(&node_mutexes[node_id]);
+        close(sock_conn);
+        return 0;
+    }
+    node_server_sockets[node_id] = sock_conn;
+    node_registrations[node_id].len = 0;   // they are all in the resync
+
+    deros_packet_batch registrations;
+    memset(&registrations, 0, sizeof(registrations));
+    append_publisher_registrations(node_id, &registrations);
+    append_subscriber_registrations(node_id, &registrations);
+    if (!deros_send_packet(sock_conn, PACKET_RESYNC, registrations.data, registrations.len))
+        shutdown(sock_conn, SHUT_RDWR);   // the next attempt follows
+    deros_batch_free(&registrations);
+    pthread_mutex_unlock(&node_mutexes[node_id]);
+    return 1;
+}
+
+long long deros_monotonic_ms()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000LL + now.tv_nsec / 1000000;
+}
+
+/** the server has announced its heartbeat interval and timeout (interval_ms!timeout_ms), the node uses them
+ *  on the connection to the server and on its connections with other nodes */
+void process_heartbeat_settings(int node_id, char *pack)
+{
+    int interval_ms = 0, timeout_ms = 0;
+    if ((sscanf(pack, "%d!%d", &interval_ms, &timeout_ms) != 2) || (interval_ms < 0) || (timeout_ms <= interval_ms))
+    {
+        deros_dbglog_msg_str(D_ERRR, node_names[node_id], "process_packet", "malformed heartbeat packet", pack);
+        return;
+    }
+    if ((interval_ms != node_heartbeat_interval_ms[node_id]) || (timeout_ms != node_heartbeat_timeout_ms[node_id]))
+        deros_dbglog_msg_2int(D_INFO, node_names[node_id], "process_packet", "heartbeats (interval, timeout)", interval_ms, timeout_ms);
+    node_heartbeat_interval_ms[node_id] = interval_ms;
+    node_heartbeat_timeout_ms[node_id] = timeout_ms;
+}
+
+/** wait until something arrives from the server, and send heartbeats to the server in the meantime
+ *  @return  1 when the socket can be read, 0 if the server has been silent for longer than the heartbeat timeout */
+int wait_for_server(int node_id, int sock, long long *last_heard_ms, long long *last_heartbeat_ms)
+{
+    struct pollfd pfd = { sock, POLLIN, 0 };
+    while (1)
+    {
+        int interval_ms = node_heartbeat_interval_ms[node_id];
+        if (!interval_ms) return 1;   // a blocking read waits for the server
+
+        long long now = deros_monotonic_ms();
+        if (now - *last_heard_ms > node_heartbeat_timeout_ms[node_id])
+        {
+            deros_dbglog_msg_int(D_WARN, node_names[node_id], "process_packet", "deros server has been silent for too long (ms)", (int)(now - *last_heard_ms));
+            return 0;
+        }
+        if (now - *last_heartbeat_ms >= interval_ms)
+        {
+            pthread_mutex_lock(&node_mutexes[node_id]);   // heartbeats must not split the registrations sent by other threads
+            if (!deros_send_packet(sock, PACKET_HEARTBEAT, (uint8_t *)"", 0)) shutdown(sock, SHUT_RDWR);
+            pthread_mutex_unlock(&node_mutexes[node_id]);
+            *last_heartbeat_ms = now;
+        }
+        long long wake_ms = *last_heartbeat_ms + interval_ms;
+        long long deadline_ms = *last_heard_ms + node_heartbeat_timeout_ms[node_id] + 1;
+        if (deadline_ms < wake_ms) wake_ms = deadline_ms;
+        int n = poll(&pfd, 1, (int)(wake_ms - now));
+        if (n > 0) return 1;
+        if ((n < 0) && (errno != EINTR)) return 1;   // the read reports the problem
+    }
+}
+
+/** read the packets from the server until the connection is lost, they are read into a buffer with large recv() calls 
+ *  and processed in place, as many as have arrived */
+void read_from_server(int node_id)
+{
+    uint8_t packet_type;
+    int sock = node_server_sockets[node_id];
+    deros_rxbuf rx;
+    deros_rxbuf_init(&rx);
+    uint8_t *packet;
+    int packet_size = 0;
+    int open = 1;
+    long long last_heard_ms = deros_monotonic_ms();
+    long long last_heartbeat_ms = last_heard_ms;
+
+    while (open && wait_for_server(node_id, sock, &last_heard_ms, &last_heartbeat_ms) && deros_rxbuf_fill(&rx, sock))
+    {
+        last_heard_ms = deros_monotonic_ms();
+        while ((packet_type = deros_rxbuf_peek_packet(&rx, &packet, &packet_size)))
+        {
+            if (packet_type == 255)
+            {
+                deros_dbglog_msg(D_ERRR, node_names[node_id], "process_packet", "too long packet from server");
+                open = 0;
+                break;
+            }
+            deros_dbglog_msg_int(D_DEBG, node_names[node_id], "process_packet", "arrived packet", packet_type);
+            if (packet_type == PACKET_BATCH) deros_node_process_batch(node_id, packet, packet_size);
+            else if (packet_type == PACKET_BATCH_DONE) batch_of_registrations_answered(node_id, 0);
+            else if (packet_type == PACKET_HEARTBEAT) process_heartbeat_settings(node_id, deros_rxbuf_packet_string(&rx));
+            else deros_node_process_packet(node_id, packet_type, deros_rxbuf_packet_string(&rx), packet_size);
+            deros_rxbuf_consume_packet(&rx);
+        }
+    }
+    deros_rxbuf_free(&rx);
+}
+
+/** the thread of the node that reads from the server, it connects to the server again whenever the connection is lost */
+void *node_read_from_server_thread(void *arg)
+{
+    int my_node_id = (int)(intptr_t) arg;
+    deros_dbglog_msg_int(D_DEBG, node_names[my_node_id], "process_packet", "read thread for node started", my_node_id);
+
+    do read_from_server(my_node_id);
+    while (reconnect_to_server(my_node_id));
+
+    free(node_server_addresses[my_node_id]);
     deros_dbglog_msg_int(D_DEBG, node_names[my_node_id], "process_packet", "read thread for node finished", my_node_id);
     return 0;
 }
@@ -115,8 +402,6 @@ void *node_read_from_server_thread(void *arg)
 
 int deros_init(char *server_address, int server_port, char *node_name, int listen_port, char *log_path)
 {
-    uint8_t packet_type;
-
     if ((node_name == 0) || (log_path == 0) || (server_address == 0) || (server_port > 49151) || (server_port < 1024)) 
     {
        printf("deros_init() illegal parameters\n");
@@ -129,81 +414,127 @@ int deros_init(char *server_address, int server_port, char *node_name, int liste
     }
     pthread_mutex_lock(&global_deros_lock);
 
-    pthread_mutex_init(&node_mutexes[next_free_node_id], 0);
-
-
-    node_log_path[next_free_node_id] = (char *) malloc(strlen(log_path) + 1);
-    strcpy(node_log_path[next_free_node_id], log_path);
-    node_listen_ports[next_free_node_id] = listen_port;
-    start_subscriber_listen_thread();
-
-    int sock_conn = deros_connect_to_server(server_address, server_port);
+    int node_id = next_free_node_id;
+    pthread_mutex_init(&node_mutexes[node_id], 0);
+
+    node_log_path[node_id] = (char *) malloc(strlen(log_path) + 1);
+    strcpy(node_log_path[node_id], log_path);
+    node_names[node_id] = node_name;
+    node_server_ports[node_id] = server_port;
+    node_server_addresses[node_id] = (char *)malloc(strlen(server_address) + 1);
+    if (!node_log_path[node_id] || !node_server_addresses[node_id]) deros_node_mem_failure("init node");
+    strcpy(node_server_addresses[node_id], server_address);
+    node_listen_ports[node_id] = listen_port;
+    deros_default_socket_options(&node_socket_options[node_id]);
+    subscriber_listen(node_id);
+
+    int sock_conn = login_to_server(node_id);
     if (sock_conn)
     {
-        char *init_msg = (char *)malloc(strlen(node_name) + strlen(INIT_MSG_HEADER) + 1 + 11);
-        if (!init_msg) deros_node_mem_failure("init msg");
-
-        sprintf(init_msg, "%s%s!%d", INIT_MSG_HEADER, node_name, listen_port);
-        int initmsg_len = strlen(init_msg);
-        int packet_size = 0;
-        int responsemsg_len = strlen(INIT_MSG_RESPONSE) + strlen(node_name);
-        if (!deros_send_packet(sock_conn, PACKET_INIT, (uint8_t *)init_msg, initmsg_len))
-        {
-            close(sock_conn);
-            sock_conn = 0;
-        }
-        else if (!(packet_type = deros_receive_packet(sock_conn, (uint8_t *)init_msg, &packet_size, responsemsg_len)))
-        {
-            close(sock_conn);
-            sock_conn = 0;
-        }
-        if (sock_conn && 
-            (packet_type == PACKET_RESPONSE_INIT) &&
-            (packet_size == responsemsg_len) &&
-            (strncmp(init_msg, INIT_MSG_RESPONSE, strlen(INIT_MSG_RESPONSE)) == 0) &&
-            (strncmp(init_msg + strlen(INIT_MSG_RESPONSE), node_name, strlen(node_name)) == 0))
-        {
-            deros_dbglog_msg(D_INFO, node_name, "process_packet", "connection to deros server established");
-            node_server_sockets[next_free_node_id] = sock_conn;
-            node_names[next_free_node_id] = node_name;
-            node_server_ports[next_free_node_id] = server_port;
-            node_server_addresses[next_free_node_id] = (char *)malloc(strlen(server_address) + 1);
-            strcpy(node_server_addresses[next_free_node_id], server_address);
-            next_free_node_id++;
-            pthread_t thr;
-            node_thread_started = 0;
-            pthread_create(&thr, 0, node_read_from_server_thread, 0);
-            while (!node_thread_started) usleep(1);
-
-        }
-        else if (sock_conn)
-        {
-            deros_dbglog_msg_str_2int(D_ERRR, node_name, "process_packet", "unexpected response from deros server, (msg, response, size)", init_msg, packet_type, packet_size);
-            close(sock_conn);
-            pthread_mutex_destroy(&node_mutexes[next_free_node_id]);
-            sock_conn = 0;
-        }
+        node_server_sockets[node_id] = sock_conn;
+        node_active[node_id] = 1;
+        pthread_t thr;
+        pthread_create(&thr, 0, node_read_from_server_thread, (void *)(intptr_t) node_id);
+        next_free_node_id++;
+    }
+    else
+    {
+        free(node_server_addresses[node_id]);
+        pthread_mutex_destroy(&node_mutexes[node_id]);
     }
 
     pthread_mutex_unlock(&global_deros_lock);
-    if (sock_conn) return next_free_node_id - 1;
+    if (sock_conn) return node_id;
     return -1;
 }
 
 void deros_done(int node_id)
 {
     pthread_mutex_lock(&global_deros_lock);
-    do {
+    if ((node_id < next_free_node_id) && (node_id >= 0) && node_active[node_id])
+    {
+        pthread_mutex_lock(&node_mutexes[node_id]);
+        node_active[node_id] = 0;
+        // the server removes the node, the thread reading from the server closes the socket and finishes
+        if (node_server_sockets[node_id]) shutdown(node_server_sockets[node_id], SHUT_RDWR);
+        pthread_mutex_unlock(&node_mutexes[node_id]);
+    }
+    pthread_mutex_unlock(&global_deros_lock);
+}
+
+int deros_set_socket_options(int node_id, int nodelay, int send_buffer, int receive_buffer, int priority)
+{
+    if ((node_id < 0) || (node_id >= next_free_node_id)) return 0;
+    if (pthread_mutex_lock(&node_mutexes[node_id])) return 0;
+    deros_socket_options *options = &node_socket_options[node_id];
+    options->nodelay = (nodelay < 0) ? -1 : (nodelay != 0);
+    options->send_buffer = send_buffer;
+    options->receive_buffer = receive_buffer;
+    options->priority = priority;
+    int ok = 1;
+    if (node_server_sockets[node_id]) ok = deros_apply_socket_options(node_server_sockets[node_id], options);
+    pthread_mutex_unlock(&node_mutexes[node_id]);
+    return ok;
+}
 
-      if ((node_id >= next_free_node_id) || (node_id < 0)) break;
-      if (node_server_sockets[node_id] == 0) break;
+int deros_set_multicast_interface(char *interface_ip)
+{
+    struct in_addr interface;
+    if (!inet_aton(interface_ip, &interface)) return 0;
+    multicast_interface = interface;
+    return 1;
+}
 
-      close(node_server_sockets[node_id]);
-      node_server_sockets[node_id] = 0;
-      free(node_server_addresses[node_id]);
+void send_registration_to_server(int node_id, uint8_t packet_type, uint8_t *prefix, int prefix_size, uint8_t *buffer, int size)
+{
+    if (node_collecting_registrations[node_id])
+        deros_batch_append(&node_registrations[node_id], packet_type, prefix, prefix_size, buffer, size);
+    else if (node_server_sockets[node_id] && 
+             !deros_send_packet_parts(node_server_sockets[node_id], packet_type, prefix, prefix_size, buffer, size))
+    {
+        deros_dbglog_msg_int(D_WARN, node_names[node_id], "process_packet", "sending to deros server failed (packet type)", packet_type);
+        shutdown(node_server_sockets[node_id], SHUT_RDWR);   // the thread reading from the server connects again
+    }
+}
 
-    } while (0);
-    pthread_mutex_unlock(&global_deros_lock);
+void deros_begin_registrations(int node_id)
+{
+    if ((node_id < 0) || (node_id >= next_free_node_id)) return;
+    if (pthread_mutex_lock(&node_mutexes[node_id])) return;
+    node_collecting_registrations[node_id] = 1;
+    pthread_mutex_unlock(&node_mutexes[node_id]);
+}
+
+int deros_end_registrations(int node_id)
+{
+    if ((node_id < 0) || (node_id >= next_free_node_id)) return 0;
+    if (pthread_mutex_lock(&node_mutexes[node_id])) return 0;
+    node_collecting_registrations[node_id] = 0;
+    deros_packet_batch *batch = &node_registrations[node_id];
+    int batch_number = 0;
+    int ok = 1;
+    if (batch->len && node_server_sockets[node_id])
+    {
+        pthread_mutex_lock(&node_batch_lock);
+        batch_number = ++node_batches_sent[node_id];
+        pthread_mutex_unlock(&node_batch_lock);
+        if (!deros_send_packet(node_server_sockets[node_id], PACKET_BATCH, batch->data, batch->len))
+        {
+            deros_dbglog_msg(D_WARN, node_names[node_id], "process_packet", "sending batch of registrations failed");
+            shutdown(node_server_sockets[node_id], SHUT_RDWR);   // the thread reading from the server connects again
+        }
+    }
+    else if (batch->len) ok = 0;   // the registrations are sent when the node connects again
+    deros_batch_free(batch);
+    pthread_mutex_unlock(&node_mutexes[node_id]);
+
+    // the server answers with the topic ids and the subscribers of the new publishers before PACKET_BATCH_DONE
+    pthread_mutex_lock(&node_batch_lock);
+    while (batch_number && (node_batches_done[node_id] < batch_number))
+        pthread_cond_wait(&node_batch_answered, &node_batch_lock);
+    if (batch_number && (node_batches_lost[node_id] >= batch_number)) ok = 0;
+    pthread_mutex_unlock(&node_batch_lock);
+    return ok;
 }
 
 void deros_node_mem_failure(char *msg)
@@ -4,22 +4,51 @@
 // internal interaction inside of the client node
 
 #include <pthread.h>
+#include <netinet/in.h>
 
 #include "../common/deros_common.h"
+#include "../common/deros_net.h"
 
 extern char *node_names[MAX_NODES];
 extern char *node_log_path[MAX_NODES];
 extern pthread_mutex_t node_mutexes[MAX_NODES];
-extern int node_server_sockets[MAX_NODES];
+extern int node_server_sockets[MAX_NODES];           // 0 while the node is connecting to the server again
+extern volatile int node_active[MAX_NODES];         // between deros_init() and deros_done()
 extern int node_listen_ports[MAX_NODES];
+extern deros_socket_options node_socket_options[MAX_NODES];   // for the connections the node opens or accepts
+extern volatile int node_heartbeat_interval_ms[MAX_NODES];   // announced by the server, 0 while heartbeats are disabled
+extern volatile int node_heartbeat_timeout_ms[MAX_NODES];
+extern struct in_addr multicast_interface;                     // INADDR_ANY lets the system choose
 
 
 extern int next_free_node_id;
 
 void deros_node_mem_failure(char *msg);
 
-void start_subscriber_listen_thread();
-void publisher_remove_subscriber(int subscriber_port, char *subscriber_ip, char *adres);
-int publisher_add_new_subscriber(int subscriber_port, char *subscriber_ip, char *adres);
+/** @return  current time of the monotonic clock in milliseconds */
+long long deros_monotonic_ms();
+
+/** send a registering packet to the server, or only collect it if the node is between deros_begin_registrations()
+ *  and deros_end_registrations(), node mutex must be held, a node without connection to the server sends all its
+ *  registrations when it connects again */
+void send_registration_to_server(int node_id, uint8_t packet_type, uint8_t *prefix, int prefix_size, uint8_t *buffer, int size);
+
+/** collect the registering packets of all publishers (subscribers) of the node for PACKET_RESYNC, node mutex must be held */
+void append_publisher_registrations(int node_id, deros_packet_batch *batch);
+void append_subscriber_registrations(int node_id, deros_packet_batch *batch);
+
+void subscriber_listen(int node_id);
+void publisher_remove_subscriber(int subscriber_port, char *subscriber_ip, int colocated, int transport, int adr_id);
+int publisher_add_new_subscriber(int node_id, int subscriber_port, char *subscriber_ip, int colocated, int transport, int history, int adr_id);
+
+// messages between nodes of the same process do not leave the process, the subscribers get a reference
+// to the packet of the publisher, it is held until all their callbacks have returned
+
+/** queue the message for the subscribers of the node to the address
+ *  @param shared  the packet of the publisher that contains the message
+ *  @return  1 on success, 0 if the message size does not match some subscriber */
+int deliver_local_message(int node_id, int adr_id, uint8_t *msg, int msglen, void *shared);
+void hold_local_message(void *shared);
+void release_local_message(void *shared);
 
 #endif
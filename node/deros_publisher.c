@@ -1,144 +1,1924 @@
 // implementation of the publisher api for client node
 
+#define _GNU_SOURCE   // memfd_create, sendmmsg
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
 #include <pthread.h>
+#include <errno.h>
+#include <time.h>
+#include <stdatomic.h>
 #include <sys/time.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <stddef.h>
 
 #include "../deros.h"
 #include "../common/deros_net.h"
 #include "../common/deros_addrs.h"
 #include "../common/deros_msglog.h"
 #include "../common/deros_dbglog.h"
+#include "../common/deros_shm.h"
 #include "deros_core_internal.h"
 
+#define PACKET_FRAMING (sizeof(unsigned int) + 1)
+
 typedef char *(*pretty_print_function)(uint8_t *message, int length);
 
 int publisher_node_id[MAX_NUM_PUBLISHERS];
 char *publisher_address[MAX_NUM_PUBLISHERS];
 int publisher_msgsize[MAX_NUM_PUBLISHERS];
 int publisher_msgqueue_size[MAX_NUM_PUBLISHERS];
+int publisher_queue_policy[MAX_NUM_PUBLISHERS];
+int publisher_block_timeout_ms[MAX_NUM_PUBLISHERS];
+int publisher_priority[MAX_NUM_PUBLISHERS];           // its messages go through the connections of this priority class
+int publisher_transport[MAX_NUM_PUBLISHERS];          // as registered at the server
 int publisher_log_enabled[MAX_NUM_PUBLISHERS];
 int publisher_log_initialized[MAX_NUM_PUBLISHERS];
 int publisher_log_handle[MAX_NUM_PUBLISHERS];
+pthread_mutex_t publisher_log_lock[MAX_NUM_PUBLISHERS];  // calls of the pretty printer of the publisher do not overlap
 pretty_print_function publisher_pretty_printer[MAX_NUM_PUBLISHERS];
 int *subscribed_remote_node_ids[MAX_NUM_PUBLISHERS];
 int num_sub_remote_nodes[MAX_NUM_PUBLISHERS];
+int *subscribed_local_node_ids[MAX_NUM_PUBLISHERS];   // nodes of this process that subscribe to the address of the publisher
+int num_sub_local_nodes[MAX_NUM_PUBLISHERS];
+int publisher_local_adr_id[MAX_NUM_PUBLISHERS];       // address id in this process, the server refers to it by its topic id
+_Atomic uint32_t publisher_seq[MAX_NUM_PUBLISHERS];
+struct sockaddr_in *publisher_udp_subs[MAX_NUM_PUBLISHERS];        // subscriber nodes that get datagrams to their listen port
+int num_udp_subs[MAX_NUM_PUBLISHERS];
+struct sockaddr_in *publisher_multicast_subs[MAX_NUM_PUBLISHERS];  // subscriber nodes in the multicast group
+int num_multicast_subs[MAX_NUM_PUBLISHERS];
+struct sockaddr_in publisher_multicast_group[MAX_NUM_PUBLISHERS];
+int publisher_datagrams_dropped[MAX_NUM_PUBLISHERS];
 int num_publishers = 0;
 int next_publisher_id = 0;
 
-pthread_mutex_t remote_nodes_lock;
+/** the subscriber nodes that the messages of a publisher go to, a snapshot of the lists above that never changes:
+ *  publish() reads it without taking any lock, a change of the lists swaps in a new one */
+typedef struct publisher_destinations {
+    int num_remote_nodes;
+    int num_local_nodes;
+    int num_udp_subs;
+    int multicast;                     // some subscriber nodes are in the multicast group of the address
+    int local_adr_id;
+    int *remote_nodes;
+    int *remote_generations;           // a remote node that has been closed and reused since then is skipped
+    int *local_nodes;
+    struct sockaddr_in *udp_subs;
+    struct sockaddr_in multicast_group;
+} publisher_destinations;
+
+/** publish() counts itself in one of the two slots of its publisher while it reads the destinations,
+ *  each publisher has its own cache line, so that publishers of different topics do not touch the same memory */
+typedef struct publisher_readers {
+    _Alignas(64) _Atomic int epoch;    // its lowest bit selects the slot for new readers
+    _Atomic int readers[2];
+} publisher_readers;
+
+_Atomic(publisher_destinations *) publisher_dests[MAX_NUM_PUBLISHERS];
+publisher_readers publisher_dest_readers[MAX_NUM_PUBLISHERS];
+
+/** destinations swapped out while some publish() may still read them, freed once both slots of the publisher were seen empty */
+typedef struct retired_destinations {
+    struct retired_destinations *next;
+    publisher_destinations *dest;
+    int pub_id;
+    int drained[2];
+} retired_destinations;
+
+static retired_destinations *retired_dests = 0;   // remote_nodes_lock must be held
+
+// changes of the lists above and of the remote nodes are serialized, publish() never takes this lock
+pthread_mutex_t remote_nodes_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/** a packet ready to be sent through the socket (length, type, contents), shared by all remote nodes it is queued for,
+ *  packets come from a pool with free lists of power-of-two capacities */
+typedef struct outbound_packet {
+    _Atomic int refs;
+    int size;              // size of the contents
+    int size_class;        // capacity is PACKET_POOL_MIN_CAPACITY << size_class, -1 if it is not pooled
+    uint32_t magic;        // recognizes loaned packets
+    int memfd;             // the message is in this sealed memory file instead of the contents, -1 if it is not
+    struct outbound_packet *next_free;
+    uint8_t type;
+    uint8_t data[];        // framing as in deros_send_packet(), then the contents
+} outbound_packet;
+
+#define OUTBOUND_PACKET_MAGIC 0x4c4f414e
+#define LOANED_MESSAGE_OFFSET (offsetof(outbound_packet, data) + PACKET_FRAMING + MSG_HEADER_LENGTH)
+
+static pthread_mutex_t packet_pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static outbound_packet *packet_pool[PACKET_POOL_CLASSES];
+static long packet_pool_bytes = 0;
+
+// the last messages of publishers with history, they are sent to subscriber nodes that come later, publish() records
+// the message and picks the destinations under the history lock, so a new subscriber node gets each message exactly once
+int publisher_history_depth[MAX_NUM_PUBLISHERS];               // 0 if the publisher keeps no history
+outbound_packet **publisher_history[MAX_NUM_PUBLISHERS];       // ring of the last messages (PACKET_NEW_MESSAGE)
+int publisher_history_count[MAX_NUM_PUBLISHERS];
+int publisher_history_next[MAX_NUM_PUBLISHERS];                // where the next message goes
+pthread_mutex_t publisher_history_lock[MAX_NUM_PUBLISHERS];
+
+typedef struct queued_packet {
+    struct queued_packet *next;
+    outbound_packet *packet;
+    int pub_id;            // -1 for control packets, they are never dropped
+    int topic_id;          // publisher whose messages must stay in order with this packet (also for its topic bind), -1 if none
+} queued_packet;
+
+/** a large message being sent in chunks, and the packets of the same publisher that have to wait for it */
+typedef struct message_stream {
+    struct message_stream *next;
+    int topic_id;
+    queued_packet *head;   // the first one is being sent, they still count in the queue of the publisher
+    queued_packet *tail;
+    int offset;            // how much of the message of the first one has been sent in chunks
+} message_stream;
+
+char* s_remote_node_IP[MAX_NUM_REMOTE_SUBSCRIBERS];
+int s_remote_node_port[MAX_NUM_REMOTE_SUBSCRIBERS];
+int s_remote_node_priority[MAX_NUM_REMOTE_SUBSCRIBERS];           // each priority class has its own connection to a subscriber node
+int s_remote_node_colocated[MAX_NUM_REMOTE_SUBSCRIBERS];
+int s_remote_node_used_by_num_pubs[MAX_NUM_REMOTE_SUBSCRIBERS];
+int s_remote_node_socket[MAX_NUM_REMOTE_SUBSCRIBERS];
+int s_remote_node_local[MAX_NUM_REMOTE_SUBSCRIBERS];              // connected through a Unix domain socket, large messages go in memory files
+deros_shm_ring *s_remote_node_ring[MAX_NUM_REMOTE_SUBSCRIBERS];   // non-zero for subscriber nodes on the same host
+pthread_mutex_t s_remote_node_send_lock[MAX_NUM_REMOTE_SUBSCRIBERS]; // guards the queue and the output state below
+pthread_cond_t s_remote_node_progress[MAX_NUM_REMOTE_SUBSCRIBERS];   // signalled whenever some queued packets leave the queue
+queued_packet *s_remote_node_queue_head[MAX_NUM_REMOTE_SUBSCRIBERS];
+queued_packet *s_remote_node_queue_tail[MAX_NUM_REMOTE_SUBSCRIBERS];
+int *s_remote_node_queued_of_pub[MAX_NUM_REMOTE_SUBSCRIBERS];     // number of waiting messages of each publisher
+queued_packet *s_remote_node_tx_head[MAX_NUM_REMOTE_SUBSCRIBERS];  // packets being sent through the socket
+queued_packet *s_remote_node_tx_tail[MAX_NUM_REMOTE_SUBSCRIBERS];
+int s_remote_node_tx_sent[MAX_NUM_REMOTE_SUBSCRIBERS];            // how much of the first one has been sent already
+message_stream *s_remote_node_streams_head[MAX_NUM_REMOTE_SUBSCRIBERS];  // large messages take turns, one chunk each
+message_stream *s_remote_node_streams_tail[MAX_NUM_REMOTE_SUBSCRIBERS];
+long s_remote_node_tx_bytes[MAX_NUM_REMOTE_SUBSCRIBERS];          // how much of all of them is left to be sent
+int s_remote_node_doorbell_queued[MAX_NUM_REMOTE_SUBSCRIBERS];    // a doorbell waits among the packets being sent
+int s_remote_node_doorbell_deferred[MAX_NUM_REMOTE_SUBSCRIBERS];  // subscriber sleeps, but the node is corked
+int s_remote_node_waiting_for_ring[MAX_NUM_REMOTE_SUBSCRIBERS];
+int s_remote_node_watching_output[MAX_NUM_REMOTE_SUBSCRIBERS];
+int s_remote_node_failed[MAX_NUM_REMOTE_SUBSCRIBERS];             // connection was lost, messages are dropped until it is made again
+int s_remote_node_state[MAX_NUM_REMOTE_SUBSCRIBERS];
+int s_remote_node_closing[MAX_NUM_REMOTE_SUBSCRIBERS];            // no publisher uses it anymore, its slot is reused once it is closed
+int s_remote_node_generation[MAX_NUM_REMOTE_SUBSCRIBERS];         // counts the reuses of the slot
+int s_remote_node_node_id[MAX_NUM_REMOTE_SUBSCRIBERS];            // its socket options apply to the connection
+deros_shm_ring *s_remote_node_attaching_ring[MAX_NUM_REMOTE_SUBSCRIBERS];  // offered to the subscriber, no answer yet
+struct timespec s_remote_node_deadline[MAX_NUM_REMOTE_SUBSCRIBERS];  // of the connection attempt, or when to make the next one
+int s_remote_node_backoff_ms[MAX_NUM_REMOTE_SUBSCRIBERS];
+uint8_t *s_remote_node_topic_bound[MAX_NUM_REMOTE_SUBSCRIBERS];   // publishers whose topics are bound again after reconnecting
+long long s_remote_node_heard_ms[MAX_NUM_REMOTE_SUBSCRIBERS];     // last heartbeat from the subscriber node
+long long s_remote_node_heartbeat_ms[MAX_NUM_REMOTE_SUBSCRIBERS]; // start of the current heartbeat interval
+int s_remote_node_sent_in_interval[MAX_NUM_REMOTE_SUBSCRIBERS];   // the socket carried something, no heartbeat is needed
+int next_remote_node_id = 0;
+
+// connection to a subscriber node, all but the connected ones are looked after by the send thread
+#define REMOTE_NODE_CLOSED      0
+#define REMOTE_NODE_CONNECTING  1   // non-blocking connect in progress
+#define REMOTE_NODE_ATTACHING   2   // waiting for the subscriber to attach the shared memory ring
+#define REMOTE_NODE_CONNECTED   3
+#define REMOTE_NODE_WAITING     4   // failed, waiting for the next attempt
+#define REMOTE_NODE_CLOSING     5   // the queued packets leave until the close deadline, then the connection is closed
+
+static int publisher_epoll = -1;
+static int publisher_wakeup = -1;   // eventfd to wake the send thread when it should start polling the rings
+static _Atomic int num_remote_nodes_waiting_for_ring = 0;
+static _Atomic int num_remote_nodes_not_connected = 0;
+static outbound_packet *doorbell_packet = 0;   // shared by all remote nodes, never released
+static outbound_packet *heartbeat_packet = 0;  // likewise
+static volatile long long next_heartbeat_check_ms = 0;
+static int publisher_udp_socket = -1;          // sends the datagrams of all publishers of the process
+
+// corked nodes only collect the messages, they leave when the node is flushed
+static pthread_mutex_t cork_lock = PTHREAD_MUTEX_INITIALIZER;
+int node_corked[MAX_NODES];
+int node_autoflush_delay_ms[MAX_NODES];    // 0 = no time limit
+long node_autoflush_bytes[MAX_NODES];      // 0 = no size limit
+long node_corked_bytes[MAX_NODES];         // size of the messages collected since the last flush
+struct timespec node_corked_since[MAX_NODES];
+int node_num_dirty_remotes[MAX_NODES];     // remote nodes that have collected messages of the node
+int node_dirty_remotes[MAX_NODES][MAX_NUM_REMOTE_SUBSCRIBERS];
+uint8_t node_remote_is_dirty[MAX_NODES][MAX_NUM_REMOTE_SUBSCRIBERS];
+
+void deros_pub_mem_failure(char *msg)
+{
+    deros_dbglog_msg_str(D_GRRR, "memf", "publisher", "not enough memory", msg);
+    exit(1);
+}
+
+/** @return  the current destinations of the publisher (0 if it has none), they stay valid until leave_publisher_destinations() */
+publisher_destinations *enter_publisher_destinations(int pub_id, int *slot)
+{
+    *slot = atomic_load(&publisher_dest_readers[pub_id].epoch) & 1;
+    atomic_fetch_add(&publisher_dest_readers[pub_id].readers[*slot], 1);
+    return atomic_load(&publisher_dests[pub_id]);
+}
+
+void leave_publisher_destinations(int pub_id, int slot)
+{
+    atomic_fetch_sub(&publisher_dest_readers[pub_id].readers[slot], 1);
+}
+
+/** free the swapped out destinations that no publish() reads anymore, the readers are never waited for (publish() may block
+ *  in its queue policy): a reader of old destinations entered its slot before they were swapped out, so they are free once both 
+ *  slots have been seen empty since then, a slot that has readers is flipped for the new readers, remote_nodes_lock must be held */
+void free_unread_publisher_destinations()
+{
+    retired_destinations **link = &retired_dests;
+    while (*link)
+    {
+        retired_destinations *retired = *link;
+        publisher_readers *r = &publisher_dest_readers[retired->pub_id];
+        for (int slot = 0; slot < 2; slot++)
+        {
+            if (retired->drained[slot]) continue;
+            if (atomic_load(&r->readers[slot]) == 0) retired->drained[slot] = 1;
+            else if ((atomic_load(&r->epoch) & 1) == slot) atomic_fetch_add(&r->epoch, 1);
+        }
+        if (retired->drained[0] && retired->drained[1])
+        {
+            *link = retired->next;
+            free(retired->dest);
+            free(retired);
+        }
+        else link = &retired->next;
+    }
+}
+
+/** take a new snapshot of the lists of the publisher (an empty one after it has unregistered) and swap it in,
+ *  the old one is freed later when nobody reads it, remote_nodes_lock must be held */
+void update_publisher_destinations(int pub_id)
+{
+    publisher_destinations *d = 0;
+    if (publisher_address[pub_id])
+    {
+        int num_udp = num_udp_subs[pub_id];
+        int num_remote = num_sub_remote_nodes[pub_id];
+        int num_local = num_sub_local_nodes[pub_id];
+        d = (publisher_destinations *) malloc(sizeof(publisher_destinations) + num_udp * sizeof(struct sockaddr_in) + (2 * num_remote + num_local) * sizeof(int));
+        if (!d) deros_pub_mem_failure("pub destinations");
+        d->num_remote_nodes = num_remote;
+        d->num_local_nodes = num_local;
+        d->num_udp_subs = num_udp;
+        d->multicast = (num_multicast_subs[pub_id] > 0);
+        d->local_adr_id = publisher_local_adr_id[pub_id];
+        d->multicast_group = publisher_multicast_group[pub_id];
+        d->udp_subs = (struct sockaddr_in *) (d + 1);
+        d->remote_nodes = (int *) (d->udp_subs + num_udp);
+        d->remote_generations = d->remote_nodes + num_remote;
+        d->local_nodes = d->remote_generations + num_remote;
+        if (num_udp) memcpy(d->udp_subs, publisher_udp_subs[pub_id], num_udp * sizeof(struct sockaddr_in));
+        if (num_remote) memcpy(d->remote_nodes, subscribed_remote_node_ids[pub_id], num_remote * sizeof(int));
+        for (int i = 0; i < num_remote; i++) d->remote_generations[i] = s_remote_node_generation[d->remote_nodes[i]];
+        if (num_local) memcpy(d->local_nodes, subscribed_local_node_ids[pub_id], num_local * sizeof(int));
+    }
+
+    publisher_destinations *old = atomic_exchange(&publisher_dests[pub_id], d);
+    if (old)
+    {
+        retired_destinations *retired = (retired_destinations *) calloc(1, sizeof(retired_destinations));
+        if (!retired) deros_pub_mem_failure("retire destinations");
+        retired->dest = old;
+        retired->pub_id = pub_id;
+        retired->next = retired_dests;
+        retired_dests = retired;
+    }
+    free_unread_publisher_destinations();
+}
+
+int find_remote_node(char *ip, int port, int priority)
+{
+    for (int i = 0; i < next_remote_node_id; i++)
+        if ((s_remote_node_port[i] == 0) || s_remote_node_closing[i]) continue;
+        else if ((s_remote_node_port[i] == port) && (s_remote_node_priority[i] == priority) &&
+                 (strncmp(s_remote_node_IP[i], ip, 15) == 0)) return i;
+    return -1;
+} 
+
+/** get a packet for contents of the specified size from the pool, or allocate a new one */
+outbound_packet *alloc_outbound_packet(int size, int refs)
+{
+    int size_class = 0;
+    while ((size_class < PACKET_POOL_CLASSES) && ((PACKET_POOL_MIN_CAPACITY << size_class) < size)) size_class++;
+    if (size_class == PACKET_POOL_CLASSES) size_class = -1;
+
+    outbound_packet *packet = 0;
+    if (size_class >= 0)
+    {
+        pthread_mutex_lock(&packet_pool_lock);
+        packet = packet_pool[size_class];
+        if (packet)
+        {
+            packet_pool[size_class] = packet->next_free;
+            packet_pool_bytes -= PACKET_POOL_MIN_CAPACITY << size_class;
+        }
+        pthread_mutex_unlock(&packet_pool_lock);
+    }
+    if (!packet)
+    {
+        int capacity = (size_class >= 0) ? (PACKET_POOL_MIN_CAPACITY << size_class) : size;
+        packet = (outbound_packet *) malloc(sizeof(outbound_packet) + PACKET_FRAMING + capacity);
+        if (!packet) deros_pub_mem_failure("outbound packet");
+    }
+    atomic_init(&packet->refs, refs);
+    packet->size = size;
+    packet->size_class = size_class;
+    packet->magic = OUTBOUND_PACKET_MAGIC;
+    packet->memfd = -1;
+    return packet;
+}
+
+/** set the framing of the packet according to its type and size */
+void frame_outbound_packet(outbound_packet *packet, uint8_t packet_type)
+{
+    packet->type = packet_type;
+    deros_store_uint(packet->data, packet->size);
+    packet->data[sizeof(unsigned int)] = packet_type;
+}
+
+/** create a packet from two parts of its contents, with the specified number of references */
+outbound_packet *new_outbound_packet(uint8_t packet_type, uint8_t *part1, int len1, uint8_t *part2, int len2, int refs)
+{
+    outbound_packet *packet = alloc_outbound_packet(len1 + len2, refs);
+    frame_outbound_packet(packet, packet_type);
+    memcpy(packet->data + PACKET_FRAMING, part1, len1);
+    if (len2) memcpy(packet->data + PACKET_FRAMING + len1, part2, len2);
+    return packet;
+}
+
+/** write the message to a sealed memory file, subscriber nodes on the same host map it instead of receiving its bytes,
+ *  the packet has no contents, its descriptor is passed with it through the Unix domain socket
+ *  @return  the packet with one reference, or 0 if the memory file could not be created */
+outbound_packet *new_memfd_packet(uint8_t *header, uint8_t *message, int msg_len)
+{
+    int fd = memfd_create("deros-message", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if (fd < 0)
+    {
+        deros_dbglog_msg_int(D_WARN, "sys", "publisher", "could not create memory file, errno=", errno);
+        return 0;
+    }
+
+    struct iovec iov[2] = { { header, MSG_HEADER_LENGTH }, { message, msg_len } };
+    struct iovec *next = iov;
+    int num_iov = 2;
+    off_t offset = 0;
+    while (num_iov)
+    {
+        ssize_t n = pwritev(fd, next, num_iov, offset);
+        if ((n < 0) && (errno == EINTR)) continue;
+        if (n <= 0)
+        {
+            deros_dbglog_msg_int(D_WARN, "sys", "publisher", "could not write memory file, errno=", errno);
+            close(fd);
+            return 0;
+        }
+        offset += n;
+        while (num_iov && (n >= next->iov_len))
+        {
+            n -= next->iov_len;
+            next++;
+            num_iov--;
+        }
+        if (num_iov)
+        {
+            next->iov_base = (uint8_t *)next->iov_base + n;
+            next->iov_len -= n;
+        }
+    }
+    // the subscriber can rely on the contents: nobody can change them or make the file shorter
+    if (fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL) < 0)
+    {
+        deros_dbglog_msg_int(D_WARN, "sys", "publisher", "could not seal memory file, errno=", errno);
+        close(fd);
+        return 0;
+    }
+
+    outbound_packet *packet = alloc_outbound_packet(0, 1);
+    frame_outbound_packet(packet, PACKET_MEMFD_MESSAGE);
+    packet->memfd = fd;
+    return packet;
+}
+
+/** drop a reference, the last one returns the packet to the pool (unless the pool is too big already) */
+void release_outbound_packet(outbound_packet *packet)
+{
+    if (atomic_fetch_sub(&packet->refs, 1) != 1) return;
+    packet->magic = 0;
+    if (packet->memfd >= 0) close(packet->memfd);
+    if (packet->size_class >= 0)
+    {
+        long capacity = PACKET_POOL_MIN_CAPACITY << packet->size_class;
+        pthread_mutex_lock(&packet_pool_lock);
+        if (packet_pool_bytes + capacity <= PACKET_POOL_MAX_BYTES)
+        {
+            packet->next_free = packet_pool[packet->size_class];
+            packet_pool[packet->size_class] = packet;
+            packet_pool_bytes += capacity;
+            packet = 0;
+        }
+        pthread_mutex_unlock(&packet_pool_lock);
+    }
+    free(packet);
+}
+
+/** watch also for the socket to accept more data, or stop watching it, send lock must be held */
+void watch_remote_node_output(int remote_node, int watch)
+{
+    if (s_remote_node_watching_output[remote_node] == watch) return;
+    struct epoll_event ev;
+    ev.events = EPOLLIN | EPOLLRDHUP | (watch ? EPOLLOUT : 0);
+    ev.data.u32 = remote_node;
+    epoll_ctl(publisher_epoll, EPOLL_CTL_MOD, s_remote_node_socket[remote_node], &ev);
+    s_remote_node_watching_output[remote_node] = watch;
+}
+
+/** the send thread should recompute how long it can sleep */
+void wake_up_publisher_send_thread()
+{
+    uint64_t one = 1;
+    if (write(publisher_wakeup, &one, sizeof(one)) < 0)
+        deros_dbglog_msg_int(D_ERRR, "sys", "publisher", "could not wake up send thread, errno=", errno);
+}
+
+void set_remote_node_waiting_for_ring(int remote_node, int waiting)
+{
+    if (s_remote_node_waiting_for_ring[remote_node] == waiting) return;
+    s_remote_node_waiting_for_ring[remote_node] = waiting;
+    if ((atomic_fetch_add(&num_remote_nodes_waiting_for_ring, waiting ? 1 : -1) == 0) && waiting)
+        wake_up_publisher_send_thread();
+}
+
+/** append a packet to those being sent through the socket, the reference of the caller passes to the list, send lock must be held */
+void append_to_remote_node_tx(int remote_node, outbound_packet *packet)
+{
+    queued_packet *t = (queued_packet *) malloc(sizeof(queued_packet));
+    if (!t) deros_pub_mem_failure("append tx packet");
+    t->packet = packet;
+    t->pub_id = -1;
+    t->topic_id = -1;
+    t->next = 0;
+    if (s_remote_node_tx_tail[remote_node]) s_remote_node_tx_tail[remote_node]->next = t;
+    else s_remote_node_tx_head[remote_node] = t;
+    s_remote_node_tx_tail[remote_node] = t;
+    s_remote_node_tx_bytes[remote_node] += PACKET_FRAMING + packet->size;
+}
+
+/** remove the first packet from those being sent through the socket, send lock must be held */
+void remove_first_tx_packet(int remote_node)
+{
+    queued_packet *t = s_remote_node_tx_head[remote_node];
+    s_remote_node_tx_head[remote_node] = t->next;
+    if (!t->next) s_remote_node_tx_tail[remote_node] = 0;
+    if (t->packet == doorbell_packet) s_remote_node_doorbell_queued[remote_node] = 0;
+    release_outbound_packet(t->packet);
+    free(t);
+}
+
+/** write the packets waiting for the socket, as many of them as possible with a single sendmsg(), 
+ *  as much as the socket accepts without blocking, send lock must be held
+ *  @return  1 on success (even if not everything was sent), 0 if the connection failed */
+int flush_remote_node_socket(int remote_node)
+{
+    struct iovec iov[PUBLISHER_MAX_IOV];
+    char control[CMSG_SPACE(sizeof(int))];
+    while (s_remote_node_tx_head[remote_node])
+    {
+        int num_iov = 0;
+        int memfd = -1;
+        for (queued_packet *t = s_remote_node_tx_head[remote_node]; t && (num_iov < PUBLISHER_MAX_IOV); t = t->next)
+        {
+            if (t->packet->memfd >= 0)
+            {
+                // the descriptor travels with the first byte of its packet, so that it never arrives after the packet
+                if (num_iov) break;
+                if (s_remote_node_tx_sent[remote_node] == 0) memfd = t->packet->memfd;
+            }
+            iov[num_iov].iov_base = t->packet->data;
+            iov[num_iov].iov_len = PACKET_FRAMING + t->packet->size;
+            num_iov++;
+        }
+        iov[0].iov_base = (uint8_t *)iov[0].iov_base + s_remote_node_tx_sent[remote_node];
+        iov[0].iov_len -= s_remote_node_tx_sent[remote_node];
+
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = iov;
+        msg.msg_iovlen = num_iov;
+        if (memfd >= 0)
+        {
+            msg.msg_control = control;
+            msg.msg_controllen = sizeof(control);
+            struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+            cmsg->cmsg_level = SOL_SOCKET;
+            cmsg->cmsg_type = SCM_RIGHTS;
+            cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+            memcpy(CMSG_DATA(cmsg), &memfd, sizeof(int));
+        }
+        ssize_t n = sendmsg(s_remote_node_socket[remote_node], &msg, MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (n < 0)
+        {
+            if (errno == EINTR) continue;
+            if ((errno == EAGAIN) || (errno == EWOULDBLOCK))
+            {
+                watch_remote_node_output(remote_node, 1);
+                return 1;
+            }
+            return 0;
+        }
+        s_remote_node_tx_bytes[remote_node] -= n;
+        s_remote_node_sent_in_interval[remote_node] = 1;
+        n += s_remote_node_tx_sent[remote_node];
+        while (s_remote_node_tx_head[remote_node] && (n >= PACKET_FRAMING + s_remote_node_tx_head[remote_node]->packet->size))
+        {
+            n -= PACKET_FRAMING + s_remote_node_tx_head[remote_node]->packet->size;
+            remove_first_tx_packet(remote_node);
+        }
+        s_remote_node_tx_sent[remote_node] = n;
+    }
+    watch_remote_node_output(remote_node, 0);
+    return 1;
+}
+
+/** the subscriber sleeps and needs to be woken up through the socket after a write to the ring,
+ *  a doorbell that has not been sent completely yet will do it as well, send lock must be held */
+void ring_doorbell_of_remote_node(int remote_node)
+{
+    s_remote_node_doorbell_deferred[remote_node] = 0;
+    if (s_remote_node_doorbell_queued[remote_node]) return;
+    atomic_fetch_add(&doorbell_packet->refs, 1);
+    append_to_remote_node_tx(remote_node, doorbell_packet);
+    s_remote_node_doorbell_queued[remote_node] = 1;
+}
+
+/** remove the first packet from the queue of the remote node, send lock must be held */
+void dequeue_remote_node_packet(int remote_node)
+{
+    queued_packet *q = s_remote_node_queue_head[remote_node];
+    s_remote_node_queue_head[remote_node] = q->next;
+    if (!q->next) s_remote_node_queue_tail[remote_node] = 0;
+    if (q->pub_id >= 0) s_remote_node_queued_of_pub[remote_node][q->pub_id]--;
+    free(q);
+}
+
+/** a large message is sent in chunks instead of one packet */
+int is_streamed_packet(outbound_packet *packet)
+{
+    return (packet->type == PACKET_NEW_MESSAGE) && (packet->memfd < 0) && (packet->size > MESSAGE_CHUNK_SIZE);
+}
+
+/** @return  the stream of the publisher at the remote node, or 0 if it has none, send lock must be held */
+message_stream *find_message_stream(int remote_node, int topic_id)
+{
+    for (message_stream *stream = s_remote_node_streams_head[remote_node]; stream; stream = stream->next)
+        if (stream->topic_id == topic_id) return stream;
+    return 0;
+}
+
+void append_message_stream(int remote_node, message_stream *stream)
+{
+    stream->next = 0;
+    if (s_remote_node_streams_tail[remote_node]) s_remote_node_streams_tail[remote_node]->next = stream;
+    else s_remote_node_streams_head[remote_node] = stream;
+    s_remote_node_streams_tail[remote_node] = stream;
+}
+
+/** move the first queued packet to the end of the stream of its publisher, a new stream is started if there is none, send lock must be held */
+void move_to_message_stream(int remote_node, message_stream *stream)
+{
+    queued_packet *q = s_remote_node_queue_head[remote_node];
+    s_remote_node_queue_head[remote_node] = q->next;
+    if (!q->next) s_remote_node_queue_tail[remote_node] = 0;
+    q->next = 0;
+
+    if (!stream)
+    {
+        stream = (message_stream *) malloc(sizeof(message_stream));
+        if (!stream) deros_pub_mem_failure("message stream");
+        stream->topic_id = q->topic_id;
+        stream->head = stream->tail = 0;
+        stream->offset = 0;
+        append_message_stream(remote_node, stream);
+    }
+    if (stream->tail) stream->tail->next = q;
+    else stream->head = q;
+    stream->tail = q;
+}
+
+/** remove the first packet from the stream, the stream is freed when it becomes empty, send lock must be held */
+void remove_first_stream_packet(int remote_node, message_stream *stream)
+{
+    queued_packet *q = stream->head;
+    stream->head = q->next;
+    if (!q->next) stream->tail = 0;
+    stream->offset = 0;
+    if (q->pub_id >= 0) s_remote_node_queued_of_pub[remote_node][q->pub_id]--;
+    free(q);
+    if (stream->head) return;
+
+    message_stream *prev = 0;
+    for (message_stream *s = s_remote_node_streams_head[remote_node]; s != stream; s = s->next) prev = s;
+    if (prev) prev->next = stream->next;
+    else s_remote_node_streams_head[remote_node] = stream->next;
+    if (s_remote_node_streams_tail[remote_node] == stream) s_remote_node_streams_tail[remote_node] = prev;
+    free(stream);
+}
+
+/** pass the packet to the shared memory ring, or to the socket if it does not fit or it is a memory file or a chunk,
+ *  the place of a packet sent through the socket is marked in the ring so that the subscriber keeps their order, 
+ *  send lock must be held
+ *  @return  1 if the packet was taken (with the reference of the caller), -1 if the ring or the socket is busy, 
+ *           0 if the subscriber is not reachable anymore */
+int send_packet_to_remote_node(int remote_node, outbound_packet *packet)
+{
+    deros_shm_ring *ring = s_remote_node_ring[remote_node];
+
+    // chunks do not use the ring: the socket tells when it can take more, and the ring keeps free for small messages
+    if (ring && (packet->memfd < 0) && (packet->type != PACKET_MESSAGE_CHUNK) && (packet->size <= deros_shm_ring_max_record(ring)))
+    {
+        int written = deros_shm_ring_write(ring, packet->type, packet->data + PACKET_FRAMING, packet->size, 0, 0);
+        if (written < 0)
+        {
+            set_remote_node_waiting_for_ring(remote_node, 1);
+            return -1;
+        }
+        if (written) ring_doorbell_of_remote_node(remote_node);
+        release_outbound_packet(packet);
+        return 1;
+    }
+
+    if (s_remote_node_tx_bytes[remote_node] >= PUBLISHER_TX_BATCH_BYTES)
+    {
+        if (!flush_remote_node_socket(remote_node)) return 0;
+        if (s_remote_node_tx_bytes[remote_node] >= PUBLISHER_TX_BATCH_BYTES) return -1;  // socket is busy
+    }
+    if (ring)
+    {
+        int written = deros_shm_ring_write(ring, PACKET_SHM_VIA_SOCKET, packet->data, 0, 0, 0);
+        if (written < 0)
+        {
+            set_remote_node_waiting_for_ring(remote_node, 1);
+            return -1;
+        }
+        if (written) ring_doorbell_of_remote_node(remote_node);
+    }
+    append_to_remote_node_tx(remote_node, packet);
+    return 1;
+}
+
+/** the first stream takes its turn: the next chunk of its large message, or the next packet that waited behind it,
+ *  then it goes to the end of the list of streams, send lock must be held
+ *  @return  1 on success, -1 if the ring or the socket is busy, 0 if the subscriber is not reachable anymore */
+int send_next_from_stream(int remote_node)
+{
+    message_stream *stream = s_remote_node_streams_head[remote_node];
+    outbound_packet *packet = stream->head->packet;
+    int done = 1;
+
+    if (is_streamed_packet(packet))
+    {
+        int msg_len = packet->size - MSG_HEADER_LENGTH;
+        int length = msg_len - stream->offset;
+        if (length > MESSAGE_CHUNK_SIZE - CHUNK_HEADER_LENGTH) length = MESSAGE_CHUNK_SIZE - CHUNK_HEADER_LENGTH;
+        uint8_t chunk_header[CHUNK_HEADER_LENGTH];
+        memcpy(chunk_header, packet->data + PACKET_FRAMING, MSG_HEADER_LENGTH);
+        deros_store_uint(chunk_header + MSG_HEADER_LENGTH, stream->offset);
+        outbound_packet *chunk = new_outbound_packet(PACKET_MESSAGE_CHUNK, chunk_header, CHUNK_HEADER_LENGTH,
+                                                     packet->data + PACKET_FRAMING + MSG_HEADER_LENGTH + stream->offset, length, 1);
+        int sent = send_packet_to_remote_node(remote_node, chunk);
+        if (sent <= 0)
+        {
+            release_outbound_packet(chunk);
+            return sent;
+        }
+        stream->offset += length;
+        done = (stream->offset == msg_len);
+        if (done) release_outbound_packet(packet);
+    }
+    else
+    {
+        int sent = send_packet_to_remote_node(remote_node, packet);
+        if (sent <= 0) return sent;
+    }
+
+    s_remote_node_streams_head[remote_node] = stream->next;
+    if (!stream->next) s_remote_node_streams_tail[remote_node] = 0;
+    append_message_stream(remote_node, stream);
+    if (done) remove_first_stream_packet(remote_node, stream);
+    return 1;
+}
+
+/** move the queued packets to the shared memory ring or to the socket as long as they accept them without blocking,
+ *  large messages and the packets of their publishers behind them go to the streams, a stream gets a turn only when 
+ *  the queue is empty and the socket has taken everything, send lock must be held
+ *  @return  1 on success, 0 if the subscriber is not reachable anymore */
+int flush_remote_node(int remote_node)
+{
+    if ((s_remote_node_state[remote_node] != REMOTE_NODE_CONNECTED) && 
+        (s_remote_node_state[remote_node] != REMOTE_NODE_CLOSING)) return 1;   // the packets wait for the connection
+    set_remote_node_waiting_for_ring(remote_node, 0);
+    if (s_remote_node_doorbell_deferred[remote_node]) ring_doorbell_of_remote_node(remote_node);
+
+    int busy = 0;
+    while (s_remote_node_queue_head[remote_node])
+    {
+        queued_packet *q = s_remote_node_queue_head[remote_node];
+        message_stream *stream = (q->topic_id >= 0) ? find_message_stream(remote_node, q->topic_id) : 0;
+        if (stream || ((q->topic_id >= 0) && is_streamed_packet(q->packet)))
+        {
+            move_to_message_stream(remote_node, stream);
+            continue;
+        }
+        int sent = send_packet_to_remote_node(remote_node, q->packet);   // takes over the reference of the queue
+        if (sent == 0) return 0;
+        if (sent < 0)
+        {
+            busy = 1;
+            break;
+        }
+        dequeue_remote_node_packet(remote_node);
+    }
+    if (!busy && s_remote_node_streams_head[remote_node] && !s_remote_node_tx_head[remote_node] && 
+        !send_next_from_stream(remote_node)) return 0;
+
+    int ok = flush_remote_node_socket(remote_node);
+    // the next turn comes when the socket is writable again, unless the ring is full, then it is polled
+    if (ok && s_remote_node_streams_head[remote_node] && !s_remote_node_waiting_for_ring[remote_node])
+        watch_remote_node_output(remote_node, 1);
+    pthread_cond_broadcast(&s_remote_node_progress[remote_node]);
+    return ok;
+}
+
+/** throw away everything that waits for the remote node, send lock must be held */
+void drop_remote_node_queue(int remote_node)
+{
+    while (s_remote_node_queue_head[remote_node])
+    {
+        release_outbound_packet(s_remote_node_queue_head[remote_node]->packet);
+        dequeue_remote_node_packet(remote_node);
+    }
+    while (s_remote_node_streams_head[remote_node])
+    {
+        release_outbound_packet(s_remote_node_streams_head[remote_node]->head->packet);
+        remove_first_stream_packet(remote_node, s_remote_node_streams_head[remote_node]);
+    }
+    while (s_remote_node_tx_head[remote_node]) remove_first_tx_packet(remote_node);
+    s_remote_node_tx_sent[remote_node] = 0;
+    s_remote_node_tx_bytes[remote_node] = 0;
+    s_remote_node_doorbell_deferred[remote_node] = 0;
+    set_remote_node_waiting_for_ring(remote_node, 0);
+}
+
+/** the send thread counts the remote nodes it has to look after, send lock must be held */
+void set_remote_node_state(int remote_node, int state)
+{
+    int was_pending = (s_remote_node_state[remote_node] != REMOTE_NODE_CLOSED) && (s_remote_node_state[remote_node] != REMOTE_NODE_CONNECTED);
+    int pending = (state != REMOTE_NODE_CLOSED) && (state != REMOTE_NODE_CONNECTED);
+    s_remote_node_state[remote_node] = state;
+    if (pending != was_pending) atomic_fetch_add(&num_remote_nodes_not_connected, pending ? 1 : -1);
+}
+
+void deadline_after_ms(struct timespec *deadline, int ms)
+{
+    clock_gettime(CLOCK_MONOTONIC, deadline);
+    deadline->tv_sec += ms / 1000;
+    deadline->tv_nsec += (ms % 1000) * 1000000L;
+    if (deadline->tv_nsec >= 1000000000L) { deadline->tv_sec++; deadline->tv_nsec -= 1000000000L; }
+}
+
+/** close the socket and the rings of the remote node, send lock must be held */
+void close_remote_node_connection(int remote_node)
+{
+    if (s_remote_node_socket[remote_node] > 0)
+    {
+        epoll_ctl(publisher_epoll, EPOLL_CTL_DEL, s_remote_node_socket[remote_node], 0);
+        close(s_remote_node_socket[remote_node]);
+    }
+    s_remote_node_socket[remote_node] = -1;  // indicates reconnecting
+    s_remote_node_watching_output[remote_node] = 0;
+    if (s_remote_node_ring[remote_node]) deros_shm_ring_close(s_remote_node_ring[remote_node]);
+    s_remote_node_ring[remote_node] = 0;
+    if (s_remote_node_attaching_ring[remote_node])
+    {
+        deros_shm_ring_unlink(s_remote_node_attaching_ring[remote_node]);
+        deros_shm_ring_close(s_remote_node_attaching_ring[remote_node]);
+    }
+    s_remote_node_attaching_ring[remote_node] = 0;
+}
+
+/** the next attempt to connect comes after the backoff, which doubles, send lock must be held */
+void wait_before_reconnecting(int remote_node)
+{
+    set_remote_node_state(remote_node, REMOTE_NODE_WAITING);
+    deadline_after_ms(&s_remote_node_deadline[remote_node], s_remote_node_backoff_ms[remote_node]);
+    s_remote_node_backoff_ms[remote_node] *= 2;
+    if (s_remote_node_backoff_ms[remote_node] > RECONNECT_MAX_BACKOFF_MS) s_remote_node_backoff_ms[remote_node] = RECONNECT_MAX_BACKOFF_MS;
+    if (publisher_wakeup >= 0) wake_up_publisher_send_thread();
+}
+
+/** drop what waits for the remote node and close its connection for good, send lock must be held */
+void shut_remote_node(int remote_node)
+{
+    drop_remote_node_queue(remote_node);
+    close_remote_node_connection(remote_node);
+    set_remote_node_state(remote_node, REMOTE_NODE_CLOSED);
+    s_remote_node_socket[remote_node] = 0;
+    pthread_cond_broadcast(&s_remote_node_progress[remote_node]);
+}
+
+/** a closing remote node is shut as soon as its queued packets have left, send lock must be held */
+void finish_closing_remote_node(int remote_node)
+{
+    if ((s_remote_node_state[remote_node] == REMOTE_NODE_CLOSING) &&
+        !s_remote_node_queue_head[remote_node] && !s_remote_node_streams_head[remote_node] && !s_remote_node_tx_head[remote_node] && 
+        !s_remote_node_doorbell_deferred[remote_node])
+        shut_remote_node(remote_node);
+}
+
+/** the subscriber node is not reachable, drop what waits for it and let the send thread connect it again later, 
+ *  publishers skip it meanwhile (a closing node is not connected again), send lock must be held */
+void fail_remote_node(int remote_node)
+{
+    if (s_remote_node_state[remote_node] == REMOTE_NODE_WAITING) return;
+    if (s_remote_node_state[remote_node] == REMOTE_NODE_CLOSING)
+    {
+        shut_remote_node(remote_node);
+        return;
+    }
+    if (!s_remote_node_failed[remote_node])
+        deros_dbglog_msg_str_int(D_WARN, "pub", "publisher", "subscriber node not reachable, its messages are dropped until it is reconnected (dstip,dstport)", s_remote_node_IP[remote_node], s_remote_node_port[remote_node]);
+    else
+        deros_dbglog_msg_str_int(D_DEBG, "pub", "publisher", "reconnecting subscriber node failed (dstip,dstport)", s_remote_node_IP[remote_node], s_remote_node_port[remote_node]);
+    s_remote_node_failed[remote_node] = 1;
+    drop_remote_node_queue(remote_node);
+    close_remote_node_connection(remote_node);
+    wait_before_reconnecting(remote_node);
+    pthread_cond_broadcast(&s_remote_node_progress[remote_node]);
+}
+
+/** subscriber nodes only send heartbeats after the connection is set up, they are read and dropped,
+ *  otherwise readable socket means it was closed
+ *  @return  1 if the subscriber node has closed the connection */
+int remote_node_closed(int remote_node)
+{
+    uint8_t buf[64];
+    int n = recv(s_remote_node_socket[remote_node], buf, sizeof(buf), MSG_DONTWAIT);
+    if (n > 0)
+    {
+        s_remote_node_heard_ms[remote_node] = deros_monotonic_ms();
+        return 0;
+    }
+    if ((n < 0) && ((errno == EAGAIN) || (errno == EWOULDBLOCK) || (errno == EINTR))) return 0;
+    return 1;
+}
+
+/** send everything the node has collected while it was corked
+ *  @param uncork  the node stops collecting the messages
+ *  @return  1 on success, 0 if some subscriber node is not reachable */
+int flush_corked_node(int node_id, int uncork)
+{
+    int dirty[MAX_NUM_REMOTE_SUBSCRIBERS];
+
+    pthread_mutex_lock(&cork_lock);
+    if (uncork) node_corked[node_id] = 0;
+    int num_dirty = node_num_dirty_remotes[node_id];
+    for (int i = 0; i < num_dirty; i++)
+    {
+        dirty[i] = node_dirty_remotes[node_id][i];
+        node_remote_is_dirty[node_id][dirty[i]] = 0;
+    }
+    node_num_dirty_remotes[node_id] = 0;
+    node_corked_bytes[node_id] = 0;
+    pthread_mutex_unlock(&cork_lock);
+
+    int ok = 1;
+    for (int i = 0; i < num_dirty; i++)
+    {
+        int remote_node = dirty[i];
+        pthread_mutex_lock(&s_remote_node_send_lock[remote_node]);
+        if ((s_remote_node_socket[remote_node] > 0) && !s_remote_node_failed[remote_node] && !flush_remote_node(remote_node))
+            fail_remote_node(remote_node);
+        if (s_remote_node_failed[remote_node]) ok = 0;
+        pthread_mutex_unlock(&s_remote_node_send_lock[remote_node]);
+    }
+    return ok;
+}
+
+/** append the packet (with the reference of the caller) to the queue of the remote node, it does not count in the queue
+ *  of any publisher and it is never dropped, send lock must be held */
+void queue_unlimited_packet(int remote_node, int topic_id, outbound_packet *packet)
+{
+    queued_packet *q = (queued_packet *) malloc(sizeof(queued_packet));
+    if (!q) deros_pub_mem_failure("queue packet");
+    q->packet = packet;
+    q->pub_id = -1;
+    q->topic_id = topic_id;
+    q->next = 0;
+    if (s_remote_node_queue_tail[remote_node]) s_remote_node_queue_tail[remote_node]->next = q;
+    else s_remote_node_queue_head[remote_node] = q;
+    s_remote_node_queue_tail[remote_node] = q;
+}
+
+/** append a control packet to the queue of the remote node, control packets are never dropped, send lock must be held
+ *  @param topic_id  the packet keeps its order with the messages of this publisher, -1 if it does not matter */
+void queue_control_packet(int remote_node, int topic_id, uint8_t packet_type, uint8_t *part1, int len1, uint8_t *part2, int len2)
+{
+    queue_unlimited_packet(remote_node, topic_id, new_outbound_packet(packet_type, part1, len1, part2, len2, 1));
+}
+
+/** queue the packet that tells the subscriber node which address the publisher sends under its topic id (that is 
+ *  the publisher id), a previous publisher with the same id may still be streaming its large message, send lock must be held */
+void queue_topic_bind(int remote_node, int pub_id)
+{
+    uint8_t topic_id[4];
+    deros_store_uint(topic_id, pub_id);
+    char *adres = publisher_address[pub_id];
+    queue_control_packet(remote_node, pub_id, PACKET_TOPIC_BIND, topic_id, 4, (uint8_t *)adres, strlen(adres));
+}
+
+/** the subscriber node can take the packets now, after a reconnect the topics of its publishers are bound again, send lock must be held
+ *  @return  1 on success, 0 if the subscriber node is not reachable */
+int remote_node_ready(int remote_node)
+{
+    set_remote_node_state(remote_node, REMOTE_NODE_CONNECTED);
+    s_remote_node_backoff_ms[remote_node] = RECONNECT_MIN_BACKOFF_MS;
+    s_remote_node_heard_ms[remote_node] = s_remote_node_heartbeat_ms[remote_node] = deros_monotonic_ms();
+    s_remote_node_sent_in_interval[remote_node] = 0;
+    next_heartbeat_check_ms = 0;
+    if (s_remote_node_failed[remote_node])
+    {
+        s_remote_node_failed[remote_node] = 0;
+        for (int pub_id = 0; pub_id < next_publisher_id; pub_id++)
+            if (s_remote_node_topic_bound[remote_node][pub_id]) queue_topic_bind(remote_node, pub_id);
+        deros_dbglog_msg_str_int(D_INFO, "pub", "publisher", "subscriber node reconnected (dstip,dstport)", s_remote_node_IP[remote_node], s_remote_node_port[remote_node]);
+    }
+    int ok = flush_remote_node(remote_node);
+    pthread_cond_broadcast(&s_remote_node_progress[remote_node]);
+    return ok;
+}
+
+/** the subscriber node has answered whether it attached the shared memory ring (or it did not answer in time), send lock must be held
+ *  @return  1 on success, 0 if the subscriber node is not reachable */
+int finish_ring_attach(int remote_node, int attached)
+{
+    deros_shm_ring *ring = s_remote_node_attaching_ring[remote_node];
+    s_remote_node_attaching_ring[remote_node] = 0;
+    deros_shm_ring_unlink(ring);   // both sides have it mapped now, or it is not going to be used
+    if (attached)
+    {
+        deros_dbglog_msg_str(D_INFO, "shm", "publisher", "pushing messages through shared memory ring", ring->name);
+        s_remote_node_ring[remote_node] = ring;
+    }
+    else
+    {
+        deros_dbglog_msg_str(D_WARN, "shm", "publisher", "subscriber did not attach shared memory ring, using TCP", ring->name);
+        deros_shm_ring_close(ring);
+    }
+    return remote_node_ready(remote_node);
+}
+
+/** read the answer to the shared memory ring offer when it has arrived whole, send lock must be held
+ *  @return  1 on success (also if the answer is not complete yet), 0 if the subscriber node is not reachable */
+int receive_ring_attach_answer(int remote_node)
+{
+    uint8_t answer[PACKET_FRAMING + 1];
+    unsigned int length;
+    int n;
+    while (1)
+    {
+        n = recv(s_remote_node_socket[remote_node], answer, sizeof(answer), MSG_PEEK | MSG_DONTWAIT);
+        if ((n < 0) && ((errno == EAGAIN) || (errno == EWOULDBLOCK) || (errno == EINTR))) return 1;
+        if (n <= 0) return 0;
+        deros_retrieve_uint(answer, &length);
+        // a heartbeat may come first if the subscriber node was slow to answer
+        if ((n < PACKET_FRAMING) || (length != 0) || (answer[PACKET_FRAMING - 1] != PACKET_HEARTBEAT)) break;
+        if (recv(s_remote_node_socket[remote_node], answer, PACKET_FRAMING, MSG_DONTWAIT) != PACKET_FRAMING) return 0;
+    }
+    if (n < (int)sizeof(answer)) return 1;
+    if (recv(s_remote_node_socket[remote_node], answer, sizeof(answer), MSG_DONTWAIT) != sizeof(answer)) return 0;
+
+    return finish_ring_attach(remote_node, (length == 1) && (answer[PACKET_FRAMING - 1] == PACKET_SHM_ATTACHED) && (answer[PACKET_FRAMING] == '1'));
+}
+
+/** the connection is established, a subscriber node on the same host is offered a shared memory ring first: messages are pushed
+ *  through it instead of the socket, the socket remains for waking up the subscriber and for messages that do not fit, 
+ *  send lock must be held
+ *  @return  1 on success, 0 if the subscriber node is not reachable */
+int remote_node_connected(int remote_node)
+{
+    deros_shm_ring *ring = s_remote_node_colocated[remote_node] ? deros_shm_ring_create(SHM_RING_CAPACITY) : 0;
+    if (!ring) return remote_node_ready(remote_node);
+
+    s_remote_node_attaching_ring[remote_node] = ring;
+    if (!deros_send_packet(s_remote_node_socket[remote_node], PACKET_SHM_ATTACH, (uint8_t *)ring->name, strlen(ring->name))) return 0;
+    set_remote_node_state(remote_node, REMOTE_NODE_ATTACHING);
+    deadline_after_ms(&s_remote_node_deadline[remote_node], SHM_ATTACH_TIMEOUT_MS);
+    watch_remote_node_output(remote_node, 0);
+    return 1;
+}
+
+/** start connecting to the subscriber node without waiting, the send thread finishes it, the connection carries the messages 
+ *  of publishers of one priority class, high and low priority connections mark their packets for the network (SO_PRIORITY and DSCP),
+ *  send lock must be held
+ *  @return  1 on success, 0 if the connection could not be started */
+int connect_remote_node(int remote_node)
+{
+    int port = s_remote_node_port[remote_node];
+    int priority = s_remote_node_priority[remote_node];
+    int in_progress = 0;
+
+    // nodes on the same host are reached through their Unix domain socket if possible
+    int sock = s_remote_node_colocated[remote_node] ? deros_connect_to_local_node(port) : 0;
+    int local = (sock != 0);
+    if (local && !deros_set_nonblocking(sock))
+    {
+        close(sock);
+        return 0;
+    }
+    if (!sock) sock = deros_start_connect(s_remote_node_IP[remote_node], port, &in_progress);
+    if (!sock) return 0;
+    deros_apply_socket_options(sock, &node_socket_options[s_remote_node_node_id[remote_node]]);
+    if (!local)
+    {
+        int unsent_limit = PUBLISHER_UNSENT_LIMIT;
+        setsockopt(sock, IPPROTO_TCP, TCP_NOTSENT_LOWAT, &unsent_limit, sizeof(unsent_limit));
+        if (priority == DEROS_PRIORITY_HIGH) deros_set_traffic_class(sock, HIGH_PRIORITY_SOCKET_PRIORITY, HIGH_PRIORITY_DSCP);
+        else if (priority == DEROS_PRIORITY_LOW) deros_set_traffic_class(sock, LOW_PRIORITY_SOCKET_PRIORITY, LOW_PRIORITY_DSCP);
+    }
+
+    s_remote_node_socket[remote_node] = sock;
+    s_remote_node_local[remote_node] = local;
+    set_remote_node_state(remote_node, REMOTE_NODE_CONNECTING);
+    deadline_after_ms(&s_remote_node_deadline[remote_node], REMOTE_NODE_CONNECT_TIMEOUT_MS);
+
+    // writable socket tells that the connection is established (or that it failed)
+    struct epoll_event ev;
+    ev.events = EPOLLIN | EPOLLRDHUP | EPOLLOUT;
+    ev.data.u32 = remote_node;
+    s_remote_node_watching_output[remote_node] = 1;
+    if (epoll_ctl(publisher_epoll, EPOLL_CTL_ADD, sock, &ev) < 0)
+        deros_dbglog_msg_int(D_ERRR, "sys", "publisher", "could not watch subscriber connection, errno=", errno);
+    wake_up_publisher_send_thread();   // to watch the deadline
+
+    if (!in_progress && !remote_node_connected(remote_node))
+    {
+        close_remote_node_connection(remote_node);
+        return 0;
+    }
+    return 1;
+}
+
+/** the subscriber node has registered again, it does not wait for the next attempt to reconnect it */
+void reconnect_remote_node_now(int remote_node)
+{
+    pthread_mutex_lock(&s_remote_node_send_lock[remote_node]);
+    if (s_remote_node_state[remote_node] == REMOTE_NODE_WAITING)
+    {
+        s_remote_node_backoff_ms[remote_node] = RECONNECT_MIN_BACKOFF_MS;
+        clock_gettime(CLOCK_MONOTONIC, &s_remote_node_deadline[remote_node]);
+        wake_up_publisher_send_thread();
+    }
+    pthread_mutex_unlock(&s_remote_node_send_lock[remote_node]);
+}
+
+/** make the connection attempts that are due, give up those that take too long, and close the closing remote nodes
+ *  whose close deadline has passed
+ *  @return  milliseconds until the next deadline, -1 if there is none */
+int manage_remote_node_connections()
+{
+    if (!atomic_load(&num_remote_nodes_not_connected)) return -1;
+    int timeout = -1;
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    for (int remote_node = 0; remote_node < next_remote_node_id; remote_node++)
+    {
+        pthread_mutex_lock(&s_remote_node_send_lock[remote_node]);
+        struct timespec *deadline = &s_remote_node_deadline[remote_node];
+        for (int turn = 0; turn < 2; turn++)
+        {
+            int state = s_remote_node_state[remote_node];
+            if ((state == REMOTE_NODE_CLOSED) || (state == REMOTE_NODE_CONNECTED)) break;
+            long left_ms = (deadline->tv_sec - now.tv_sec) * 1000L + (deadline->tv_nsec - now.tv_nsec) / 1000000L;
+            if ((left_ms > 0) || (turn > 0))
+            {
+                if (left_ms < 0) left_ms = 0;
+                if ((timeout < 0) || (left_ms < timeout)) timeout = left_ms;
+                break;
+            }
+            if (state == REMOTE_NODE_WAITING)
+            {
+                if (!connect_remote_node(remote_node)) wait_before_reconnecting(remote_node);
+            }
+            else if (state == REMOTE_NODE_ATTACHING)
+            {
+                if (!finish_ring_attach(remote_node, 0)) fail_remote_node(remote_node);
+            }
+            else if (state == REMOTE_NODE_CLOSING) shut_remote_node(remote_node);
+            else fail_remote_node(remote_node);   // connect takes too long
+        }
+        pthread_mutex_unlock(&s_remote_node_send_lock[remote_node]);
+    }
+    return timeout;
+}
+
+/** send a heartbeat to each connected subscriber node whose socket has carried nothing for the heartbeat interval of its node,
+ *  and give up the subscriber nodes that have not sent their heartbeats for the heartbeat timeout, 
+ *  publishers do not queue messages for dead nodes then
+ *  @return  milliseconds until the next heartbeat or timeout, -1 if there is none */
+int manage_remote_node_heartbeats()
+{
+    long long now = deros_monotonic_ms();
+    if (now < next_heartbeat_check_ms) return (int)(next_heartbeat_check_ms - now);
+    int timeout = -1;
+
+    for (int remote_node = 0; remote_node < next_remote_node_id; remote_node++)
+    {
+        int node_id = s_remote_node_node_id[remote_node];
+        int interval_ms = node_heartbeat_interval_ms[node_id];
+        if (!interval_ms || (s_remote_node_state[remote_node] != REMOTE_NODE_CONNECTED)) continue;
+
+        pthread_mutex_lock(&s_remote_node_send_lock[remote_node]);
+        int timeout_ms = node_heartbeat_timeout_ms[node_id];
+        int connected = (s_remote_node_state[remote_node] == REMOTE_NODE_CONNECTED) && (s_remote_node_socket[remote_node] > 0);
+        if (connected && (now - s_remote_node_heard_ms[remote_node] > timeout_ms))
+        {
+            deros_dbglog_msg_str_int(D_WARN, "pub", "publisher", "subscriber node has been silent for too long (dstip,dstport)", s_remote_node_IP[remote_node], s_remote_node_port[remote_node]);
+            fail_remote_node(remote_node);
+        }
+        else if (connected)
+        {
+            if (now - s_remote_node_heartbeat_ms[remote_node] >= interval_ms)
+            {
+                if (!s_remote_node_sent_in_interval[remote_node] && !s_remote_node_tx_head[remote_node])
+                {
+                    atomic_fetch_add(&heartbeat_packet->refs, 1);
+                    append_to_remote_node_tx(remote_node, heartbeat_packet);
+                    if (!flush_remote_node_socket(remote_node)) fail_remote_node(remote_node);
+                }
+                s_remote_node_sent_in_interval[remote_node] = 0;
+                s_remote_node_heartbeat_ms[remote_node] = now;
+            }
+            long long wake_ms = s_remote_node_heartbeat_ms[remote_node] + interval_ms;
+            long long deadline_ms = s_remote_node_heard_ms[remote_node] + timeout_ms + 1;
+            if (deadline_ms < wake_ms) wake_ms = deadline_ms;
+            if ((timeout < 0) || (wake_ms - now < timeout)) timeout = (int)(wake_ms - now);
+        }
+        pthread_mutex_unlock(&s_remote_node_send_lock[remote_node]);
+    }
+    next_heartbeat_check_ms = (timeout < 0) ? 0 : now + timeout;
+    return timeout;
+}
+
+/** flush the corked nodes that hold their messages for too long
+ *  @return  milliseconds until the next corked node should be flushed, -1 if there is none */
+int flush_expired_corked_nodes()
+{
+    int timeout = -1;
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    for (int node_id = 0; node_id < next_free_node_id; node_id++)
+    {
+        pthread_mutex_lock(&cork_lock);
+        int waiting = node_corked[node_id] && (node_autoflush_delay_ms[node_id] > 0) && node_num_dirty_remotes[node_id];
+        long left_ms = 0;
+        if (waiting)
+            left_ms = node_autoflush_delay_ms[node_id] - ((now.tv_sec - node_corked_since[node_id].tv_sec) * 1000L + 
+                                                          (now.tv_nsec - node_corked_since[node_id].tv_nsec) / 1000000L);
+        pthread_mutex_unlock(&cork_lock);
+
+        if (!waiting) continue;
+        if (left_ms <= 0) flush_corked_node(node_id, 0);
+        else if ((timeout < 0) || (left_ms < timeout)) timeout = left_ms;
+    }
+    return timeout;
+}
+
+/** a single thread of the process sends the queued packets in the background, as the sockets and rings of the remote nodes accept them,
+ *  connects the remote nodes (again, after they have failed), and flushes corked nodes when their time limit is over */
+void *publisher_send_thread(void *args)
+{
+    struct epoll_event events[PUBLISHER_MAX_EPOLL_EVENTS];
+
+    while (1)
+    {
+        // rings do not notify about free space, they are polled while some remote node waits for one
+        int timeout = flush_expired_corked_nodes();
+        int connect_timeout = manage_remote_node_connections();
+        if ((connect_timeout >= 0) && ((timeout < 0) || (connect_timeout < timeout))) timeout = connect_timeout;
+        int heartbeat_timeout = manage_remote_node_heartbeats();
+        if ((heartbeat_timeout >= 0) && ((timeout < 0) || (heartbeat_timeout < timeout))) timeout = heartbeat_timeout;
+        if (atomic_load(&num_remote_nodes_waiting_for_ring) && ((timeout < 0) || (timeout > 1))) timeout = 1;
+        int n = epoll_wait(publisher_epoll, events, PUBLISHER_MAX_EPOLL_EVENTS, timeout);
+        if (n < 0)
+        {
+            if (errno == EINTR) continue;
+            deros_dbglog_msg_int(D_ERRR, "sys", "publisher", "epoll_wait failed, errno=", errno);
+            break;
+        }
+        for (int i = 0; i < n; i++)
+        {
+            int remote_node = events[i].data.u32;
+            if (remote_node == MAX_NUM_REMOTE_SUBSCRIBERS)
+            {
+                uint64_t count;
+                while (read(publisher_wakeup, &count, sizeof(count)) > 0);
+                continue;
+            }
+            pthread_mutex_lock(&s_remote_node_send_lock[remote_node]);
+            if (s_remote_node_state[remote_node] == REMOTE_NODE_CONNECTING)
+            {
+                if (!deros_connect_result(s_remote_node_socket[remote_node]) || !remote_node_connected(remote_node))
+                    fail_remote_node(remote_node);
+            }
+            else if (s_remote_node_state[remote_node] == REMOTE_NODE_ATTACHING)
+            {
+                if (!receive_ring_attach_answer(remote_node)) fail_remote_node(remote_node);
+            }
+            else if (((s_remote_node_state[remote_node] == REMOTE_NODE_CONNECTED) || (s_remote_node_state[remote_node] == REMOTE_NODE_CLOSING)) &&
+                     (s_remote_node_socket[remote_node] > 0))
+            {
+                if ((events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) && remote_node_closed(remote_node))
+                    fail_remote_node(remote_node);
+                else if (!flush_remote_node(remote_node))
+                    fail_remote_node(remote_node);
+                else finish_closing_remote_node(remote_node);
+            }
+            pthread_mutex_unlock(&s_remote_node_send_lock[remote_node]);
+        }
+        if (atomic_load(&num_remote_nodes_waiting_for_ring))
+            for (int remote_node = 0; remote_node < next_remote_node_id; remote_node++)
+            {
+                if (!s_remote_node_waiting_for_ring[remote_node]) continue;
+                pthread_mutex_lock(&s_remote_node_send_lock[remote_node]);
+                if (s_remote_node_waiting_for_ring[remote_node] && !s_remote_node_failed[remote_node])
+                {
+                    if (!flush_remote_node(remote_node)) fail_remote_node(remote_node);
+                    else finish_closing_remote_node(remote_node);
+                }
+                pthread_mutex_unlock(&s_remote_node_send_lock[remote_node]);
+            }
+    }
+    deros_dbglog_msg(D_INFO, "sys", "publisher", "publisher send thread terminates");
+    return 0;
+}
+
+/** the background send thread is started with the first remote node */
+void start_publisher_send_thread()
+{
+    publisher_epoll = epoll_create1(0);
+    publisher_wakeup = eventfd(0, EFD_NONBLOCK);
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.u32 = MAX_NUM_REMOTE_SUBSCRIBERS;
+    if ((publisher_epoll < 0) || (publisher_wakeup < 0) || (epoll_ctl(publisher_epoll, EPOLL_CTL_ADD, publisher_wakeup, &ev) < 0))
+    {
+        deros_dbglog_msg_int(D_GRRR, "sys", "publisher", "could not create epoll instance", errno);
+        exit(1);
+    }
+    doorbell_packet = alloc_outbound_packet(0, 1);
+    frame_outbound_packet(doorbell_packet, PACKET_SHM_DOORBELL);
+    heartbeat_packet = alloc_outbound_packet(0, 1);
+    frame_outbound_packet(heartbeat_packet, PACKET_HEARTBEAT);
+
+    pthread_t thr;
+    if (pthread_create(&thr, 0, publisher_send_thread, 0) != 0)
+    {
+        deros_dbglog_msg_int(D_GRRR, "sys", "publisher", "could not create publisher send thread", errno);
+        exit(1);
+    }
+}
+
+/** @return  1 if the slot of the remote node is free, a closing one is free once the send thread has closed it */
+int remote_node_slot_free(int remote_node)
+{
+    if (s_remote_node_port[remote_node] == 0) return 1;
+    if (!s_remote_node_closing[remote_node]) return 0;
+    pthread_mutex_lock(&s_remote_node_send_lock[remote_node]);
+    int closed = (s_remote_node_state[remote_node] == REMOTE_NODE_CLOSED);
+    pthread_mutex_unlock(&s_remote_node_send_lock[remote_node]);
+    return closed;
+}
+
+/** a new subscriber node, it is connected in the background, meanwhile the packets for it wait in its queue, 
+ *  remote_nodes_lock must be held
+ *  @return  the new remote node, or -1 if the connection could not be started */
+int add_remote_node(int node_id, char *ip, int port, int colocated, int priority)
+{
+    if (publisher_epoll < 0) start_publisher_send_thread();
+
+    int i;
+    for (i = 0; i < next_remote_node_id; i++)
+        if (remote_node_slot_free(i))
+            break;
+    if (i == MAX_NUM_REMOTE_SUBSCRIBERS) return -1;
+    if (i == next_remote_node_id) 
+    {
+        pthread_mutex_init(&s_remote_node_send_lock[i], 0);
+        pthread_cond_init(&s_remote_node_progress[i], 0);
+        s_remote_node_queued_of_pub[i] = (int *) malloc(sizeof(int) * MAX_NUM_PUBLISHERS);
+        s_remote_node_topic_bound[i] = (uint8_t *) malloc(MAX_NUM_PUBLISHERS);
+        if (!s_remote_node_queued_of_pub[i] || !s_remote_node_topic_bound[i]) deros_pub_mem_failure("add remote node");
+        next_remote_node_id++;
+    }
+
+    char *ip_copy = (char *) malloc(strlen(ip) + 1);
+    if (!ip_copy) deros_pub_mem_failure("add remote node ip");
+    strcpy(ip_copy, ip);
+
+    pthread_mutex_lock(&s_remote_node_send_lock[i]);
+    free(s_remote_node_IP[i]);   // of the closed remote node that had the slot before
+    s_remote_node_closing[i] = 0;
+    s_remote_node_generation[i]++;
+    s_remote_node_port[i] = port;
+    s_remote_node_priority[i] = priority;
+    s_remote_node_colocated[i] = colocated;
+    s_remote_node_node_id[i] = node_id;
+    s_remote_node_IP[i] = ip_copy;
+    s_remote_node_socket[i] = 0;
+    s_remote_node_local[i] = 0;
+    s_remote_node_ring[i] = 0;
+    s_remote_node_attaching_ring[i] = 0;
+    s_remote_node_used_by_num_pubs[i] = 0;
+    s_remote_node_queue_head[i] = s_remote_node_queue_tail[i] = 0;
+    memset(s_remote_node_queued_of_pub[i], 0, sizeof(int) * MAX_NUM_PUBLISHERS);
+    memset(s_remote_node_topic_bound[i], 0, MAX_NUM_PUBLISHERS);
+    s_remote_node_tx_head[i] = s_remote_node_tx_tail[i] = 0;
+    s_remote_node_tx_sent[i] = 0;
+    s_remote_node_tx_bytes[i] = 0;
+    s_remote_node_streams_head[i] = s_remote_node_streams_tail[i] = 0;
+    s_remote_node_doorbell_queued[i] = 0;
+    s_remote_node_doorbell_deferred[i] = 0;
+    s_remote_node_waiting_for_ring[i] = 0;
+    s_remote_node_watching_output[i] = 0;
+    s_remote_node_failed[i] = 0;
+    s_remote_node_backoff_ms[i] = RECONNECT_MIN_BACKOFF_MS;
+
+    int ok = connect_remote_node(i);
+    if (!ok)
+    {
+        set_remote_node_state(i, REMOTE_NODE_CLOSED);
+        s_remote_node_port[i] = 0;
+        s_remote_node_IP[i] = 0;
+        free(ip_copy);
+    }
+    pthread_mutex_unlock(&s_remote_node_send_lock[i]);
+
+    return ok ? i : -1;
+}
+
+/** the last publisher does not need the remote node anymore, the send thread gives the queued packets a chance to leave
+ *  until the close deadline and closes the connection then, the caller does not wait for it, remote_nodes_lock must be held */
+void close_remote_node(int remote_node)
+{
+    pthread_mutex_lock(&s_remote_node_send_lock[remote_node]);
+    s_remote_node_closing[remote_node] = 1;
+
+    // messages of corked nodes may wait without anybody pushing them
+    if ((s_remote_node_state[remote_node] == REMOTE_NODE_CONNECTED) && (s_remote_node_socket[remote_node] > 0) && 
+        flush_remote_node(remote_node))
+    {
+        set_remote_node_state(remote_node, REMOTE_NODE_CLOSING);
+        deadline_after_ms(&s_remote_node_deadline[remote_node], REMOTE_NODE_CLOSE_TIMEOUT_MS);
+        finish_closing_remote_node(remote_node);
+        if (s_remote_node_state[remote_node] == REMOTE_NODE_CLOSING) wake_up_publisher_send_thread();   // to watch the deadline
+    }
+    else shut_remote_node(remote_node);
+
+    pthread_mutex_unlock(&s_remote_node_send_lock[remote_node]);
+}
+
+int publisher_register(int node_id, char *address, int message_size, int message_queue_size)
+{
+    return publisher_register_with_transport(node_id, address, message_size, message_queue_size, DEROS_TRANSPORT_TCP);
+}
+
+int publisher_register_with_transport(int node_id, char *address, int message_size, int message_queue_size, int transport)
+{
+    if ((strlen(address) > MAX_ADDRESS_LENGTH) || address_is_pattern(address)) return -1;
+    if ((transport < DEROS_TRANSPORT_TCP) || (transport > DEROS_TRANSPORT_MULTICAST)) return -1;
+    if (pthread_mutex_lock(&node_mutexes[node_id])) return -1;
+
+    if (!node_active[node_id])
+    {
+        pthread_mutex_unlock(&node_mutexes[node_id]); 
+        return -1;
+    }
+
+    int pub_id = 0;
+    while (pub_id < next_publisher_id)
+    {
+        if (publisher_address[pub_id] == 0) break;
+        pub_id++;
+    }
+    if (pub_id == next_publisher_id) 
+    {
+        next_publisher_id++;
+        deros_dbglog_msg_int(D_DEBG, node_names[node_id], "publisher", "increased next_publisher_id to", next_publisher_id);
+    }
+
+    char *adres = (char *)malloc(strlen(address) + 1);
+    if (!adres) deros_pub_mem_failure("pub register adr");
+    strcpy(adres, address);
+    publisher_node_id[pub_id] = node_id;
+    publisher_pretty_printer[pub_id] = 0;
+    publisher_log_enabled[pub_id] = 0;
+    publisher_log_initialized[pub_id] = 0;
+    pthread_mutex_init(&publisher_log_lock[pub_id], 0);
+    pthread_mutex_init(&publisher_history_lock[pub_id], 0);
+    publisher_history[pub_id] = 0;
+    publisher_history_depth[pub_id] = 0;
+    publisher_history_count[pub_id] = 0;
+    publisher_history_next[pub_id] = 0;
+    publisher_msgsize[pub_id] = message_size;
+    publisher_msgqueue_size[pub_id] = (message_queue_size > 0) ? message_queue_size : 1;
+    publisher_queue_policy[pub_id] = DEROS_QUEUE_DROP_OLDEST;
+    publisher_block_timeout_ms[pub_id] = DEFAULT_QUEUE_BLOCK_TIMEOUT_MS;
+    publisher_priority[pub_id] = DEROS_PRIORITY_NORMAL;
+    publisher_seq[pub_id] = 0;
+    subscribed_remote_node_ids[pub_id] = 0;
+    num_sub_remote_nodes[pub_id] = 0;
+    subscribed_local_node_ids[pub_id] = 0;
+    num_sub_local_nodes[pub_id] = 0;
+    publisher_udp_subs[pub_id] = 0;
+    num_udp_subs[pub_id] = 0;
+    publisher_multicast_subs[pub_id] = 0;
+    num_multicast_subs[pub_id] = 0;
+    publisher_datagrams_dropped[pub_id] = 0;
+    memset(&publisher_multicast_group[pub_id], 0, sizeof(struct sockaddr_in));
+    publisher_multicast_group[pub_id].sin_family = AF_INET;
+    publisher_multicast_group[pub_id].sin_port = htons(DEROS_MULTICAST_PORT);
+    address_multicast_group(address, &publisher_multicast_group[pub_id].sin_addr);
+    publisher_local_adr_id[pub_id] = find_or_insert_address(adres);
+
+    // the publisher must be ready before the register packet leaves, the server answers with its subscribers immediately
+    pthread_mutex_lock(&remote_nodes_lock);
+    publisher_address[pub_id] = adres;
+    update_publisher_destinations(pub_id);
+    num_publishers++;
+    pthread_mutex_unlock(&remote_nodes_lock);
+
+    publisher_transport[pub_id] = (transport == DEROS_TRANSPORT_TCP) ? DEROS_TRANSPORT_TCP : DEROS_TRANSPORT_UDP;
+    char size_prefix[24];
+    int prefix_len = sprintf(size_prefix, "%d!%d!", message_size, publisher_transport[pub_id]);
+    send_registration_to_server(node_id, PACKET_PUB_REGISTER, (uint8_t *)size_prefix, prefix_len, (uint8_t *)address, strlen(address));
+    deros_dbglog_msg(D_DEBG, node_names[node_id], "publisher", "sent register publisher packet");
+
+    pthread_mutex_unlock(&node_mutexes[node_id]);
+    return pub_id;
+}
+
+int publisher_set_queue_policy(int publisher_id, int policy, int block_timeout_ms)
+{
+    if ((publisher_id < 0) || (publisher_id >= next_publisher_id) ||
+        (publisher_address[publisher_id] == 0)) return 0;
+    if ((policy != DEROS_QUEUE_DROP_OLDEST) && (policy != DEROS_QUEUE_DROP_NEWEST) && (policy != DEROS_QUEUE_BLOCK)) return 0;
+    if (block_timeout_ms < 0) return 0;
+    publisher_queue_policy[publisher_id] = policy;
+    publisher_block_timeout_ms[publisher_id] = block_timeout_ms;
+    return 1;
+}
+
+/** bind the topic of the publisher at the subscriber node, also every time the node is reconnected
+ *  @return  1 (a subscriber node that is not reachable now gets the bind when it is reconnected) */
+int bind_topic_at_remote_node(int pub_id, int remote_node)
+{
+    pthread_mutex_lock(&s_remote_node_send_lock[remote_node]);
+    s_remote_node_topic_bound[remote_node][pub_id] = 1;
+    if (!s_remote_node_failed[remote_node])
+    {
+        queue_topic_bind(remote_node, pub_id);
+        if (!flush_remote_node(remote_node)) fail_remote_node(remote_node);
+    }
+    pthread_mutex_unlock(&s_remote_node_send_lock[remote_node]);
+    return 1;
+}
+
+/** the publisher does not send to the subscriber node anymore */
+void unbind_topic_at_remote_node(int pub_id, int remote_node)
+{
+    pthread_mutex_lock(&s_remote_node_send_lock[remote_node]);
+    s_remote_node_topic_bound[remote_node][pub_id] = 0;
+    pthread_mutex_unlock(&s_remote_node_send_lock[remote_node]);
+}
+
+/** the publisher moves to the connections of its new priority class, remote_nodes_lock must be held
+ *  @return  1 on success, 0 if it could not move to some subscriber node (it stays in its old connection) */
+int move_publisher_to_priority_class(int pub_id)
+{
+    int ok = 1;
+    int priority = publisher_priority[pub_id];
+    for (int i = 0; i < num_sub_remote_nodes[pub_id]; i++)
+    {
+        int old_node = subscribed_remote_node_ids[pub_id][i];
+        if (s_remote_node_priority[old_node] == priority) continue;
+
+        int new_node = find_remote_node(s_remote_node_IP[old_node], s_remote_node_port[old_node], priority);
+        if (new_node < 0) new_node = add_remote_node(publisher_node_id[pub_id], s_remote_node_IP[old_node], s_remote_node_port[old_node], 
+                                                     s_remote_node_colocated[old_node], priority);
+        if ((new_node < 0) || !bind_topic_at_remote_node(pub_id, new_node))
+        {
+            if ((new_node >= 0) && (s_remote_node_used_by_num_pubs[new_node] == 0)) close_remote_node(new_node);
+            ok = 0;
+            continue;
+        }
+        s_remote_node_used_by_num_pubs[new_node]++;
+        subscribed_remote_node_ids[pub_id][i] = new_node;
+        update_publisher_destinations(pub_id);
+        unbind_topic_at_remote_node(pub_id, old_node);
+        if (--s_remote_node_used_by_num_pubs[old_node] == 0) close_remote_node(old_node);
+    }
+    return ok;
+}
+
+int publisher_set_priority(int publisher_id, int priority)
+{
+    if ((publisher_id < 0) || (publisher_id >= next_publisher_id) ||
+        (publisher_address[publisher_id] == 0)) return 0;
+    if ((priority < DEROS_PRIORITY_HIGH) || (priority >= DEROS_NUM_PRIORITIES)) return 0;
+
+    pthread_mutex_lock(&remote_nodes_lock);
+    publisher_priority[publisher_id] = priority;
+    int ok = move_publisher_to_priority_class(publisher_id);
+    pthread_mutex_unlock(&remote_nodes_lock);
+    return ok;
+}
+
+/** keep the message in the history of the publisher, the oldest one falls out when it is full, history lock must be held */
+void record_history_message(int pub_id, outbound_packet *packet)
+{
+    int depth = publisher_history_depth[pub_id];
+    int next = publisher_history_next[pub_id];
+    if (publisher_history_count[pub_id] == depth) release_outbound_packet(publisher_history[pub_id][next]);
+    else publisher_history_count[pub_id]++;
+    atomic_fetch_add(&packet->refs, 1);
+    publisher_history[pub_id][next] = packet;
+    publisher_history_next[pub_id] = (next + 1) % depth;
+}
+
+/** @return  the i-th oldest message in the history of the publisher, history lock must be held */
+outbound_packet *history_message(int pub_id, int i)
+{
+    int depth = publisher_history_depth[pub_id];
+    int first = publisher_history_next[pub_id] - publisher_history_count[pub_id] + depth;
+    return publisher_history[pub_id][(first + i) % depth];
+}
+
+/** @return  index of the first message of the history the new subscriber node gets, history lock must be held */
+int first_history_message_to_replay(int pub_id, int history)
+{
+    int count = publisher_history_count[pub_id];
+    return ((history == DEROS_HISTORY_LATEST) && (count > 1)) ? count - 1 : 0;
+}
+
+/** queue the history of the publisher for a new subscriber node right after its topic bind, before any new message of the publisher,
+ *  the messages are never dropped, remote_nodes_lock and history lock must be held */
+void replay_history_to_remote_node(int pub_id, int remote_node, int history)
+{
+    if (!publisher_history_count[pub_id]) return;
+    pthread_mutex_lock(&s_remote_node_send_lock[remote_node]);
+    if (!s_remote_node_failed[remote_node])
+    {
+        for (int i = first_history_message_to_replay(pub_id, history); i < publisher_history_count[pub_id]; i++)
+        {
+            outbound_packet *packet = history_message(pub_id, i);
+            atomic_fetch_add(&packet->refs, 1);
+            queue_unlimited_packet(remote_node, pub_id, packet);
+        }
+        if (!flush_remote_node(remote_node)) fail_remote_node(remote_node);
+    }
+    pthread_mutex_unlock(&s_remote_node_send_lock[remote_node]);
+}
+
+/** pass the history of the publisher to a new subscriber node in the same process, remote_nodes_lock and history lock must be held */
+void replay_history_to_local_node(int pub_id, int local_node, int adr_id, int history)
+{
+    for (int i = first_history_message_to_replay(pub_id, history); i < publisher_history_count[pub_id]; i++)
+    {
+        outbound_packet *packet = history_message(pub_id, i);
+        deliver_local_message(local_node, adr_id, packet->data + PACKET_FRAMING + MSG_HEADER_LENGTH, packet->size - MSG_HEADER_LENGTH, packet);
+    }
+}
+
+/** forget the history of the publisher, history lock must be held */
+void clear_publisher_history(int pub_id)
+{
+    for (int i = 0; i < publisher_history_count[pub_id]; i++) release_outbound_packet(history_message(pub_id, i));
+    free(publisher_history[pub_id]);
+    publisher_history[pub_id] = 0;
+    publisher_history_depth[pub_id] = 0;
+    publisher_history_count[pub_id] = 0;
+    publisher_history_next[pub_id] = 0;
+}
+
+int publisher_set_history_depth(int publisher_id, int depth)
+{
+    if ((publisher_id < 0) || (publisher_id >= next_publisher_id) ||
+        (publisher_address[publisher_id] == 0)) return 0;
+    if (depth < 0) depth = 0;
 
-char* s_remote_node_IP[MAX_NUM_REMOTE_SUBSCRIBERS];
-int s_remote_node_port[MAX_NUM_REMOTE_SUBSCRIBERS];
-int s_remote_node_used_by_num_pubs[MAX_NUM_REMOTE_SUBSCRIBERS];
-int s_remote_node_socket[MAX_NUM_REMOTE_SUBSCRIBERS];
-uint8_t s_remote_node_msg_queue[MAX_NUM_REMOTE_SUBSCRIBERS];
-int s_remote_node_items_in_queue[MAX_NUM_REMOTE_SUBSCRIBERS];
-int next_remote_node_id = 0;
+    // the last messages that fit stay
+    outbound_packet **ring = 0;
+    if (depth)
+    {
+        ring = (outbound_packet **) malloc(sizeof(outbound_packet *) * depth);
+        if (!ring) deros_pub_mem_failure("publisher history");
+    }
+    pthread_mutex_lock(&publisher_history_lock[publisher_id]);
+    int count = publisher_history_count[publisher_id];
+    int kept = (count < depth) ? count : depth;
+    for (int i = 0; i < kept; i++)
+    {
+        ring[i] = history_message(publisher_id, count - kept + i);
+        atomic_fetch_add(&ring[i]->refs, 1);
+    }
+    clear_publisher_history(publisher_id);
+    publisher_history[publisher_id] = ring;
+    publisher_history_depth[publisher_id] = depth;
+    publisher_history_count[publisher_id] = kept;
+    publisher_history_next[publisher_id] = depth ? kept % depth : 0;
+    pthread_mutex_unlock(&publisher_history_lock[publisher_id]);
+    return 1;
+}
 
-void deros_pub_mem_failure(char *msg)
+/** drop the oldest waiting message of the publisher from the queue of the remote node, a large message
+ *  that is being sent in chunks already stays, send lock must be held */
+void drop_oldest_message_of_publisher(int remote_node, int pub_id)
 {
-    deros_dbglog_msg_str(D_GRRR, "memf", "publisher", "not enough memory", msg);
-    exit(1);
+    message_stream *stream = find_message_stream(remote_node, pub_id);
+    if (stream)
+    {
+        queued_packet *prev = (stream->offset > 0) ? stream->head : 0;
+        queued_packet *q = prev ? prev->next : stream->head;
+        while (q && (q->pub_id != pub_id))
+        {
+            prev = q;
+            q = q->next;
+        }
+        if (q && !prev)
+        {
+            release_outbound_packet(q->packet);
+            remove_first_stream_packet(remote_node, stream);
+            return;
+        }
+        if (q)
+        {
+            prev->next = q->next;
+            if (stream->tail == q) stream->tail = prev;
+            s_remote_node_queued_of_pub[remote_node][pub_id]--;
+            release_outbound_packet(q->packet);
+            free(q);
+            return;
+        }
+    }
+
+    queued_packet *prev = 0;
+    queued_packet *q = s_remote_node_queue_head[remote_node];
+    while (q && (q->pub_id != pub_id))
+    {
+        prev = q;
+        q = q->next;
+    }
+    if (!q) return;
+    if (!prev)
+    {
+        release_outbound_packet(q->packet);
+        dequeue_remote_node_packet(remote_node);
+        return;
+    }
+    prev->next = q->next;
+    if (s_remote_node_queue_tail[remote_node] == q) s_remote_node_queue_tail[remote_node] = prev;
+    s_remote_node_queued_of_pub[remote_node][pub_id]--;
+    release_outbound_packet(q->packet);
+    free(q);
 }
 
-int find_remote_node(char *ip, int port)
+/** wait until the queue of the remote node has space for another message of the publisher, send lock must be held
+ *  @return  1 if there is space, 0 on timeout or if the subscriber is not reachable */
+int wait_for_space_in_queue(int remote_node, int pub_id)
 {
-    for (int i = 0; i < next_remote_node_id; i++)
-        if (s_remote_node_port[i] == 0) continue;
-        else if ((s_remote_node_port[i] == port) &&
-                 (strncmp(s_remote_node_IP[i], ip, 15) == 0)) return i;
-    return -1;
-} 
+    int timeout_ms = publisher_block_timeout_ms[pub_id];
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += timeout_ms / 1000;
+    deadline.tv_nsec += (timeout_ms % 1000) * 1000000L;
+    if (deadline.tv_nsec >= 1000000000L) { deadline.tv_sec++; deadline.tv_nsec -= 1000000000L; }
 
-int add_remote_node(char *ip, int port)
-{
-    int i;
-    for (i = 0; i < next_remote_node_id; i++)
-        if (s_remote_node_port[i] == 0)
-            break;
-    if (i == next_remote_node_id) 
-        next_remote_node_id++;
+    while (!s_remote_node_failed[remote_node] &&
+           (s_remote_node_queued_of_pub[remote_node][pub_id] >= publisher_msgqueue_size[pub_id]))
+        if (pthread_cond_timedwait(&s_remote_node_progress[remote_node], &s_remote_node_send_lock[remote_node], &deadline)) break;   // timeout or error
 
-    s_remote_node_port[i] = port;
-    s_remote_node_IP[i] = ip;
+    return !s_remote_node_failed[remote_node] && (s_remote_node_queued_of_pub[remote_node][pub_id] < publisher_msgqueue_size[pub_id]);
+}
 
-    s_remote_node_socket[i] = deros_connect_to_server(s_remote_node_IP[i], s_remote_node_port[i]);
-    if (!s_remote_node_socket[i])
+/** remember that the remote node holds messages of the corked node, they are sent right away if the node was uncorked meanwhile
+ *  @return  1 on success, 0 if the subscriber is not reachable */
+int collect_corked_message(int node_id, int remote_node)
+{
+    pthread_mutex_lock(&cork_lock);
+    int corked = node_corked[node_id];
+    if (corked && !node_remote_is_dirty[node_id][remote_node])
     {
-        s_remote_node_port[i] = 0;
-        return -1;
+        if (node_num_dirty_remotes[node_id] == 0)
+        {
+            clock_gettime(CLOCK_MONOTONIC, &node_corked_since[node_id]);
+            if (node_autoflush_delay_ms[node_id] > 0) wake_up_publisher_send_thread();
+        }
+        node_remote_is_dirty[node_id][remote_node] = 1;
+        node_dirty_remotes[node_id][node_num_dirty_remotes[node_id]++] = remote_node;
     }
-    s_remote_node_used_by_num_pubs[i] = 1;
+    pthread_mutex_unlock(&cork_lock);
+    if (corked) return 1;
 
-    return i;
+    pthread_mutex_lock(&s_remote_node_send_lock[remote_node]);
+    int ok = !s_remote_node_failed[remote_node] && (s_remote_node_socket[remote_node] > 0);
+    if (ok && !flush_remote_node(remote_node))
+    {
+        fail_remote_node(remote_node);
+        ok = 0;
+    }
+    pthread_mutex_unlock(&s_remote_node_send_lock[remote_node]);
+    return ok;
 }
 
-int publisher_register(int node_id, char *address, int message_size, int message_queue_size)
+/** deliver a message to one remote node: written directly to its ring when nothing waits for it, otherwise queued,
+ *  the queue is bounded by message_queue_size of the publisher and the publisher's queue policy applies when it is full
+ *  @param generation  of the remote node in the destinations of the publisher, a node closed or reused since then is skipped
+ *  @param packet  the packet shared among all remote nodes, created here when needed for the first time
+ *  @param memfd_packet  the same for the memory file of a large message, that is used for nodes connected through Unix domain sockets
+ *  @param corked  the message is only collected, it is sent when the node of the publisher is flushed
+ *  @return  1 on success, 0 if the message was dropped or the subscriber is not reachable */
+int publish_to_remote_node(int pub_id, int remote_node, int generation, uint8_t *header, uint8_t *message, int msg_len, 
+                           outbound_packet **packet, outbound_packet **memfd_packet, int corked)
 {
-    if (strlen(address) > MAX_ADDRESS_LENGTH) return -1;
-    if (pthread_mutex_lock(&node_mutexes[node_id])) return -1;
+    int use_memfd = s_remote_node_local[remote_node] && (MSG_HEADER_LENGTH + msg_len >= MEMFD_MESSAGE_THRESHOLD);
+    if (use_memfd && !*memfd_packet) *memfd_packet = new_memfd_packet(header, message, msg_len);
+    if (!*memfd_packet) use_memfd = 0;   // the bytes of the message are sent instead
 
-    if (node_server_sockets[node_id] == 0)
+    pthread_mutex_lock(&s_remote_node_send_lock[remote_node]);
+    if (s_remote_node_closing[remote_node] || (s_remote_node_generation[remote_node] != generation))
     {
-        pthread_mutex_unlock(&node_mutexes[node_id]); 
-        return -1;
+        pthread_mutex_unlock(&s_remote_node_send_lock[remote_node]);
+        return 1;   // not a destination of the publisher anymore
+    }
+    if (s_remote_node_failed[remote_node] || (s_remote_node_socket[remote_node] <= 0))
+    {
+        pthread_mutex_unlock(&s_remote_node_send_lock[remote_node]);
+        return 0;
     }
 
-    uint8_t *my_buffer = (uint8_t *) malloc(strlen(address) + 12);
-    if (!my_buffer) deros_pub_mem_failure("pub register");
+    deros_shm_ring *ring = s_remote_node_ring[remote_node];
+    if (!use_memfd && (MSG_HEADER_LENGTH + msg_len <= MESSAGE_CHUNK_SIZE) && !s_remote_node_queue_head[remote_node] && 
+        ring && (MSG_HEADER_LENGTH + msg_len <= deros_shm_ring_max_record(ring)) && !find_message_stream(remote_node, pub_id))
+    {
+        int written = deros_shm_ring_write(ring, PACKET_NEW_MESSAGE, header, MSG_HEADER_LENGTH, message, msg_len);
+        if (written >= 0)
+        {
+            if (written && corked) s_remote_node_doorbell_deferred[remote_node] = 1;
+            else if (written) ring_doorbell_of_remote_node(remote_node);
+            int ok = corked || flush_remote_node_socket(remote_node);
+            if (!ok) fail_remote_node(remote_node);
+            pthread_mutex_unlock(&s_remote_node_send_lock[remote_node]);
+            return ok && (!corked || collect_corked_message(publisher_node_id[pub_id], remote_node));
+        }
+    }
 
-    sprintf((char *)my_buffer, "%d!%s", message_size, address);
+    // the queue of a corked node does not wait for the flush when it is full
+    if (corked && (s_remote_node_queued_of_pub[remote_node][pub_id] >= publisher_msgqueue_size[pub_id]) && !flush_remote_node(remote_node))
+    {
+        fail_remote_node(remote_node);
+        pthread_mutex_unlock(&s_remote_node_send_lock[remote_node]);
+        return 0;
+    }
 
-    if (!deros_send_packet(node_server_sockets[node_id], PACKET_PUB_REGISTER, my_buffer, strlen((char *)my_buffer)))
+    if (s_remote_node_queued_of_pub[remote_node][pub_id] >= publisher_msgqueue_size[pub_id])
     {
-        deros_dbglog_msg(D_ERRR, node_names[node_id], "publisher", "sending register publisher packet failed");
-        close(node_server_sockets[node_id]);
-        node_server_sockets[node_id] = 0;
-        pthread_mutex_unlock(&node_mutexes[node_id]);
-        free(my_buffer);
-        return -1;
+        int has_space = 0;
+        if (publisher_queue_policy[pub_id] == DEROS_QUEUE_DROP_OLDEST)
+        {
+            drop_oldest_message_of_publisher(remote_node, pub_id);
+            has_space = 1;
+        }
+        else if (publisher_queue_policy[pub_id] == DEROS_QUEUE_BLOCK)
+            has_space = wait_for_space_in_queue(remote_node, pub_id);
+        if (!has_space)
+        {
+            deros_dbglog_msg_str_int(D_DEBG, publisher_address[pub_id], "publisher", "queue for subscriber node full, message dropped (dstip,dstport)", s_remote_node_IP[remote_node], s_remote_node_port[remote_node]);
+            pthread_mutex_unlock(&s_remote_node_send_lock[remote_node]);
+            return 0;
+        }
     }
-    deros_dbglog_msg(D_DEBG, node_names[node_id], "publisher", "sent register publisher packet");
 
-    int pub_id = 0;
-    while (pub_id < next_publisher_id)
+    if (!use_memfd && !*packet) *packet = new_outbound_packet(PACKET_NEW_MESSAGE, header, MSG_HEADER_LENGTH, message, msg_len, 1);
+    outbound_packet *queued = use_memfd ? *memfd_packet : *packet;
+    atomic_fetch_add(&queued->refs, 1);
+    queued_packet *q = (queued_packet *) malloc(sizeof(queued_packet));
+    if (!q) deros_pub_mem_failure("queue message");
+    q->packet = queued;
+    q->pub_id = pub_id;
+    q->topic_id = pub_id;
+    q->next = 0;
+    if (s_remote_node_queue_tail[remote_node]) s_remote_node_queue_tail[remote_node]->next = q;
+    else s_remote_node_queue_head[remote_node] = q;
+    s_remote_node_queue_tail[remote_node] = q;
+    s_remote_node_queued_of_pub[remote_node][pub_id]++;
+
+    int ok = corked || flush_remote_node(remote_node);
+    if (!ok) fail_remote_node(remote_node);
+    pthread_mutex_unlock(&s_remote_node_send_lock[remote_node]);
+    return ok && (!corked || collect_corked_message(publisher_node_id[pub_id], remote_node));
+}
+
+/** send a batch of datagrams, they are never waited for
+ *  @return  the number of datagrams that were dropped (the socket buffer was full, or the destination is unreachable) */
+int send_datagram_batch(struct mmsghdr *datagrams, int count)
+{
+    int done = 0;
+    int dropped = 0;
+    while (done < count)
     {
-        if (publisher_address[pub_id] == 0) break;
-        pub_id++;
+        int sent = sendmmsg(publisher_udp_socket, datagrams + done, count - done, MSG_DONTWAIT);
+        if (sent > 0) done += sent;
+        else if ((sent < 0) && (errno == EINTR)) continue;
+        else
+        {
+            done++;
+            dropped++;
+        }
     }
-    if (pub_id == next_publisher_id) 
+    return dropped;
+}
+
+/** send the message to the subscriber nodes that get it in datagrams, one datagram per fragment and destination,
+ *  the multicast group is one destination for all multicast subscriber nodes
+ *  @return  1 if all datagrams were sent, 0 otherwise */
+int publish_datagrams(int pub_id, publisher_destinations *dest, deros_msg_header *msg_header, uint8_t *message, int msg_len)
+{
+    struct mmsghdr datagrams[UDP_SEND_BATCH];
+    struct iovec iov[UDP_SEND_BATCH][2];
+    uint8_t headers[UDP_SEND_BATCH][DATAGRAM_HEADER_LENGTH + MAX_ADDRESS_LENGTH];
+
+    char *adres = publisher_address[pub_id];
+    int adr_len = strlen(adres);
+    int payload = deros_fragment_payload(adr_len);
+    int num_fragments = (msg_len > 0) ? (msg_len + payload - 1) / payload : 1;
+    if (num_fragments > 0xffff)
     {
-        next_publisher_id++;
-        deros_dbglog_msg_int(D_DEBG, node_names[node_id], "publisher", "increased next_publisher_id to", next_publisher_id);
+        deros_dbglog_msg_str_int(D_ERRR, node_names[publisher_node_id[pub_id]], "publisher", "message too long for datagrams (adr, len)", adres, msg_len);
+        return 0;
     }
+    int num_destinations = dest->num_udp_subs + dest->multicast;
+    deros_datagram_header header = { *msg_header, 0, num_fragments, adr_len };
 
-    publisher_node_id[pub_id] = node_id;
-    publisher_address[pub_id] = (char *)malloc(strlen(address) + 1);
-    if (!publisher_address[pub_id]) deros_pub_mem_failure("pub register adr");
-    publisher_pretty_printer[pub_id] = 0;
-    publisher_log_enabled[pub_id] = 0;
-    publisher_log_initialized[pub_id] = 0;
-    strcpy(publisher_address[pub_id], address);
-    publisher_msgsize[pub_id] = message_size;
-    publisher_msgqueue_size[pub_id] = message_queue_size;
-    subscribed_remote_node_ids[pub_id] = 0;
-    num_sub_remote_nodes[pub_id] = 0;
-    num_publishers++;
+    memset(datagrams, 0, sizeof(datagrams));
+    int batched = 0;
+    int dropped = 0;
+    for (int fragment = 0; fragment < num_fragments; fragment++)
+    {
+        header.fragment = fragment;
+        int offset = fragment * payload;
+        int length = (msg_len - offset < payload) ? msg_len - offset : payload;
+        for (int d = 0; d < num_destinations; d++)
+        {
+            struct sockaddr_in *to = (d < dest->num_udp_subs) ? &dest->udp_subs[d] : &dest->multicast_group;
+            deros_store_datagram_header(headers[batched], &header);
+            memcpy(headers[batched] + DATAGRAM_HEADER_LENGTH, adres, adr_len);
+            iov[batched][0].iov_base = headers[batched];
+            iov[batched][0].iov_len = DATAGRAM_HEADER_LENGTH + adr_len;
+            iov[batched][1].iov_base = message + offset;
+            iov[batched][1].iov_len = length;
+            datagrams[batched].msg_hdr.msg_name = to;
+            datagrams[batched].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+            datagrams[batched].msg_hdr.msg_iov = iov[batched];
+            datagrams[batched].msg_hdr.msg_iovlen = 2;
+            if (++batched == UDP_SEND_BATCH)
+            {
+                dropped += send_datagram_batch(datagrams, batched);
+                batched = 0;
+            }
+        }
+    }
+    if (batched) dropped += send_datagram_batch(datagrams, batched);
 
-    pthread_mutex_unlock(&node_mutexes[node_id]);
-    free(my_buffer);
-    return pub_id;
+    if (dropped && ((publisher_datagrams_dropped[pub_id]++ % 1000) == 0))
+        deros_dbglog_msg_str_2int(D_WARN, node_names[publisher_node_id[pub_id]], "publisher", "datagrams dropped (adr, errno, messages with dropped datagrams)", adres, errno, publisher_datagrams_dropped[pub_id]);
+    return dropped == 0;
 }
 
-int publish(int publisher_id, uint8_t *message, int msg_len)
+/** push the message to all remote subscriber nodes of the publisher and log it
+ *  @param packet  the message already in an outbound packet (loaned), or 0 if it is created when needed 
+ *  @return  1 if the message was delivered to all, 0 otherwise */
+int publish_message(int publisher_id, uint8_t *message, int msg_len, outbound_packet *packet)
 {
-    if ((publisher_id < 0) || (publisher_id >= next_publisher_id) ||
-        (publisher_address[publisher_id] == 0)) return 0;
-
     int node_id = publisher_node_id[publisher_id];
 
     if ((publisher_msgsize[publisher_id] >= 0) &&
@@ -147,81 +1927,343 @@ int publish(int publisher_id, uint8_t *message, int msg_len)
         deros_dbglog_msg_str_2int(D_GRRR, node_names[node_id], "publisher", "publishing message to address with incorrect length (adr, len1, len2)", publisher_address[publisher_id], publisher_msgsize[publisher_id], msg_len);
         exit(1);
     }
+    if ((msg_len < 0) || (msg_len > MAX_MESSAGE_LENGTH))
+    {
+        deros_dbglog_msg_str_int(D_ERRR, node_names[node_id], "publisher", "message too long (adr, len)", publisher_address[publisher_id], msg_len);
+        if (packet) release_outbound_packet(packet);
+        return 0;
+    }
 
     struct timeval timestamp;
     gettimeofday(&timestamp, 0);
 
-    if (pthread_mutex_lock(&node_mutexes[node_id])) return 0;
-
     char *adres = publisher_address[publisher_id];
-    int adrlen = strlen(adres);
-    uint8_t *packet = (uint8_t *) malloc(adrlen + 2 + 10 + msg_len + 1);
-    if (!packet) deros_pub_mem_failure("publish packet");
+    deros_msg_header msg_header = { publisher_id, msg_len, atomic_fetch_add(&publisher_seq[publisher_id], 1), timestamp.tv_sec, timestamp.tv_usec };
+    uint8_t my_header[MSG_HEADER_LENGTH];
+    uint8_t *header = my_header;
+    if (packet)   // header is encoded in front of the loaned message
+    {
+        header = packet->data + PACKET_FRAMING;
+        packet->size = MSG_HEADER_LENGTH + msg_len;
+        frame_outbound_packet(packet, PACKET_NEW_MESSAGE);
+    }
+    deros_store_msg_header(header, &msg_header);
+    int delivered = 1;
+    int corked = node_corked[node_id];
+    outbound_packet *memfd_packet = 0;
 
-    for (int remote = 0; remote < num_sub_remote_nodes[publisher_id]; remote++)
+    // header and message are joined only once for all subscribers that need it queued or sent through TCP,
+    // publishers only meet at the send locks of the remote nodes they share
+    int slot;
+    publisher_destinations *dest;
+    if (publisher_history_depth[publisher_id] && !pthread_mutex_lock(&publisher_history_lock[publisher_id]))
+    {
+        if (publisher_history_depth[publisher_id])
+        {
+            if (!packet) packet = new_outbound_packet(PACKET_NEW_MESSAGE, header, MSG_HEADER_LENGTH, message, msg_len, 1);
+            record_history_message(publisher_id, packet);
+        }
+        dest = enter_publisher_destinations(publisher_id, &slot);
+        pthread_mutex_unlock(&publisher_history_lock[publisher_id]);
+    }
+    else dest = enter_publisher_destinations(publisher_id, &slot);
+    for (int remote = 0; dest && (remote < dest->num_remote_nodes); remote++)
+    {
+        int remote_node = dest->remote_nodes[remote];
+        if (publish_to_remote_node(publisher_id, remote_node, dest->remote_generations[remote], header, message, msg_len, &packet, &memfd_packet, corked))
+            deros_dbglog_msg_3str_int(D_DEBG, node_names[node_id], "publisher", "published message to subscriber (node,adr,dstip,dstport)", node_names[node_id], adres, s_remote_node_IP[remote_node], s_remote_node_port[remote_node]);
+        else delivered = 0;
+    }
+    if (dest && (dest->num_udp_subs || dest->multicast) && !publish_datagrams(publisher_id, dest, &msg_header, message, msg_len))
+        delivered = 0;
+    if (dest && dest->num_local_nodes)
     {
-        int remote_node = subscribed_remote_node_ids[publisher_id][remote];
+        if (!packet) packet = new_outbound_packet(PACKET_NEW_MESSAGE, header, MSG_HEADER_LENGTH, message, msg_len, 1);
+        uint8_t *shared_message = packet->data + PACKET_FRAMING + MSG_HEADER_LENGTH;
+        for (int local = 0; local < dest->num_local_nodes; local++)
+            if (!deliver_local_message(dest->local_nodes[local], dest->local_adr_id, shared_message, msg_len, packet))
+                delivered = 0;
+    }
+    leave_publisher_destinations(publisher_id, slot);
 
-        int remote_socket = s_remote_node_socket[remote_node];
+    if (corked)
+    {
+        pthread_mutex_lock(&cork_lock);
+        node_corked_bytes[node_id] += msg_len;
+        int flush_now = (node_autoflush_bytes[node_id] > 0) && (node_corked_bytes[node_id] >= node_autoflush_bytes[node_id]);
+        pthread_mutex_unlock(&cork_lock);
+        if (flush_now && !flush_corked_node(node_id, 0)) delivered = 0;
+    }
 
-        sprintf((char *)packet, "%s!%d!", adres, msg_len);
-        int paklen1 = strlen((char *)packet);
-        memcpy(packet + paklen1, message, msg_len);
-        if (!deros_send_packet(remote_socket, PACKET_NEW_MESSAGE, packet, msg_len + paklen1))
+    if (publisher_log_enabled[publisher_id] && !pthread_mutex_lock(&publisher_log_lock[publisher_id])) 
+    {
+        char *pretty = (char *)message;
+        if (publisher_pretty_printer[publisher_id])
         {
-            deros_dbglog_msg_2str_int(D_WARN, node_names[node_id], "publisher", "publishing message failed, will try reconnecting (adr,dstip,dstport)", adres, s_remote_node_IP[remote_node], s_remote_node_port[remote_node]);
-
-            close(remote_socket);
-            s_remote_node_socket[remote_node] = -1;  // indicates reconnecting
-            pthread_mutex_unlock(&node_mutexes[node_id]);
-            free(packet);
-            return 0;
+           pretty = publisher_pretty_printer[publisher_id](message, msg_len);
+           deros_msglog_published_msg(publisher_log_handle[publisher_id], &timestamp, node_names[node_id], adres, pretty, strlen(pretty), 1);
         }
-        deros_dbglog_msg_3str_int(D_DEBG, node_names[node_id], "publisher", "published message to subscriber (node,adr,dstip,dstport)", node_names[node_id], adres, s_remote_node_IP[remote_node], s_remote_node_port[remote_node]);
+        else deros_msglog_published_msg(publisher_log_handle[publisher_id], &timestamp, node_names[node_id], adres, (char *)message, msg_len, 0);
+
+        pthread_mutex_unlock(&publisher_log_lock[publisher_id]);
     }
-    free(packet);
-    if (!publisher_log_enabled[publisher_id]) 
+
+    if (packet) release_outbound_packet(packet);
+    if (memfd_packet) release_outbound_packet(memfd_packet);
+    return delivered;
+}
+
+int publish(int publisher_id, uint8_t *message, int msg_len)
+{
+    if ((publisher_id < 0) || (publisher_id >= next_publisher_id) ||
+        (publisher_address[publisher_id] == 0)) return 0;
+
+    return publish_message(publisher_id, message, msg_len, 0);
+}    
+
+uint8_t *publisher_loan(int publisher_id, int size)
+{
+    if ((publisher_id < 0) || (publisher_id >= next_publisher_id) ||
+        (publisher_address[publisher_id] == 0) || (size < 0) || 
+        (size > MAX_MESSAGE_LENGTH)) return 0;
+
+    outbound_packet *packet = alloc_outbound_packet(MSG_HEADER_LENGTH + size, 1);
+    return packet->data + PACKET_FRAMING + MSG_HEADER_LENGTH;
+}
+
+/** @return  the packet that contains the loaned message, or 0 if the pointer was not loaned */
+outbound_packet *loaned_packet(uint8_t *message, int msg_len)
+{
+    if (!message) return 0;
+    outbound_packet *packet = (outbound_packet *) (message - LOANED_MESSAGE_OFFSET);
+    if ((packet->magic != OUTBOUND_PACKET_MAGIC) || (atomic_load(&packet->refs) != 1) ||
+        (msg_len < 0) || (MSG_HEADER_LENGTH + msg_len > packet->size)) return 0;
+    return packet;
+}
+
+int publish_loaned(int publisher_id, uint8_t *message, int msg_len)
+{
+    outbound_packet *packet = loaned_packet(message, msg_len);
+    if (!packet) return 0;
+    if ((publisher_id < 0) || (publisher_id >= next_publisher_id) ||
+        (publisher_address[publisher_id] == 0))
     {
-        pthread_mutex_unlock(&node_mutexes[node_id]);
-        return 1;
+        release_outbound_packet(packet);
+        return 0;
     }
+    return publish_message(publisher_id, message, msg_len, packet);
+}
+
+void publisher_return_loan(uint8_t *message)
+{
+    outbound_packet *packet = loaned_packet(message, 0);
+    if (packet) release_outbound_packet(packet);
+}
+
+void deros_cork(int node_id)
+{
+    if ((node_id < 0) || (node_id >= next_free_node_id)) return;
+    pthread_mutex_lock(&cork_lock);
+    node_corked[node_id] = 1;
+    pthread_mutex_unlock(&cork_lock);
+}
+
+int deros_flush(int node_id)
+{
+    if ((node_id < 0) || (node_id >= next_free_node_id)) return 0;
+    return flush_corked_node(node_id, 1);
+}
+
+void deros_set_autoflush(int node_id, int max_delay_ms, long max_bytes)
+{
+    if ((node_id < 0) || (node_id >= next_free_node_id)) return;
+    pthread_mutex_lock(&cork_lock);
+    node_autoflush_delay_ms[node_id] = (max_delay_ms > 0) ? max_delay_ms : 0;
+    node_autoflush_bytes[node_id] = (max_bytes > 0) ? max_bytes : 0;
+    pthread_mutex_unlock(&cork_lock);
+    if (publisher_wakeup >= 0) wake_up_publisher_send_thread();
+}
 
-    char *pretty = (char *)message;
-    if (publisher_pretty_printer[publisher_id])
+void hold_local_message(void *shared)
+{
+    atomic_fetch_add(&((outbound_packet *)shared)->refs, 1);
+}
+
+void release_local_message(void *shared)
+{
+    release_outbound_packet((outbound_packet *)shared);
+}
+
+/** @return  the node of this process that listens on the port, or -1 if the subscriber node is in another process */
+int find_local_node(int port)
+{
+    for (int node_id = 0; node_id < next_free_node_id; node_id++)
+        if (node_active[node_id] && (node_listen_ports[node_id] == port)) return node_id;
+    return -1;
+}
+
+/** publishers to the address will deliver their messages to the node of this process directly, remote_nodes_lock must be held */
+void add_local_subscriber_node(int local_node, int history, int adr_id)
+{
+    for (int pub_i = 0; pub_i < next_publisher_id; pub_i++)
     {
-       pretty = publisher_pretty_printer[publisher_id](message, msg_len);
-       deros_msglog_published_msg(publisher_log_handle[publisher_id], &timestamp, node_names[node_id], adres, pretty, strlen(pretty), 1);
+        if ((publisher_address[pub_i] == 0) || (publisher_local_adr_id[pub_i] != adr_id)) continue;
+        int already_subscribed = 0;
+        for (int j = 0; j < num_sub_local_nodes[pub_i]; j++)
+            if (subscribed_local_node_ids[pub_i][j] == local_node) already_subscribed = 1;
+        if (already_subscribed) continue;
+
+        subscribed_local_node_ids[pub_i] = (int *) realloc(subscribed_local_node_ids[pub_i], sizeof(int) * (1 + num_sub_local_nodes[pub_i]));
+        if (!subscribed_local_node_ids[pub_i]) deros_pub_mem_failure("pub new local sub");
+        subscribed_local_node_ids[pub_i][num_sub_local_nodes[pub_i]++] = local_node;
+        pthread_mutex_lock(&publisher_history_lock[pub_i]);
+        replay_history_to_local_node(pub_i, local_node, adr_id, history);
+        update_publisher_destinations(pub_i);
+        pthread_mutex_unlock(&publisher_history_lock[pub_i]);
+        deros_dbglog_msg_str_int(D_INFO, addresses[adr_id], "publisher", "delivering to node in the same process (adr, node)", addresses[adr_id], local_node);
     }
-    else deros_msglog_published_msg(publisher_log_handle[publisher_id], &timestamp, node_names[node_id], adres, (char *)message, msg_len, 0);
+}
 
-    pthread_mutex_unlock(&node_mutexes[node_id]);
+/** remote_nodes_lock must be held */
+void remove_local_subscriber_node(int local_node, int adr_id)
+{
+    for (int pub_i = 0; pub_i < next_publisher_id; pub_i++)
+    {
+        if ((publisher_address[pub_i] == 0) || (publisher_local_adr_id[pub_i] != adr_id)) continue;
+        for (int j = 0; j < num_sub_local_nodes[pub_i]; j++)
+            if (subscribed_local_node_ids[pub_i][j] == local_node)
+            {
+                subscribed_local_node_ids[pub_i][j] = subscribed_local_node_ids[pub_i][--num_sub_local_nodes[pub_i]];
+                update_publisher_destinations(pub_i);
+                break;
+            }
+    }
+}
 
+/** the process sends all datagrams through one unbound socket, multicast does not leave the local network, 
+ *  remote_nodes_lock must be held
+ *  @return  1 on success, 0 if the socket could not be created */
+int open_publisher_udp_socket()
+{
+    if (publisher_udp_socket >= 0) return 1;
+    int sock = socket(AF_INET, SOCK_DGRAM, 0);
+    if (sock < 0)
+    {
+        deros_dbglog_msg_int(D_ERRR, "sys", "publisher", "could not create UDP socket, errno=", errno);
+        return 0;
+    }
+    int sndbuf = UDP_SOCKET_BUFFER;   // the system limits it to net.core.wmem_max
+    setsockopt(sock, SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof(sndbuf));
+    uint8_t ttl = 1;
+    uint8_t loop = 1;   // subscriber nodes on the same host are in the group too
+    setsockopt(sock, IPPROTO_IP, IP_MULTICAST_TTL, &ttl, sizeof(ttl));
+    setsockopt(sock, IPPROTO_IP, IP_MULTICAST_LOOP, &loop, sizeof(loop));
+    if ((multicast_interface.s_addr != htonl(INADDR_ANY)) &&
+        (setsockopt(sock, IPPROTO_IP, IP_MULTICAST_IF, &multicast_interface, sizeof(multicast_interface)) < 0))
+        deros_dbglog_msg_int(D_WARN, "sys", "publisher", "could not set multicast interface, errno=", errno);
+    publisher_udp_socket = sock;
     return 1;
-}    
+}
+
+int find_datagram_subscriber(struct sockaddr_in *list, int num, struct sockaddr_in *node)
+{
+    for (int i = 0; i < num; i++)
+        if ((list[i].sin_addr.s_addr == node->sin_addr.s_addr) && (list[i].sin_port == node->sin_port)) return i;
+    return -1;
+}
+
+/** publishers to the address will send their messages to the node in datagrams, remote_nodes_lock must be held
+ *  @return  1 on success, 0 if the node cannot be reached */
+int add_datagram_subscriber_node(char *ip, int port, int transport, int adr_id)
+{
+    struct sockaddr_in node;
+    memset(&node, 0, sizeof(node));
+    node.sin_family = AF_INET;
+    node.sin_port = htons(port);
+    if (!inet_aton(ip, &node.sin_addr) || !open_publisher_udp_socket()) return 0;
+
+    for (int pub_i = 0; pub_i < next_publisher_id; pub_i++)
+    {
+        if ((publisher_address[pub_i] == 0) || (publisher_local_adr_id[pub_i] != adr_id)) continue;
+        struct sockaddr_in **list = (transport == DEROS_TRANSPORT_MULTICAST) ? &publisher_multicast_subs[pub_i] : &publisher_udp_subs[pub_i];
+        int *num = (transport == DEROS_TRANSPORT_MULTICAST) ? &num_multicast_subs[pub_i] : &num_udp_subs[pub_i];
+        if (find_datagram_subscriber(*list, *num, &node) >= 0) continue;
+
+        *list = (struct sockaddr_in *) realloc(*list, sizeof(struct sockaddr_in) * (*num + 1));
+        if (!*list) deros_pub_mem_failure("pub new datagram sub");
+        (*list)[(*num)++] = node;
+        update_publisher_destinations(pub_i);
+    }
+    deros_dbglog_msg_str_2int(D_INFO, addresses[adr_id], "publisher", "sending datagrams to subscriber node (ip, port, transport)", ip, port, transport);
+    return 1;
+}
 
-int publisher_add_new_subscriber(int subscriber_port, char *subscriber_ip, char *adres)
+/** remote_nodes_lock must be held */
+void remove_datagram_subscriber_node(char *ip, int port, int transport, int adr_id)
+{
+    struct sockaddr_in node;
+    node.sin_port = htons(port);
+    if (!inet_aton(ip, &node.sin_addr)) return;
+
+    for (int pub_i = 0; pub_i < next_publisher_id; pub_i++)
+    {
+        if ((publisher_address[pub_i] == 0) || (publisher_local_adr_id[pub_i] != adr_id)) continue;
+        struct sockaddr_in *list = (transport == DEROS_TRANSPORT_MULTICAST) ? publisher_multicast_subs[pub_i] : publisher_udp_subs[pub_i];
+        int *num = (transport == DEROS_TRANSPORT_MULTICAST) ? &num_multicast_subs[pub_i] : &num_udp_subs[pub_i];
+        int i = find_datagram_subscriber(list, *num, &node);
+        if (i < 0) continue;
+        list[i] = list[--(*num)];
+        update_publisher_destinations(pub_i);
+    }
+}
+
+int publisher_add_new_subscriber(int node_id, int subscriber_port, char *subscriber_ip, int colocated, int transport, int history, int adr_id)
 {
     pthread_mutex_lock(&remote_nodes_lock);
-    
-    // first make sure we have this remote node and a connection to it
-    int remote_node = find_remote_node(subscriber_ip, subscriber_port);
-    if (remote_node < 0) 
+
+    // subscriber nodes in the same process are not connected at all
+    int local_node = colocated ? find_local_node(subscriber_port) : -1;
+    if (local_node >= 0)
     {
-        deros_dbglog_msg_str_int(D_INFO, adres, "publisher", "adding new remote node (ip,port)", subscriber_ip, subscriber_port);
-        remote_node = add_remote_node(subscriber_ip, subscriber_port);
-        if (remote_node < 0) 
-        {
-            pthread_mutex_unlock(&remote_nodes_lock);
-            return 0;
-        }
+        add_local_subscriber_node(local_node, history, adr_id);
+        pthread_mutex_unlock(&remote_nodes_lock);
+        return 1;
     }
 
-    // then check publishers of all nodes if they publish to this address, add the node to their remote subscribers list
+    if (transport != DEROS_TRANSPORT_TCP)
+    {
+        int ok = add_datagram_subscriber_node(subscriber_ip, subscriber_port, transport, adr_id);
+        pthread_mutex_unlock(&remote_nodes_lock);
+        return ok;
+    }
+    
+    // check publishers of all nodes if they publish to this address, add the node to their remote subscribers list,
+    // the node is connected once for each priority class of these publishers
+    int ok = 1;
+    int class_node[DEROS_NUM_PRIORITIES] = { -1, -1, -1 };
     for (int pub_i = 0; pub_i < next_publisher_id; pub_i++)
     {
         if (publisher_address[pub_i] == 0) continue;
-        if (strcmp(publisher_address[pub_i], adres) == 0)
+        if (publisher_local_adr_id[pub_i] == adr_id)
         {
+            int priority = publisher_priority[pub_i];
+            if (class_node[priority] < 0)
+            {
+                class_node[priority] = find_remote_node(subscriber_ip, subscriber_port, priority);
+                if (class_node[priority] >= 0) reconnect_remote_node_now(class_node[priority]);
+            }
+            if (class_node[priority] < 0)
+            {
+                deros_dbglog_msg_str_2int(D_INFO, addresses[adr_id], "publisher", "adding new remote node (ip,port,priority)", subscriber_ip, subscriber_port, priority);
+                class_node[priority] = add_remote_node(node_id, subscriber_ip, subscriber_port, colocated, priority);
+                if (class_node[priority] < 0)
+                {
+                    ok = 0;
+                    continue;
+                }
+            }
+            int remote_node = class_node[priority];
+
             int already_subscribed = 0;
             for (int j = 0; j < num_sub_remote_nodes[pub_i]; j++)
             {
@@ -232,6 +2274,7 @@ int publisher_add_new_subscriber(int subscriber_port, char *subscriber_ip, char
                 }
             }
             if (already_subscribed) continue;
+            if (!bind_topic_at_remote_node(pub_i, remote_node)) continue;
             if (num_sub_remote_nodes[pub_i] == 0) 
                 subscribed_remote_node_ids[pub_i] = (int *) malloc(sizeof(int));
             else 
@@ -240,25 +2283,26 @@ int publisher_add_new_subscriber(int subscriber_port, char *subscriber_ip, char
 
             subscribed_remote_node_ids[pub_i][num_sub_remote_nodes[pub_i]++] = remote_node;
             s_remote_node_used_by_num_pubs[remote_node]++;
+            pthread_mutex_lock(&publisher_history_lock[pub_i]);
+            replay_history_to_remote_node(pub_i, remote_node, history);
+            update_publisher_destinations(pub_i);
+            pthread_mutex_unlock(&publisher_history_lock[pub_i]);
         }
     }
+    for (int priority = 0; priority < DEROS_NUM_PRIORITIES; priority++)
+        if ((class_node[priority] >= 0) && (s_remote_node_used_by_num_pubs[class_node[priority]] == 0)) 
+            close_remote_node(class_node[priority]);
 
     pthread_mutex_unlock(&remote_nodes_lock);
-    return 1;
+    return ok;
 }
 
+/** a publish() that still reads the old destinations skips the remote node once it is closing, remote_nodes_lock must be held */
 void remove_publisher_from_remote_node(int pub_id, int remote_node)
 {
     for (int remote_ind_in_pub = 0; remote_ind_in_pub < num_sub_remote_nodes[pub_id]; remote_ind_in_pub++)
         if (subscribed_remote_node_ids[pub_id][remote_ind_in_pub] == remote_node)
         {
-            s_remote_node_used_by_num_pubs[remote_node]--;
-            if (s_remote_node_used_by_num_pubs[remote_node] == 0)  // last publisher of this subscriber?
-            {
-                close(s_remote_node_socket[remote_node]);
-                s_remote_node_port[remote_node] = 0;
-                s_remote_node_socket[remote_node] = 0;
-            }
             subscribed_remote_node_ids[pub_id][remote_ind_in_pub] = subscribed_remote_node_ids[pub_id][--num_sub_remote_nodes[pub_id]];
             if (num_sub_remote_nodes[pub_id])
                 subscribed_remote_node_ids[pub_id] = (int *)realloc(subscribed_remote_node_ids[pub_id], sizeof(int) * num_sub_remote_nodes[pub_id]);
@@ -267,32 +2311,63 @@ void remove_publisher_from_remote_node(int pub_id, int remote_node)
                 free(subscribed_remote_node_ids[pub_id]);
                 subscribed_remote_node_ids[pub_id] = 0;
             }
+            update_publisher_destinations(pub_id);
+            unbind_topic_at_remote_node(pub_id, remote_node);
+
+            s_remote_node_used_by_num_pubs[remote_node]--;
+            if (s_remote_node_used_by_num_pubs[remote_node] == 0)  // last publisher of this subscriber?
+                close_remote_node(remote_node);
             break;
         }
 }
 
-void publisher_remove_subscriber(int subscriber_port, char *subscriber_ip, char *adres)
+void publisher_remove_subscriber(int subscriber_port, char *subscriber_ip, int colocated, int transport, int adr_id)
 {
     pthread_mutex_lock(&remote_nodes_lock);
 
-    int remote_node = find_remote_node(subscriber_ip, subscriber_port);
-    if (remote_node < 0)  // we do not have him
+    int local_node = colocated ? find_local_node(subscriber_port) : -1;
+    if (local_node >= 0)
     {
+        remove_local_subscriber_node(local_node, adr_id);
         pthread_mutex_unlock(&remote_nodes_lock);
         return;
     }
 
-    for (int pub_i = 0; pub_i < next_publisher_id; pub_i++)
+    if (transport != DEROS_TRANSPORT_TCP)
     {
-        if (publisher_address[pub_i] == 0) continue;
+        remove_datagram_subscriber_node(subscriber_ip, subscriber_port, transport, adr_id);
+        pthread_mutex_unlock(&remote_nodes_lock);
+        return;
+    }
+
+    for (int priority = 0; priority < DEROS_NUM_PRIORITIES; priority++)
+    {
+        int remote_node = find_remote_node(subscriber_ip, subscriber_port, priority);
+        if (remote_node < 0) continue;  // we do not have him
 
-        if (strcmp(publisher_address[pub_i], adres) == 0)
-            remove_publisher_from_remote_node(pub_i, remote_node);
+        for (int pub_i = 0; pub_i < next_publisher_id; pub_i++)
+        {
+            if ((publisher_address[pub_i] != 0) && (publisher_local_adr_id[pub_i] == adr_id))
+                remove_publisher_from_remote_node(pub_i, remote_node);
+        }
     }
 
     pthread_mutex_unlock(&remote_nodes_lock);
 }
 
+void append_publisher_registrations(int node_id, deros_packet_batch *batch)
+{
+    pthread_mutex_lock(&remote_nodes_lock);
+    for (int pub_i = 0; pub_i < next_publisher_id; pub_i++)
+    {
+        if ((publisher_address[pub_i] == 0) || (publisher_node_id[pub_i] != node_id)) continue;
+        char size_prefix[24];
+        int prefix_len = sprintf(size_prefix, "%d!%d!", publisher_msgsize[pub_i], publisher_transport[pub_i]);
+        deros_batch_append(batch, PACKET_PUB_REGISTER, (uint8_t *)size_prefix, prefix_len, (uint8_t *)publisher_address[pub_i], strlen(publisher_address[pub_i]));
+    }
+    pthread_mutex_unlock(&remote_nodes_lock);
+}
+
 void publisher_unregister(int publisher_id)
 {
     if ((publisher_id < 0) || 
@@ -307,7 +2382,7 @@ void publisher_unregister(int publisher_id)
 
     if ((node_id < 0) || 
         (node_id >= next_free_node_id) ||
-        (node_server_sockets[node_id] == 0))
+        !node_active[node_id])
     {
         pthread_mutex_unlock(&node_mutexes[node_id]); 
         return;
@@ -315,26 +2390,33 @@ void publisher_unregister(int publisher_id)
 
     char *adres = publisher_address[publisher_id];
 
-    if (!deros_send_packet(node_server_sockets[node_id], PACKET_PUB_UNREGISTER, (uint8_t *)adres, strlen(adres)))
-    {
-        deros_dbglog_msg_str(D_ERRR, node_names[node_id], "publisher", "sending unregister publisher packet failed (adr)", adres);
-        close(node_server_sockets[node_id]);
-        node_server_sockets[node_id] = 0;
-    }
+    send_registration_to_server(node_id, PACKET_PUB_UNREGISTER, 0, 0, (uint8_t *)adres, strlen(adres));
     deros_dbglog_msg(D_DEBG, node_names[node_id], "publisher", "sent unregister publisher packet");
 
-    for (int i = 0; i < num_sub_remote_nodes[publisher_id]; i++)
-    {
-        int remote_node = subscribed_remote_node_ids[publisher_id][i];
-        remove_publisher_from_remote_node(publisher_id, remote_node);
-    }
+    pthread_mutex_lock(&remote_nodes_lock);
+    while (num_sub_remote_nodes[publisher_id] > 0)
+        remove_publisher_from_remote_node(publisher_id, subscribed_remote_node_ids[publisher_id][0]);
 
     publisher_node_id[publisher_id] = 0;
     free(subscribed_remote_node_ids[publisher_id]);
     subscribed_remote_node_ids[publisher_id] = 0;
+    free(subscribed_local_node_ids[publisher_id]);
+    subscribed_local_node_ids[publisher_id] = 0;
+    num_sub_local_nodes[publisher_id] = 0;
+    free(publisher_udp_subs[publisher_id]);
+    publisher_udp_subs[publisher_id] = 0;
+    num_udp_subs[publisher_id] = 0;
+    free(publisher_multicast_subs[publisher_id]);
+    publisher_multicast_subs[publisher_id] = 0;
+    num_multicast_subs[publisher_id] = 0;
     free(publisher_address[publisher_id]);
     publisher_address[publisher_id] = 0;
+    update_publisher_destinations(publisher_id);
+    pthread_mutex_lock(&publisher_history_lock[publisher_id]);
+    clear_publisher_history(publisher_id);
+    pthread_mutex_unlock(&publisher_history_lock[publisher_id]);
     num_publishers--;
+    pthread_mutex_unlock(&remote_nodes_lock);
 
     pthread_mutex_unlock(&node_mutexes[node_id]);
 }
@@ -1,208 +1,1196 @@
 // implementation of the subscriber API of the client node
 
+#define _GNU_SOURCE   // recvmmsg
+
 #include <string.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <pthread.h>
 #include <errno.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <stdatomic.h>
+#include <netinet/in.h>
 
 #include "../deros.h"
 #include "../common/deros_common.h"
 #include "../common/deros_addrs.h"
 #include "../common/deros_net.h"
 #include "../common/deros_dbglog.h"
+#include "../common/deros_shm.h"
 #include "deros_core_internal.h"
 
 static int subscriber_node_id[MAX_NUM_SUBSCRIBERS];
 static int subscriber_address[MAX_NUM_SUBSCRIBERS];
 static subscriber_callback_function subscriber_callback[MAX_NUM_SUBSCRIBERS];
+static subscriber_chunk_callback_function subscriber_chunk_callback[MAX_NUM_SUBSCRIBERS];   // 0 = messages are delivered whole
 static int subscriber_msgsize[MAX_NUM_SUBSCRIBERS];
 static int subscriber_msgqueue_size[MAX_NUM_SUBSCRIBERS];
+static int subscriber_transport[MAX_NUM_SUBSCRIBERS];
+static int subscriber_history[MAX_NUM_SUBSCRIBERS];
 static int num_subscribers = 0;
 static int next_subscriber_id = 0;
 
-static int open_publisher_sockets[MAX_NUM_PUBLISHERS]; 
-static int num_open_pub_sockets = 0;
-
-static volatile int subscriber_listen_thread_runs = 0;
-static volatile int subscriber_client_thread_runs = 0;
-
-int process_packet_from_publisher(int my_node_id, uint8_t packet_type, uint8_t *packet, int packet_size)
-{
-    packet[packet_size] = 0;
-    char *excl = strchr((char *)packet, '!');
-    if (!excl) return 0;
-    *excl = 0;
-    char *adres = (char *)packet;
-    excl++;
-    char *msg = strchr(excl, '!');
-    if (!msg) return 0;
-    *msg = 0;
-    int msglen;
-    sscanf(excl, "%d", &msglen);
-    msg++;
-   
-    int found = 0;
-    int adr_id = find_address(adres, &found); 
-    if (!found)  // msg to address we do not know yet are ignored with warning
-    {
-        deros_dbglog_msg_str(D_WARN, node_names[my_node_id], "subscriber", "msg from publisher to subscriber to unrecognized address=", adres);
-        return 1;
+/** a large message received once for all subscribers of the node, mapped from the memory file of a publisher 
+ *  on the same host, or assembled from chunks, it is released after their callbacks */
+typedef struct {
+    _Atomic int refs;
+    uint8_t *data;
+    size_t size;
+    int mapped;            // data is mapped memory file, otherwise allocated
+} message_buffer;
+
+/** a received message (or a chunk of it) waiting for the callback of a subscriber */
+typedef struct queued_message {
+    struct queued_message *next;
+    int length;
+    int offset;            // of the chunk in the message, 0 for whole messages
+    int total_length;      // of the message
+    uint8_t *message;      // data, or the message in a packet of a publisher in the same process, or in a message buffer
+    void *shared;          // that packet, it is released after the callback, 0 if the message was copied to data
+    message_buffer *buffer;
+    uint8_t data[];
+} queued_message;
+
+/** a large message of a publisher that is arriving in chunks */
+typedef struct {
+    int assembling;
+    uint32_t seq;
+    uint32_t length;
+    uint32_t received;
+    message_buffer *buffer;   // the message is assembled here for subscribers that want it whole, 0 if there are none
+} chunked_message;
+
+// callbacks are called from a pool of worker threads, each subscriber has its own queue of messages and it is served
+// by at most one worker at a time (so its messages are delivered in order), ready subscribers wait in a list of their
+// priority class, the first worker serves only the high priority class, so that slow callbacks cannot delay it
+static pthread_mutex_t executor_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t executor_work = PTHREAD_COND_INITIALIZER;       // some subscriber became ready
+static pthread_cond_t executor_callback_done = PTHREAD_COND_INITIALIZER;
+static int num_executor_threads = 0;
+static int requested_executor_threads = DEFAULT_CALLBACK_THREADS;
+
+static int subscriber_priority[MAX_NUM_SUBSCRIBERS];
+static queued_message *subscriber_queue_head[MAX_NUM_SUBSCRIBERS];
+static queued_message *subscriber_queue_tail[MAX_NUM_SUBSCRIBERS];
+static int subscriber_queue_length[MAX_NUM_SUBSCRIBERS];
+static int subscriber_dropped[MAX_NUM_SUBSCRIBERS];
+static int subscriber_scheduled[MAX_NUM_SUBSCRIBERS];       // in a ready list or its callback is running
+static int subscriber_running[MAX_NUM_SUBSCRIBERS];
+static pthread_t subscriber_running_thread[MAX_NUM_SUBSCRIBERS];
+static int subscriber_next_ready[MAX_NUM_SUBSCRIBERS];
+static int ready_head[DEROS_NUM_PRIORITIES] = { -1, -1, -1 };
+static int ready_tail[DEROS_NUM_PRIORITIES] = { -1, -1, -1 };
+
+static int subscriber_epoll = -1;
+static int node_multicast_socket[MAX_NODES];   // joins the multicast groups of the addresses of the node, 0 if none yet
+
+/** messages from one publisher (its socket and topic id) that arrive in datagrams, a message is assembled from its fragments */
+typedef struct {
+    struct sockaddr_in from;
+    uint32_t topic_id;
+    long long next_seq;              // expected sequence number of the next message, -1 if not known yet
+    int assembling;                  // some fragments of the message seq have arrived
+    uint32_t seq;
+    uint32_t length;
+    int num_fragments;
+    int fragments_received;
+    uint8_t *fragment_received;      // a flag for each fragment
+    uint8_t *message;
+    uint32_t capacity;
+    long long lost;                  // messages that have not arrived
+    int loss_reports;
+} datagram_source;
+
+#define MAX_DATAGRAM_SOURCES 256
+
+/** state of a connection from a remote publisher node, or of a listening socket of a node, or of a datagram socket of a node,
+ *  all of them are owned by the receive thread */
+typedef struct publisher_connection {
+    int node_id;
+    int socket;
+    int listening;                   // listening socket of the node - accepts new publisher connections
+    int datagram;                    // DEROS_TRANSPORT_UDP or DEROS_TRANSPORT_MULTICAST for datagram sockets, 0 otherwise
+    uint8_t *datagram_buffers;       // UDP_RECEIVE_BATCH datagrams received at once
+    datagram_source *sources;
+    int num_sources;
+    int next_replaced_source;        // when there are too many sources
+    deros_rxbuf rx;
+    deros_shm_ring *ring;
+    int waiting_for_socket_message;  // the ring contains a mark of a message that comes through the socket
+    int *topic_addr;                 // local address id for each topic id bound by the publisher, -1 if unknown
+    long long *topic_next_seq;       // expected sequence number of the next message, -1 if not known yet
+    chunked_message *topic_chunked; // large message arriving in chunks
+    int num_topics;
+    struct publisher_connection *prev;   // in the list of connections from publishers
+    struct publisher_connection *next;
+    long long last_heard_ms;         // when something arrived from the publisher the last time
+    long long last_heartbeat_ms;     // when the subscriber sent its last heartbeat
+} publisher_connection;
+
+static publisher_connection *publisher_connections = 0;   // their heartbeats are checked by the receive thread
+
+/** append subscriber to the ready list of its priority class, executor lock must be held */
+void make_subscriber_ready(int sub_id)
+{
+    int priority = subscriber_priority[sub_id];
+    subscriber_next_ready[sub_id] = -1;
+    if (ready_tail[priority] >= 0) subscriber_next_ready[ready_tail[priority]] = sub_id;
+    else ready_head[priority] = sub_id;
+    ready_tail[priority] = sub_id;
+    subscriber_scheduled[sub_id] = 1;
+    pthread_cond_broadcast(&executor_work);
+}
+
+/** @param mapped  data is a mapped memory file of the specified size, otherwise the buffer allocates it
+ *  @return  the buffer with one reference */
+message_buffer *new_message_buffer(uint8_t *data, size_t size, int mapped)
+{
+    message_buffer *buffer = (message_buffer *) malloc(sizeof(message_buffer));
+    if (!buffer) deros_node_mem_failure("message buffer");
+    if (!mapped)
+    {
+        data = (uint8_t *) malloc(size);
+        if (!data) deros_node_mem_failure("message buffer data");
+    }
+    atomic_init(&buffer->refs, 1);
+    buffer->data = data;
+    buffer->size = size;
+    buffer->mapped = mapped;
+    return buffer;
+}
+
+void release_message_buffer(message_buffer *buffer)
+{
+    if (atomic_fetch_sub(&buffer->refs, 1) != 1) return;
+    if (buffer->mapped) munmap(buffer->data, buffer->size);
+    else free(buffer->data);
+    free(buffer);
+}
+
+void free_queued_message(queued_message *m)
+{
+    if (m->shared) release_local_message(m->shared);
+    if (m->buffer) release_message_buffer(m->buffer);
+    free(m);
+}
+
+/** add a chunk of a message to the queue of the subscriber, when the queue is full, its oldest entry is dropped
+ *  @param shared  packet of a local publisher that contains the message, it is referenced instead of copying the message, or 0
+ *  @param buffer  message buffer that contains the message, it is referenced instead of copying the message, or 0 */
+void queue_chunk_for_subscriber(int sub_id, uint8_t *chunk, int length, int offset, int total_length, void *shared, message_buffer *buffer)
+{
+    int copied = !shared && !buffer;
+    queued_message *m = (queued_message *) malloc(sizeof(queued_message) + (copied ? length : 0));
+    if (!m) deros_node_mem_failure("queue message");
+    m->next = 0;
+    m->length = length;
+    m->offset = offset;
+    m->total_length = total_length;
+    m->shared = shared;
+    m->buffer = buffer;
+    if (shared)
+    {
+        hold_local_message(shared);
+        m->message = chunk;
+    }
+    else if (buffer)
+    {
+        atomic_fetch_add(&buffer->refs, 1);
+        m->message = chunk;
+    }
+    else
+    {
+        memcpy(m->data, chunk, length);
+        m->message = m->data;
+    }
+
+    pthread_mutex_lock(&executor_lock);
+    if (!subscriber_callback[sub_id])   // it has unregistered while the message was arriving
+    {
+        pthread_mutex_unlock(&executor_lock);
+        free_queued_message(m);
+        return;
+    }
+    if (subscriber_queue_length[sub_id] >= subscriber_msgqueue_size[sub_id])
+    {
+        queued_message *oldest = subscriber_queue_head[sub_id];
+        subscriber_queue_head[sub_id] = oldest->next;
+        if (!oldest->next) subscriber_queue_tail[sub_id] = 0;
+        subscriber_queue_length[sub_id]--;
+        free_queued_message(oldest);
+        if ((subscriber_dropped[sub_id]++ % 1000) == 0)
+            deros_dbglog_msg_str_int(D_WARN, node_names[subscriber_node_id[sub_id]], "subscriber", "callback does not keep up, messages dropped (adr, total dropped)", addresses[subscriber_address[sub_id]], subscriber_dropped[sub_id]);
+    }
+    if (subscriber_queue_tail[sub_id]) subscriber_queue_tail[sub_id]->next = m;
+    else subscriber_queue_head[sub_id] = m;
+    subscriber_queue_tail[sub_id] = m;
+    subscriber_queue_length[sub_id]++;
+
+    if (!subscriber_scheduled[sub_id]) make_subscriber_ready(sub_id);
+    pthread_mutex_unlock(&executor_lock);
+}
+
+/** add the whole message to the queue of the subscriber, see queue_chunk_for_subscriber() */
+void queue_message_for_subscriber(int sub_id, uint8_t *msg, int msglen, void *shared, message_buffer *buffer)
+{
+    queue_chunk_for_subscriber(sub_id, msg, msglen, 0, msglen, shared, buffer);
+}
+
+/** take the first ready subscriber of the highest priority class this worker serves, executor lock must be held
+ *  @return  subscriber id, or -1 if none is ready */
+int take_ready_subscriber(int worker)
+{
+    int lowest_class = ((worker == 0) && (num_executor_threads > 1)) ? DEROS_PRIORITY_HIGH : DEROS_NUM_PRIORITIES - 1;
+    for (int priority = DEROS_PRIORITY_HIGH; priority <= lowest_class; priority++)
+    {
+        int sub_id = ready_head[priority];
+        if (sub_id < 0) continue;
+        ready_head[priority] = subscriber_next_ready[sub_id];
+        if (ready_head[priority] < 0) ready_tail[priority] = -1;
+        return sub_id;
     }
+    return -1;
+}
 
-    for (int i = 0; i < addr_num_sub[adr_id]; i++)
+/** worker of the callback executor - delivers one message at a time, then lets the other ready subscribers of the same class go first */
+void *subscriber_executor_thread(void *arg)
+{
+    int worker = *((int *)arg);
+    free(arg);
+
+    pthread_mutex_lock(&executor_lock);
+    while (1)
     {
-        int sub_id = addr_subscribers[adr_id][i];
-        if (msglen != subscriber_msgsize[sub_id])
+        int sub_id = take_ready_subscriber(worker);
+        if (sub_id < 0)
         {
-            deros_dbglog_msg_str_2int(D_ERRR, node_names[my_node_id], "subscriber", "msg from publisher to subscriber len mismatch (adr, len1, len2)", adres, msglen, subscriber_msgsize[sub_id]);
-            return 0;
+            pthread_cond_wait(&executor_work, &executor_lock);
+            continue;
+        }
+        queued_message *m = subscriber_queue_head[sub_id];
+        subscriber_queue_head[sub_id] = m->next;
+        if (!m->next) subscriber_queue_tail[sub_id] = 0;
+        subscriber_queue_length[sub_id]--;
+        subscriber_callback_function callback = subscriber_callback[sub_id];
+        subscriber_chunk_callback_function chunk_callback = subscriber_chunk_callback[sub_id];
+        subscriber_running[sub_id] = 1;
+        subscriber_running_thread[sub_id] = pthread_self();
+        pthread_mutex_unlock(&executor_lock);
+
+        if (chunk_callback) chunk_callback(m->message, m->length, m->offset, m->total_length);
+        else if ((m->offset == 0) && (m->length == m->total_length)) callback(m->message, m->length);
+        free_queued_message(m);
+
+        pthread_mutex_lock(&executor_lock);
+        subscriber_running[sub_id] = 0;
+        pthread_cond_broadcast(&executor_callback_done);
+        if (subscriber_queue_head[sub_id]) make_subscriber_ready(sub_id);
+        else subscriber_scheduled[sub_id] = 0;
+    }
+    return 0;
+}
+
+/** start worker threads up to the requested number, executor lock must be held */
+void start_executor_threads()
+{
+    while (num_executor_threads < requested_executor_threads)
+    {
+        int *worker = (int *) malloc(sizeof(int));
+        if (!worker) deros_node_mem_failure("executor thread");
+        *worker = num_executor_threads;
+        pthread_t thr;
+        if (pthread_create(&thr, 0, subscriber_executor_thread, worker) != 0)
+        {
+            deros_dbglog_msg_int(D_GRRR, "sys", "subscriber", "could not create callback thread", errno);
+            exit(1);
         }
+        num_executor_threads++;
+    }
+}
+
+void deros_set_callback_threads(int num_threads)
+{
+    if (num_threads < 1) num_threads = 1;
+    pthread_mutex_lock(&executor_lock);
+    if (num_threads > requested_executor_threads) requested_executor_threads = num_threads;
+    if (num_executor_threads > 0) start_executor_threads();
+    pthread_mutex_unlock(&executor_lock);
+}
 
-        subscriber_callback[sub_id]((uint8_t *)msg, msglen);
+int subscriber_set_priority(int subscriber_id, int priority)
+{
+    if ((subscriber_id < 0) || (subscriber_id >= next_subscriber_id) ||
+        (subscriber_callback[subscriber_id] == 0)) return 0;
+    if ((priority < DEROS_PRIORITY_HIGH) || (priority >= DEROS_NUM_PRIORITIES)) return 0;
+
+    pthread_mutex_lock(&executor_lock);
+    if (subscriber_scheduled[subscriber_id] && !subscriber_running[subscriber_id])
+    {
+        // move it from the ready list of its old class
+        int prev = -1;
+        int old = subscriber_priority[subscriber_id];
+        for (int i = ready_head[old]; i != subscriber_id; i = subscriber_next_ready[i]) prev = i;
+        if (prev < 0) ready_head[old] = subscriber_next_ready[subscriber_id];
+        else subscriber_next_ready[prev] = subscriber_next_ready[subscriber_id];
+        if (ready_tail[old] == subscriber_id) ready_tail[old] = prev;
+        subscriber_priority[subscriber_id] = priority;
+        make_subscriber_ready(subscriber_id);
     }
+    else subscriber_priority[subscriber_id] = priority;
+    pthread_mutex_unlock(&executor_lock);
     return 1;
 }
 
-void *subscriber_handler_for_publisher_thread(void *args)
+int subscriber_set_chunk_callback(int subscriber_id, subscriber_chunk_callback_function callback)
 {
-    int my_node_id = *((int *)args);
-    int my_socket = open_publisher_sockets[num_open_pub_sockets - 1];
-    subscriber_client_thread_runs = 1;
+    if ((subscriber_id < 0) || (subscriber_id >= next_subscriber_id) ||
+        (subscriber_callback[subscriber_id] == 0)) return 0;
+    pthread_mutex_lock(&executor_lock);
+    subscriber_chunk_callback[subscriber_id] = callback;
+    pthread_mutex_unlock(&executor_lock);
+    return 1;
+}
 
-    uint8_t *my_buffer = (uint8_t *)malloc(MAX_PACKET_LENGTH + 1);
-    if (my_buffer == 0) deros_node_mem_failure("sub handler for pub");
-    int packet_size;
+/** subscriber is leaving: throw away its queue and wait until its callback returns (unless it is called from the callback itself) */
+void stop_delivering_to_subscriber(int sub_id)
+{
+    pthread_mutex_lock(&executor_lock);
+    while (subscriber_queue_head[sub_id])
+    {
+        queued_message *m = subscriber_queue_head[sub_id];
+        subscriber_queue_head[sub_id] = m->next;
+        free_queued_message(m);
+    }
+    subscriber_queue_tail[sub_id] = 0;
+    subscriber_queue_length[sub_id] = 0;
+    subscriber_callback[sub_id] = 0;    // receivers that still hold the subscriber id drop their messages
+    subscriber_chunk_callback[sub_id] = 0;
+    if (subscriber_scheduled[sub_id] && !subscriber_running[sub_id])
+    {
+        int prev = -1;
+        int priority = subscriber_priority[sub_id];
+        for (int i = ready_head[priority]; i != sub_id; i = subscriber_next_ready[i]) prev = i;
+        if (prev < 0) ready_head[priority] = subscriber_next_ready[sub_id];
+        else subscriber_next_ready[prev] = subscriber_next_ready[sub_id];
+        if (ready_tail[priority] == sub_id) ready_tail[priority] = prev;
+        subscriber_scheduled[sub_id] = 0;
+    }
+    while (subscriber_running[sub_id] && !pthread_equal(subscriber_running_thread[sub_id], pthread_self()))
+        pthread_cond_wait(&executor_callback_done, &executor_lock);
+    pthread_mutex_unlock(&executor_lock);
+}
 
-    while (1)
+/** forget the large message that has not arrived completely */
+void abandon_chunked_message(chunked_message *chunked)
+{
+    if (chunked->buffer) release_message_buffer(chunked->buffer);
+    chunked->buffer = 0;
+    chunked->assembling = 0;
+}
+
+/** publisher announced which address it will send under the specified topic id (4 bytes id, then the address) 
+ *  @return  1 on success, 0 if the packet was malformed */
+int bind_topic_of_publisher(publisher_connection *conn, uint8_t *packet, int packet_size)
+{
+    if ((packet_size < 5) || (packet_size - 4 > MAX_ADDRESS_LENGTH)) return 0;
+    unsigned int topic_id;
+    deros_retrieve_uint(packet, &topic_id);
+    if (topic_id >= MAX_NUM_PUBLISHERS) return 0;
+
+    if (topic_id >= conn->num_topics)
     {
-        int packet_type = deros_receive_packet(my_socket, my_buffer, &packet_size, MAX_PACKET_LENGTH);
-        if (!packet_type) break;
-        if (!process_packet_from_publisher(my_node_id, packet_type, my_buffer, packet_size))
+        int new_num = topic_id + 1;
+        conn->topic_addr = (int *) realloc(conn->topic_addr, sizeof(int) * new_num);
+        conn->topic_next_seq = (long long *) realloc(conn->topic_next_seq, sizeof(long long) * new_num);
+        conn->topic_chunked = (chunked_message *) realloc(conn->topic_chunked, sizeof(chunked_message) * new_num);
+        if (!conn->topic_addr || !conn->topic_next_seq || !conn->topic_chunked) deros_node_mem_failure("bind topic");
+        for (int i = conn->num_topics; i < new_num; i++) 
         {
-            deros_dbglog_msg_int(D_ERRR, node_names[my_node_id], "subscriber", "sub_handler: a problem with packet from pub, packet_type=", packet_type);
-            break;
+            conn->topic_addr[i] = -1;
+            conn->topic_chunked[i].assembling = 0;
+            conn->topic_chunked[i].buffer = 0;
         }
+        conn->num_topics = new_num;
     }
+    abandon_chunked_message(&conn->topic_chunked[topic_id]);
+
+    char adres[MAX_ADDRESS_LENGTH + 1];
+    memcpy(adres, packet + 4, packet_size - 4);
+    adres[packet_size - 4] = 0;
+    conn->topic_addr[topic_id] = find_or_insert_matched_address(adres);
+    conn->topic_next_seq[topic_id] = -1;
+    if (conn->topic_addr[topic_id] < 0)  // msg to address we do not know yet are ignored with warning
+        deros_dbglog_msg_str(D_WARN, node_names[conn->node_id], "subscriber", "publisher bound topic to unrecognized address=", adres);
+    else
+        deros_dbglog_msg_str_int(D_DEBG, node_names[conn->node_id], "subscriber", "publisher bound topic (adr, topic_id)", adres, topic_id);
+    return 1;
+}
+
+/** a message of the publisher starts to arrive, check that none was lost before it */
+void check_message_seq(publisher_connection *conn, int adr_id, deros_msg_header *header)
+{
+    if ((conn->topic_next_seq[header->topic_id] >= 0) && (header->seq != conn->topic_next_seq[header->topic_id]))
+        deros_dbglog_msg_str_2int(D_WARN, node_names[conn->node_id], "subscriber", "messages from publisher lost (adr, expected seq, seq)", addresses[adr_id], conn->topic_next_seq[header->topic_id], header->seq);
+    conn->topic_next_seq[header->topic_id] = header->seq + 1LL;
+}
+
+/** deliver a message (header and contents) from a publisher to the subscribers of the node
+ *  @param buffer  message buffer that contains the message, or 0 if the message has to be copied
+ *  @return  1 on success, 0 if the message was malformed */
+int deliver_message_from_publisher(publisher_connection *conn, uint8_t *packet, int packet_size, message_buffer *buffer)
+{
+    if (packet_size < MSG_HEADER_LENGTH) return 0;
+
+    deros_msg_header header;
+    deros_retrieve_msg_header(packet, &header);
+    if ((header.topic_id >= conn->num_topics) || (header.length != packet_size - MSG_HEADER_LENGTH)) return 0;
 
-    deros_dbglog_msg_str(D_INFO, node_names[my_node_id], "subscriber", "deros_subscriber_handler: a publisher node disconnected (node)", node_names[my_node_id]);
-    //lock
-    for (int i = 0; i < num_open_pub_sockets; i++)
-        if (my_socket == open_publisher_sockets[i])
+    int adr_id = conn->topic_addr[header.topic_id];
+    if (adr_id < 0) return 1;
+    check_message_seq(conn, adr_id, &header);
+
+    uint8_t *msg = packet + MSG_HEADER_LENGTH;
+    int msglen = header.length;
+    int num_subs;
+    int *subs = address_subscribers(adr_id, &num_subs);
+    for (int i = 0; i < num_subs; i++)
+    {
+        int sub_id = subs[i];
+        if (subscriber_node_id[sub_id] != conn->node_id) continue;   // other nodes of the process have their own connections
+        if ((subscriber_msgsize[sub_id] >= 0) && (msglen != subscriber_msgsize[sub_id]))
         {
-            open_publisher_sockets[i] = open_publisher_sockets[--num_open_pub_sockets];
-            break;
+            deros_dbglog_msg_str_2int(D_ERRR, node_names[conn->node_id], "subscriber", "msg from publisher to subscriber len mismatch (adr, len1, len2)", addresses[adr_id], msglen, subscriber_msgsize[sub_id]);
+            continue;
         }
-    // unlock
 
-    close(my_socket);
-    free(my_buffer);
-    return 0;
+        queue_message_for_subscriber(sub_id, msg, msglen, 0, buffer);
+    }
+    return 1;
 }
 
-void *subscriber_listen_thread(void *args)
+/** a chunk of a large message arrived from a publisher, subscribers with a chunk callback get it right away,
+ *  for the others the message is assembled and delivered when its last chunk arrives
+ *  @return  1 on success, 0 if the chunk was malformed */
+int process_message_chunk(publisher_connection *conn, uint8_t *packet, int packet_size)
 {
-    int my_node_id = next_free_node_id;
+    if (packet_size < CHUNK_HEADER_LENGTH) return 0;
+
+    deros_msg_header header;
+    unsigned int offset;
+    deros_retrieve_msg_header(packet, &header);
+    deros_retrieve_uint(packet + MSG_HEADER_LENGTH, &offset);
+    uint8_t *chunk = packet + CHUNK_HEADER_LENGTH;
+    unsigned int length = packet_size - CHUNK_HEADER_LENGTH;
+    if ((header.topic_id >= conn->num_topics) || (header.length > MAX_MESSAGE_LENGTH) || 
+        (offset > header.length) || (length > header.length - offset)) return 0;
+
+    int adr_id = conn->topic_addr[header.topic_id];
+    if (adr_id < 0) return 1;
+
+    chunked_message *chunked = &conn->topic_chunked[header.topic_id];
+    if (offset == 0)
+    {
+        if (chunked->assembling)
+            deros_dbglog_msg_str_int(D_WARN, node_names[conn->node_id], "subscriber", "incomplete chunked message abandoned (adr, seq)", addresses[adr_id], chunked->seq);
+        abandon_chunked_message(chunked);
+        check_message_seq(conn, adr_id, &header);
+        chunked->assembling = 1;
+        chunked->seq = header.seq;
+        chunked->length = header.length;
+        chunked->received = 0;
+        int num_subs;
+        int *subs = address_subscribers(adr_id, &num_subs);
+        for (int i = 0; i < num_subs; i++)
+        {
+            int sub_id = subs[i];
+            if ((subscriber_node_id[sub_id] == conn->node_id) && !subscriber_chunk_callback[sub_id])
+            {
+                chunked->buffer = new_message_buffer(0, header.length, 0);
+                break;
+            }
+        }
+    }
+    else if (!chunked->assembling || (chunked->seq != header.seq) || (chunked->length != header.length) || (chunked->received != offset))
+    {
+        deros_dbglog_msg_str_2int(D_WARN, node_names[conn->node_id], "subscriber", "unexpected chunk from publisher ignored (adr, seq, offset)", addresses[adr_id], header.seq, offset);
+        return 1;
+    }
+
+    if (chunked->buffer) memcpy(chunked->buffer->data + offset, chunk, length);
+    chunked->received += length;
+    int complete = (chunked->received == chunked->length);
+
+    int num_subs;
+    int *subs = address_subscribers(adr_id, &num_subs);
+    for (int i = 0; i < num_subs; i++)
+    {
+        int sub_id = subs[i];
+        if (subscriber_node_id[sub_id] != conn->node_id) continue;
+        if ((subscriber_msgsize[sub_id] >= 0) && (header.length != subscriber_msgsize[sub_id]))
+        {
+            if (offset == 0)
+                deros_dbglog_msg_str_2int(D_ERRR, node_names[conn->node_id], "subscriber", "chunked msg from publisher to subscriber len mismatch (adr, len1, len2)", addresses[adr_id], header.length, subscriber_msgsize[sub_id]);
+            continue;
+        }
+        if (subscriber_chunk_callback[sub_id]) queue_chunk_for_subscriber(sub_id, chunk, length, offset, header.length, 0, 0);
+        else if (complete && chunked->buffer) queue_message_for_subscriber(sub_id, chunked->buffer->data, header.length, 0, chunked->buffer);
+    }
+    if (complete) abandon_chunked_message(chunked);   // the subscribers hold the buffer now
+    return 1;
+}
 
-    subscriber_listen_thread_runs = 1;
+/** a large message arrived in a memory file, its descriptor came with the packet, the file is mapped 
+ *  and the subscribers get the message in place
+ *  @return  1 on success, 0 if the descriptor is missing or the file is not sealed */
+int deliver_mapped_message(publisher_connection *conn)
+{
+    int fd = deros_rxbuf_take_fd(&conn->rx);
+    if (fd < 0) return 0;
 
-    int deros_sub_server_socket = deros_create_server(node_listen_ports[my_node_id]);
-    if (!deros_sub_server_socket) 
+    // the publisher cannot modify a sealed file nor make it shorter while the subscribers read it
+    int seals = fcntl(fd, F_GET_SEALS);
+    struct stat st;
+    if ((seals < 0) || ((seals & (F_SEAL_SHRINK | F_SEAL_WRITE)) != (F_SEAL_SHRINK | F_SEAL_WRITE)) || 
+        (fstat(fd, &st) < 0) || (st.st_size < MSG_HEADER_LENGTH) || (st.st_size > MSG_HEADER_LENGTH + MAX_MESSAGE_LENGTH))
     {
-        deros_dbglog_msg(D_ERRR, node_names[my_node_id], "subscriber", "deros subscriber: cannot create listening socket");
+        close(fd);
         return 0;
     }
+    uint8_t *data = (uint8_t *) mmap(0, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED)
+    {
+        deros_dbglog_msg_int(D_ERRR, node_names[conn->node_id], "subscriber", "could not map message file, errno=", errno);
+        return 0;
+    }
+
+    message_buffer *buffer = new_message_buffer(data, st.st_size, 1);
+    int ok = deliver_message_from_publisher(conn, data, st.st_size, buffer);
+    release_message_buffer(buffer);
+    return ok;
+}
+
+/** deliver a message or process a control packet that arrived from a publisher 
+ *  @return  1 on success, 0 if the packet was malformed */
+int process_packet_from_publisher(publisher_connection *conn, uint8_t packet_type, uint8_t *packet, int packet_size)
+{
+    if (packet_type == PACKET_TOPIC_BIND) return bind_topic_of_publisher(conn, packet, packet_size);
+    if (packet_type == PACKET_NEW_MESSAGE) return deliver_message_from_publisher(conn, packet, packet_size, 0);
+    if (packet_type == PACKET_MEMFD_MESSAGE) return deliver_mapped_message(conn);
+    if (packet_type == PACKET_MESSAGE_CHUNK) return process_message_chunk(conn, packet, packet_size);
+    return 0;
+}
+
+int deliver_local_message(int node_id, int adr_id, uint8_t *msg, int msglen, void *shared)
+{
+    int ok = 1;
+    int num_subs;
+    int *subs = address_subscribers(adr_id, &num_subs);
+    for (int i = 0; i < num_subs; i++)
+    {
+        int sub_id = subs[i];
+        if (subscriber_node_id[sub_id] != node_id) continue;
+        if ((subscriber_msgsize[sub_id] >= 0) && (msglen != subscriber_msgsize[sub_id]))
+        {
+            deros_dbglog_msg_str_2int(D_ERRR, node_names[node_id], "subscriber", "msg from local publisher to subscriber len mismatch (adr, len1, len2)", addresses[adr_id], msglen, subscriber_msgsize[sub_id]);
+            ok = 0;
+            continue;
+        }
+        queue_message_for_subscriber(sub_id, msg, msglen, shared, 0);
+    }
+    return ok;
+}
+
+/** @return  the state of messages from the publisher, it is created when its first datagram arrives */
+datagram_source *find_datagram_source(publisher_connection *conn, struct sockaddr_in *from, uint32_t topic_id)
+{
+    for (int i = 0; i < conn->num_sources; i++)
+    {
+        datagram_source *source = &conn->sources[i];
+        if ((source->topic_id == topic_id) && (source->from.sin_port == from->sin_port) && 
+            (source->from.sin_addr.s_addr == from->sin_addr.s_addr)) return source;
+    }
+
+    datagram_source *source;
+    if (conn->num_sources < MAX_DATAGRAM_SOURCES)
+    {
+        conn->sources = (datagram_source *) realloc(conn->sources, sizeof(datagram_source) * (conn->num_sources + 1));
+        if (!conn->sources) deros_node_mem_failure("datagram source");
+        source = &conn->sources[conn->num_sources++];
+        source->fragment_received = 0;
+        source->message = 0;
+        source->capacity = 0;
+    }
+    else   // publishers that have left are forgotten eventually
+    {
+        source = &conn->sources[conn->next_replaced_source];
+        conn->next_replaced_source = (conn->next_replaced_source + 1) % MAX_DATAGRAM_SOURCES;
+    }
+    source->from = *from;
+    source->topic_id = topic_id;
+    source->next_seq = -1;
+    source->assembling = 0;
+    source->lost = 0;
+    source->loss_reports = 0;
+    return source;
+}
+
+/** deliver a complete message that arrived in datagrams to the subscribers of the node, lost messages are counted */
+void deliver_datagram_message(publisher_connection *conn, datagram_source *source, int adr_id, deros_msg_header *header, uint8_t *msg)
+{
+    if ((source->next_seq >= 0) && (header->seq != (uint32_t) source->next_seq))
+    {
+        source->lost += (uint32_t) (header->seq - (uint32_t) source->next_seq);
+        if ((source->loss_reports++ % 1000) == 0)
+            deros_dbglog_msg_str_2int(D_WARN, node_names[conn->node_id], "subscriber", "datagram messages from publisher lost (adr, seq, lost in total)", addresses[adr_id], header->seq, source->lost);
+    }
+    source->next_seq = (uint32_t) (header->seq + 1);
+
+    int num_subs;
+    int *subs = address_subscribers(adr_id, &num_subs);
+    for (int i = 0; i < num_subs; i++)
+    {
+        int sub_id = subs[i];
+        if (subscriber_node_id[sub_id] != conn->node_id) continue;
+        // addresses may share a multicast group, the node can be subscribed to this one through TCP
+        if ((conn->datagram == DEROS_TRANSPORT_MULTICAST) && (subscriber_transport[sub_id] != DEROS_TRANSPORT_MULTICAST)) continue;
+        if ((subscriber_msgsize[sub_id] >= 0) && (header->length != subscriber_msgsize[sub_id]))
+        {
+            deros_dbglog_msg_str_2int(D_ERRR, node_names[conn->node_id], "subscriber", "datagram msg from publisher to subscriber len mismatch (adr, len1, len2)", addresses[adr_id], header->length, subscriber_msgsize[sub_id]);
+            continue;
+        }
+        queue_message_for_subscriber(sub_id, msg, header->length, 0, 0);
+    }
+}
+
+/** a datagram with a fragment of a message arrived, the message is delivered when all its fragments have arrived,
+ *  an incomplete message is abandoned when a fragment of a newer message arrives, late fragments are ignored
+ *  @return  1 on success, 0 if the datagram was malformed */
+int process_datagram(publisher_connection *conn, uint8_t *datagram, int size, struct sockaddr_in *from)
+{
+    deros_datagram_header header;
+    if (size < DATAGRAM_HEADER_LENGTH) return 0;
+    deros_retrieve_datagram_header(datagram, &header);
+
+    int payload = deros_fragment_payload(header.address_length);
+    if ((header.address_length == 0) || (header.address_length > MAX_ADDRESS_LENGTH) || 
+        (size < DATAGRAM_HEADER_LENGTH + header.address_length) || (header.msg.length > MAX_MESSAGE_LENGTH) || 
+        (header.num_fragments != ((header.msg.length > 0) ? (header.msg.length + payload - 1) / payload : 1)) ||
+        (header.fragment >= header.num_fragments)) return 0;
+    uint32_t offset = header.fragment * payload;
+    uint8_t *fragment = datagram + DATAGRAM_HEADER_LENGTH + header.address_length;
+    int length = size - DATAGRAM_HEADER_LENGTH - header.address_length;
+    if (length != ((header.msg.length - offset < payload) ? header.msg.length - offset : payload)) return 0;
+
+    char adres[MAX_ADDRESS_LENGTH + 1];
+    memcpy(adres, datagram + DATAGRAM_HEADER_LENGTH, header.address_length);
+    adres[header.address_length] = 0;
+    int adr_id = find_or_insert_matched_address(adres);
+    if (adr_id < 0) return 1;   // a subscriber that has left, or another address of the same multicast group
+
+    datagram_source *source = find_datagram_source(conn, from, header.msg.topic_id);
+    if ((source->next_seq >= 0) && ((int32_t) (header.msg.seq - (uint32_t) source->next_seq) < 0)) return 1;   // late or repeated
+    if (header.num_fragments == 1)
+    {
+        deliver_datagram_message(conn, source, adr_id, &header.msg, fragment);
+        return 1;
+    }
+
+    if (source->assembling && (source->seq != header.msg.seq))
+    {
+        if ((int32_t) (header.msg.seq - source->seq) < 0) return 1;   // fragment of an abandoned message
+        source->assembling = 0;   // some fragment is lost, the message will be counted as lost
+    }
+    if (!source->assembling)
+    {
+        if (source->capacity < header.msg.length)
+        {
+            free(source->message);
+            free(source->fragment_received);
+            source->message = (uint8_t *) malloc(header.msg.length);
+            source->fragment_received = (uint8_t *) malloc(header.num_fragments);
+            if (!source->message || !source->fragment_received) deros_node_mem_failure("datagram reassembly");
+            source->capacity = header.msg.length;
+        }
+        memset(source->fragment_received, 0, header.num_fragments);
+        source->assembling = 1;
+        source->seq = header.msg.seq;
+        source->length = header.msg.length;
+        source->num_fragments = header.num_fragments;
+        source->fragments_received = 0;
+    }
+    else if (source->length != header.msg.length) return 0;
+
+    if (source->fragment_received[header.fragment]) return 1;
+    memcpy(source->message + offset, fragment, length);
+    source->fragment_received[header.fragment] = 1;
+    if (++source->fragments_received == source->num_fragments)
+    {
+        source->assembling = 0;
+        deliver_datagram_message(conn, source, adr_id, &header.msg, source->message);
+    }
+    return 1;
+}
+
+/** receive all datagrams waiting at the datagram socket of a node, in batches */
+void receive_datagrams(publisher_connection *conn)
+{
+    struct mmsghdr datagrams[UDP_RECEIVE_BATCH];
+    struct iovec iov[UDP_RECEIVE_BATCH];
+    struct sockaddr_in from[UDP_RECEIVE_BATCH];
+
+    int received;
     do {
+        memset(datagrams, 0, sizeof(datagrams));
+        for (int i = 0; i < UDP_RECEIVE_BATCH; i++)
+        {
+            iov[i].iov_base = conn->datagram_buffers + i * UDP_DATAGRAM_SIZE;
+            iov[i].iov_len = UDP_DATAGRAM_SIZE;
+            datagrams[i].msg_hdr.msg_iov = &iov[i];
+            datagrams[i].msg_hdr.msg_iovlen = 1;
+            datagrams[i].msg_hdr.msg_name = &from[i];
+            datagrams[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+        }
+        received = recvmmsg(conn->socket, datagrams, UDP_RECEIVE_BATCH, MSG_DONTWAIT, 0);
+        if (received < 0)
+        {
+            if (errno == EINTR) continue;
+            if ((errno != EAGAIN) && (errno != EWOULDBLOCK))
+                deros_dbglog_msg_int(D_ERRR, node_names[conn->node_id], "subscriber", "receiving datagrams failed, errno=", errno);
+            return;
+        }
+        for (int i = 0; i < received; i++)
+            if ((datagrams[i].msg_hdr.msg_flags & MSG_TRUNC) || 
+                !process_datagram(conn, (uint8_t *) iov[i].iov_base, datagrams[i].msg_len, &from[i]))
+                deros_dbglog_msg_int(D_WARN, node_names[conn->node_id], "subscriber", "malformed datagram, size=", datagrams[i].msg_len);
+    } while (received == UDP_RECEIVE_BATCH);
+}
+
+/** publisher on the same host asked to push its messages through a shared memory ring, try to map it
+ *  @return  the mapped ring, or 0 if it could not be used */
+deros_shm_ring *attach_publisher_shm_ring(publisher_connection *conn, uint8_t *packet, int packet_size)
+{
+    char name[DEROS_SHM_NAME_LENGTH];
+    deros_shm_ring *ring = 0;
+    if (packet_size < DEROS_SHM_NAME_LENGTH)
+    {
+        memcpy(name, packet, packet_size);
+        name[packet_size] = 0;
+        ring = deros_shm_ring_attach(name);
+    }
+    uint8_t reply = ring ? '1' : '0';
+    if (!deros_send_packet(conn->socket, PACKET_SHM_ATTACHED, &reply, 1))
+        deros_dbglog_msg(D_WARN, node_names[conn->node_id], "subscriber", "could not confirm shared memory ring to publisher");
+    return ring;
+}
+
+/** deliver the messages waiting in the shared memory ring, they are processed in place without copying,
+ *  stops at a mark of a message that was too long for the ring, it comes through the socket
+ *  @return  1 on success, 0 if some message was malformed */
+int drain_publisher_shm_ring(publisher_connection *conn)
+{
+    uint8_t packet_type;
+    int packet_size;
+    uint8_t *packet;
 
-        int new_client_socket = deros_wait_for_client_connection(deros_sub_server_socket);
-        if (new_client_socket == 0) break;
+    while ((packet = deros_shm_ring_peek(conn->ring, &packet_type, &packet_size)))
+    {
+        if (packet_type == PACKET_SHM_VIA_SOCKET)
+        {
+            conn->waiting_for_socket_message = 1;   // the mark is released after the message is processed
+            return 1;
+        }
+        int ok = process_packet_from_publisher(conn, packet_type, packet, packet_size);
+        deros_shm_ring_release(conn->ring);
+        if (!ok) return 0;
+    }
+    return 1;
+}
 
-        subscriber_client_thread_runs = 0;
-        open_publisher_sockets[num_open_pub_sockets++] = new_client_socket;
+/** process all complete packets that arrived from the publisher so far, and all messages in its shared memory ring
+ *  @return  1 on success, 0 if the connection should be closed */
+int process_publisher_connection(publisher_connection *conn)
+{
+    uint8_t *packet;
+    int packet_size;
 
-        pthread_t thr;
-        pthread_create(&thr, 0, subscriber_handler_for_publisher_thread, &my_node_id);
+    while (1)
+    {
+        if (conn->ring && !conn->waiting_for_socket_message && !drain_publisher_shm_ring(conn)) return 0;
+
+        uint8_t packet_type = deros_rxbuf_peek_packet(&conn->rx, &packet, &packet_size);
+        if (packet_type == 255) return 0;
+        if (packet_type == 0)
+        {
+            // wait for more data, the publisher will ring the doorbell when it writes to the ring
+            if (!conn->ring || conn->waiting_for_socket_message || deros_shm_ring_prepare_wait(conn->ring)) return 1;
+            continue;
+        }
+
+        int ok = 1;
+        if (packet_type == PACKET_SHM_ATTACH)
+        {
+            if (!conn->ring) conn->ring = attach_publisher_shm_ring(conn, packet, packet_size);
+        }
+        else if ((packet_type != PACKET_SHM_DOORBELL) && (packet_type != PACKET_HEARTBEAT))
+        {
+            ok = process_packet_from_publisher(conn, packet_type, packet, packet_size);
+            if (conn->waiting_for_socket_message && 
+                ((packet_type == PACKET_NEW_MESSAGE) || (packet_type == PACKET_MEMFD_MESSAGE) || (packet_type == PACKET_MESSAGE_CHUNK)))
+            {
+                deros_shm_ring_release(conn->ring);
+                conn->waiting_for_socket_message = 0;
+            }
+        }
+        deros_rxbuf_consume_packet(&conn->rx);
+        if (!ok)
+        {
+            deros_dbglog_msg_int(D_ERRR, node_names[conn->node_id], "subscriber", "a problem with packet from pub, packet_type=", packet_type);
+            return 0;
+        }
+    }
+}
 
-        while (!subscriber_client_thread_runs) usleep(1);
+/** create the state of a new connection and let the receive thread watch it */
+publisher_connection *add_publisher_connection(int node_id, int socket, int listening, int datagram)
+{
+    publisher_connection *conn = (publisher_connection *) malloc(sizeof(publisher_connection));
+    if (!conn) deros_node_mem_failure("new publisher connection");
+    conn->node_id = node_id;
+    conn->socket = socket;
+    conn->listening = listening;
+    conn->datagram = datagram;
+    conn->datagram_buffers = 0;
+    conn->sources = 0;
+    conn->num_sources = 0;
+    conn->next_replaced_source = 0;
+    if (datagram)
+    {
+        conn->datagram_buffers = (uint8_t *) malloc(UDP_RECEIVE_BATCH * UDP_DATAGRAM_SIZE);
+        if (!conn->datagram_buffers) deros_node_mem_failure("datagram buffers");
+    }
+    else if (!listening) deros_rxbuf_init(&conn->rx);
+    conn->ring = 0;
+    conn->waiting_for_socket_message = 0;
+    conn->topic_addr = 0;
+    conn->topic_next_seq = 0;
+    conn->topic_chunked = 0;
+    conn->num_topics = 0;
+    conn->prev = conn->next = 0;
+    conn->last_heard_ms = conn->last_heartbeat_ms = deros_monotonic_ms();
 
-    } while (1);
-    deros_dbglog_msg_str(D_INFO, node_names[my_node_id], "subscriber", "subscriber_listen_thread for node terminates (node)", node_names[my_node_id]);
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.ptr = conn;
+    if (epoll_ctl(subscriber_epoll, EPOLL_CTL_ADD, socket, &ev) < 0)
+    {
+        deros_dbglog_msg_int(D_ERRR, node_names[node_id], "subscriber", "could not watch publisher connection, errno=", errno);
+        close(socket);
+        if (!listening && !datagram) deros_rxbuf_free(&conn->rx);
+        free(conn->datagram_buffers);
+        free(conn);
+        return 0;
+    }
+    if (!listening && !datagram)
+    {
+        conn->next = publisher_connections;
+        if (publisher_connections) publisher_connections->prev = conn;
+        publisher_connections = conn;
+    }
+    return conn;
+}
+
+void close_publisher_connection(publisher_connection *conn)
+{
+    deros_dbglog_msg_str(D_INFO, node_names[conn->node_id], "subscriber", "a publisher node disconnected (node)", node_names[conn->node_id]);
+    epoll_ctl(subscriber_epoll, EPOLL_CTL_DEL, conn->socket, 0);
+    close(conn->socket);
+    if (conn->prev) conn->prev->next = conn->next;
+    else publisher_connections = conn->next;
+    if (conn->next) conn->next->prev = conn->prev;
+    if (conn->ring) deros_shm_ring_close(conn->ring);
+    deros_rxbuf_free(&conn->rx);
+    for (int i = 0; i < conn->num_topics; i++)
+        abandon_chunked_message(&conn->topic_chunked[i]);
+    free(conn->topic_addr);
+    free(conn->topic_next_seq);
+    free(conn->topic_chunked);
+    free(conn);
+}
+
+/** accept all pending connections from publishers on the listening socket of a node */
+void accept_publisher_connections(publisher_connection *listener)
+{
+    int new_socket;
+    while ((new_socket = accept(listener->socket, 0, 0)) >= 0)
+    {
+        deros_dbglog_msg_int(D_DEBG, node_names[listener->node_id], "subscriber", "accepted publisher connection, socket=", new_socket);
+        deros_apply_socket_options(new_socket, &node_socket_options[listener->node_id]);
+        if (deros_set_nonblocking(new_socket)) add_publisher_connection(listener->node_id, new_socket, 0, 0);
+        else close(new_socket);
+    }
+    if ((errno != EAGAIN) && (errno != EWOULDBLOCK) && (errno != EINTR))
+        deros_dbglog_msg_int(D_ERRR, node_names[listener->node_id], "subscriber", "accept failed, errno=", errno);
+}
+
+/** send heartbeats to the publisher nodes, they do not hear from the subscriber otherwise, and close the connections 
+ *  from publisher nodes that have sent nothing for the heartbeat timeout of their subscriber node
+ *  @return  milliseconds until the next heartbeat or timeout, -1 if there is none */
+int check_publisher_heartbeats()
+{
+    long long now = deros_monotonic_ms();
+    int timeout = -1;
+    publisher_connection *next;
+    for (publisher_connection *conn = publisher_connections; conn; conn = next)
+    {
+        next = conn->next;
+        int interval_ms = node_heartbeat_interval_ms[conn->node_id];
+        int timeout_ms = node_heartbeat_timeout_ms[conn->node_id];
+        if (!interval_ms) continue;
+        if (now - conn->last_heard_ms > timeout_ms)
+        {
+            deros_dbglog_msg_int(D_WARN, node_names[conn->node_id], "subscriber", "publisher node has been silent for too long, socket=", conn->socket);
+            close_publisher_connection(conn);
+            continue;
+        }
+        if (now - conn->last_heartbeat_ms >= interval_ms)
+        {
+            if (!deros_send_packet(conn->socket, PACKET_HEARTBEAT, (uint8_t *)"", 0))
+            {
+                close_publisher_connection(conn);
+                continue;
+            }
+            conn->last_heartbeat_ms = now;
+        }
+        long long wake_ms = conn->last_heartbeat_ms + interval_ms;
+        long long deadline_ms = conn->last_heard_ms + timeout_ms + 1;
+        if (deadline_ms < wake_ms) wake_ms = deadline_ms;
+        if ((timeout < 0) || (wake_ms - now < timeout)) timeout = (int)(wake_ms - now);
+    }
+    return timeout;
+}
+
+/** a single thread receives from all publisher connections of all nodes of this process */
+void *subscriber_receive_thread(void *args)
+{
+    struct epoll_event events[SUBSCRIBER_MAX_EPOLL_EVENTS];
+    long long next_heartbeat_check_ms = 0;
+
+    while (1)
+    {
+        // heartbeats are only checked when one is due, or when the heartbeat settings of some node may have changed
+        int timeout = -1;
+        long long now = deros_monotonic_ms();
+        if (now >= next_heartbeat_check_ms)
+        {
+            timeout = check_publisher_heartbeats();
+            next_heartbeat_check_ms = (timeout < 0) ? 0 : now + timeout;
+        }
+        else timeout = (int)(next_heartbeat_check_ms - now);
+        int n = epoll_wait(subscriber_epoll, events, SUBSCRIBER_MAX_EPOLL_EVENTS, timeout);
+        if (n < 0)
+        {
+            if (errno == EINTR) continue;
+            deros_dbglog_msg_int(D_ERRR, "sys", "subscriber", "epoll_wait failed, errno=", errno);
+            break;
+        }
+        for (int i = 0; i < n; i++)
+        {
+            publisher_connection *conn = (publisher_connection *) events[i].data.ptr;
+            if (conn->listening) accept_publisher_connections(conn);
+            else if (conn->datagram) receive_datagrams(conn);
+            else
+            {
+                conn->last_heard_ms = deros_monotonic_ms();
+                int open = deros_rxbuf_fill(&conn->rx, conn->socket);
+                // the publisher may close the connection right after writing its last messages to the ring
+                if (!process_publisher_connection(conn) || !open)
+                    close_publisher_connection(conn);
+            }
+        }
+    }
+    deros_dbglog_msg(D_INFO, "sys", "subscriber", "subscriber receive thread terminates");
     return 0;
 }
 
-void start_subscriber_listen_thread()
+void subscriber_listen(int node_id)
 {
-    if (subscriber_listen_thread_runs) return;
+    if (subscriber_epoll < 0)
+    {
+        subscriber_epoll = epoll_create1(0);
+        if (subscriber_epoll < 0)
+        {
+            deros_dbglog_msg_int(D_GRRR, "sys", "subscriber", "could not create epoll instance", errno);
+            exit(1);
+        }
+        pthread_t thr;
+        if (pthread_create(&thr, 0, subscriber_receive_thread, 0) != 0)
+        {
+            deros_dbglog_msg_int(D_GRRR, "sys", "subscriber", "could not create subscriber receive thread", errno);
+            exit(1);
+        }
+    }
+
+    int listen_socket = deros_create_server(node_listen_ports[node_id]);
+    if (!listen_socket || !deros_set_nonblocking(listen_socket))
+    {
+        deros_dbglog_msg_int(D_ERRR, "sys", "subscriber", "deros subscriber: cannot create listening socket on port", node_listen_ports[node_id]);
+        return;
+    }
+    add_publisher_connection(node_id, listen_socket, 1, 0);
+
+    // publishers on the same host connect here
+    int local_socket = deros_create_local_server(node_listen_ports[node_id]);
+    if (local_socket && deros_set_nonblocking(local_socket)) add_publisher_connection(node_id, local_socket, 1, 0);
+    else deros_dbglog_msg_int(D_WARN, "sys", "subscriber", "deros subscriber: no local socket, publishers on the same host use TCP, port", node_listen_ports[node_id]);
 
-    pthread_t thr;
-    if (pthread_create(&thr, 0, subscriber_listen_thread, 0) != 0)
+    int datagram_socket = deros_create_datagram_socket(node_listen_ports[node_id], 0);
+    if (!datagram_socket)
     {
-        deros_dbglog_msg_int(D_GRRR, "sys", "subscriber", "could not create subscriber listening thread", errno);
-        exit(1);
+        deros_dbglog_msg_int(D_ERRR, "sys", "subscriber", "deros subscriber: cannot create datagram socket on port", node_listen_ports[node_id]);
+        return;
     }
-    while (!subscriber_listen_thread_runs) usleep(1);
+    add_publisher_connection(node_id, datagram_socket, 0, DEROS_TRANSPORT_UDP);
+}
+
+/** the node joins the multicast group of the address, its socket for multicast groups is created with the first one, 
+ *  node mutex must be held
+ *  @return  1 on success, 0 if the group could not be joined */
+int join_multicast_group(int node_id, char *address)
+{
+    if (!node_multicast_socket[node_id])
+    {
+        int sock = deros_create_datagram_socket(DEROS_MULTICAST_PORT, 1);
+        if (!sock) return 0;
+        int all = 0;   // only the groups joined with this socket, not those of the other nodes
+        setsockopt(sock, IPPROTO_IP, IP_MULTICAST_ALL, &all, sizeof(all));
+        if (!add_publisher_connection(node_id, sock, 0, DEROS_TRANSPORT_MULTICAST)) return 0;
+        node_multicast_socket[node_id] = sock;
+    }
+
+    struct ip_mreq membership;
+    address_multicast_group(address, &membership.imr_multiaddr);
+    membership.imr_interface = multicast_interface;
+    if ((setsockopt(node_multicast_socket[node_id], IPPROTO_IP, IP_ADD_MEMBERSHIP, &membership, sizeof(membership)) < 0) && 
+        (errno != EADDRINUSE))   // another address of the node shares the group
+    {
+        deros_dbglog_msg_str_int(D_ERRR, node_names[node_id], "subscriber", "could not join multicast group (adr, errno)", address, errno);
+        return 0;
+    }
+    return 1;
+}
+
+/** the node leaves the multicast group of the address, unless its other multicast subscribers need it, node mutex must be held */
+void leave_multicast_group(int node_id, int leaving_sub_id)
+{
+    struct ip_mreq membership;
+    address_multicast_group(addresses[subscriber_address[leaving_sub_id]], &membership.imr_multiaddr);
+    membership.imr_interface = multicast_interface;
+    for (int sub_id = 0; sub_id < next_subscriber_id; sub_id++)
+    {
+        if ((sub_id == leaving_sub_id) || (subscriber_callback[sub_id] == 0) || (subscriber_node_id[sub_id] != node_id) ||
+            (subscriber_transport[sub_id] != DEROS_TRANSPORT_MULTICAST)) continue;
+        struct in_addr group;
+        address_multicast_group(addresses[subscriber_address[sub_id]], &group);
+        if (group.s_addr == membership.imr_multiaddr.s_addr) return;
+    }
+    setsockopt(node_multicast_socket[node_id], IPPROTO_IP, IP_DROP_MEMBERSHIP, &membership, sizeof(membership));
 }
 
 
 int subscriber_register(int node_id, char *address, int message_size, subscriber_callback_function callback, int message_queue_size)
+{
+    return subscriber_register_with_history(node_id, address, message_size, callback, message_queue_size, DEROS_TRANSPORT_TCP, DEROS_HISTORY_ALL);
+}
+
+int subscriber_register_with_transport(int node_id, char *address, int message_size, subscriber_callback_function callback, int message_queue_size, int transport)
+{
+    return subscriber_register_with_history(node_id, address, message_size, callback, message_queue_size, transport, DEROS_HISTORY_ALL);
+}
+
+int subscriber_register_with_history(int node_id, char *address, int message_size, subscriber_callback_function callback, int message_queue_size, int transport, int history)
 {
     if (strlen(address) > MAX_ADDRESS_LENGTH) return -1;
+    if ((transport < DEROS_TRANSPORT_TCP) || (transport > DEROS_TRANSPORT_MULTICAST)) return -1;
+    if ((history != DEROS_HISTORY_ALL) && (history != DEROS_HISTORY_LATEST)) return -1;
+    if ((transport == DEROS_TRANSPORT_MULTICAST) && address_is_pattern(address)) return -1;   // no group to join
 
     if (pthread_mutex_lock(&node_mutexes[node_id])) return -1;
 
     if ((node_id < 0) ||
         (node_id >= next_free_node_id) ||
-        (node_server_sockets[node_id] == 0))
+        !node_active[node_id])
     {
         pthread_mutex_unlock(&node_mutexes[node_id]);
         return -1;
     }
 
-    uint8_t *my_buffer = (uint8_t *) malloc(strlen(address) + 12);
-    if (!my_buffer) deros_node_mem_failure("sub register");
-
-    sprintf((char *)my_buffer, "%d!%s", message_size, address);
-
-    if (!deros_send_packet(node_server_sockets[node_id], PACKET_SUB_REGISTER, my_buffer, strlen((char *)my_buffer)))
+    if ((transport == DEROS_TRANSPORT_MULTICAST) && !join_multicast_group(node_id, address))
     {
-        deros_dbglog_msg(D_ERRR, node_names[node_id], "subscriber", "sending register subscriber packet failed");
-        close(node_server_sockets[node_id]);
-        node_server_sockets[node_id] = 0;
         pthread_mutex_unlock(&node_mutexes[node_id]);
-        free(my_buffer);
         return -1;
     }
-    deros_dbglog_msg(D_DEBG, node_names[node_id], "subscriber", "sent register subscriber packet");
 
+    char size_prefix[32];
+    int prefix_len = sprintf(size_prefix, "%d!%d!%d!", message_size, transport, history);
+
+    // the subscriber must be ready before the register packet leaves, publishers in this process may deliver their history immediately
     int sub_id = 0;
     while (sub_id < next_subscriber_id)
     {
-        if (subscriber_address[sub_id] == 0) break;
+        if (subscriber_callback[sub_id] == 0) break;  // free slot (address id 0 is valid)
         sub_id++;
     }
     if (sub_id == next_subscriber_id) next_subscriber_id++;
 
     subscriber_node_id[sub_id] = node_id;
-    int adr_found = 0;
-    int adr_id = find_address(address, &adr_found);
-    if (!adr_found) 
-    {
-        insert_address_at_index(address, adr_id);
-        init_address_of_subscriber(adr_id, sub_id);
-    }
-    else add_subscriber_to_address(adr_id, sub_id);
+    int adr_id = find_or_insert_address(address);
 
+    pthread_mutex_lock(&executor_lock);
+    start_executor_threads();
+    subscriber_priority[sub_id] = DEROS_PRIORITY_NORMAL;
+    subscriber_queue_head[sub_id] = subscriber_queue_tail[sub_id] = 0;
+    subscriber_queue_length[sub_id] = 0;
+    subscriber_dropped[sub_id] = 0;
+    subscriber_scheduled[sub_id] = 0;
+    subscriber_running[sub_id] = 0;
     subscriber_address[sub_id] = adr_id;
     subscriber_callback[sub_id] = callback;
+    subscriber_chunk_callback[sub_id] = 0;
     subscriber_msgsize[sub_id] = message_size;
-    subscriber_msgqueue_size[sub_id] = message_queue_size;
+    subscriber_transport[sub_id] = transport;
+    subscriber_history[sub_id] = history;
+    subscriber_msgqueue_size[sub_id] = (message_queue_size > 0) ? message_queue_size : 1;
+    pthread_mutex_unlock(&executor_lock);
+    add_subscriber_to_address(adr_id, sub_id);   // receiving threads find the subscriber only when its slot is set up
     num_subscribers++;
 
+    send_registration_to_server(node_id, PACKET_SUB_REGISTER, (uint8_t *)size_prefix, prefix_len, (uint8_t *)address, strlen(address));
+    deros_dbglog_msg(D_DEBG, node_names[node_id], "subscriber", "sent register subscriber packet");
+
     pthread_mutex_unlock(&node_mutexes[node_id]);
     return sub_id;
 }
 
+void append_subscriber_registrations(int node_id, deros_packet_batch *batch)
+{
+    pthread_mutex_lock(&executor_lock);
+    for (int sub_i = 0; sub_i < next_subscriber_id; sub_i++)
+    {
+        if ((subscriber_callback[sub_i] == 0) || (subscriber_node_id[sub_i] != node_id)) continue;
+        char size_prefix[32];
+        int prefix_len = sprintf(size_prefix, "%d!%d!%d!", subscriber_msgsize[sub_i], subscriber_transport[sub_i], subscriber_history[sub_i]);
+        char *address = addresses[subscriber_address[sub_i]];
+        deros_batch_append(batch, PACKET_SUB_REGISTER, (uint8_t *)size_prefix, prefix_len, (uint8_t *)address, strlen(address));
+    }
+    pthread_mutex_unlock(&executor_lock);
+}
+
 void subscriber_unregister(int subscriber_id)
 {
     if ((subscriber_id < 0) ||
@@ -211,25 +1199,19 @@ void subscriber_unregister(int subscriber_id)
 
     int node_id = subscriber_node_id[subscriber_id];
     if ((node_id < 0) || (node_id > next_free_node_id) ||
-        (node_server_sockets[node_id] == 0)) return; 
+        !node_active[node_id]) return; 
 
     if (pthread_mutex_lock(&node_mutexes[node_id])) return;
 
     int adres = subscriber_address[subscriber_id];
 
-    if (!deros_send_packet(node_server_sockets[node_id], PACKET_SUB_UNREGISTER, (uint8_t *)addresses[adres], strlen(addresses[adres])))
-    {
-        deros_dbglog_msg(D_ERRR, node_names[node_id], "subscriber", "sending unregister subscriber packet failed");
-        close(node_server_sockets[node_id]);
-        node_server_sockets[node_id] = 0;
-    }
-    else 
-        deros_dbglog_msg(D_DEBG, node_names[node_id], "subscriber", "sent unregister subscriber packet");
+    send_registration_to_server(node_id, PACKET_SUB_UNREGISTER, 0, 0, (uint8_t *)addresses[adres], strlen(addresses[adres]));
+    deros_dbglog_msg(D_DEBG, node_names[node_id], "subscriber", "sent unregister subscriber packet");
 
+    if (subscriber_transport[subscriber_id] == DEROS_TRANSPORT_MULTICAST) leave_multicast_group(node_id, subscriber_id);
     remove_subscriber_from_address(adres, subscriber_id);
-
     subscriber_node_id[subscriber_id] = 0;
-    subscriber_callback[subscriber_id] = 0;
+    stop_delivering_to_subscriber(subscriber_id);   // frees the slot
     num_subscribers--;
 
     pthread_mutex_unlock(&node_mutexes[node_id]);
@@ -0,0 +1,64 @@
+// command-line client that asks a running Deros server for its registry and counters: the nodes, their topics
+// with the publishers and subscribers, and how busy the server is (see process_query() in deros_server.c)
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <inttypes.h>
+
+#include "../deros.h"
+#include "../common/deros_common.h"
+#include "../common/deros_net.h"
+
+static char *server_address = "127.0.0.1";
+static int server_port = DEFAULT_DEROS_SERVER_PORT;
+
+/** parsing the command line, same arguments as the main() function */
+void process_arguments(int argc, char **argv)
+{
+    for (int i = 1; i < argc; i++)
+    {
+        if ((strncmp(argv[i], "--help", 6) == 0) || (i + 1 == argc))
+        {
+            printf("usage: deros_query [--help] [--server IP] [--port TCP_PORT]\n");
+            exit(0);
+        }
+        else if (strncmp(argv[i], "--server", 8) == 0) server_address = argv[++i];
+        else if (strncmp(argv[i], "--port", 6) == 0) sscanf(argv[++i], "%d", &server_port);
+    }
+}
+
+/** main program entry */
+int main(int argc, char **argv)
+{
+    if (argc > 1) process_arguments(argc, argv);
+
+    int sock = deros_connect_to_server(server_address, server_port);
+    if (!sock)
+    {
+        fprintf(stderr, "deros_query: could not connect to deros server at %s:%d\n", server_address, server_port);
+        return 1;
+    }
+
+    uint8_t *report = (uint8_t *) malloc(MAX_PACKET_LENGTH + 1);
+    if (!report)
+    {
+        fprintf(stderr, "deros_query: not enough memory\n");
+        return 1;
+    }
+    int report_size = 0;
+    if (!deros_send_packet(sock, PACKET_QUERY, (uint8_t *)"", 0) ||
+        (deros_receive_packet(sock, report, &report_size, MAX_PACKET_LENGTH) != PACKET_QUERY_RESPONSE))
+    {
+        fprintf(stderr, "deros_query: no answer from deros server at %s:%d\n", server_address, server_port);
+        close(sock);
+        free(report);
+        return 1;
+    }
+    close(sock);
+
+    fwrite(report, 1, report_size, stdout);
+    free(report);
+    return 0;
+}
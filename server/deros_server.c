@@ -11,6 +11,10 @@
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/epoll.h>
+#include <sys/stat.h>
 
 #include "../deros.h"
 #include "../common/deros_common.h"
@@ -25,29 +29,91 @@ static char *log_path = DEFAULT_LOG_PATH;
 static pthread_mutex_t deros_server_lock;
 static int deros_server_socket;
 
-static int client_sockets[MAX_NUM_CLIENTS];
-static char *client_node_names[MAX_NUM_CLIENTS]; 
-static char *client_ip[MAX_NUM_CLIENTS];
-static int client_port[MAX_NUM_CLIENTS];
-static int client_to_be_removed[MAX_NUM_CLIENTS];
+/** connection of a client node, it is served by one of the reactor threads */
+typedef struct {
+    int client_id;
+    int socket;
+    int reactor;
+    int logged_in;
+    deros_rxbuf rx;
+    pthread_mutex_t tx_lock;
+    uint8_t *tx;                 // packets that the socket has not accepted yet
+    unsigned int tx_len;
+    unsigned int tx_capacity;
+    int waiting_for_output;      // EPOLLOUT is watched until tx is empty
+    deros_packet_batch batched;  // packets caused by a batch of registrations, they leave together (see process_batch())
+    volatile long long last_heard_ms;   // when something arrived from the node the last time
+} client_connection;
+
+// all client tables grow as needed, they are only accessed with deros_server_lock held
+static int *client_sockets;
+static char **client_node_names; 
+static char **client_ip;
+static int *client_port;
+static int *client_to_be_removed;
+static client_connection **client_conn;
+static long long *client_restored_deadline;   // restored from the snapshot, removed unless its node logs in again until then (ms)
+static int *client_missed_updates;            // restored, and some packets for it were dropped before its node logged in again
+static int num_restored_clients = 0;
+static int restore_grace_ms = DEFAULT_RESTORE_GRACE_MS;
+static int heartbeat_interval_ms = DEFAULT_HEARTBEAT_INTERVAL_MS;   // 0 if the nodes do not send heartbeats
+static int heartbeat_timeout_ms = DEFAULT_HEARTBEAT_TIMEOUT_MS;
+static long long last_heartbeat_ms = 0;
+static int client_capacity = 0;
 static int next_client_id = 0;
 static int num_clients = 0;
 
-static int publisher_client[MAX_NUM_PUBLISHERS];
-static int publisher_msgsize[MAX_NUM_PUBLISHERS];
-static int publisher_address[MAX_NUM_PUBLISHERS];
-static int publisher_count[MAX_NUM_PUBLISHERS];
+static int num_reactors = DEFAULT_NUM_REACTORS;
+static int reactor_epoll[MAX_NUM_REACTORS];
+static int next_reactor = 0;
+
+// publishers and subscribers are kept compact (the last one moves to the place of the removed one),
+// each address keeps the list of its publishers and subscribers (see deros_addrs.h)
+static int *publisher_client;
+static int *publisher_msgsize;
+static int *publisher_address;
+static int *publisher_count;
+static int *publisher_transport;
 static int num_publishers;   // count > 1 is counted only once here
-
-static int subscriber_client[MAX_NUM_SUBSCRIBERS];
-static int subscriber_msgsize[MAX_NUM_SUBSCRIBERS];
-static int subscriber_address[MAX_NUM_SUBSCRIBERS];
-static int subscriber_count[MAX_NUM_SUBSCRIBERS];
+static int publisher_capacity = 0;
+
+static int *subscriber_client;
+static int *subscriber_msgsize;
+static int *subscriber_address;
+static int *subscriber_count;
+static int *subscriber_transport;
+static int *subscriber_history;   // which kept messages of publishers with history its node gets
 static int num_subscribers;  // count > 1 is counted only once here
+static int subscriber_capacity = 0;
 
-static volatile int client_thread_started;
-static int new_client_socket;
 static volatile int server_running;
+static int collecting_batch;   // only accessed with deros_server_lock held
+
+// the registry survives a restart of the server in an append-only journal of the packets that changed it,
+// the journal is replayed and compacted when the server starts, and whenever it grows too much
+static char *snapshot_path = 0;
+static int snapshot_fd = -1;
+static int replaying_snapshot = 0;
+static long snapshot_records = 0;
+static long snapshot_compacted_records = 0;
+static deros_packet_batch snapshot_record;
+
+// counters reported to the introspection query (see process_query()), only accessed with deros_server_lock held
+static long long server_start_ms;
+static long stats_registrations = 0;
+static long stats_unregistrations = 0;
+static int registrations_in_second[REGISTRATION_RATE_SECONDS];   // a ring of the last seconds
+static long long registration_second[REGISTRATION_RATE_SECONDS];
+static long stats_notifications = 0;     // ADD_SUBSCRIBER and REMOVE_SUBSCRIBER packets sent to publishers
+static long stats_fanout_events = 0;     // registrations and leaving nodes that caused some notifications
+static long stats_max_fanout = 0;        // most notifications caused by one of them
+static long *address_notifications = 0;  // notifications about the publishers of each address
+static int address_notifications_capacity = 0;
+static int server_lock_depth = 0;        // the lock is recursive, its hold time is measured from the outermost lock
+static long long server_lock_since_us;
+static long stats_lock_holds = 0;
+static long long stats_lock_hold_total_us = 0;
+static long long stats_lock_hold_max_us = 0;
 
 /** parsing the server command line, same arguments as the main() server function */
 void process_arguments(int argc, char **argv)
@@ -58,7 +124,7 @@ void process_arguments(int argc, char **argv)
     {
         if (strncmp(argv[i], "--help", 6) == 0)
         {
-            printf("usage: deros_server [--help] [--port TCP_PORT] [--logpath PATH]\n");
+            printf("usage: deros_server [--help] [--port TCP_PORT] [--logpath PATH] [--threads NUM_REACTOR_THREADS] [--snapshot FILE] [--grace SECONDS] [--heartbeat MS] [--heartbeat-timeout MS]\n");
             will_exit = 1;
         }
         else if (strncmp(argv[i], "--port", 6) == 0)
@@ -74,6 +140,53 @@ void process_arguments(int argc, char **argv)
         {
             log_path = argv[++i];
         }
+        else if (strncmp(argv[i], "--threads", 9) == 0)
+        {
+            sscanf(argv[++i], "%d", &num_reactors);
+            if ((num_reactors < 1) || (num_reactors > MAX_NUM_REACTORS))
+            {
+                deros_dbglog_msg_int(D_ERRR, "server", "args", "number of reactor threads out of range", num_reactors);
+                will_exit = 1;
+            }
+        }
+        else if (strncmp(argv[i], "--snapshot", 10) == 0)
+        {
+            snapshot_path = argv[++i];
+        }
+        else if (strncmp(argv[i], "--grace", 7) == 0)
+        {
+            int grace_seconds = 0;
+            sscanf(argv[++i], "%d", &grace_seconds);
+            if (grace_seconds < 1)
+            {
+                deros_dbglog_msg_int(D_ERRR, "server", "args", "grace period out of range", grace_seconds);
+                will_exit = 1;
+            }
+            restore_grace_ms = grace_seconds * 1000;
+        }
+        else if (strncmp(argv[i], "--heartbeat-timeout", 19) == 0)
+        {
+            sscanf(argv[++i], "%d", &heartbeat_timeout_ms);
+            if (heartbeat_timeout_ms < 1)
+            {
+                deros_dbglog_msg_int(D_ERRR, "server", "args", "heartbeat timeout out of range", heartbeat_timeout_ms);
+                will_exit = 1;
+            }
+        }
+        else if (strncmp(argv[i], "--heartbeat", 11) == 0)
+        {
+            sscanf(argv[++i], "%d", &heartbeat_interval_ms);
+            if (heartbeat_interval_ms < 0)
+            {
+                deros_dbglog_msg_int(D_ERRR, "server", "args", "heartbeat interval out of range", heartbeat_interval_ms);
+                will_exit = 1;
+            }
+        }
+    }
+    if (heartbeat_interval_ms && (heartbeat_timeout_ms <= heartbeat_interval_ms))
+    {
+        deros_dbglog_msg_2int(D_ERRR, "server", "args", "heartbeat timeout must be longer than the interval (interval, timeout)", heartbeat_interval_ms, heartbeat_timeout_ms);
+        will_exit = 1;
     }
 
     if (will_exit) exit(0);
@@ -86,108 +199,572 @@ void mem_failure()
     exit(1);
 }
 
+/** make sure the client tables have space for the specified client id */
+void ensure_client_capacity(int id_client)
+{
+    if (id_client < client_capacity) return;
+    int new_capacity = client_capacity ? 2 * client_capacity : INITIAL_CLIENT_CAPACITY;
+    client_sockets = (int *) realloc(client_sockets, sizeof(int) * new_capacity);
+    client_node_names = (char **) realloc(client_node_names, sizeof(char *) * new_capacity);
+    client_ip = (char **) realloc(client_ip, sizeof(char *) * new_capacity);
+    client_port = (int *) realloc(client_port, sizeof(int) * new_capacity);
+    client_to_be_removed = (int *) realloc(client_to_be_removed, sizeof(int) * new_capacity);
+    client_conn = (client_connection **) realloc(client_conn, sizeof(client_connection *) * new_capacity);
+    client_restored_deadline = (long long *) realloc(client_restored_deadline, sizeof(long long) * new_capacity);
+    client_missed_updates = (int *) realloc(client_missed_updates, sizeof(int) * new_capacity);
+    if (!client_sockets || !client_node_names || !client_ip || !client_port || !client_to_be_removed || !client_conn ||
+        !client_restored_deadline || !client_missed_updates) mem_failure();
+    for (int i = client_capacity; i < new_capacity; i++)
+    {
+        client_sockets[i] = 0;
+        client_conn[i] = 0;
+        client_restored_deadline[i] = 0;
+        client_missed_updates[i] = 0;
+    }
+    client_capacity = new_capacity;
+}
+
+/** watch also for the socket to accept more data (when some packets are waiting), or stop watching it */
+void watch_client_output(client_connection *conn, int watch)
+{
+    if (conn->waiting_for_output == watch) return;
+    struct epoll_event ev;
+    ev.events = watch ? (EPOLLIN | EPOLLOUT) : EPOLLIN;
+    ev.data.ptr = conn;
+    epoll_ctl(reactor_epoll[conn->reactor], EPOLL_CTL_MOD, conn->socket, &ev);
+    conn->waiting_for_output = watch;
+}
+
+/** send as much of the waiting packets as the socket accepts without blocking, tx_lock must be held
+ *  @return  1 on success, 0 if the connection failed */
+int flush_client_output(client_connection *conn)
+{
+    unsigned int sent_total = 0;
+    while (sent_total < conn->tx_len)
+    {
+        int sent = send(conn->socket, conn->tx + sent_total, conn->tx_len - sent_total, MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (sent > 0) sent_total += sent;
+        else if ((sent < 0) && (errno == EINTR)) continue;
+        else if ((sent < 0) && ((errno == EAGAIN) || (errno == EWOULDBLOCK))) break;
+        else return 0;
+    }
+    if (sent_total)
+    {
+        memmove(conn->tx, conn->tx + sent_total, conn->tx_len - sent_total);
+        conn->tx_len -= sent_total;
+    }
+    watch_client_output(conn, conn->tx_len > 0);
+    return 1;
+}
+
+/** client cannot be reached, its reactor thread will notice the closed socket and remove it */
+void drop_client(int id_client)
+{
+    if (client_to_be_removed[id_client]) return;
+    client_to_be_removed[id_client] = 1;
+    shutdown(client_sockets[id_client], SHUT_RDWR);
+}
+
+/** queue a packet for a client and send it as soon as its socket accepts it, packets for the same client 
+ *  keep their order, deros_server_lock must be held
+ *  @return  1 on success, 0 if the client cannot be reached */
+int send_packet_to_client(int id_client, uint8_t packet_type, uint8_t *packet, unsigned int size)
+{
+    if (replaying_snapshot) return 1;
+    client_connection *conn = client_conn[id_client];
+    if (!conn && client_restored_deadline[id_client])   // its node gets the subscribers again when it resynchronizes
+    {
+        client_missed_updates[id_client] = 1;
+        return 1;
+    }
+    if (!conn || client_to_be_removed[id_client]) return 0;
+    if (collecting_batch)
+    {
+        deros_batch_append(&conn->batched, packet_type, 0, 0, packet, size);
+        return 1;
+    }
+
+    pthread_mutex_lock(&conn->tx_lock);
+    unsigned int needed = conn->tx_len + size + sizeof(unsigned int) + 1;
+    if (needed > conn->tx_capacity)
+    {
+        unsigned int new_capacity = conn->tx_capacity ? conn->tx_capacity : 1024;
+        while (new_capacity < needed) new_capacity *= 2;
+        conn->tx = (uint8_t *) realloc(conn->tx, new_capacity);
+        if (!conn->tx) mem_failure();
+        conn->tx_capacity = new_capacity;
+    }
+    deros_store_uint(conn->tx + conn->tx_len, size);
+    conn->tx[conn->tx_len + sizeof(unsigned int)] = packet_type;
+    memcpy(conn->tx + conn->tx_len + sizeof(unsigned int) + 1, packet, size);
+    conn->tx_len = needed;
+    int ok = flush_client_output(conn);
+    pthread_mutex_unlock(&conn->tx_lock);
+
+    if (!ok) drop_client(id_client);
+    return ok;
+}
+
+/** @return  current time of the monotonic clock in milliseconds */
+long long monotonic_ms()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000LL + now.tv_nsec / 1000000;
+}
+
+/** @return  current time of the monotonic clock in microseconds */
+long long monotonic_us()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000LL + now.tv_nsec / 1000;
+}
+
+/** lock deros_server_lock, the time it is held is counted for the queries */
+void lock_server()
+{
+    pthread_mutex_lock(&deros_server_lock);
+    if (server_lock_depth++ == 0) server_lock_since_us = monotonic_us();
+}
+
+void unlock_server()
+{
+    if (--server_lock_depth == 0)
+    {
+        long long held_us = monotonic_us() - server_lock_since_us;
+        stats_lock_holds++;
+        stats_lock_hold_total_us += held_us;
+        if (held_us > stats_lock_hold_max_us) stats_lock_hold_max_us = held_us;
+    }
+    pthread_mutex_unlock(&deros_server_lock);
+}
+
+/** count a publisher notified about a subscriber to the address, deros_server_lock must be held */
+void count_notification(int id_addr)
+{
+    if (replaying_snapshot) return;
+    stats_notifications++;
+    if (id_addr >= address_notifications_capacity)
+    {
+        int new_capacity = address_notifications_capacity ? 2 * address_notifications_capacity : INITIAL_ADDRESS_CAPACITY;
+        while (new_capacity <= id_addr) new_capacity *= 2;
+        address_notifications = (long *) realloc(address_notifications, sizeof(long) * new_capacity);
+        if (!address_notifications) mem_failure();
+        for (int i = address_notifications_capacity; i < new_capacity; i++) address_notifications[i] = 0;
+        address_notifications_capacity = new_capacity;
+    }
+    address_notifications[id_addr]++;
+}
+
+/** count the notifications caused by one registration or leaving node, deros_server_lock must be held
+ *  @param notifications_before  stats_notifications before it was processed */
+void count_fanout(long notifications_before)
+{
+    long fanout = stats_notifications - notifications_before;
+    if (!fanout) return;
+    stats_fanout_events++;
+    if (fanout > stats_max_fanout) stats_max_fanout = fanout;
+}
+
+/** count a processed registering packet, deros_server_lock must be held */
+void count_registration(uint8_t packet_type)
+{
+    if (replaying_snapshot) return;
+    if ((packet_type == PACKET_PUB_UNREGISTER) || (packet_type == PACKET_SUB_UNREGISTER))
+    {
+        stats_unregistrations++;
+        return;
+    }
+    stats_registrations++;
+    long long second = monotonic_ms() / 1000;
+    int slot = second % REGISTRATION_RATE_SECONDS;
+    if (registration_second[slot] != second)
+    {
+        registration_second[slot] = second;
+        registrations_in_second[slot] = 0;
+    }
+    registrations_in_second[slot]++;
+}
+
+/** @return  registrations per second in the last REGISTRATION_RATE_SECONDS, deros_server_lock must be held */
+double recent_registration_rate()
+{
+    long long second = monotonic_ms() / 1000;
+    long count = 0;
+    for (int i = 0; i < REGISTRATION_RATE_SECONDS; i++)
+        if (second - registration_second[i] < REGISTRATION_RATE_SECONDS) count += registrations_in_second[i];
+    return (double)count / REGISTRATION_RATE_SECONDS;
+}
+
+/** the snapshot cannot be written, the server goes on without it */
+void disable_snapshot(char *reason)
+{
+    deros_dbglog_msg_str_int(D_ERRR, "server", "snapshot", reason, snapshot_path, errno);
+    if (snapshot_fd >= 0) close(snapshot_fd);
+    snapshot_fd = -1;
+}
+
+/** write the collected records to the snapshot file
+ *  @return  1 on success, 0 if the file cannot be written */
+int write_snapshot_records(int fd)
+{
+    unsigned int written = 0;
+    while (written < snapshot_record.len)
+    {
+        ssize_t n = write(fd, snapshot_record.data + written, snapshot_record.len - written);
+        if ((n < 0) && (errno == EINTR)) continue;
+        if (n <= 0) break;
+        written += n;
+    }
+    int ok = (written == snapshot_record.len);
+    snapshot_record.len = 0;
+    return ok;
+}
+
+/** collect one record of the snapshot: client_id[4] followed by the contents of the packet */
+void append_snapshot_record(int id_client, uint8_t packet_type, uint8_t *packet, unsigned int size)
+{
+    uint8_t client_id[sizeof(unsigned int)];
+    deros_store_uint(client_id, id_client);
+    deros_batch_append(&snapshot_record, packet_type, client_id, sizeof(client_id), packet, size);
+}
+
+/** collect the record of a client as PACKET_INIT (port!ip!name) */
+void append_client_record(int id_client)
+{
+    char *text = (char *) malloc(strlen(client_node_names[id_client]) + strlen(client_ip[id_client]) + 14);
+    if (!text) mem_failure();
+    sprintf(text, "%d!%s!%s", client_port[id_client], client_ip[id_client], client_node_names[id_client]);
+    append_snapshot_record(id_client, PACKET_INIT, (uint8_t *)text, strlen(text));
+    free(text);
+}
+
+/** collect the records of the registration as registering packets, once for each of its count */
+void append_registration_records(int id_client, uint8_t packet_type, int id_addr, int msgsize, int transport, int history, int count)
+{
+    char *text = (char *) malloc(strlen(addresses[id_addr]) + 40);
+    if (!text) mem_failure();
+    if (packet_type == PACKET_PUB_REGISTER) sprintf(text, "%d!%d!%s", msgsize, transport, addresses[id_addr]);
+    else sprintf(text, "%d!%d!%d!%s", msgsize, transport, history, addresses[id_addr]);
+    for (int i = 0; i < count; i++)
+        append_snapshot_record(id_client, packet_type, (uint8_t *)text, strlen(text));
+    free(text);
+}
+
+/** replace the journal with the records of the current registry: the addresses in the order of their ids
+ *  (PACKET_TOPIC_ID), the clients and their registrations, deros_server_lock must be held */
+void compact_snapshot()
+{
+    char *tmp_path = (char *) malloc(strlen(snapshot_path) + 5);
+    if (!tmp_path) mem_failure();
+    sprintf(tmp_path, "%s.tmp", snapshot_path);
+    int fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0644);
+    if (fd < 0)
+    {
+        free(tmp_path);
+        disable_snapshot("could not create snapshot (path, errno)");
+        return;
+    }
+
+    long records = num_addresses;
+    for (int i = 0; i < num_addresses; i++)
+        append_snapshot_record(0, PACKET_TOPIC_ID, (uint8_t *)addresses[i], strlen(addresses[i]));
+    for (int i = 0; i < next_client_id; i++)
+        if (client_sockets[i] && client_node_names[i])
+        {
+            append_client_record(i);
+            records++;
+        }
+    for (int i = 0; i < num_publishers; i++)
+    {
+        append_registration_records(publisher_client[i], PACKET_PUB_REGISTER, publisher_address[i], publisher_msgsize[i],
+                                    publisher_transport[i], 0, publisher_count[i]);
+        records += publisher_count[i];
+    }
+    for (int i = 0; i < num_subscribers; i++)
+    {
+        append_registration_records(subscriber_client[i], PACKET_SUB_REGISTER, subscriber_address[i], subscriber_msgsize[i],
+                                    subscriber_transport[i], subscriber_history[i], subscriber_count[i]);
+        records += subscriber_count[i];
+    }
+
+    if (!write_snapshot_records(fd) || (fsync(fd) < 0) || (rename(tmp_path, snapshot_path) < 0))
+    {
+        close(fd);
+        unlink(tmp_path);
+        free(tmp_path);
+        disable_snapshot("could not write snapshot (path, errno)");
+        return;
+    }
+    free(tmp_path);
+    if (snapshot_fd >= 0) close(snapshot_fd);
+    snapshot_fd = fd;
+    snapshot_records = snapshot_compacted_records = records;
+    deros_dbglog_msg_str_int(D_INFO, "server", "snapshot", "compacted snapshot (path, records)", snapshot_path, records);
+}
+
+/** append the collected record to the journal, compact it when it has grown too much */
+void flush_journal()
+{
+    if (!write_snapshot_records(snapshot_fd))
+    {
+        disable_snapshot("could not append to snapshot (path, errno)");
+        return;
+    }
+    if (++snapshot_records > 2 * snapshot_compacted_records + SNAPSHOT_MIN_COMPACTION) compact_snapshot();
+}
+
+/** append a packet that has changed the registry to the journal, deros_server_lock must be held */
+void journal_packet(int id_client, uint8_t packet_type, uint8_t *packet, unsigned int size)
+{
+    if ((snapshot_fd < 0) || replaying_snapshot) return;
+    append_snapshot_record(id_client, packet_type, packet, size);
+    flush_journal();
+}
+
+/** append the client node that has logged in to the journal, deros_server_lock must be held */
+void journal_client(int id_client)
+{
+    if ((snapshot_fd < 0) || replaying_snapshot) return;
+    append_client_record(id_client);
+    flush_journal();
+}
+
+/** make sure there is space for one more publisher */
+void ensure_publisher_capacity()
+{
+    if (num_publishers < publisher_capacity) return;
+    publisher_capacity = publisher_capacity ? 2 * publisher_capacity : INITIAL_ENDPOINT_CAPACITY;
+    publisher_client = (int *) realloc(publisher_client, sizeof(int) * publisher_capacity);
+    publisher_msgsize = (int *) realloc(publisher_msgsize, sizeof(int) * publisher_capacity);
+    publisher_address = (int *) realloc(publisher_address, sizeof(int) * publisher_capacity);
+    publisher_count = (int *) realloc(publisher_count, sizeof(int) * publisher_capacity);
+    publisher_transport = (int *) realloc(publisher_transport, sizeof(int) * publisher_capacity);
+    if (!publisher_client || !publisher_msgsize || !publisher_address || !publisher_count || !publisher_transport) mem_failure();
+}
+
+/** make sure there is space for one more subscriber */
+void ensure_subscriber_capacity()
+{
+    if (num_subscribers < subscriber_capacity) return;
+    subscriber_capacity = subscriber_capacity ? 2 * subscriber_capacity : INITIAL_ENDPOINT_CAPACITY;
+    subscriber_client = (int *) realloc(subscriber_client, sizeof(int) * subscriber_capacity);
+    subscriber_msgsize = (int *) realloc(subscriber_msgsize, sizeof(int) * subscriber_capacity);
+    subscriber_address = (int *) realloc(subscriber_address, sizeof(int) * subscriber_capacity);
+    subscriber_count = (int *) realloc(subscriber_count, sizeof(int) * subscriber_capacity);
+    subscriber_transport = (int *) realloc(subscriber_transport, sizeof(int) * subscriber_capacity);
+    subscriber_history = (int *) realloc(subscriber_history, sizeof(int) * subscriber_capacity);
+    if (!subscriber_client || !subscriber_msgsize || !subscriber_address || !subscriber_count || !subscriber_transport || 
+        !subscriber_history) mem_failure();
+}
+
 /** internal function to update data structures when publisher is leaving the server */
 void remove_publisher(int id_publisher)
 {
-    publisher_client[id_publisher] = publisher_client[num_publishers - 1];
-    publisher_msgsize[id_publisher] = publisher_msgsize[num_publishers - 1];
-    publisher_address[id_publisher] = publisher_address[num_publishers - 1];
-    publisher_count[id_publisher] = publisher_count[num_publishers - 1];
+    int last = num_publishers - 1;
+    remove_publisher_from_address(publisher_address[id_publisher], id_publisher);
+    if (id_publisher != last)
+    {
+        publisher_client[id_publisher] = publisher_client[last];
+        publisher_msgsize[id_publisher] = publisher_msgsize[last];
+        publisher_address[id_publisher] = publisher_address[last];
+        publisher_count[id_publisher] = publisher_count[last];
+        publisher_transport[id_publisher] = publisher_transport[last];
+        renumber_publisher_of_address(publisher_address[id_publisher], last, id_publisher);
+    }
     num_publishers--;
 }
 
+/** two client nodes seen from the same IP address run on the same host, their publishers and subscribers
+ *  can then communicate through shared memory */
+int clients_are_colocated(int id_client1, int id_client2)
+{
+    return strcmp(client_ip[id_client1], client_ip[id_client2]) == 0;
+}
+
+/** datagram transports are used only when both the publisher and the subscriber registered with one of them,
+ *  the subscriber chooses between unicast and multicast */
+int transport_between(int id_publisher, int id_subscriber)
+{
+    if ((publisher_transport[id_publisher] == DEROS_TRANSPORT_TCP) || (subscriber_transport[id_subscriber] == DEROS_TRANSPORT_TCP))
+        return DEROS_TRANSPORT_TCP;
+    return subscriber_transport[id_subscriber];
+}
+
+/** a subscriber of a pattern gets the messages of the publishers that match it only when their message sizes agree,
+ *  (the size of a subscriber of the address itself must agree) */
+int subscriber_accepts_publisher(int id_subscriber, int id_publisher)
+{
+    return !addr_is_pattern[subscriber_address[id_subscriber]] || (subscriber_msgsize[id_subscriber] < 0) ||
+           (subscriber_msgsize[id_subscriber] == publisher_msgsize[id_publisher]);
+}
+
+/** a publisher connects each subscriber node only once, even if more of its subscribers (to the address and to patterns) match
+ *  @return  1 if some other subscriber of the same node gets the messages of the publisher */
+int node_gets_publisher_through_other_subscriber(int id_publisher, int id_subscriber)
+{
+    int adr = publisher_address[id_publisher];
+    for (int i = 0; i < addr_num_sub[adr]; i++)
+    {
+        int other = addr_subscribers[adr][i];
+        if ((other != id_subscriber) && (subscriber_client[other] == subscriber_client[id_subscriber]) &&
+            subscriber_accepts_publisher(other, id_publisher)) return 1;
+    }
+    return 0;
+}
+
 /** subscriber has just left, its publisher is being notified to close connection to the original subscriber node */
 void notify_publisher_of_removed_subscriber(int id_publisher, int id_subscriber)
 {
     int id_client = subscriber_client[id_subscriber];
-    int publisher_socket = client_sockets[publisher_client[id_publisher]];
+    char packet[64];   // the topic of the publisher, the subscriber may have subscribed to a pattern
+    sprintf(packet, "%d!%s!%d!%d!%d!%d", client_port[id_client], client_ip[id_client], 
+            clients_are_colocated(publisher_client[id_publisher], id_client), transport_between(id_publisher, id_subscriber),
+            subscriber_history[id_subscriber], publisher_address[id_publisher]);
 
-    char *packet = (char *)malloc(strlen(addresses[subscriber_address[id_subscriber]]) + 2 + 15 + 5 + 1);
-    sprintf(packet, "%d!%s!%s", client_port[id_client], client_ip[id_client], addresses[subscriber_address[id_subscriber]]);
+    count_notification(publisher_address[id_publisher]);
+    if (!send_packet_to_client(publisher_client[id_publisher], PACKET_REMOVE_SUBSCRIBER, (uint8_t *)packet, strlen(packet)))
+        deros_dbglog_msg(D_WARN, "server", "remsub", "deros_server: could not send remove subscriber to publisher");
+}
 
-    if (!deros_send_packet(publisher_socket, PACKET_REMOVE_SUBSCRIBER, (uint8_t *)packet, strlen(packet)))
+/** the publishers of the address close their connections to the leaving subscriber node, unless it still needs them */
+void notify_publishers_of_address_of_removed_subscriber(int adr, int id_subscriber)
+{
+    for (int i = 0; i < addr_num_pub[adr]; i++)
     {
-        deros_dbglog_msg(D_WARN, "server", "remsub", "deros_server: could not send remove subscriber to publisher");
-        if (publisher_client[id_publisher] != subscriber_client[id_subscriber])
-            client_to_be_removed[publisher_client[id_publisher]] = 1;
+        int id_publisher = addr_publishers[adr][i];
+        if (subscriber_accepts_publisher(id_subscriber, id_publisher) && 
+            !node_gets_publisher_through_other_subscriber(id_publisher, id_subscriber))
+            notify_publisher_of_removed_subscriber(id_publisher, id_subscriber);
     }
 }
 
-/** subscriber has just left, all publishers should be notified to close their connections to the leaving subscriber node */
+/** subscriber has just left, all publishers should be notified to close their connections to the leaving subscriber node,
+ *  the publishers of all addresses that match the pattern of a pattern subscriber */
 void notify_all_publishers_of_removed_subscriber(int id_subscriber)
 {
-    for (int i = 0; i < num_publishers; i++)
-        if (publisher_address[i] == subscriber_address[id_subscriber]) 
-            notify_publisher_of_removed_subscriber(i, id_subscriber);
+    int adr = subscriber_address[id_subscriber];
+    if (!addr_is_pattern[adr]) notify_publishers_of_address_of_removed_subscriber(adr, id_subscriber);
+    for (int i = 0; addr_is_pattern[adr] && (i < addr_num_matches[adr]); i++)
+        notify_publishers_of_address_of_removed_subscriber(addr_matches[adr][i], id_subscriber);
 }
 
 /** internal update of data structures when subscriber is removed */
 void remove_subscriber(int id_subscriber)
 {
-    subscriber_client[id_subscriber] = subscriber_client[num_subscribers - 1];
-    subscriber_msgsize[id_subscriber] = subscriber_msgsize[num_subscribers - 1];
-    subscriber_address[id_subscriber] = subscriber_address[num_subscribers - 1];
-    subscriber_count[id_subscriber] = subscriber_count[num_subscribers - 1];
+    int last = num_subscribers - 1;
+    remove_subscriber_from_address(subscriber_address[id_subscriber], id_subscriber);
+    if (id_subscriber != last)
+    {
+        subscriber_client[id_subscriber] = subscriber_client[last];
+        subscriber_msgsize[id_subscriber] = subscriber_msgsize[last];
+        subscriber_address[id_subscriber] = subscriber_address[last];
+        subscriber_count[id_subscriber] = subscriber_count[last];
+        subscriber_transport[id_subscriber] = subscriber_transport[last];
+        subscriber_history[id_subscriber] = subscriber_history[last];
+        renumber_subscriber_of_address(subscriber_address[id_subscriber], last, id_subscriber);
+    }
     num_subscribers--;
 }
 
-/** internal update of data structures when the whole node is leaving - all subscribers and publishers of this node should clean up */
+/** @return  1 if another connected client node listens on the same ip and port (the node has connected again) */
+int client_listen_address_taken(int node_id)
+{
+    for (int i = 0; i < next_client_id; i++)
+        if ((i != node_id) && (client_sockets[i] > 0) && client_node_names[i] && (client_port[i] == client_port[node_id]) &&
+            (strcmp(client_ip[i], client_ip[node_id]) == 0)) return 1;
+    return 0;
+}
+
+/** internal update of data structures when the whole node is leaving - all subscribers and publishers of this node should clean up,
+ *  and its connection is closed, only the reactor thread serving the node can call this */
 void remove_node(int node_id)
 {
-    pthread_mutex_lock(&deros_server_lock);
+    lock_server();
 
-    if (client_sockets[node_id] == 0) return; // already removed
+    if (client_sockets[node_id] == 0)  // already removed
+    {
+        unlock_server();
+        return;
+    }
 
+    // the publishers must not drop a subscriber node that has connected again before its old connection was removed
+    int notify = !client_node_names[node_id] || !client_listen_address_taken(node_id);
+    long notifications_before = stats_notifications;
     for (int i = 0; i < num_subscribers; i++)
         if (subscriber_client[i] == node_id)
         {
-            notify_all_publishers_of_removed_subscriber(i);
-            remove_subscriber(i); 
+            if (notify) notify_all_publishers_of_removed_subscriber(i);
+            remove_subscriber(i--); 
         }
 
     for (int i = 0; i < num_publishers; i++)
         if (publisher_client[i] == node_id)
-            remove_publisher(i);
+            remove_publisher(i--);
+    count_fanout(notifications_before);
+
+    client_connection *conn = client_conn[node_id];
+    if (conn)   // a restored client has no connection
+    {
+        epoll_ctl(reactor_epoll[conn->reactor], EPOLL_CTL_DEL, conn->socket, 0);
+        close(conn->socket);
+        deros_rxbuf_free(&conn->rx);
+        pthread_mutex_destroy(&conn->tx_lock);
+        free(conn->tx);
+        deros_batch_free(&conn->batched);
+        free(conn);
+    }
+    client_conn[node_id] = 0;
+    if (client_restored_deadline[node_id]) num_restored_clients--;
+    client_restored_deadline[node_id] = 0;
+    client_missed_updates[node_id] = 0;
 
-    close(client_sockets[node_id]);
     client_sockets[node_id] = 0;
+    int logged_in = (client_node_names[node_id] != 0);
     free(client_node_names[node_id]);
+    client_node_names[node_id] = 0;
     free(client_ip[node_id]);
     client_port[node_id] = 0;
     client_to_be_removed[node_id] = 0;
 
     num_clients--;
-    pthread_mutex_unlock(&deros_server_lock);
+    if (logged_in) journal_packet(node_id, PACKET_DONE, (uint8_t *)"", 0);
+    unlock_server();
 }
 
-/** if a message cannot be sent to the subscribers, they are put on hold for possible later reconnection */
-void remove_unaccessible_clients()
+/** @return  the publisher of the node to the address, -1 if there is none */
+int publisher_of_node(int node_id, int id_addr)
 {
-    for (int i = 0; i < next_client_id; i++)
-        if (client_sockets[i]) continue;
-        else if (client_to_be_removed[i]) 
-        {
-            remove_node(i);
-            i = -1;  // start over, maybe some new node is to be removed as a consequence
-        }
+    for (int j = 0; j < addr_num_pub[id_addr]; j++)
+        if (publisher_client[addr_publishers[id_addr][j]] == node_id) return addr_publishers[id_addr][j];
+    return -1;
+}
+
+/** @return  the subscriber of the node to the address (not to a pattern that matches it), -1 if there is none */
+int subscriber_of_node(int node_id, int id_addr)
+{
+    for (int j = 0; j < addr_num_sub[id_addr]; j++)
+    {
+        int i = addr_subscribers[id_addr][j];
+        if ((subscriber_client[i] == node_id) && (subscriber_address[i] == id_addr)) return i;
+    }
+    return -1;
 }
 
 /** Deros does allow multiple publishers to the same address from the same node, but handles that just by a counter */
 int if_publisher_from_this_node_exists_only_increment_counter(int node_id, int msgsize, int id_addr)
 {
-    for (int i = 0; i < num_publishers; i++)
+    int i = publisher_of_node(node_id, id_addr);
+    if (i >= 0)
     {
-        if ((publisher_client[i] == node_id) &&
-            (publisher_address[i] == id_addr))
+        if (publisher_msgsize[i] != msgsize)
         {
-            if (publisher_msgsize[i] != msgsize)
-            {
-                deros_dbglog_msg_str_2int(D_GRRR, "server", "chkpub", "deros register new publisher with wrong msgsize (adr, node_id, msgsize)", addresses[id_addr], node_id, msgsize);
-                exit(1);
-            }
-            publisher_count[i]++;
-            return 1;
+            deros_dbglog_msg_str_2int(D_GRRR, "server", "chkpub", "deros register new publisher with wrong msgsize (adr, node_id, msgsize)", addresses[id_addr], node_id, msgsize);
+            exit(1);
         }
+        publisher_count[i]++;
+        return 1;
     }
     return 0;
 }
@@ -195,91 +772,130 @@ int if_publisher_from_this_node_exists_only_increment_counter(int node_id, int m
 /** Doers does allow multiple subscribers of the same address from the same node, but hadnles that jsut by a counter */
 int if_subscriber_from_this_node_exists_only_increment_counter(int node_id, int msgsize, int id_addr)
 {
-    for (int i = 0; i < num_subscribers; i++)
+    int i = subscriber_of_node(node_id, id_addr);
+    if (i >= 0)
     {
-        if ((subscriber_client[i] == node_id) &&
-            (subscriber_address[i] == id_addr))
+        if (subscriber_msgsize[i] != msgsize)
         {
-            if (subscriber_msgsize[i] != msgsize)
-            {
-                deros_dbglog_msg_str_2int(D_GRRR, "server", "chksub", "deros register new subscriber with wrong msgsize (adr, node_id, msgsize)", addresses[id_addr], node_id, msgsize);
-                exit(1);
-            }
-            subscriber_count[i]++;
-            return 1;
+            deros_dbglog_msg_str_2int(D_GRRR, "server", "chksub", "deros register new subscriber with wrong msgsize (adr, node_id, msgsize)", addresses[id_addr], node_id, msgsize);
+            exit(1);
         }
+        subscriber_count[i]++;
+        return 1;
     }
     return 0;
 }
 
 /** internal communication to notify a publisher about its subscriber */
-void send_subscriber_to_publisher(int id_publisher, int id_sub_node)
+void send_subscriber_to_publisher(int id_publisher, int id_subscriber)
 {
-    int publisher_socket = client_sockets[publisher_client[id_publisher]];
-    char *adres = addresses[publisher_address[id_publisher]];
+    int id_sub_node = subscriber_client[id_subscriber];
 
-    char *packet = (char *) malloc(15 + 5 + 2 + strlen(adres) + 1);
-    sprintf(packet, "%d!%s!%s", client_port[id_sub_node], client_ip[id_sub_node], adres);
+    char packet[64];
+    sprintf(packet, "%d!%s!%d!%d!%d!%d", client_port[id_sub_node], client_ip[id_sub_node], 
+            clients_are_colocated(publisher_client[id_publisher], id_sub_node), transport_between(id_publisher, id_subscriber), 
+            subscriber_history[id_subscriber], publisher_address[id_publisher]);
                     
-    if (!deros_send_packet(publisher_socket, PACKET_ADD_SUBSCRIBER, (uint8_t *)packet, strlen(packet)))
-    {
+    count_notification(publisher_address[id_publisher]);
+    if (!send_packet_to_client(publisher_client[id_publisher], PACKET_ADD_SUBSCRIBER, (uint8_t *)packet, strlen(packet)))
         deros_dbglog_msg(D_WARN, "server", "newsub", "deros_server: could not send new subscriber to publisher");
-        client_to_be_removed[publisher_client[id_publisher]] = 1;
-    }
+}
 
+/** the id of the address is the topic id of the node, all further packets about it carry the id, 
+ *  it is sent before any packet that refers to it */
+void send_topic_id_to_client(int id_client, int id_addr)
+{
+    char *adres = addresses[id_addr];
+    char *packet = (char *) malloc(11 + 1 + strlen(adres) + 1);
+    if (!packet) mem_failure();
+    sprintf(packet, "%d!%s", id_addr, adres);
+    if (!send_packet_to_client(id_client, PACKET_TOPIC_ID, (uint8_t *)packet, strlen(packet)))
+        deros_dbglog_msg(D_WARN, "server", "topicid", "deros_server: could not send topic id to client");
     free(packet);
 }
 
-/** internal communication to notify a publisher about all of its subscribers, one by one (after publisher just arrived) */
+/** internal communication to notify a publisher about all of its subscribers, one by one (after publisher just arrived),
+ *  a node with more matching subscribers (to the address and to patterns) is sent only once */
 void send_all_subscribers_to_publisher(int id_publisher)
 {
     int adr = publisher_address[id_publisher];
-    for (int i = 0; i < num_subscribers; i++)
+    for (int i = 0; i < addr_num_sub[adr]; i++)
     {
-        if (subscriber_address[i] == adr)
-            send_subscriber_to_publisher(id_publisher, subscriber_client[i]);
-    }    
+        int id_subscriber = addr_subscribers[adr][i];
+        if (!subscriber_accepts_publisher(id_subscriber, id_publisher)) continue;
+        int node_sent = 0;
+        for (int j = 0; j < i; j++)
+        {
+            int earlier = addr_subscribers[adr][j];
+            if ((subscriber_client[earlier] == subscriber_client[id_subscriber]) && subscriber_accepts_publisher(earlier, id_publisher))
+                node_sent = 1;
+        }
+        if (!node_sent) send_subscriber_to_publisher(id_publisher, id_subscriber);
+    }
+}
+
+/** parse msg_size!transport!address of a register packet, or msg_size!transport!history!address of a subscriber
+ *  @param history  0 if the packet has no history
+ *  @return  the address, or 0 if the packet is malformed */
+char *parse_register_packet(char *packet, int *msgsize, int *transport, int *history)
+{
+    char *transport_pos = strchr(packet, '!');
+    if (transport_pos == 0) return 0;
+    char *adres = strchr(transport_pos + 1, '!');
+    if (adres == 0) return 0;
+    if ((sscanf(packet, "%d", msgsize) != 1) || (sscanf(transport_pos + 1, "%d", transport) != 1)) return 0;
+    if ((*transport < DEROS_TRANSPORT_TCP) || (*transport > DEROS_TRANSPORT_MULTICAST)) *transport = DEROS_TRANSPORT_TCP;
+    if (history)   // only subscribers send it
+    {
+        char *history_pos = adres;
+        adres = strchr(history_pos + 1, '!');
+        if ((adres == 0) || (sscanf(history_pos + 1, "%d", history) != 1)) return 0;
+        if (*history != DEROS_HISTORY_LATEST) *history = DEROS_HISTORY_ALL;
+    }
+    return adres + 1;
 }
 
 /** process packet of new publisher arriving */
 void register_new_publisher(int node_id, uint8_t *packet, int size)
 {
     packet[size] = 0;
-    char *exclpos = strchr((char *)packet, '!');
-    if (exclpos == 0)
+    int msgsize, transport;
+    char *adres = parse_register_packet((char *)packet, &msgsize, &transport, 0);
+    if (adres == 0)
     {
         deros_dbglog_msg(D_ERRR, "server", "regpub", "malformatted PUB_REGISTER packet");
         return;
     }
-    *exclpos = 0;
-    int msgsize;
-    sscanf((char *)packet, "%d", &msgsize);
-
-    int found;
+    if (address_is_pattern(adres))
+    {
+        deros_dbglog_msg_str(D_ERRR, "server", "regpub", "publisher cannot publish to a pattern", adres);
+        return;
+    }
 
-    pthread_mutex_lock(&deros_server_lock);
+    lock_server();
 
-    int id_addr = find_address(exclpos + 1, &found);
-    if (!found) insert_address_at_index(exclpos + 1, id_addr);
-    id_addr = addr[id_addr];  // now it is addr id
+    int id_addr = find_or_insert_address(adres);
     deros_dbglog_msg_int(D_DEBG, "server", "regpub", "actual addr id = ", id_addr);
+    send_topic_id_to_client(node_id, id_addr);
 
     if (if_publisher_from_this_node_exists_only_increment_counter(node_id, msgsize, id_addr)) 
     { 
-        pthread_mutex_unlock(&deros_server_lock);
+        unlock_server();
         return;
     }
     
+    ensure_publisher_capacity();
     publisher_client[num_publishers] = node_id;
     publisher_msgsize[num_publishers] = msgsize;
     publisher_address[num_publishers] = id_addr;
     publisher_count[num_publishers] = 1;
+    publisher_transport[num_publishers] = transport;
+    add_publisher_to_address(id_addr, num_publishers);
     num_publishers++;
 
     send_all_subscribers_to_publisher(num_publishers - 1);
-    id_addr = addr[id_addr];  // now it is addr id
     deros_dbglog_msg_2str(D_INFO, "server", "regpub", "registered publisher (from, address)", client_node_names[node_id], addresses[id_addr]);
-    pthread_mutex_unlock(&deros_server_lock);
+    unlock_server();
 }
 
 /** process packet of publisher leaving */
@@ -287,19 +903,18 @@ void unregister_publisher(int node_id, uint8_t *packet, int size)
 {
     packet[size] = 0;
 
-    pthread_mutex_lock(&deros_server_lock);
-    int found;
-    int id_addr = find_address((char *)packet, &found);
-    if (!found)
+    lock_server();
+    int id_addr = find_address((char *)packet);
+    if (id_addr < 0)
     {
         deros_dbglog_msg_str(D_ERRR, "server", "unregpub", "deros_server: unregister_publisher() with unknown address from node", client_node_names[node_id]);
-        pthread_mutex_unlock(&deros_server_lock);
+        unlock_server();
         return;
     }
-    id_addr = addr[id_addr]; // now it is address id
-    for (int i = 0; i < num_publishers; i++)
-        if ((publisher_client[i] == node_id) &&
-            (publisher_address[i] == id_addr))
+    for (int j = 0; j < addr_num_pub[id_addr]; j++)
+    {
+        int i = addr_publishers[id_addr][j];
+        if (publisher_client[i] == node_id)
         {
             if (publisher_count[i] == 1)
                remove_publisher(i);
@@ -307,65 +922,79 @@ void unregister_publisher(int node_id, uint8_t *packet, int size)
             deros_dbglog_msg_2str(D_INFO, "server", "unregpub", "unregistered publisher (from, address)", client_node_names[node_id], addresses[id_addr]);
             break;
         }
-    pthread_mutex_unlock(&deros_server_lock);
+    }
+    unlock_server();
 }
 
-/** if subscriber arrived, we need to notify all publishers */
-void send_a_new_subscriber_to_all_publishers(int sub_node_id, int id_addr, int msgsize)
+/** notify the publishers of the address about the new subscriber (to the address or to a pattern that matches it),
+ *  unless its node gets their messages already */
+void send_a_new_subscriber_to_publishers_of_address(int id_subscriber, int id_addr)
 {
-    for (int i = 0; i < num_publishers; i++)
+    int sub_node_id = subscriber_client[id_subscriber];
+    int msgsize = subscriber_msgsize[id_subscriber];
+    for (int j = 0; j < addr_num_pub[id_addr]; j++)
     {
-        if (publisher_address[i] == id_addr)
+        int i = addr_publishers[id_addr][j];
+        if ((subscriber_address[id_subscriber] == id_addr) && (publisher_msgsize[i] != msgsize))
         {
-            if (publisher_msgsize[i] != msgsize)
-            {
-                deros_dbglog_msg_2str_int(D_GRRR, "server", "newsub", "deros server: new subscriber with an incompatible msg size from client (node,adr,size)", client_node_names[sub_node_id], addresses[id_addr], msgsize);
-                exit(1);
-            }
-            send_subscriber_to_publisher(i, sub_node_id);
+            deros_dbglog_msg_2str_int(D_GRRR, "server", "newsub", "deros server: new subscriber with an incompatible msg size from client (node,adr,size)", client_node_names[sub_node_id], addresses[id_addr], msgsize);
+            exit(1);
         }
+        if (!subscriber_accepts_publisher(id_subscriber, i))
+        {
+            deros_dbglog_msg_2str_int(D_WARN, "server", "newsub", "pattern subscriber does not get publisher with another msg size (node,adr,size)", client_node_names[sub_node_id], addresses[id_addr], msgsize);
+            continue;
+        }
+        if (!node_gets_publisher_through_other_subscriber(i, id_subscriber))
+            send_subscriber_to_publisher(i, id_subscriber);
     }
 }
 
+/** if subscriber arrived, we need to notify all publishers, of all the addresses that match the pattern of a pattern subscriber */
+void send_a_new_subscriber_to_all_publishers(int id_subscriber, int id_addr)
+{
+    if (!addr_is_pattern[id_addr]) send_a_new_subscriber_to_publishers_of_address(id_subscriber, id_addr);
+    for (int i = 0; addr_is_pattern[id_addr] && (i < addr_num_matches[id_addr]); i++)
+        send_a_new_subscriber_to_publishers_of_address(id_subscriber, addr_matches[id_addr][i]);
+}
+
 /** new subscriber just arrived, process its packet */
 void register_new_subscriber(int node_id, uint8_t *packet, int size)
 {
     packet[size] = 0;
-    char *exclpos = strchr((char *)packet, '!');
-    if (exclpos == 0)
+    int msgsize, transport, history;
+    char *adres = parse_register_packet((char *)packet, &msgsize, &transport, &history);
+    if (adres == 0)
     {
         deros_dbglog_msg(D_ERRR, "server", "regsub", "malformatted SUB_REGISTER packet");
         return;
     }
-    *exclpos = 0;
-    int msgsize;
-    sscanf((char *)packet, "%d", &msgsize);
-
-    int found;
-
-    pthread_mutex_lock(&deros_server_lock);
 
-    int id_addr = find_address(exclpos + 1, &found);
-    if (!found) insert_address_at_index(exclpos + 1, id_addr);
+    lock_server();
 
-    id_addr = addr[id_addr];  // now it is address id
+    int id_addr = find_or_insert_address(adres);
     deros_dbglog_msg_int(D_DEBG, "server", "regsub", "actual addr id =", id_addr);
+    send_topic_id_to_client(node_id, id_addr);
 
     if (if_subscriber_from_this_node_exists_only_increment_counter(node_id, msgsize, id_addr)) 
     { 
-        pthread_mutex_unlock(&deros_server_lock);
+        unlock_server();
         return;
     }
     
+    ensure_subscriber_capacity();
     subscriber_client[num_subscribers] = node_id;
     subscriber_msgsize[num_subscribers] = msgsize;
     subscriber_address[num_subscribers] = id_addr;
     subscriber_count[num_subscribers] = 1;
+    subscriber_transport[num_subscribers] = transport;
+    subscriber_history[num_subscribers] = history;
+    add_subscriber_to_address(id_addr, num_subscribers);
     num_subscribers++;
 
-    send_a_new_subscriber_to_all_publishers(node_id, id_addr, msgsize);
-    pthread_mutex_unlock(&deros_server_lock);
+    send_a_new_subscriber_to_all_publishers(num_subscribers - 1, id_addr);
     deros_dbglog_msg_2str(D_INFO, "server", "regsub", "registered subscriber (from, address)", client_node_names[node_id], addresses[id_addr]);
+    unlock_server();
 }
 
 /* a subscriber has left, process its packet */
@@ -373,18 +1002,18 @@ void unregister_subscriber(int node_id, uint8_t *packet, int size)
 {
     packet[size] = 0;
 
-    pthread_mutex_lock(&deros_server_lock);
-    int found;
-    int id_addr = find_address((char *)packet, &found);
-    if (!found)
+    lock_server();
+    int id_addr = find_address((char *)packet);
+    if (id_addr < 0)
     {
         deros_dbglog_msg_str(D_WARN, "server", "unregsub", "deros_server: unregister_subscriber with unknown address from node", client_node_names[node_id]);
-        pthread_mutex_unlock(&deros_server_lock);
+        unlock_server();
         return;
     }
-    for (int i = 0; i < num_subscribers; i++)
-        if ((subscriber_client[i] == node_id) &&
-            (subscriber_address[i] == id_addr))
+    for (int j = 0; j < addr_num_sub[id_addr]; j++)
+    {
+        int i = addr_subscribers[id_addr][j];
+        if ((subscriber_client[i] == node_id) && (subscriber_address[i] == id_addr))
         {
             if (subscriber_count[i] == 1)
             {
@@ -395,52 +1024,269 @@ void unregister_subscriber(int node_id, uint8_t *packet, int size)
             deros_dbglog_msg_2str(D_WARN, "server", "unregsub", "unregistered subscriber (from,address)", client_node_names[node_id], addresses[id_addr]);
             break;
         }
-    pthread_mutex_unlock(&deros_server_lock);
+    }
+    unlock_server();
+}
+
+int process_client_packet(int node_id, uint8_t packet_type, uint8_t *packet, int packet_size);
+
+/** send the packets collected for each client while collecting_batch was set in one PACKET_BATCH, deros_server_lock must be held */
+void send_collected_batches()
+{
+    for (int id_client = 0; id_client < next_client_id; id_client++)
+    {
+        client_connection *conn = client_conn[id_client];
+        if (!conn || (conn->batched.len == 0)) continue;
+        send_packet_to_client(id_client, PACKET_BATCH, conn->batched.data, conn->batched.len);
+        conn->batched.len = 0;
+    }
+}
+
+/** process the registrations of a PACKET_BATCH together, all the packets they cause to be sent to a node leave
+ *  in one PACKET_BATCH, the node that has sent the batch gets PACKET_BATCH_DONE after its own */
+void process_batch(int node_id, uint8_t *packet, int size)
+{
+    lock_server();   // recursive, the registrations of the batch are not interleaved with others
+    collecting_batch = 1;
+
+    uint8_t packet_type, *registration;
+    unsigned int offset = 0, registration_size;
+    int count = 0;
+    while ((packet_type = deros_batch_next_packet(packet, size, &offset, &registration, &registration_size)))
+    {
+        if ((packet_type < PACKET_PUB_REGISTER) || (packet_type > PACKET_SUB_UNREGISTER))
+        {
+            deros_dbglog_msg_str_int(D_ERRR, "server", "batch", "malformed PACKET_BATCH (from, type)", client_node_names[node_id], packet_type);
+            break;
+        }
+        uint8_t saved_byte = registration[registration_size];   // the handlers terminate the contents with zero
+        process_client_packet(node_id, packet_type, registration, registration_size);
+        registration[registration_size] = saved_byte;
+        count++;
+    }
+
+    collecting_batch = 0;
+    send_collected_batches();
+    send_packet_to_client(node_id, PACKET_BATCH_DONE, (uint8_t *)"", 0);
+    deros_dbglog_msg_str_int(D_INFO, "server", "batch", "processed batch of registrations (from, count)", client_node_names[node_id], count);
+    unlock_server();
 }
 
-/** a new packet has arrived from client node, do a respective packet handling */
-int process_client_packet(int node_id, uint8_t packet_type, uint8_t *my_buffer, int packet_size)
+/** @return  the client restored from the snapshot that the node was before the restart of the server, -1 if there is none */
+int find_restored_client(int node_id)
+{
+    for (int i = 0; i < next_client_id; i++)
+        if ((i != node_id) && client_restored_deadline[i] && (client_port[i] == client_port[node_id]) &&
+            (strcmp(client_ip[i], client_ip[node_id]) == 0) && (strcmp(client_node_names[i], client_node_names[node_id]) == 0))
+            return i;
+    return -1;
+}
+
+/** the node takes over the publishers and subscribers of the client restored for it, the restored client is removed */
+void adopt_restored_client(int node_id, int restored)
+{
+    for (int i = 0; i < num_publishers; i++)
+        if (publisher_client[i] == restored) publisher_client[i] = node_id;
+    for (int i = 0; i < num_subscribers; i++)
+        if (subscriber_client[i] == restored) subscriber_client[i] = node_id;
+
+    client_sockets[restored] = 0;
+    free(client_node_names[restored]);
+    client_node_names[restored] = 0;
+    free(client_ip[restored]);
+    client_port[restored] = 0;
+    client_restored_deadline[restored] = 0;
+    client_missed_updates[restored] = 0;
+    num_restored_clients--;
+    num_clients--;
+}
+
+/** the node has connected again and sends all its registrations (framed as in PACKET_BATCH), the registry is brought 
+ *  to the same state: the node takes over the client restored for it from the snapshot, missing registrations are added,
+ *  those that the node does not have anymore are removed, the answers leave in one PACKET_BATCH */
+void process_resync(int node_id, uint8_t *packet, int size)
+{
+    lock_server();
+    collecting_batch = 1;
+
+    int missed_updates = 0;
+    int restored = find_restored_client(node_id);
+    if (restored >= 0)
+    {
+        missed_updates = client_missed_updates[restored];
+        adopt_restored_client(node_id, restored);
+    }
+
+    uint8_t packet_type, *registration;
+    unsigned int offset = 0, registration_size;
+    int count = 0;
+    while ((packet_type = deros_batch_next_packet(packet, size, &offset, &registration, &registration_size)) && (packet_type != 255))
+        count++;
+
+    // how many registrations of each publisher and subscriber of the node the node still has
+    int *pub_wanted = (int *) calloc(num_publishers + count + 1, sizeof(int));
+    int *sub_wanted = (int *) calloc(num_subscribers + count + 1, sizeof(int));
+    if (!pub_wanted || !sub_wanted) mem_failure();
+
+    offset = 0;
+    while ((packet_type = deros_batch_next_packet(packet, size, &offset, &registration, &registration_size)))
+    {
+        if ((packet_type != PACKET_PUB_REGISTER) && (packet_type != PACKET_SUB_REGISTER))
+        {
+            deros_dbglog_msg_str_int(D_ERRR, "server", "resync", "malformed PACKET_RESYNC (from, type)", client_node_names[node_id], packet_type);
+            break;
+        }
+        uint8_t saved_byte = registration[registration_size];
+        registration[registration_size] = 0;
+        int msgsize, transport, history;
+        char *adres = parse_register_packet((char *)registration, &msgsize, &transport, (packet_type == PACKET_SUB_REGISTER) ? &history : 0);
+        int id_addr = adres ? find_address(adres) : -1;
+        int known = (id_addr < 0) ? -1 : (packet_type == PACKET_PUB_REGISTER) ? publisher_of_node(node_id, id_addr) : subscriber_of_node(node_id, id_addr);
+        int *wanted = (packet_type == PACKET_PUB_REGISTER) ? pub_wanted : sub_wanted;
+        if ((known >= 0) && (wanted[known] < ((packet_type == PACKET_PUB_REGISTER) ? publisher_count[known] : subscriber_count[known])))
+        {
+            wanted[known]++;
+            send_topic_id_to_client(node_id, id_addr);
+        }
+        else if (adres)
+        {
+            process_client_packet(node_id, packet_type, registration, registration_size);
+            id_addr = find_address(adres);
+            known = (id_addr < 0) ? -1 : (packet_type == PACKET_PUB_REGISTER) ? publisher_of_node(node_id, id_addr) : subscriber_of_node(node_id, id_addr);
+            if (known >= 0) wanted[known] = (packet_type == PACKET_PUB_REGISTER) ? publisher_count[known] : subscriber_count[known];
+        }
+        registration[registration_size] = saved_byte;
+    }
+
+    // from the last one, removing moves the last one to the place of the removed one
+    for (int i = num_subscribers - 1; i >= 0; i--)
+        if ((subscriber_client[i] == node_id) && (sub_wanted[i] < subscriber_count[i]))
+        {
+            if (sub_wanted[i]) subscriber_count[i] = sub_wanted[i];
+            else
+            {
+                notify_all_publishers_of_removed_subscriber(i);
+                remove_subscriber(i);
+            }
+        }
+    for (int i = num_publishers - 1; i >= 0; i--)
+        if ((publisher_client[i] == node_id) && (pub_wanted[i] < publisher_count[i]))
+        {
+            if (pub_wanted[i]) publisher_count[i] = pub_wanted[i];
+            else remove_publisher(i);
+        }
+    free(pub_wanted);
+    free(sub_wanted);
+
+    // subscribers that arrived before the node connected again
+    if (missed_updates)
+        for (int i = 0; i < num_publishers; i++)
+            if (publisher_client[i] == node_id) send_all_subscribers_to_publisher(i);
+
+    collecting_batch = 0;
+    send_collected_batches();
+    deros_dbglog_msg_str_2int(D_INFO, "server", "resync", "node connected again (name, registrations, restored)", client_node_names[node_id], count, restored >= 0);
+    unlock_server();
+}
+
+/** a new packet has arrived from client node, do a respective packet handling 
+ *  @param packet  contents of the packet terminated with zero, the handlers may modify them
+ *  @return  1 on success, 0 if the node leaves or its packet was malformed */
+int process_client_packet(int node_id, uint8_t packet_type, uint8_t *packet, int packet_size)
 {
     deros_dbglog_msg_3int(D_DEBG, "server", "newpak", "packet from node of size (type,nodeid,size)", packet_type, node_id, packet_size); 
+
+    int registering = (packet_type >= PACKET_PUB_REGISTER) && (packet_type <= PACKET_SUB_UNREGISTER);
+    int ok = 1;
+    lock_server();
+    long notifications_before = stats_notifications;
     switch (packet_type) 
     {
         case PACKET_DONE: // client node terminates: remove it from lists of publishers and subscribers, and from the list of nodes
-                          remove_node(node_id);
-                          return 0;  // this will terminate this node reading thread
-        case PACKET_PUB_REGISTER: register_new_publisher(node_id, my_buffer, packet_size);
+                          ok = 0;
+                          break;
+        case PACKET_PUB_REGISTER: register_new_publisher(node_id, packet, packet_size);
                                   break;
-        case PACKET_PUB_UNREGISTER: unregister_publisher(node_id, my_buffer, packet_size);
+        case PACKET_PUB_UNREGISTER: unregister_publisher(node_id, packet, packet_size);
                                     break;
-        case PACKET_SUB_REGISTER: register_new_subscriber(node_id, my_buffer, packet_size);
+        case PACKET_SUB_REGISTER: register_new_subscriber(node_id, packet, packet_size);
                                   break;
-        case PACKET_SUB_UNREGISTER: unregister_subscriber(node_id, my_buffer, packet_size);
+        case PACKET_SUB_UNREGISTER: unregister_subscriber(node_id, packet, packet_size);
                                     break;
+        case PACKET_BATCH: process_batch(node_id, packet, packet_size);
+                           break;
+        case PACKET_RESYNC: process_resync(node_id, packet, packet_size);
+                            break;
+        case PACKET_HEARTBEAT: break;   // the node is alive, its reactor has noted the time
     }
-    remove_unaccessible_clients();
-    return 1;
+    if (registering)
+    {
+        count_registration(packet_type);
+        count_fanout(notifications_before);
+    }
+    unlock_server();
+    return ok;
 }
 
 /* CLIENT -> SERVER protocol:
  *
  * 1. PACKET_INIT                (deros?name!listen_port)
  * 2. PACKET_DONE                ()
- * 3. PACKET_PUB_REGISTER        (msg_size!address)
+ * 3. PACKET_PUB_REGISTER        (msg_size!transport!address)
  * 4. PACKET_PUB_UNREGISTER      (address)
- * 5. PACKET_SUB_REGISTER        (msg_size!address)
+ * 5. PACKET_SUB_REGISTER        (msg_size!transport!history!address)
  * 6. PACKET_SUB_UNREGISTER      (address)
+ * 7. PACKET_BATCH               (len[4] type[1] contents ...)   // registering packets 3.-6. framed as on the socket
+ * 8. PACKET_RESYNC              (len[4] type[1] contents ...)   // first packet after a node has connected again: all its
+ *                                                               // PUB_REGISTER and SUB_REGISTER packets, framed as above
+ * 9. PACKET_HEARTBEAT           ()                  // every heartbeat interval announced by the server
+ *    PACKET_QUERY               ()                  // instead of PACKET_INIT: deros_query asks for the registry and counters
  *
  * SERVER -> CLIENT protocol:
  *
  * 1. PACKET_RESPONSE_INIT       (deros!name)
- * 2. PACKET_ADD_SUBSCRIBER      (port!ip!address)   // sent to publisher for each [new] subscriber
- * 3. PACKET_REMOVE_SUBSCRIBER   (port!ip!address)   // sent to publisher
+ * 2. PACKET_TOPIC_ID            (topic_id!address)  // reply to each PUB_REGISTER and SUB_REGISTER
+ * 3. PACKET_ADD_SUBSCRIBER      (port!ip!colocated!transport!history!topic_id)  // sent to publisher for each [new] subscriber
+ * 4. PACKET_REMOVE_SUBSCRIBER   (port!ip!colocated!transport!history!topic_id)  // sent to publisher
+ * 5. PACKET_BATCH               (len[4] type[1] contents ...)   // packets 2.-4. caused by a batch of registrations or a resync
+ * 6. PACKET_BATCH_DONE          ()                  // after a batch of registrations of the node has been processed
+ * 7. PACKET_HEARTBEAT           (interval_ms!timeout_ms)   // after login and every interval, unless heartbeats are disabled
+ *    PACKET_QUERY_RESPONSE      (text report)       // answer to PACKET_QUERY, see process_query()
  *
  * CLIENT -> SUBSCRIBER protocol:
  *
- * 1. PACKET_NEW_MESSAGE         (address!len!message)
+ * 1. PACKET_TOPIC_BIND          (topic_id[4] address)    // once per address before its first message
+ *    PACKET_NEW_MESSAGE         (topic_id[4] len[4] seq[4] sec[4] usec[4] message)
+ * 2. PACKET_SHM_ATTACH          (shm_name)          // colocated only: further messages go through shared memory ring
+ * 3. PACKET_SHM_DOORBELL        ()                  // new messages in the ring while the subscriber was sleeping
+ *    PACKET_SHM_VIA_SOCKET      ()                  // ring record only: message too long for the ring follows on the socket
+ *    PACKET_MEMFD_MESSAGE       ()                  // same host, Unix domain socket: descriptor of a sealed memory file
+ *                                                   // with header and message is passed with the packet
+ *    PACKET_MESSAGE_CHUNK       (topic_id[4] len[4] seq[4] sec[4] usec[4] offset[4] chunk)   // messages longer than
+ *                                                   // MESSAGE_CHUNK_SIZE, len is the length of the whole message
+ *
+ * 4. PACKET_HEARTBEAT           ()                  // when the connection has been idle for the heartbeat interval
+ *
+ * SUBSCRIBER -> CLIENT protocol:
+ *
+ * 1. PACKET_SHM_ATTACHED        (1 or 0)            // whether the subscriber has mapped the ring
+ * 2. PACKET_HEARTBEAT           ()                  // every heartbeat interval
+ *
+ * CLIENT -> SUBSCRIBER datagrams (transport 1 = UDP to the listen port, 2 = multicast group of the address):
+ *
+ *    (topic_id[4] len[4] seq[4] sec[4] usec[4] fragment[2] num_fragments[2] adr_len[1] address fragment_of_message)
  *
  */
 
+/** tell the node that the server is alive, and how often the node should do the same, deros_server_lock must be held
+ *  @return  1 on success, 0 if the client cannot be reached */
+int send_heartbeat_to_client(int id_client)
+{
+    char settings[30];
+    sprintf(settings, "%d!%d", heartbeat_interval_ms, heartbeat_timeout_ms);
+    return send_packet_to_client(id_client, PACKET_HEARTBEAT, (uint8_t *)settings, strlen(settings));
+}
+
 /** retrieves an unused client id */
 int find_new_client_id()
 {
@@ -448,27 +1294,29 @@ int find_new_client_id()
     for (id = 0; id < next_client_id; id++)
         if (client_sockets[id] == 0) 
             return id;
+    ensure_client_capacity(next_client_id);
     return next_client_id++;
 }
 
-/** after a client (publisher/subscriber) registers on the server, it will get a separate thread to deal with it */
-void *client_thread(void *arg)
+/** the first packet from a new client node must be its login (deros?name!listen_port), answer it
+ *  @return  1 on success, 0 if the node has not logged in properly */
+int login_client(client_connection *conn, uint8_t packet_type, uint8_t *packet, int packet_size)
 {
-    int my_socket = new_client_socket;
-    client_thread_started = 1;
-
-    uint8_t *my_buffer = (uint8_t *)malloc(MAX_PACKET_LENGTH + 1);
-    if (my_buffer == 0) mem_failure();
-
-    int packet_size = 0;
-    uint8_t packet_type = deros_receive_packet(my_socket, my_buffer, &packet_size, MAX_PACKET_LENGTH);
+    if ((packet_type != PACKET_INIT) || (packet_size < strlen(INIT_MSG_HEADER) + 3))
+    {
+        deros_dbglog_msg_2int(D_ERRR, "server", "login", "deros_server: node has not logged in properly, (packet_type,packet_size)", packet_type, packet_size);
+        return 0;
+    }
+    uint8_t *my_buffer = (uint8_t *) malloc(packet_size + strlen(INIT_MSG_RESPONSE) + 1);
+    if (!my_buffer) mem_failure();
+    memcpy(my_buffer, packet, packet_size);
     my_buffer[packet_size] = 0;
     char *exclpos = strchr((char *)(my_buffer + strlen(INIT_MSG_HEADER)), '!');
 
-    if ((packet_type != PACKET_INIT) || (packet_size < strlen(INIT_MSG_HEADER) + 3) || 
-        (strncmp(INIT_MSG_HEADER, (char *)my_buffer, strlen(INIT_MSG_HEADER)) != 0) || (exclpos == 0))
+    if ((strncmp(INIT_MSG_HEADER, (char *)my_buffer, strlen(INIT_MSG_HEADER)) != 0) || (exclpos == 0))
     {
-        deros_dbglog_msg_2int(D_ERRR, "server", "clithr", "deros_server: node has not logged in properly, (packet_type,packet_size)", packet_type, packet_size);
+        deros_dbglog_msg_2int(D_ERRR, "server", "login", "deros_server: node has not logged in properly, (packet_type,packet_size)", packet_type, packet_size);
+        free(my_buffer);
         return 0;
     }   
 
@@ -477,42 +1325,326 @@ void *client_thread(void *arg)
     if (my_node_name == 0) mem_failure();
     strncpy(my_node_name, (char *)(my_buffer + strlen(INIT_MSG_HEADER)), name_length);
     my_node_name[name_length] = 0;
+
+    lock_server();
+    int id_client = conn->client_id;
+    sscanf(exclpos + 1, "%d", &client_port[id_client]);
+    client_node_names[id_client] = my_node_name;
     sprintf((char *)my_buffer, "%s%s", INIT_MSG_RESPONSE, my_node_name);
-    if (!deros_send_packet(my_socket, PACKET_RESPONSE_INIT, my_buffer, strlen(INIT_MSG_RESPONSE) + name_length))
+    int ok = send_packet_to_client(id_client, PACKET_RESPONSE_INIT, my_buffer, strlen(INIT_MSG_RESPONSE) + name_length);
+    if (ok && heartbeat_interval_ms) ok = send_heartbeat_to_client(id_client);
+    if (ok)
+    {
+        journal_client(id_client);
+        deros_dbglog_msg_2str(D_INFO, "server", "login", "node logged in (name, ip)", my_node_name, client_ip[id_client]);
+    }
+    unlock_server();
+    free(my_buffer);
+
+    if (!ok)
     {
-        deros_dbglog_msg(D_ERRR, "server", "clithr", "deros_server: could not respond to login from node");
+        deros_dbglog_msg(D_ERRR, "server", "login", "deros_server: could not respond to login from node");
         return 0;
     }
+    conn->logged_in = 1;
+    return 1;
+}
 
-    pthread_mutex_lock(&deros_server_lock);
-    int new_client_id = find_new_client_id();
-    sscanf(exclpos + 1, "%d", &client_port[new_client_id]);
+static char *transport_names[] = { "tcp", "udp", "multicast" };
+
+/** write the endpoints of the address to the report: its publishers, and its subscribers (also of the patterns that match it) */
+void report_endpoints(FILE *report, int id_addr)
+{
+    for (int j = 0; j < addr_num_pub[id_addr]; j++)
+    {
+        int i = addr_publishers[id_addr][j];
+        fprintf(report, "  pub %s msgsize %d count %d transport %s\n", client_node_names[publisher_client[i]], 
+                publisher_msgsize[i], publisher_count[i], transport_names[publisher_transport[i]]);
+    }
+    for (int j = 0; j < addr_num_sub[id_addr]; j++)
+    {
+        int i = addr_subscribers[id_addr][j];
+        fprintf(report, "  sub %s msgsize %d count %d transport %s history %s", client_node_names[subscriber_client[i]], 
+                subscriber_msgsize[i], subscriber_count[i], transport_names[subscriber_transport[i]],
+                (subscriber_history[i] == DEROS_HISTORY_LATEST) ? "latest" : "all");
+        if (subscriber_address[i] != id_addr) fprintf(report, " pattern %s", addresses[subscriber_address[i]]);
+        fprintf(report, "\n");
+    }
+}
+
+/** answer PACKET_QUERY with a text report of the registry and the counters of the server, one item per line:
+ *
+ *    server uptime_s U nodes N restored R publishers P subscribers S addresses A reactors T heartbeat_ms H
+ *    counters registrations R unregistrations U registrations_per_s X recent_registrations_per_s Y notifications N
+ *             fanout_events F avg_fanout X max_fanout M lock_holds L lock_hold_avg_us X lock_hold_max_us M   (one line)
+ *    node ID NAME IP:PORT connected|restored publishers P subscribers S
+ *    topic ID ADDRESS publishers P subscribers S notifications N       (or pattern ID PATTERN ...)
+ *      pub NODE msgsize M count C transport tcp|udp|multicast
+ *      sub NODE msgsize M count C transport tcp|udp|multicast history all|latest [pattern PATTERN]
+ *
+ *  notifications are the ADD_SUBSCRIBER and REMOVE_SUBSCRIBER packets sent to publishers, a fanout event is a registration
+ *  or a leaving node that caused some of them
+ *  @return  1 on success, 0 if the client cannot be reached */
+int process_query(int id_client)
+{
+    char *text = 0;
+    size_t text_len = 0;
+    FILE *report = open_memstream(&text, &text_len);
+    if (!report) mem_failure();
+
+    lock_server();
+    long long now = monotonic_ms();
+    double uptime_s = (now - server_start_ms) / 1000.0;
+    int *node_publishers = (int *) calloc(next_client_id + 1, sizeof(int));
+    int *node_subscribers = (int *) calloc(next_client_id + 1, sizeof(int));
+    if (!node_publishers || !node_subscribers) mem_failure();
+    for (int i = 0; i < num_publishers; i++) node_publishers[publisher_client[i]]++;
+    for (int i = 0; i < num_subscribers; i++) node_subscribers[subscriber_client[i]]++;
+    int num_nodes = 0;
+    for (int i = 0; i < next_client_id; i++)
+        if (client_sockets[i] && client_node_names[i]) num_nodes++;
+
+    fprintf(report, "server uptime_s %.1f nodes %d restored %d publishers %d subscribers %d addresses %d reactors %d heartbeat_ms %d\n",
+            uptime_s, num_nodes, num_restored_clients, num_publishers, num_subscribers, num_addresses, num_reactors, heartbeat_interval_ms);
+    fprintf(report, "counters registrations %ld unregistrations %ld registrations_per_s %.1f recent_registrations_per_s %.1f "
+                    "notifications %ld fanout_events %ld avg_fanout %.1f max_fanout %ld lock_holds %ld lock_hold_avg_us %.1f lock_hold_max_us %lld\n",
+            stats_registrations, stats_unregistrations, (uptime_s > 0) ? stats_registrations / uptime_s : 0.0, recent_registration_rate(),
+            stats_notifications, stats_fanout_events, stats_fanout_events ? (double)stats_notifications / stats_fanout_events : 0.0, stats_max_fanout,
+            stats_lock_holds, stats_lock_holds ? (double)stats_lock_hold_total_us / stats_lock_holds : 0.0, stats_lock_hold_max_us);
+    for (int i = 0; i < next_client_id; i++)
+        if (client_sockets[i] && client_node_names[i])
+            fprintf(report, "node %d %s %s:%d %s publishers %d subscribers %d\n", i, client_node_names[i], client_ip[i], client_port[i],
+                    client_conn[i] ? "connected" : "restored", node_publishers[i], node_subscribers[i]);
+    for (int id_addr = 0; id_addr < num_addresses; id_addr++)
+    {
+        if (!addr_num_pub[id_addr] && !addr_num_sub[id_addr]) continue;
+        fprintf(report, "%s %d %s publishers %d subscribers %d notifications %ld\n", addr_is_pattern[id_addr] ? "pattern" : "topic", 
+                id_addr, addresses[id_addr], addr_num_pub[id_addr], addr_num_sub[id_addr], 
+                (id_addr < address_notifications_capacity) ? address_notifications[id_addr] : 0);
+        report_endpoints(report, id_addr);
+    }
+    free(node_publishers);
+    free(node_subscribers);
+    fclose(report);
+
+    int ok = send_packet_to_client(id_client, PACKET_QUERY_RESPONSE, (uint8_t *)text, text_len);
+    deros_dbglog_msg_str_int(D_INFO, "server", "query", "answered query (from, bytes)", client_ip[id_client], (int)text_len);
+    unlock_server();
+    free(text);
+    return ok;
+}
+
+/** process all complete packets that arrived from a client node 
+ *  @return  1 on success, 0 if the node should be removed */
+int process_client_connection(client_connection *conn)
+{
+    uint8_t packet_type;
+    uint8_t *packet;
+    int packet_size;
+
+    while ((packet_type = deros_rxbuf_peek_packet(&conn->rx, &packet, &packet_size)))
+    {
+        if (packet_type == 255) return 0;
+        int ok;
+        if (packet_type == PACKET_QUERY) ok = process_query(conn->client_id);
+        else if (!conn->logged_in) ok = login_client(conn, packet_type, packet, packet_size);
+        else   // the handlers parse the packet in place, as a zero-terminated string, and leave it as it was for the journal
+        {
+            lock_server();   // packets are journaled in the order they were processed in
+            ok = process_client_packet(conn->client_id, packet_type, (uint8_t *)deros_rxbuf_packet_string(&conn->rx), packet_size);
+            if (ok && (((packet_type >= PACKET_PUB_REGISTER) && (packet_type <= PACKET_SUB_UNREGISTER)) ||
+                       (packet_type == PACKET_BATCH) || (packet_type == PACKET_RESYNC)))
+                journal_packet(conn->client_id, packet_type, packet, packet_size);
+            unlock_server();
+        }
+        deros_rxbuf_consume_packet(&conn->rx);
+        if (!ok) return 0;
+    }
+    return 1;
+}
+
+/** remove the clients restored from the snapshot whose nodes have not connected again in time, deros_server_lock must be held */
+void expire_restored_clients(long long now)
+{
+    for (int i = 0; (i < next_client_id) && num_restored_clients; i++)
+        if (client_restored_deadline[i] && (client_restored_deadline[i] <= now))
+        {
+            deros_dbglog_msg_str(D_INFO, "server", "snapshot", "restored node has not connected again", client_node_names[i]);
+            remove_node(i);
+        }
+}
+
+/** send heartbeats to all logged in nodes once per interval, and drop the nodes that have been silent for too long,
+ *  their reactor threads remove them, and the publishers are told to forget them, deros_server_lock must be held */
+void check_client_heartbeats(long long now)
+{
+    int send_heartbeats = (now - last_heartbeat_ms >= heartbeat_interval_ms);
+    if (send_heartbeats) last_heartbeat_ms = now;
+    for (int i = 0; i < next_client_id; i++)
+    {
+        client_connection *conn = client_conn[i];
+        if (!conn || client_to_be_removed[i]) continue;
+        if (now - conn->last_heard_ms > heartbeat_timeout_ms)
+        {
+            deros_dbglog_msg_str_int(D_WARN, "server", "heartbeat", "node has been silent for too long, dropping it (name, ms)",
+                                     client_node_names[i] ? client_node_names[i] : client_ip[i], (int)(now - conn->last_heard_ms));
+            drop_client(i);
+        }
+        else if (send_heartbeats && client_node_names[i]) send_heartbeat_to_client(i);
+    }
+}
+
+/** @return  how long the first reactor can wait for events before it does the housekeeping, -1 if there is nothing to do */
+int housekeeping_period()
+{
+    int period = -1;
+    if (num_restored_clients) period = SERVER_HOUSEKEEPING_MS;
+    if (heartbeat_interval_ms && ((period < 0) || (heartbeat_interval_ms < period))) period = heartbeat_interval_ms;
+    return period;
+}
+
+/** periodic work of the first reactor thread */
+void server_housekeeping()
+{
+    lock_server();
+    long long now = monotonic_ms();
+    if (num_restored_clients) expire_restored_clients(now);
+    if (heartbeat_interval_ms) check_client_heartbeats(now);
+    unlock_server();
+}
+
+/** each reactor thread serves the connections of a subset of client nodes, the first one does the housekeeping too */
+void *reactor_thread(void *arg)
+{
+    int my_reactor = *((int *)arg);
+    int my_epoll = reactor_epoll[my_reactor];
+    free(arg);
+    struct epoll_event events[SERVER_MAX_EPOLL_EVENTS];
+    long long next_housekeeping_ms = 0;
+
+    while (server_running)
+    {
+        int timeout = -1;
+        int period = (my_reactor == 0) ? housekeeping_period() : -1;
+        if (period >= 0)
+        {
+            long long now = monotonic_ms();
+            if (now >= next_housekeeping_ms)
+            {
+                server_housekeeping();
+                next_housekeeping_ms = now + period;
+            }
+            timeout = (int)(next_housekeeping_ms - now);
+        }
+        int n = epoll_wait(my_epoll, events, SERVER_MAX_EPOLL_EVENTS, timeout);
+        if (n < 0)
+        {
+            if (errno == EINTR) continue;
+            deros_dbglog_msg_int(D_ERRR, "server", "reactor", "epoll_wait failed", errno);
+            break;
+        }
+        for (int i = 0; i < n; i++)
+        {
+            client_connection *conn = (client_connection *) events[i].data.ptr;
+            int ok = 1;
+            if (events[i].events & EPOLLOUT)
+            {
+                pthread_mutex_lock(&conn->tx_lock);
+                ok = flush_client_output(conn);
+                pthread_mutex_unlock(&conn->tx_lock);
+            }
+            if (ok && (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)))
+            {
+                conn->last_heard_ms = monotonic_ms();
+                ok = deros_rxbuf_fill(&conn->rx, conn->socket) && process_client_connection(conn);
+            }
+            if (!ok)
+            {
+                lock_server();   // recursive, remove_node() takes it too
+                if (conn->logged_in)
+                    deros_dbglog_msg_str(D_INFO, "server", "reactor", "deros_server: node disconnected", client_node_names[conn->client_id]);
+                remove_node(conn->client_id);
+                unlock_server();
+            }
+        }
+    }
+    return 0;
+}
+
+/** a new client node has connected, assign it to one of the reactor threads */
+void add_client_connection(int socket)
+{
+    deros_socket_options options;
+    deros_default_socket_options(&options);   // control packets should not wait for more data
+    deros_apply_socket_options(socket, &options);
+    if (!deros_set_nonblocking(socket))
+    {
+        close(socket);
+        return;
+    }
+    client_connection *conn = (client_connection *) malloc(sizeof(client_connection));
+    if (!conn) mem_failure();
+    conn->socket = socket;
+    conn->logged_in = 0;
+    deros_rxbuf_init(&conn->rx);
+    pthread_mutex_init(&conn->tx_lock, 0);
+    conn->tx = 0;
+    conn->tx_len = conn->tx_capacity = 0;
+    conn->waiting_for_output = 0;
+    memset(&conn->batched, 0, sizeof(conn->batched));
+    conn->last_heard_ms = monotonic_ms();
 
     struct sockaddr_in peer_addr;
     socklen_t peer_adr_len = sizeof(peer_addr);
-    getpeername(my_socket, (struct sockaddr*)&peer_addr, &peer_adr_len);
+    getpeername(socket, (struct sockaddr*)&peer_addr, &peer_adr_len);
+
+    lock_server();
+    int new_client_id = find_new_client_id();
+    conn->client_id = new_client_id;
+    conn->reactor = next_reactor;
+    next_reactor = (next_reactor + 1) % num_reactors;
+
     client_ip[new_client_id] = (char *) malloc(20);
+    if (!client_ip[new_client_id]) mem_failure();
     strncpy(client_ip[new_client_id], inet_ntoa(peer_addr.sin_addr), 19);
-    client_ip[new_client_id][20] = 0;
-
-    client_sockets[new_client_id] = my_socket;
-    client_node_names[new_client_id] = my_node_name;
-    int my_node_id = new_client_id;
+    client_ip[new_client_id][19] = 0;
+    client_sockets[new_client_id] = socket;
+    client_node_names[new_client_id] = 0;
+    client_port[new_client_id] = 0;
+    client_to_be_removed[new_client_id] = 0;
+    client_conn[new_client_id] = conn;
     num_clients++;
-    pthread_mutex_unlock(&deros_server_lock);
 
-    while (1)
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.ptr = conn;
+    if (epoll_ctl(reactor_epoll[conn->reactor], EPOLL_CTL_ADD, socket, &ev) < 0)
     {
-        packet_type = deros_receive_packet(my_socket, my_buffer, &packet_size, MAX_PACKET_LENGTH);
-        if (!packet_type) break;
-        if (!process_client_packet(my_node_id, packet_type, my_buffer, packet_size)) break;
+        deros_dbglog_msg_int(D_ERRR, "server", "accept", "could not watch client connection", errno);
+        unlock_server();
+        remove_node(new_client_id);
+        return;
     }
+    unlock_server();
+}
 
-    deros_dbglog_msg_str(D_INFO, "server", "clithr", "deros_server: node disconnected", client_node_names[my_node_id]);
-
-    remove_node(my_node_id);
-    free(my_buffer);
-    return 0;
+/** start the reactor threads that will serve the client connections */
+void start_reactors()
+{
+    for (int i = 0; i < num_reactors; i++)
+    {
+        reactor_epoll[i] = epoll_create1(0);
+        int *reactor_index = (int *) malloc(sizeof(int));
+        if (!reactor_index) mem_failure();
+        *reactor_index = i;
+        pthread_t thr;
+        if ((reactor_epoll[i] < 0) || (pthread_create(&thr, 0, reactor_thread, reactor_index) != 0))
+        {
+            deros_dbglog_msg_int(D_GRRR, "server", "main", "could not start reactor thread", errno);
+            exit(1);
+        }
+    }
+    deros_dbglog_msg_int(D_INFO, "server", "main", "started reactor threads", num_reactors);
 }
 
 /** the main thread that accepts new connections from client nodes */
@@ -520,17 +1652,113 @@ void deros_server_accepting_thread()
 {
     server_running = 1;
     do {
-        new_client_socket = deros_wait_for_client_connection(deros_server_socket);
+        int new_client_socket = deros_wait_for_client_connection(deros_server_socket);
         if (new_client_socket == 0) continue;
 
-        client_thread_started = 0;
+        add_client_connection(new_client_socket);
 
-        pthread_t thr;
-        pthread_create(&thr, 0, client_thread, 0);
+    } while (server_running);
+}
 
-        while (!client_thread_started) usleep(1);
+/** replay a client record of the snapshot (port!ip!name), the client waits for its node to connect again
+ *  @return  its new client id, -1 if the record is malformed */
+int restore_client(char *record)
+{
+    char *ip = strchr(record, '!');
+    char *name = ip ? strchr(ip + 1, '!') : 0;
+    int port;
+    if (!name || (sscanf(record, "%d", &port) != 1) || (name - ip - 1 > 19)) return -1;
+
+    int id_client = find_new_client_id();
+    client_ip[id_client] = (char *) malloc(20);
+    client_node_names[id_client] = (char *) malloc(strlen(name + 1) + 1);
+    if (!client_ip[id_client] || !client_node_names[id_client]) mem_failure();
+    strncpy(client_ip[id_client], ip + 1, name - ip - 1);
+    client_ip[id_client][name - ip - 1] = 0;
+    strcpy(client_node_names[id_client], name + 1);
+    client_sockets[id_client] = -1;   // not free, but without connection
+    client_port[id_client] = port;
+    client_to_be_removed[id_client] = 0;
+    client_conn[id_client] = 0;
+    client_restored_deadline[id_client] = monotonic_ms() + restore_grace_ms;
+    client_missed_updates[id_client] = 0;
+    num_clients++;
+    num_restored_clients++;
+    return id_client;
+}
 
-    } while (server_running);
+/** restore the registry from the snapshot by replaying its records, the client ids of the records are mapped to new ones,
+ *  then the snapshot is compacted and the journal continues */
+void load_snapshot()
+{
+    uint8_t *data = 0;
+    unsigned int size = 0;
+    int fd = open(snapshot_path, O_RDONLY);
+    struct stat st;
+    if ((fd >= 0) && (fstat(fd, &st) == 0) && (st.st_size > 0) && (st.st_size < 0x7fffffff))
+    {
+        data = (uint8_t *) malloc(st.st_size + 1);
+        if (!data) mem_failure();
+        while (size < st.st_size)
+        {
+            ssize_t n = read(fd, data + size, st.st_size - size);
+            if ((n < 0) && (errno == EINTR)) continue;
+            if (n <= 0) break;
+            size += n;
+        }
+    }
+    else if ((fd < 0) && (errno != ENOENT)) deros_dbglog_msg_str_int(D_ERRR, "server", "snapshot", "could not open snapshot (path, errno)", snapshot_path, errno);
+    if (fd >= 0) close(fd);
+
+    lock_server();
+    replaying_snapshot = 1;
+    int *client_map = 0;
+    unsigned int map_size = 0;
+    uint8_t packet_type, *record;
+    unsigned int offset = 0, record_size;
+    long records = 0;
+    while (data && (packet_type = deros_batch_next_packet(data, size, &offset, &record, &record_size)))
+    {
+        if ((packet_type == 255) || (record_size < sizeof(unsigned int)))
+        {
+            deros_dbglog_msg_str_int(D_WARN, "server", "snapshot", "snapshot ends with a malformed record (path, records)", snapshot_path, records);
+            break;
+        }
+        unsigned int old_id;
+        deros_retrieve_uint(record, &old_id);
+        if (old_id >= map_size)
+        {
+            unsigned int new_size = old_id + 64;
+            client_map = (int *) realloc(client_map, sizeof(int) * new_size);
+            if (!client_map) mem_failure();
+            for (unsigned int i = map_size; i < new_size; i++) client_map[i] = -1;
+            map_size = new_size;
+        }
+        uint8_t *contents = record + sizeof(unsigned int);
+        int contents_size = record_size - sizeof(unsigned int);
+        uint8_t saved_byte = contents[contents_size];   // start of the next record
+        contents[contents_size] = 0;
+        if (packet_type == PACKET_TOPIC_ID) find_or_insert_address((char *)contents);
+        else if (packet_type == PACKET_INIT) client_map[old_id] = restore_client((char *)contents);
+        else if (client_map[old_id] >= 0)
+        {
+            if (packet_type == PACKET_DONE)
+            {
+                remove_node(client_map[old_id]);
+                client_map[old_id] = -1;
+            }
+            else process_client_packet(client_map[old_id], packet_type, contents, contents_size);
+        }
+        contents[contents_size] = saved_byte;
+        records++;
+    }
+    replaying_snapshot = 0;
+    free(client_map);
+    free(data);
+
+    deros_dbglog_msg_str_2int(D_INFO, "server", "snapshot", "restored registry (path, records, nodes)", snapshot_path, records, num_restored_clients);
+    compact_snapshot();
+    unlock_server();
 }
 
 /** main program entry */
@@ -538,13 +1766,20 @@ int main(int argc, char  **argv)
 {
     if (argc > 1) process_arguments(argc, argv);
 
-    pthread_mutex_init(&deros_server_lock, 0);
+    pthread_mutexattr_t recursive;
+    pthread_mutexattr_init(&recursive);
+    pthread_mutexattr_settype(&recursive, PTHREAD_MUTEX_RECURSIVE);
+    pthread_mutex_init(&deros_server_lock, &recursive);
 
     deros_dbglog_init(log_path, "server", 5, deros_dbg_levels);
 
     deros_dbglog_msg_int(D_INFO, "server", "main", "starting deros server on port", deros_port);
+    server_start_ms = monotonic_ms();
+    if (snapshot_path) load_snapshot();
     deros_server_socket = deros_create_server(deros_port);
 
+    server_running = 1;
+    start_reactors();
     deros_server_accepting_thread();
 
     close(deros_server_socket);
@@ -3,7 +3,19 @@
 
 // some innocent values of the Deros server
 
-#define MAX_NUM_CLIENTS 100
+#define INITIAL_CLIENT_CAPACITY 64
+#define INITIAL_ENDPOINT_CAPACITY 256
+
+#define DEFAULT_NUM_REACTORS 2
+#define MAX_NUM_REACTORS 16
+#define SERVER_MAX_EPOLL_EVENTS 64
+#define SERVER_HOUSEKEEPING_MS 200
+
+#define DEFAULT_RESTORE_GRACE_MS 5000   // nodes restored from the snapshot have this long to connect again
+#define SNAPSHOT_MIN_COMPACTION 1024    // records appended to the journal before it is compacted at the earliest
+
+#define REGISTRATION_RATE_SECONDS 10   // registrations per second reported to queries are averaged over this window
+
 
 #define DEFAULT_LOG_PATH "/usr/local/smely-zajko-24/logs"
 